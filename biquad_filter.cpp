@@ -0,0 +1,239 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Channel-interleaved biquad cascade
+*/
+
+#include "biquad_filter.h"
+#include "sample_vector.h"
+#include <algorithm>
+#include <cmath>
+
+// One section for one channel, in exactly the operation order of the vector
+// kernels (no fused multiply-add) so every kernel gives the same bits.
+static inline double biquadStep(const biquadSection &q, double x, double &z1, double &z2)
+{
+	double y = q.b0 * x + z1;
+	z1 = (q.b1 * x - q.a1 * y) + z2;
+	z2 = q.b2 * x - q.a2 * y;
+	return y;
+}
+
+template<class T>
+static void filterScalar(T *frames, size_t stride, size_t n, int first, int last,
+		const biquadSection *sections, int numSections, double *state)
+{
+	for (size_t j = 0; j < n; j++) {
+		T *frame = frames + j * stride;
+		for (int c = first; c < last; c++) {
+			bool blanked = isBlanked(frame[c]);
+			double y = blanked ? 0 : frame[c];
+			for (int s = 0; s < numSections; s++)
+				y = biquadStep(sections[s], y, state[2 * s * stride + c], state[(2 * s + 1) * stride + c]);
+			if (!blanked)
+				storeSample(frame[c], y);
+		}
+	}
+}
+
+#ifdef SAMPLE_VECTOR_X86
+template<class T>
+__attribute__((target("sse2")))
+static void filterSSE2(T *frames, size_t stride, size_t n, int first, int last,
+		const biquadSection *sections, int numSections, double *state)
+{
+	for (size_t j = 0; j < n; j++) {
+		T *frame = frames + j * stride;
+		int c = first;
+		for (; c + 2 <= last; c += 2) {
+			__m128d x = loadSSE2(frame + c);
+			__m128d blanked = blankedSSE2(frame + c, x);
+			__m128d y = _mm_andnot_pd(blanked, x); // blanked samples go in as 0
+			for (int s = 0; s < numSections; s++) {
+				const biquadSection &q = sections[s];
+				double *z1p = state + 2 * s * stride + c;
+				double *z2p = state + (2 * s + 1) * stride + c;
+				__m128d in = y;
+				y = _mm_add_pd(_mm_mul_pd(_mm_set1_pd(q.b0), in), _mm_loadu_pd(z1p));
+				__m128d z1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(_mm_set1_pd(q.b1), in), _mm_mul_pd(_mm_set1_pd(q.a1), y)), _mm_loadu_pd(z2p));
+				__m128d z2 = _mm_sub_pd(_mm_mul_pd(_mm_set1_pd(q.b2), in), _mm_mul_pd(_mm_set1_pd(q.a2), y));
+				_mm_storeu_pd(z1p, z1);
+				_mm_storeu_pd(z2p, z2);
+			}
+			storeSSE2(frame + c, y, blanked);
+		}
+		if (c < last)
+			filterScalar(frame, stride, 1, c, last, sections, numSections, state);
+	}
+}
+
+template<class T>
+__attribute__((target("avx2")))
+static void filterAVX2(T *frames, size_t stride, size_t n, int first, int last,
+		const biquadSection *sections, int numSections, double *state)
+{
+	for (size_t j = 0; j < n; j++) {
+		T *frame = frames + j * stride;
+		int c = first;
+		for (; c + 4 <= last; c += 4) {
+			__m256d x = loadAVX2(frame + c);
+			__m256d blanked = blankedAVX2(frame + c, x);
+			__m256d y = _mm256_andnot_pd(blanked, x);
+			for (int s = 0; s < numSections; s++) {
+				const biquadSection &q = sections[s];
+				double *z1p = state + 2 * s * stride + c;
+				double *z2p = state + (2 * s + 1) * stride + c;
+				__m256d in = y;
+				y = _mm256_add_pd(_mm256_mul_pd(_mm256_set1_pd(q.b0), in), _mm256_loadu_pd(z1p));
+				__m256d z1 = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(q.b1), in),
+						_mm256_mul_pd(_mm256_set1_pd(q.a1), y)), _mm256_loadu_pd(z2p));
+				__m256d z2 = _mm256_sub_pd(_mm256_mul_pd(_mm256_set1_pd(q.b2), in), _mm256_mul_pd(_mm256_set1_pd(q.a2), y));
+				_mm256_storeu_pd(z1p, z1);
+				_mm256_storeu_pd(z2p, z2);
+			}
+			storeAVX2(frame + c, y, blanked);
+		}
+		if (c < last)
+			filterSSE2(frame, stride, 1, c, last, sections, numSections, state);
+	}
+}
+#endif
+
+template<class T>
+biquadKernelFn<T> getBiquadKernel(crossingScanIsa isa)
+{
+	if (isa == scanBest) {
+#ifdef SAMPLE_VECTOR_X86
+		if (__builtin_cpu_supports("avx2"))
+			return filterAVX2<T>;
+		if (__builtin_cpu_supports("sse2"))
+			return filterSSE2<T>;
+#endif
+		return filterScalar<T>;
+	}
+	switch (isa) {
+#ifdef SAMPLE_VECTOR_X86
+		case scanAVX2:
+			return __builtin_cpu_supports("avx2") ? filterAVX2<T> : NULL;
+		case scanSSE2:
+			return __builtin_cpu_supports("sse2") ? filterSSE2<T> : NULL;
+#endif
+		case scanScalar:
+			return filterScalar<T>;
+		default:
+			return NULL;
+	}
+}
+
+template biquadKernelFn<float> getBiquadKernel<float>(crossingScanIsa isa);
+template biquadKernelFn<int16_t> getBiquadKernel<int16_t>(crossingScanIsa isa);
+
+biquadFilter::biquadFilter(void) : numChannels(0), samplingFrequency(0), lowCut(0), highCut(0), order(0)
+{
+	floatKernel = getBiquadKernel<float>();
+	int16Kernel = getBiquadKernel<int16_t>();
+}
+
+// RBJ audio EQ cookbook sections; a Butterworth filter of order 2m is m
+// sections with Q = 1 / (2 cos((2k + 1) pi / 4m))
+void biquadFilter::design(int channels, double fs, double low, double high, int filterOrder)
+{
+	if (channels == numChannels && fs == samplingFrequency && low == lowCut && high == highCut && filterOrder == order)
+		return;
+	numChannels = channels;
+	samplingFrequency = fs;
+	lowCut = low;
+	highCut = high;
+	order = filterOrder;
+
+	sections.clear();
+	int m = std::max(1, order / 2);
+	for (int side = 0; side < 2; side++) {
+		double cut = side == 0 ? lowCut : highCut;
+		if (!(cut > 0) || cut >= samplingFrequency / 2)
+			continue;
+		double w0 = 2 * M_PI * cut / samplingFrequency;
+		double cosw = cos(w0);
+		for (int k = 0; k < m; k++) {
+			double Q = 1 / (2 * cos((2 * k + 1) * M_PI / (4 * m)));
+			double alpha = sin(w0) / (2 * Q);
+			double a0 = 1 + alpha;
+			biquadSection q;
+			if (side == 0) { // highpass
+				q.b0 = (1 + cosw) / 2 / a0;
+				q.b1 = -(1 + cosw) / a0;
+			} else { // lowpass
+				q.b0 = (1 - cosw) / 2 / a0;
+				q.b1 = (1 - cosw) / a0;
+			}
+			q.b2 = q.b0;
+			q.a1 = -2 * cosw / a0;
+			q.a2 = (1 - alpha) / a0;
+			sections.push_back(q);
+		}
+	}
+	reset();
+}
+
+bool biquadFilter::setIsa(crossingScanIsa isa)
+{
+	biquadKernelFn<float> k = getBiquadKernel<float>(isa);
+	if (!k)
+		return false;
+	floatKernel = k;
+	int16Kernel = getBiquadKernel<int16_t>(isa);
+	return true;
+}
+
+void biquadFilter::reset(void)
+{
+	state.assign(2 * sections.size() * numChannels, 0);
+}
+
+template<class T>
+void biquadFilter::process(T *frames, size_t n, int first, int last)
+{
+	if (!sections.empty())
+		kernel((T*)NULL)(frames, numChannels, n, first, last, sections.data(), sections.size(), state.data());
+}
+
+template void biquadFilter::process<float>(float *frames, size_t n, int first, int last);
+template void biquadFilter::process<int16_t>(int16_t *frames, size_t n, int first, int last);
+
+template<class T>
+void biquadFilter::processFrames(framebuffer &source, unsigned long long start, size_t n, int first, int last)
+{
+	size_t done = 0;
+	while (done < n) {
+		size_t run;
+		T *frames = source.frameData<T>(start + done, &run);
+		run = std::min(run, n - done);
+		process(frames, run, first, last);
+		done += run;
+	}
+}
+
+// int16 frames are filtered in counts, the filter is linear
+void biquadFilter::process(framebuffer &source, unsigned long long start, size_t n, int first, int last)
+{
+	if (source.format() == sampleInt16)
+		processFrames<int16_t>(source, start, n, first, last);
+	else
+		processFrames<float>(source, start, n, first, last);
+}
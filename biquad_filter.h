@@ -0,0 +1,96 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Bandpass filtering of the voltage traces ahead of detection, so LFP and
+* baseline drift neither inflate the noise estimate nor cross the threshold.
+* The filter runs in place on frame-interleaved data (one frame holds every
+* channel) with its state stored channel-interleaved as well, so one SIMD
+* register holds consecutive channels and a cascade section is a handful of
+* vector instructions per frame for 4 channels (AVX2) at a time. Samples are
+* widened to double on load and rounded back to their storage type on store.
+*/
+
+#ifndef BIQUAD_FILTER_H
+#define BIQUAD_FILTER_H
+
+#include "crossing_scan.h"
+#include "ringbuffer.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// y = b0 x + z1, z1 = b1 x - a1 y + z2, z2 = b2 x - a2 y (transposed direct form II, a0 = 1)
+struct biquadSection {
+	double b0, b1, b2, a1, a2;
+};
+
+// Filters frames[j * stride + c] for j in [0, n) and c in [first, last) in
+// place through numSections sections. state holds 2 * numSections * stride
+// values, z1 and z2 of section s for channel c at state[(2 * s) * stride + c]
+// and state[(2 * s + 1) * stride + c]. Blanked samples (isBlanked()) stay
+// blanked; the filter still runs through them as 0. T is float or int16_t.
+template<class T>
+using biquadKernelFn = void (*)(T *frames, size_t stride, size_t n, int first, int last,
+		const biquadSection *sections, int numSections, double *state);
+// kernel for the requested instruction set, or NULL if the CPU lacks it; all
+// give identical results
+template<class T>
+biquadKernelFn<T> getBiquadKernel(crossingScanIsa isa = scanBest);
+
+class biquadFilter {
+	public:
+		biquadFilter(void);
+
+		// Butterworth highpass at lowCut and lowpass at highCut (Hz), each of
+		// the given even order; a cut at 0 (or at or above Nyquist for the
+		// lowpass) leaves that side out. The filter state is cleared unless
+		// nothing changed. Not thread safe with process().
+		void design(int numChannels, double samplingFrequency, double lowCut, double highCut, int order = 4);
+		void reset(void);
+		// kernel for the given instruction set, false if the CPU lacks it (for benchmarks)
+		bool setIsa(crossingScanIsa isa);
+		bool isEnabled(void) const { return !sections.empty(); }
+		int numSections(void) const { return sections.size(); }
+
+		// channels [first, last) of n frame-interleaved frames; threads may
+		// filter disjoint channel ranges of the same frames at once; T is
+		// float or int16_t
+		template<class T>
+		void process(T *frames, size_t n, int first, int last);
+		// same for frames [start, start + n) of a framebuffer the caller consumes
+		void process(framebuffer &source, unsigned long long start, size_t n, int first, int last);
+
+	private:
+		int numChannels;
+		double samplingFrequency;
+		double lowCut;
+		double highCut;
+		int order;
+		std::vector<biquadSection> sections;
+		std::vector<double> state;
+		biquadKernelFn<float> floatKernel;
+		biquadKernelFn<int16_t> int16Kernel;
+
+		biquadKernelFn<float> kernel(float *) const { return floatKernel; }
+		biquadKernelFn<int16_t> kernel(int16_t *) const { return int16Kernel; }
+		template<class T>
+		void processFrames(framebuffer &source, unsigned long long start, size_t n, int first, int last);
+};
+
+#endif
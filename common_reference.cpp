@@ -0,0 +1,349 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Per-frame common average and median reference
+*/
+
+#include "common_reference.h"
+#include "sample_vector.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+// mean of one frame in the lane order of the kernels, false if no sample is used
+template<class T>
+static bool frameMean(const T *frame, size_t stride, const double *include, const double *scale, double &ref)
+{
+	size_t padded = (stride + 3) & ~(size_t)3;
+	double sum[4] = { 0, 0, 0, 0 }, count[4] = { 0, 0, 0, 0 };
+	for (size_t c = 0; c < padded; c++) {
+		bool use = c < stride && include[c] != 0 && !isBlanked(frame[c]); // the mask is a NaN, not 0
+		sum[c & 3] += use ? frame[c] * scale[c] : 0.0;
+		count[c & 3] += use ? 1.0 : 0.0;
+	}
+	double total = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+	double used = (count[0] + count[1]) + (count[2] + count[3]);
+	if (used == 0)
+		return false;
+	ref = total / used;
+	return true;
+}
+
+template<class T>
+static void meanScalar(T *frames, size_t stride, size_t n, const double *include, const double *scale, const double *inverse)
+{
+	for (size_t j = 0; j < n; j++) {
+		T *frame = frames + j * stride;
+		double ref;
+		if (!frameMean(frame, stride, include, scale, ref))
+			continue;
+		for (size_t c = 0; c < stride; c++) {
+			if (include[c] != 0 && !isBlanked(frame[c]))
+				storeSample(frame[c], frame[c] - ref * inverse[c]);
+		}
+	}
+}
+
+#ifdef SAMPLE_VECTOR_X86
+template<class T>
+__attribute__((target("sse2")))
+static void meanSSE2(T *frames, size_t stride, size_t n, const double *include, const double *scale, const double *inverse)
+{
+	const __m128d zero = _mm_setzero_pd();
+	const __m128d one = _mm_set1_pd(1);
+	for (size_t j = 0; j < n; j++) {
+		T *frame = frames + j * stride;
+		__m128d sum01 = zero, sum23 = zero, count01 = zero, count23 = zero;
+		size_t c = 0;
+		for (; c < stride; c += 4) {
+			const T *x = frame + c;
+			T tail[4] = { 0, 0, 0, 0 };
+			if (c + 4 > stride) { // padding is excluded anyway
+				std::copy(frame + c, frame + stride, tail);
+				x = tail;
+			}
+			__m128d x01 = loadSSE2(x);
+			__m128d x23 = loadSSE2(x + 2);
+			__m128d use01 = _mm_andnot_pd(blankedSSE2(x, x01), _mm_loadu_pd(include + c));
+			__m128d use23 = _mm_andnot_pd(blankedSSE2(x, x23), _mm_loadu_pd(include + c + 2));
+			sum01 = _mm_add_pd(sum01, _mm_and_pd(use01, _mm_mul_pd(x01, _mm_loadu_pd(scale + c))));
+			sum23 = _mm_add_pd(sum23, _mm_and_pd(use23, _mm_mul_pd(x23, _mm_loadu_pd(scale + c + 2))));
+			count01 = _mm_add_pd(count01, _mm_and_pd(use01, one));
+			count23 = _mm_add_pd(count23, _mm_and_pd(use23, one));
+		}
+		__m128d total = _mm_add_sd(_mm_add_sd(sum01, _mm_unpackhi_pd(sum01, sum01)), _mm_add_sd(sum23, _mm_unpackhi_pd(sum23, sum23)));
+		__m128d used = _mm_add_sd(_mm_add_sd(count01, _mm_unpackhi_pd(count01, count01)), _mm_add_sd(count23, _mm_unpackhi_pd(count23, count23)));
+		if (_mm_cvtsd_f64(used) == 0)
+			continue;
+		__m128d ref = _mm_set1_pd(_mm_cvtsd_f64(total) / _mm_cvtsd_f64(used));
+		for (c = 0; c + 2 <= stride; c += 2) {
+			__m128d x = loadSSE2(frame + c);
+			__m128d blanked = blankedSSE2(frame + c, x);
+			__m128d use = _mm_andnot_pd(blanked, _mm_loadu_pd(include + c));
+			storeSSE2(frame + c, _mm_sub_pd(x, _mm_and_pd(use, _mm_mul_pd(ref, _mm_loadu_pd(inverse + c)))), blanked);
+		}
+		if (c < stride && include[c] != 0 && !isBlanked(frame[c]))
+			storeSample(frame[c], frame[c] - _mm_cvtsd_f64(ref) * inverse[c]);
+	}
+}
+
+template<class T>
+__attribute__((target("avx2")))
+static void meanAVX2(T *frames, size_t stride, size_t n, const double *include, const double *scale, const double *inverse)
+{
+	const __m256d zero = _mm256_setzero_pd();
+	const __m256d one = _mm256_set1_pd(1);
+	for (size_t j = 0; j < n; j++) {
+		T *frame = frames + j * stride;
+		__m256d sum = zero, count = zero;
+		size_t c = 0;
+		for (; c < stride; c += 4) {
+			const T *x = frame + c;
+			T tail[4] = { 0, 0, 0, 0 };
+			if (c + 4 > stride) {
+				std::copy(frame + c, frame + stride, tail);
+				x = tail;
+			}
+			__m256d v = loadAVX2(x);
+			__m256d use = _mm256_andnot_pd(blankedAVX2(x, v), _mm256_loadu_pd(include + c));
+			sum = _mm256_add_pd(sum, _mm256_and_pd(use, _mm256_mul_pd(v, _mm256_loadu_pd(scale + c))));
+			count = _mm256_add_pd(count, _mm256_and_pd(use, one));
+		}
+		// hadd gives lanes 0 + 1 and 2 + 3, then one add across the halves
+		__m256d sums = _mm256_hadd_pd(sum, count);
+		__m128d pairs = _mm_add_pd(_mm256_castpd256_pd128(sums), _mm256_extractf128_pd(sums, 1));
+		double used = _mm_cvtsd_f64(_mm_unpackhi_pd(pairs, pairs));
+		if (used == 0)
+			continue;
+		__m256d ref = _mm256_set1_pd(_mm_cvtsd_f64(pairs) / used);
+		for (c = 0; c + 4 <= stride; c += 4) {
+			__m256d x = loadAVX2(frame + c);
+			__m256d blanked = blankedAVX2(frame + c, x);
+			__m256d use = _mm256_andnot_pd(blanked, _mm256_loadu_pd(include + c));
+			storeAVX2(frame + c, _mm256_sub_pd(x, _mm256_and_pd(use, _mm256_mul_pd(ref, _mm256_loadu_pd(inverse + c)))), blanked);
+		}
+		for (; c < stride; c++) {
+			if (include[c] != 0 && !isBlanked(frame[c]))
+				storeSample(frame[c], frame[c] - _mm256_cvtsd_f64(ref) * inverse[c]);
+		}
+	}
+}
+#endif
+
+template<class T>
+meanReferenceFn<T> getMeanReference(crossingScanIsa isa)
+{
+	if (isa == scanBest) {
+#ifdef SAMPLE_VECTOR_X86
+		if (__builtin_cpu_supports("avx2"))
+			return meanAVX2<T>;
+		if (__builtin_cpu_supports("sse2"))
+			return meanSSE2<T>;
+#endif
+		return meanScalar<T>;
+	}
+	switch (isa) {
+#ifdef SAMPLE_VECTOR_X86
+		case scanAVX2:
+			return __builtin_cpu_supports("avx2") ? meanAVX2<T> : NULL;
+		case scanSSE2:
+			return __builtin_cpu_supports("sse2") ? meanSSE2<T> : NULL;
+#endif
+		case scanScalar:
+			return meanScalar<T>;
+		default:
+			return NULL;
+	}
+}
+
+template meanReferenceFn<float> getMeanReference<float>(crossingScanIsa isa);
+template meanReferenceFn<int16_t> getMeanReference<int16_t>(crossingScanIsa isa);
+
+bool parseChannelList(const std::string &list, int numChannels, std::vector<int> &channels)
+{
+	std::vector<int> parsed;
+	const char *p = list.c_str();
+	while (*p) {
+		if (*p == ',' || *p == ' ') {
+			p++;
+			continue;
+		}
+		char *end;
+		long first = strtol(p, &end, 10);
+		if (end == p)
+			return false;
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1)
+				return false;
+			p = end;
+		}
+		if (first < 0 || last < first || last >= numChannels)
+			return false;
+		for (long c = first; c <= last; c++)
+			parsed.push_back(c);
+	}
+	std::sort(parsed.begin(), parsed.end());
+	parsed.erase(std::unique(parsed.begin(), parsed.end()), parsed.end());
+	channels.swap(parsed);
+	return true;
+}
+
+commonReference::commonReference(void) : numChannels(0), mode(referenceNone), numIncluded(0)
+{
+	floatKernel = getMeanReference<float>();
+	int16Kernel = getMeanReference<int16_t>();
+}
+
+void commonReference::configure(int channels, referenceMode m, const std::vector<int> &excluded)
+{
+	numChannels = channels;
+	mode = m;
+	double all;
+	memset(&all, 0xff, sizeof(all));
+	include.assign((numChannels + 3) & ~3, 0);
+	std::fill(include.begin(), include.begin() + numChannels, all);
+	for (size_t k = 0; k < excluded.size(); k++) {
+		if (excluded[k] >= 0 && excluded[k] < numChannels)
+			include[excluded[k]] = 0;
+	}
+	included.clear();
+	for (int c = 0; c < numChannels; c++) {
+		if (include[c] != 0)
+			included.push_back(c);
+	}
+	numIncluded = included.size();
+	scratch.resize(numIncluded);
+	scale.assign(include.size(), 1);
+	inverse.assign(include.size(), 1);
+}
+
+void commonReference::setScales(const double *scales)
+{
+	for (int c = 0; c < numChannels; c++) {
+		scale[c] = scales[c];
+		inverse[c] = 1 / scales[c];
+	}
+}
+
+bool commonReference::setIsa(crossingScanIsa isa)
+{
+	meanReferenceFn<float> k = getMeanReference<float>(isa);
+	if (!k)
+		return false;
+	floatKernel = k;
+	int16Kernel = getMeanReference<int16_t>(isa);
+	return true;
+}
+
+// the median needs a selection per frame, which does not vectorize; it is
+// for arrays where a few channels with large spikes or artifacts would pull
+// the mean
+template<class T>
+bool commonReference::frameMedian(const T *frame, double &ref)
+{
+	size_t used = 0;
+	for (int k = 0; k < numIncluded; k++) {
+		T v = frame[included[k]];
+		if (!isBlanked(v))
+			scratch[used++] = v * scale[included[k]];
+	}
+	if (used == 0)
+		return false;
+	size_t mid = used / 2;
+	std::nth_element(scratch.begin(), scratch.begin() + mid, scratch.begin() + used);
+	ref = scratch[mid];
+	if (used % 2 == 0)
+		ref = (*std::max_element(scratch.begin(), scratch.begin() + mid) + ref) / 2;
+	return true;
+}
+
+template<class T>
+void commonReference::medianReference(T *frames, size_t n)
+{
+	for (size_t j = 0; j < n; j++) {
+		T *frame = frames + j * numChannels;
+		double ref;
+		if (!frameMedian(frame, ref))
+			continue;
+		for (int k = 0; k < numIncluded; k++) {
+			T &v = frame[included[k]];
+			if (!isBlanked(v))
+				storeSample(v, v - ref * inverse[included[k]]);
+		}
+	}
+}
+
+template<class T>
+void commonReference::process(T *frames, size_t n)
+{
+	if (!isEnabled())
+		return;
+	if (mode == referenceMedian)
+		medianReference(frames, n);
+	else
+		kernel((T*)NULL)(frames, numChannels, n, include.data(), scale.data(), inverse.data());
+}
+
+template void commonReference::process<float>(float *frames, size_t n);
+template void commonReference::process<int16_t>(int16_t *frames, size_t n);
+
+// every mean kernel gives the bits of the scalar one, so its sums stand for all
+template<class T>
+void commonReference::frameReference(const T *frames, size_t n, double *ref)
+{
+	for (size_t j = 0; j < n; j++) {
+		const T *frame = frames + j * numChannels;
+		bool found = false;
+		if (isEnabled())
+			found = mode == referenceMedian ? frameMedian(frame, ref[j]) : frameMean(frame, numChannels, include.data(), scale.data(), ref[j]);
+		if (!found)
+			ref[j] = NAN;
+	}
+}
+
+template void commonReference::frameReference<float>(const float *frames, size_t n, double *ref);
+template void commonReference::frameReference<int16_t>(const int16_t *frames, size_t n, double *ref);
+
+template<class T>
+void commonReference::processFrames(framebuffer &source, unsigned long long start, size_t n)
+{
+	size_t done = 0;
+	while (done < n) {
+		size_t run;
+		T *frames = source.frameData<T>(start + done, &run);
+		run = std::min(run, n - done);
+		process(frames, run);
+		done += run;
+	}
+}
+
+void commonReference::process(framebuffer &source, unsigned long long start, size_t n)
+{
+	if (!isEnabled())
+		return;
+	setScales(source.scales());
+	if (source.format() == sampleInt16)
+		processFrames<int16_t>(source, start, n);
+	else
+		processFrames<float>(source, start, n);
+}
@@ -0,0 +1,115 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Common reference removal ahead of detection. Noise that every electrode
+* picks up at once (mains, motion, stimulation pickup) is estimated per frame
+* as the mean or median of the included channels and subtracted from each of
+* them, so it neither crosses the threshold on many channels together nor
+* inflates the noise estimates. Runs in place on frame-interleaved data,
+* before the bandpass filter. Channels are averaged in volts, so int16
+* frames may have a different step on every channel.
+*/
+
+#ifndef COMMON_REFERENCE_H
+#define COMMON_REFERENCE_H
+
+#include "crossing_scan.h"
+#include "ringbuffer.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+enum referenceMode {
+	referenceNone,
+	referenceMean,
+	referenceMedian,
+};
+
+// Subtracts the mean of the included, non-blanked samples of each frame
+// from those samples, for n frames of stride channels. include has stride
+// entries rounded up to a multiple of 4, all bits set for an included
+// channel and 0 otherwise (the padding is 0); scale and inverse, of the same
+// length, are the value of one count of each channel and its inverse.
+// Excluded channels and blanked samples (isBlanked()) are left as they
+// are. Sums run in 4 lanes of channels c % 4, added as (0 + 1) + (2 +
+// 3), so all kernels give the same bits. T is float or int16_t.
+template<class T>
+using meanReferenceFn = void (*)(T *frames, size_t stride, size_t n, const double *include,
+		const double *scale, const double *inverse);
+// kernel for the requested instruction set, or NULL if the CPU lacks it
+template<class T>
+meanReferenceFn<T> getMeanReference(crossingScanIsa isa = scanBest);
+
+// "3,7,12-15" into sorted channel numbers below numChannels; false, leaving
+// channels as they were, on a malformed list or a channel out of range
+bool parseChannelList(const std::string &list, int numChannels, std::vector<int> &channels);
+
+class commonReference {
+	public:
+		commonReference(void);
+
+		// The excluded channels (dead electrodes, the reference electrode)
+		// neither contribute to the reference nor have it subtracted. Not
+		// thread safe with process().
+		void configure(int numChannels, referenceMode mode, const std::vector<int> &excluded);
+		// kernel for the given instruction set, false if the CPU lacks it (for benchmarks)
+		bool setIsa(crossingScanIsa isa);
+		bool isEnabled(void) const { return mode != referenceNone && numIncluded > 1; }
+		referenceMode getMode(void) const { return mode; }
+		int getNumIncluded(void) const { return numIncluded; }
+
+		// value of one count of each channel (framebuffer::scales()), all 1
+		// after configure(); process(framebuffer &) sets them itself
+		void setScales(const double *scales);
+		// every channel of n frame-interleaved frames, one frame at a time
+		template<class T>
+		void process(T *frames, size_t n);
+		// same for frames [start, start + n) of a framebuffer the caller consumes
+		void process(framebuffer &source, unsigned long long start, size_t n);
+		// the reference process() takes off each of n frames in volts (each
+		// included channel loses it over its step), or NaN for a frame it
+		// leaves alone; for replaying the reference one channel at a time
+		template<class T>
+		void frameReference(const T *frames, size_t n, double *ref);
+		bool isIncluded(int channel) const { return include[channel] != 0; }
+
+	private:
+		int numChannels;
+		referenceMode mode;
+		int numIncluded;
+		std::vector<double> include; // bit masks, see meanReferenceFn
+		std::vector<int> included; // channel numbers, for the median
+		std::vector<double> scale; // padded as include
+		std::vector<double> inverse;
+		std::vector<double> scratch;
+		meanReferenceFn<float> floatKernel;
+		meanReferenceFn<int16_t> int16Kernel;
+
+		meanReferenceFn<float> kernel(float *) const { return floatKernel; }
+		meanReferenceFn<int16_t> kernel(int16_t *) const { return int16Kernel; }
+		template<class T>
+		bool frameMedian(const T *frame, double &ref);
+		template<class T>
+		void medianReference(T *frames, size_t n);
+		template<class T>
+		void processFrames(framebuffer &source, unsigned long long start, size_t n);
+};
+
+#endif
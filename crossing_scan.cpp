@@ -0,0 +1,295 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Threshold-crossing scan kernels
+*/
+
+#include "crossing_scan.h"
+#include <cmath>
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CROSSING_SCAN_X86
+#include <immintrin.h>
+#endif
+
+// the original per-sample band test of the detector, negated
+template<int polarity>
+static inline bool outsideBand(float v, float threshold)
+{
+	switch (polarity) {
+		case 1:
+			return !(v > -threshold);
+		case 2:
+			return !(v < threshold);
+		default:
+			return !(v < threshold && v > -threshold);
+	}
+}
+
+template<int polarity>
+static int scanScalarImpl(const float *data, int begin, int length, float threshold, float probe,
+		int *candidates, int n, scanStats *stats)
+{
+	double sumSquares = 0;
+	int numNonZero = 0, numAbove = 0;
+	for (int i = begin; i < length; i++) {
+		float v = data[i];
+		sumSquares += (double)v * v; // exact square; blanked samples add nothing
+		numNonZero += v != 0;
+		numAbove += fabsf(v) > probe;
+		candidates[n] = i;
+		n += outsideBand<polarity>(v, threshold);
+	}
+	stats->sumSquares += sumSquares;
+	stats->numNonZero += numNonZero;
+	stats->numAbove += numAbove;
+	return n;
+}
+
+template<int polarity>
+static int scanScalarKernel(const float *data, int length, float threshold, float probe, int *candidates, scanStats *stats)
+{
+	stats->sumSquares = 0;
+	stats->numNonZero = 0;
+	stats->numAbove = 0;
+	return scanScalarImpl<polarity>(data, 0, length, threshold, probe, candidates, 0, stats);
+}
+
+// expand a comparison bitmask into candidate indices
+static inline int appendMask(unsigned mask, int base, int *candidates, int n)
+{
+	while (mask) {
+		candidates[n++] = base + __builtin_ctz(mask);
+		mask &= mask - 1;
+	}
+	return n;
+}
+
+#ifdef CROSSING_SCAN_X86
+template<int polarity>
+static inline __m128 outsideSSE2(__m128 v, __m128 hi, __m128 lo)
+{
+	switch (polarity) {
+		case 1:
+			return _mm_cmpngt_ps(v, lo);
+		case 2:
+			return _mm_cmpnlt_ps(v, hi);
+		default:
+			return _mm_or_ps(_mm_cmpnlt_ps(v, hi), _mm_cmpngt_ps(v, lo));
+	}
+}
+
+// squares of the four lanes of v, widened to double so they are exact
+__attribute__((target("sse2")))
+static inline __m128d squareLowSSE2(__m128 v)
+{
+	__m128d d = _mm_cvtps_pd(v);
+	return _mm_mul_pd(d, d);
+}
+
+__attribute__((target("sse2")))
+static inline __m128d squareHighSSE2(__m128 v)
+{
+	__m128d d = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+	return _mm_mul_pd(d, d);
+}
+
+template<int polarity>
+__attribute__((target("sse2")))
+static int scanSSE2Kernel(const float *data, int length, float threshold, float probe, int *candidates, scanStats *stats)
+{
+	const __m128 hi = _mm_set1_ps(threshold);
+	const __m128 lo = _mm_set1_ps(-threshold);
+	const __m128 level = _mm_set1_ps(probe);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 sign = _mm_set1_ps(-0.0f);
+	__m128d sumA = _mm_setzero_pd(), sumB = sumA, sumC = sumA, sumD = sumA;
+	int numNonZero = 0, numAbove = 0;
+	int n = 0;
+	int i = 0;
+	for (; i + 8 <= length; i += 8) {
+		__m128 a = _mm_loadu_ps(data + i);
+		__m128 b = _mm_loadu_ps(data + i + 4);
+		sumA = _mm_add_pd(sumA, squareLowSSE2(a));
+		sumB = _mm_add_pd(sumB, squareHighSSE2(a));
+		sumC = _mm_add_pd(sumC, squareLowSSE2(b));
+		sumD = _mm_add_pd(sumD, squareHighSSE2(b));
+		numNonZero += __builtin_popcount(_mm_movemask_ps(_mm_cmpneq_ps(a, zero)) |
+			(_mm_movemask_ps(_mm_cmpneq_ps(b, zero)) << 4));
+		numAbove += __builtin_popcount(_mm_movemask_ps(_mm_cmpgt_ps(_mm_andnot_ps(sign, a), level)) |
+			(_mm_movemask_ps(_mm_cmpgt_ps(_mm_andnot_ps(sign, b), level)) << 4));
+		unsigned mask = _mm_movemask_ps(outsideSSE2<polarity>(a, hi, lo)) |
+			(_mm_movemask_ps(outsideSSE2<polarity>(b, hi, lo)) << 4);
+		if (mask)
+			n = appendMask(mask, i, candidates, n);
+	}
+	double lanes[2];
+	_mm_storeu_pd(lanes, _mm_add_pd(_mm_add_pd(sumA, sumB), _mm_add_pd(sumC, sumD)));
+	stats->sumSquares = lanes[0] + lanes[1];
+	stats->numNonZero = numNonZero;
+	stats->numAbove = numAbove;
+	return scanScalarImpl<polarity>(data, i, length, threshold, probe, candidates, n, stats);
+}
+
+template<int polarity>
+__attribute__((target("avx2")))
+static inline __m256 outsideAVX2(__m256 v, __m256 hi, __m256 lo)
+{
+	switch (polarity) {
+		case 1:
+			return _mm256_cmp_ps(v, lo, _CMP_NGT_UQ);
+		case 2:
+			return _mm256_cmp_ps(v, hi, _CMP_NLT_UQ);
+		default:
+			return _mm256_or_ps(_mm256_cmp_ps(v, hi, _CMP_NLT_UQ), _mm256_cmp_ps(v, lo, _CMP_NGT_UQ));
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256d squareLowAVX2(__m256 v)
+{
+	__m256d d = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+	return _mm256_mul_pd(d, d);
+}
+
+__attribute__((target("avx2")))
+static inline __m256d squareHighAVX2(__m256 v)
+{
+	__m256d d = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+	return _mm256_mul_pd(d, d);
+}
+
+template<int polarity>
+__attribute__((target("avx2")))
+static int scanAVX2Kernel(const float *data, int length, float threshold, float probe, int *candidates, scanStats *stats)
+{
+	const __m256 hi = _mm256_set1_ps(threshold);
+	const __m256 lo = _mm256_set1_ps(-threshold);
+	const __m256 level = _mm256_set1_ps(probe);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 sign = _mm256_set1_ps(-0.0f);
+	__m256d sumA = _mm256_setzero_pd(), sumB = sumA, sumC = sumA, sumD = sumA;
+	int numNonZero = 0, numAbove = 0;
+	int n = 0;
+	int i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m256 a = _mm256_loadu_ps(data + i);
+		__m256 b = _mm256_loadu_ps(data + i + 8);
+		// separate accumulators, no FMA: keeps the sum close to the scalar one
+		sumA = _mm256_add_pd(sumA, squareLowAVX2(a));
+		sumB = _mm256_add_pd(sumB, squareHighAVX2(a));
+		sumC = _mm256_add_pd(sumC, squareLowAVX2(b));
+		sumD = _mm256_add_pd(sumD, squareHighAVX2(b));
+		numNonZero += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(a, zero, _CMP_NEQ_UQ)) |
+			(_mm256_movemask_ps(_mm256_cmp_ps(b, zero, _CMP_NEQ_UQ)) << 8));
+		numAbove += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, a), level, _CMP_GT_OQ)) |
+			(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_andnot_ps(sign, b), level, _CMP_GT_OQ)) << 8));
+		unsigned mask = _mm256_movemask_ps(outsideAVX2<polarity>(a, hi, lo)) |
+			(_mm256_movemask_ps(outsideAVX2<polarity>(b, hi, lo)) << 8);
+		if (mask)
+			n = appendMask(mask, i, candidates, n);
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, _mm256_add_pd(_mm256_add_pd(sumA, sumB), _mm256_add_pd(sumC, sumD)));
+	stats->sumSquares = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+	stats->numNonZero = numNonZero;
+	stats->numAbove = numAbove;
+	return scanScalarImpl<polarity>(data, i, length, threshold, probe, candidates, n, stats);
+}
+#endif
+
+// polarity is a template parameter of the kernels, dispatch on it once per call
+#define CROSSING_SCAN_DISPATCH(name, kernel) \
+	static int name(const float *data, int length, float threshold, int threshPolarity, float probe, \
+			int *candidates, scanStats *stats) \
+	{ \
+		switch (threshPolarity) { \
+			case 1: return kernel<1>(data, length, threshold, probe, candidates, stats); \
+			case 2: return kernel<2>(data, length, threshold, probe, candidates, stats); \
+			default: return kernel<0>(data, length, threshold, probe, candidates, stats); \
+		} \
+	}
+
+CROSSING_SCAN_DISPATCH(crossingScanScalar, scanScalarKernel)
+#ifdef CROSSING_SCAN_X86
+CROSSING_SCAN_DISPATCH(crossingScanSSE2, scanSSE2Kernel)
+CROSSING_SCAN_DISPATCH(crossingScanAVX2, scanAVX2Kernel)
+#endif
+
+template<int polarity>
+static int narrowKernel(const float *data, const int *candidates, int n, float threshold, int *out)
+{
+	int m = 0;
+	for (int k = 0; k < n; k++) {
+		out[m] = candidates[k];
+		m += outsideBand<polarity>(data[candidates[k]], threshold);
+	}
+	return m;
+}
+
+int narrowCandidates(const float *data, const int *candidates, int n, float threshold, int threshPolarity, int *out)
+{
+	switch (threshPolarity) {
+		case 1: return narrowKernel<1>(data, candidates, n, threshold, out);
+		case 2: return narrowKernel<2>(data, candidates, n, threshold, out);
+		default: return narrowKernel<0>(data, candidates, n, threshold, out);
+	}
+}
+
+static crossingScanIsa bestIsa(void)
+{
+#ifdef CROSSING_SCAN_X86
+	if (__builtin_cpu_supports("avx2"))
+		return scanAVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return scanSSE2;
+#endif
+	return scanScalar;
+}
+
+crossingScanFn getCrossingScan(crossingScanIsa isa)
+{
+	static const crossingScanIsa best = bestIsa();
+	if (isa == scanBest)
+		isa = best;
+	switch (isa) {
+#ifdef CROSSING_SCAN_X86
+		case scanAVX2:
+			return __builtin_cpu_supports("avx2") ? crossingScanAVX2 : NULL;
+		case scanSSE2:
+			return __builtin_cpu_supports("sse2") ? crossingScanSSE2 : NULL;
+#endif
+		case scanScalar:
+			return crossingScanScalar;
+		default:
+			return NULL;
+	}
+}
+
+const char *crossingScanName(crossingScanIsa isa)
+{
+	if (isa == scanBest)
+		isa = bestIsa();
+	switch (isa) {
+		case scanAVX2: return "avx2";
+		case scanSSE2: return "sse2";
+		default: return "scalar";
+	}
+}
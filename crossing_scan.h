@@ -0,0 +1,63 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Vectorized threshold-crossing scan. Finds every sample of a detection
+* window that lies outside the detection band so only those candidates go
+* through the spike-tracking state machine, and gathers the noise
+* statistics of the window in the same pass. Samples are float, so a
+* vector holds twice as many of them as it would doubles; the sum of
+* squares is still kept in double.
+*/
+
+#ifndef CROSSING_SCAN_H
+#define CROSSING_SCAN_H
+
+enum crossingScanIsa {
+	scanBest, // fastest kernel the CPU supports, chosen at run time
+	scanScalar,
+	scanSSE2,
+	scanAVX2,
+};
+
+// noise statistics of one window, gathered while it is scanned
+struct scanStats {
+	double sumSquares; // sum of the squared non-zero samples
+	int numNonZero; // samples that are not blanked (exactly 0)
+	int numAbove; // samples with |v| > probe
+};
+
+// Writes the index of every sample in data[0, length) that is outside the
+// band for threshPolarity (0 = bipolar; 1 = negative only; 2 = positive
+// only) into candidates, in increasing order, and returns their number.
+// candidates must have room for length entries. The noise statistics of the
+// same samples are written to *stats; probe is the level numAbove is
+// counted against.
+typedef int (*crossingScanFn)(const float *data, int length, float threshold, int threshPolarity,
+		float probe, int *candidates, scanStats *stats);
+
+// Keeps the candidates[0, n) that are also outside the band at threshold, a
+// higher threshold than they were found with, in out (which may be
+// candidates itself). Returns their number.
+int narrowCandidates(const float *data, const int *candidates, int n, float threshold, int threshPolarity, int *out);
+
+// kernel for the requested instruction set, or NULL if the CPU lacks it
+crossingScanFn getCrossingScan(crossingScanIsa isa = scanBest);
+const char *crossingScanName(crossingScanIsa isa = scanBest);
+
+#endif
@@ -0,0 +1,282 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Worker pool for multi-channel spike detection
+*/
+
+#include "detection_pool.h"
+#include "spike_sorter.h"
+#include <algorithm>
+
+detectionPool::detectionPool(void) : detector(NULL), source(NULL), recorder(NULL), rawFile(NULL), filter(NULL), reference(NULL), analytics(NULL), sorter(NULL), nextQueue(0), stampMask(0), nsPerFrame(0),
+	queuedSpikes(0), droppedSpikes(0), generation(0), pending(0), quit(false), jobStart(0), jobLength(0), jobNewest(0), jobRecord(false), jobSort(false), jobCollect(false)
+{
+}
+
+detectionPool::~detectionPool(void)
+{
+	stop();
+}
+
+void detectionPool::start(SpikeDetector *det, framebuffer *src, int numThreads, size_t queueLength)
+{
+	stop();
+	detector = det;
+	source = src;
+	int numChannels = detector->getNumChannels();
+	if (numThreads > numChannels)
+		numThreads = numChannels;
+	if (numThreads < 1)
+		numThreads = 1;
+	channelBlocks.assign(numChannels, NULL);
+	// only a re-referenced or filtered pass needs its own copy for the raw recorder
+	bool rawCopy = rawFile && ((filter && filter->isEnabled()) || (reference && reference->isEnabled()));
+	rawSamples.assign(rawCopy ? numChannels * source->capacity() : 0, 0);
+	rawBlocks.assign(rawCopy ? numChannels : 0, NULL);
+	for (size_t c = 0; c < rawBlocks.size(); c++)
+		rawBlocks[c] = &rawSamples[c * source->capacity()];
+	nextQueue = 0;
+	size_t history = 1;
+	while (history < source->capacity() + detector->getCarryOverLength())
+		history <<= 1;
+	// kept across restarts, the detector's carry-over still refers to them
+	if (stamps.size() != history)
+		stamps.assign(history, 0);
+	stampMask = history - 1;
+	nsPerFrame = 1e9 / detector->getParameters().samplingFrequency;
+	generation = 0;
+	pending = 0;
+	quit = false;
+
+	// contiguous channel groups, sizes differ by at most one channel
+	for (int k = 0; k < numThreads; k++) {
+		worker *w = new worker;
+		w->firstChannel = numChannels * k / numThreads;
+		w->lastChannel = numChannels * (k + 1) / numThreads;
+		w->queue.resize(queueLength);
+		workers.push_back(std::unique_ptr<worker>(w));
+	}
+	// worker 0 runs on the thread calling detect()
+	for (int k = 1; k < numThreads; k++)
+		workers[k]->thread = std::thread(&detectionPool::workerLoop, this, workers[k].get());
+}
+
+void detectionPool::stop(void)
+{
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		quit = true;
+	}
+	jobReady.notify_all();
+	for (size_t k = 0; k < workers.size(); k++) {
+		if (workers[k]->thread.joinable())
+			workers[k]->thread.join();
+	}
+	workers.clear();
+}
+
+size_t detectionPool::detect(void)
+{
+	size_t n = source->available();
+	if (n == 0 || workers.empty())
+		return 0;
+	std::chrono::steady_clock::time_point passStart = std::chrono::steady_clock::now();
+
+	// keep the stamps past the release so spikes in the carry-over can be timed
+	unsigned long long start = source->readIndex();
+	for (unsigned long long f = start; f < start + n; f++)
+		stamps[f & stampMask] = source->stamp(f);
+
+	// the reference and the filter work in place, take the raw samples first
+	bool recordingRaw = rawFile && rawFile->isOpen();
+	bool rawCopy = recordingRaw && !rawBlocks.empty();
+	if (rawCopy)
+		source->readChannels(rawBlocks.data(), 0, rawBlocks.size(), start, n);
+
+	// across all channels, so before the frames are split into groups
+	if (reference && reference->isEnabled())
+		reference->process(*source, start, n);
+
+	{
+		std::lock_guard<std::mutex> lock(jobMutex);
+		jobStart = start;
+		jobLength = n;
+		jobClock = passStart;
+		jobNewest = stamps[(start + n - 1) & stampMask];
+		jobRecord = recorder && recorder->isOpen();
+		jobSort = sorter != NULL;
+		jobCollect = jobRecord || analytics || jobSort;
+		pending = workers.size() - 1;
+		generation++;
+	}
+	jobReady.notify_all();
+	detectGroup(workers[0].get());
+	{
+		std::unique_lock<std::mutex> lock(jobMutex);
+		jobDone.wait(lock, [this] { return pending == 0; });
+	}
+
+	// every group has its copy of the frames, hand them back to the producer
+	source->release(n);
+
+	// unfiltered, the new samples stay in the detector windows until the next pass
+	if (recordingRaw)
+		recordRaw(rawCopy ? rawBlocks.data() : channelBlocks.data(), start, n);
+
+	if (jobCollect) {
+		for (size_t k = 0; k < workers.size(); k++) {
+			std::vector<pooledSpike> &recorded = workers[k]->recorded;
+			for (size_t i = 0; i < recorded.size(); i++) {
+				if (analytics)
+					analytics->add(recorded[i].spike.channel, recorded[i].sampleIndex);
+				if (jobRecord)
+					recorder->append(recorded[i].sampleIndex, recorded[i].spike);
+			}
+			if (jobSort)
+				sorter->append(recorded);
+			recorded.clear();
+		}
+		if (jobRecord)
+			recorder->flush();
+	}
+	// later passes can still find spikes in the carry-over, not before it
+	if (analytics) {
+		size_t carry = detector->getCarryOverLength();
+		if (start + n > carry)
+			analytics->advance(stamps[(start + n - carry) & stampMask]);
+	}
+	passTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - passStart).count());
+	return n;
+}
+
+void detectionPool::recordRaw(const float *const *blocks, unsigned long long start, size_t n)
+{
+	size_t run = 0;
+	for (size_t f = 1; f <= n; f++) {
+		// a block per run of consecutive stamps, so gaps survive in the file
+		if (f == n || stamps[(start + f) & stampMask] != stamps[(start + f - 1) & stampMask] + 1) {
+			rawFile->append(blocks, run, f - run, stamps[(start + run) & stampMask]);
+			run = f;
+		}
+	}
+	rawFile->flush();
+}
+
+void detectionPool::workerLoop(worker *w)
+{
+	unsigned long long seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(jobMutex);
+			jobReady.wait(lock, [this, seen] { return quit || generation != seen; });
+			if (quit)
+				return;
+			seen = generation;
+		}
+		detectGroup(w);
+		{
+			std::lock_guard<std::mutex> lock(jobMutex);
+			if (--pending == 0)
+				jobDone.notify_one();
+		}
+	}
+}
+
+// filter, transpose and search one channel group; touches only that group's
+// channels of the frames and its detector state
+void detectionPool::detectGroup(worker *w)
+{
+	if (filter && filter->isEnabled())
+		filter->process(*source, jobStart, jobLength, w->firstChannel, w->lastChannel);
+	for (int c = w->firstChannel; c < w->lastChannel; c++)
+		channelBlocks[c] = detector->appendBuffer(c, jobLength);
+	source->readChannels(channelBlocks.data(), w->firstChannel, w->lastChannel, jobStart, jobLength);
+
+	unsigned long long queued = 0, dropped = 0;
+	for (int c = w->firstChannel; c < w->lastChannel; c++) {
+		w->found.clear();
+		detector->processWindow(c, jobLength, w->found, w->ws);
+		if (w->found.empty())
+			continue;
+		double sinceStart = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - jobClock).count();
+		if (jobCollect) {
+			for (size_t k = 0; k < w->found.size(); k++) {
+				pooledSpike spike = { stamps[(jobStart + w->found[k].maxIndex) & stampMask], w->found[k] };
+				w->recorded.push_back(spike);
+			}
+		}
+		if (jobSort) {
+			// the sorter takes every spike of the pass and queues it for the display itself
+			for (size_t k = 0; k < w->found.size(); k++) {
+				unsigned long long sampleIndex = stamps[(jobStart + w->found[k].maxIndex) & stampMask];
+				spikeLatency.record((uint64_t)(sinceStart + (jobNewest - sampleIndex) * nsPerFrame));
+			}
+			queued += w->found.size();
+			continue;
+		}
+		for (size_t k = 0; k < w->found.size(); k++) {
+			pooledSpike *slot = w->queue.prepare();
+			if (!slot) {
+				dropped += w->found.size() - k; // display is not keeping up
+				break;
+			}
+			const detectedSpike &found = w->found[k];
+			slot->sampleIndex = stamps[(jobStart + found.maxIndex) & stampMask];
+			spikeLatency.record((uint64_t)(sinceStart + (jobNewest - slot->sampleIndex) * nsPerFrame));
+			// header and the used part of the snippet only
+			slot->spike.channel = found.channel;
+			slot->spike.maxIndex = found.maxIndex;
+			slot->spike.threshold = found.threshold;
+			slot->spike.waveLength = found.waveLength;
+			slot->spike.unit = found.unit;
+			std::copy(found.wave, found.wave + found.waveLength, slot->spike.wave);
+			w->queue.commit();
+			queued++;
+		}
+	}
+	// once per group and pass, so workers rarely touch the shared counters
+	if (queued)
+		queuedSpikes.fetch_add(queued, std::memory_order_relaxed);
+	if (dropped)
+		droppedSpikes.fetch_add(dropped, std::memory_order_relaxed);
+}
+
+void detectionPool::clearStats(void)
+{
+	queuedSpikes.store(0, std::memory_order_relaxed);
+	droppedSpikes.store(0, std::memory_order_relaxed);
+	passTime.clear();
+	spikeLatency.clear();
+}
+
+bool detectionPool::popSpike(pooledSpike &spike)
+{
+	// round robin so one busy group cannot starve the others
+	for (size_t k = 0; k < workers.size(); k++) {
+		ringbuffer<pooledSpike> &queue = workers[nextQueue]->queue;
+		nextQueue = (nextQueue + 1) % workers.size();
+		pooledSpike *slot = queue.front();
+		if (slot) {
+			spike = *slot;
+			queue.release();
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,167 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Runs the spike detector over a framebuffer on a pool of worker threads.
+* Each worker owns a contiguous group of channels and hands the spikes it
+* finds to the display through its own lock-free queue.
+*/
+
+#ifndef DETECTION_POOL_H
+#define DETECTION_POOL_H
+
+#include "biquad_filter.h"
+#include "common_reference.h"
+#include "network_analytics.h"
+#include "pipeline_stats.h"
+#include "raw_recorder.h"
+#include "ringbuffer.h"
+#include "spike_detector.h"
+#include "spike_file.h"
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class spikeSorter;
+
+struct pooledSpike {
+	unsigned long long sampleIndex; // producer's stamp of the frame holding the spike maximum
+	detectedSpike spike;
+};
+
+class detectionPool {
+	public:
+		detectionPool(void);
+		~detectionPool(void);
+
+		// Not thread safe: splits the detector's channels over numThreads
+		// workers (the thread calling detect() counts as one of them) and
+		// starts them. Each worker queues up to queueLength spikes for the
+		// display; the queues are allocated here and nothing is allocated per spike.
+		void start(SpikeDetector *detector, framebuffer *source, int numThreads, size_t queueLength = 4096);
+		void stop(void);
+		bool isRunning(void) const { return !workers.empty(); }
+		// Every spike found while the recorder is open is also handed to it,
+		// from the thread calling detect() after each pass, whether or not the
+		// display queue had room. Not thread safe: set while stopped.
+		void setRecorder(spikeFileWriter *r) { recorder = r; }
+		// Every frame searched while the raw recorder is open goes to it too,
+		// as it came in: read back from the detector windows after the pass, or
+		// transposed on its own before the frames are re-referenced or filtered. Not thread
+		// safe: set while stopped.
+		void setRawRecorder(rawRecorder *r) { rawFile = r; }
+		// When enabled, each worker filters its channels of the new frames in
+		// place before it searches them, so the detector and the spike
+		// snippets see the filtered traces; the raw recording does not. Not
+		// thread safe: set and design while stopped.
+		void setFilter(biquadFilter *f) { filter = f; }
+		// When enabled, the thread calling detect() removes the common
+		// reference from the new frames before the workers filter and search
+		// them; it needs every channel of a frame. The raw recording keeps the
+		// frames as they were. Not thread safe: set and configure while stopped.
+		void setReference(commonReference *r) { reference = r; }
+		// Every spike found is also handed to the analytics from the thread
+		// calling detect() after each pass, which then advances it past the
+		// frames no later pass can find a spike in. Not thread safe: set and
+		// configure while stopped.
+		void setAnalytics(networkAnalytics *a) { analytics = a; }
+		// When set, every spike found goes to the sorter instead of the
+		// display queues, from the thread calling detect() after each pass;
+		// the sorter queues it for the display once it has its unit. Not
+		// thread safe: set while stopped.
+		void setSorter(spikeSorter *s) { sorter = s; }
+		int numWorkers(void) const { return workers.size(); }
+
+		// detection thread: searches every frame published so far, returns once
+		// all channel groups are done and the frames are released
+		size_t detect(void);
+
+		// display thread: next queued spike from any worker, false when all
+		// queues are empty
+		bool popSpike(pooledSpike &spike);
+
+		// Health statistics, readable from any thread and kept across restarts.
+		// Spike latency runs from the RT tick that published the newest frame
+		// of a pass (taken as the start of the pass, so a pass that starts late
+		// reads short by the delay) to the spike entering its queue, or being
+		// kept for the sorter.
+		unsigned long long spikesQueued(void) const { return queuedSpikes.load(std::memory_order_relaxed); }
+		unsigned long long spikesDropped(void) const { return droppedSpikes.load(std::memory_order_relaxed); } // queue was full
+		const latencyHistogram &passDurations(void) const { return passTime; } // (ns)
+		const latencyHistogram &spikeLatencies(void) const { return spikeLatency; } // (ns)
+		void clearStats(void);
+
+	private:
+		struct worker {
+			int firstChannel;
+			int lastChannel;
+			detectionWorkspace ws;
+			std::vector<detectedSpike> found;
+			std::vector<pooledSpike> recorded; // this pass, for the recorder, the analytics and the sorter
+			ringbuffer<pooledSpike> queue; // worker -> display
+			std::thread thread;
+		};
+		std::vector<std::unique_ptr<worker> > workers;
+		SpikeDetector *detector;
+		framebuffer *source;
+		spikeFileWriter *recorder;
+		rawRecorder *rawFile;
+		biquadFilter *filter;
+		commonReference *reference;
+		networkAnalytics *analytics;
+		spikeSorter *sorter;
+		std::vector<float*> channelBlocks;
+		std::vector<float> rawSamples; // unreferenced, unfiltered copy of a pass for the raw recorder
+		std::vector<float*> rawBlocks; // into rawSamples, one capacity() run per channel
+		size_t nextQueue; // display thread only
+
+		// stamps of the frames still reachable from the detection windows
+		// (current block and carry-over), indexed by frame & stampMask
+		std::vector<unsigned long long> stamps;
+		unsigned long long stampMask;
+		double nsPerFrame;
+
+		std::atomic<unsigned long long> queuedSpikes;
+		std::atomic<unsigned long long> droppedSpikes;
+		latencyHistogram passTime;
+		latencyHistogram spikeLatency;
+
+		// the current job, published to the workers under jobMutex
+		std::mutex jobMutex;
+		std::condition_variable jobReady;
+		std::condition_variable jobDone;
+		unsigned long long generation;
+		int pending;
+		bool quit;
+		unsigned long long jobStart;
+		size_t jobLength;
+		std::chrono::steady_clock::time_point jobClock; // when the pass started
+		unsigned long long jobNewest; // stamp of the newest frame in the pass
+		bool jobRecord; // recorder open
+		bool jobSort; // spikes go to the sorter, not the display queues
+		bool jobCollect; // spikes kept for the recorder, the analytics or the sorter
+
+		void recordRaw(const float *const *blocks, unsigned long long start, size_t n);
+		void workerLoop(worker *w);
+		void detectGroup(worker *w);
+};
+
+#endif
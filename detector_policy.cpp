@@ -0,0 +1,249 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Detection signal kernels
+*/
+
+#include "detector_policy.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define POLICY_X86
+#include <immintrin.h>
+#endif
+
+// Products and sums are rounded separately (no fused multiply-add) and
+// summed in the same order by every kernel, so all give the same bits.
+static void energyScalar(const float *x, int length, int k, float *out)
+{
+	int edge = std::min(k, length);
+	std::fill(out, out + edge, 0.0f);
+	for (int n = edge; n < length - k; n++)
+		out[n] = x[n] * x[n] - x[n - k] * x[n + k];
+	std::fill(out + std::max(edge, length - k), out + length, 0.0f);
+}
+
+// out[n] for n in [begin, end), all of whose taps are inside x
+static inline void matchedFilterRange(const float *x, int begin, int end, const float *taps, int numTaps, int center, float *out)
+{
+	for (int n = begin; n < end; n++) {
+		const float *w = x + n - center;
+		float acc = 0;
+		for (int k = 0; k < numTaps; k++)
+			acc = acc + taps[k] * w[k];
+		out[n] = acc;
+	}
+}
+
+// [first, last) is where the taps fit; the rest of out is 0
+static inline void matchedFilterEdges(int length, int numTaps, int center, float *out, int *first, int *last)
+{
+	*first = std::min(center, length);
+	*last = std::max(*first, length - (numTaps - 1 - center));
+	std::fill(out, out + *first, 0.0f);
+	std::fill(out + *last, out + length, 0.0f);
+}
+
+static void matchedFilterScalar(const float *x, int length, const float *taps, int numTaps, int center, float *out)
+{
+	int first, last;
+	matchedFilterEdges(length, numTaps, center, out, &first, &last);
+	matchedFilterRange(x, first, last, taps, numTaps, center, out);
+}
+
+#ifdef POLICY_X86
+__attribute__((target("sse2")))
+static void energySSE2(const float *x, int length, int k, float *out)
+{
+	int edge = std::min(k, length);
+	std::fill(out, out + edge, 0.0f);
+	int n = edge;
+	for (; n + 4 <= length - k; n += 4) {
+		__m128 v = _mm_loadu_ps(x + n);
+		__m128 cross = _mm_mul_ps(_mm_loadu_ps(x + n - k), _mm_loadu_ps(x + n + k));
+		_mm_storeu_ps(out + n, _mm_sub_ps(_mm_mul_ps(v, v), cross));
+	}
+	for (; n < length - k; n++)
+		out[n] = x[n] * x[n] - x[n - k] * x[n + k];
+	std::fill(out + std::max(edge, length - k), out + length, 0.0f);
+}
+
+__attribute__((target("sse2")))
+static void matchedFilterSSE2(const float *x, int length, const float *taps, int numTaps, int center, float *out)
+{
+	int first, last;
+	matchedFilterEdges(length, numTaps, center, out, &first, &last);
+	int n = first;
+	for (; n + 4 <= last; n += 4) {
+		const float *w = x + n - center;
+		__m128 acc = _mm_setzero_ps();
+		for (int k = 0; k < numTaps; k++)
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(taps[k]), _mm_loadu_ps(w + k)));
+		_mm_storeu_ps(out + n, acc);
+	}
+	matchedFilterRange(x, n, last, taps, numTaps, center, out);
+}
+
+__attribute__((target("avx2")))
+static void energyAVX2(const float *x, int length, int k, float *out)
+{
+	int edge = std::min(k, length);
+	std::fill(out, out + edge, 0.0f);
+	int n = edge;
+	for (; n + 8 <= length - k; n += 8) {
+		__m256 v = _mm256_loadu_ps(x + n);
+		__m256 cross = _mm256_mul_ps(_mm256_loadu_ps(x + n - k), _mm256_loadu_ps(x + n + k));
+		_mm256_storeu_ps(out + n, _mm256_sub_ps(_mm256_mul_ps(v, v), cross));
+	}
+	for (; n < length - k; n++)
+		out[n] = x[n] * x[n] - x[n - k] * x[n + k];
+	std::fill(out + std::max(edge, length - k), out + length, 0.0f);
+}
+
+// eight outputs per register, every tap broadcast once per 32 outputs
+__attribute__((target("avx2")))
+static void matchedFilterAVX2(const float *x, int length, const float *taps, int numTaps, int center, float *out)
+{
+	int first, last;
+	matchedFilterEdges(length, numTaps, center, out, &first, &last);
+	int n = first;
+	// four independent sums cover the latency of the adds
+	for (; n + 32 <= last; n += 32) {
+		const float *w = x + n - center;
+		__m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), acc2 = _mm256_setzero_ps(), acc3 = _mm256_setzero_ps();
+		for (int k = 0; k < numTaps; k++) {
+			__m256 t = _mm256_set1_ps(taps[k]);
+			acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(t, _mm256_loadu_ps(w + k)));
+			acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(t, _mm256_loadu_ps(w + k + 8)));
+			acc2 = _mm256_add_ps(acc2, _mm256_mul_ps(t, _mm256_loadu_ps(w + k + 16)));
+			acc3 = _mm256_add_ps(acc3, _mm256_mul_ps(t, _mm256_loadu_ps(w + k + 24)));
+		}
+		_mm256_storeu_ps(out + n, acc0);
+		_mm256_storeu_ps(out + n + 8, acc1);
+		_mm256_storeu_ps(out + n + 16, acc2);
+		_mm256_storeu_ps(out + n + 24, acc3);
+	}
+	for (; n + 8 <= last; n += 8) {
+		const float *w = x + n - center;
+		__m256 acc = _mm256_setzero_ps();
+		for (int k = 0; k < numTaps; k++)
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(taps[k]), _mm256_loadu_ps(w + k)));
+		_mm256_storeu_ps(out + n, acc);
+	}
+	matchedFilterRange(x, n, last, taps, numTaps, center, out);
+}
+#endif
+
+energyKernelFn getEnergyKernel(crossingScanIsa isa)
+{
+	if (isa == scanBest) {
+#ifdef POLICY_X86
+		if (__builtin_cpu_supports("avx2"))
+			return energyAVX2;
+		if (__builtin_cpu_supports("sse2"))
+			return energySSE2;
+#endif
+		return energyScalar;
+	}
+	switch (isa) {
+#ifdef POLICY_X86
+		case scanAVX2:
+			return __builtin_cpu_supports("avx2") ? energyAVX2 : NULL;
+		case scanSSE2:
+			return __builtin_cpu_supports("sse2") ? energySSE2 : NULL;
+#endif
+		case scanScalar:
+			return energyScalar;
+		default:
+			return NULL;
+	}
+}
+
+matchedFilterFn getMatchedFilter(crossingScanIsa isa)
+{
+	if (isa == scanBest) {
+#ifdef POLICY_X86
+		if (__builtin_cpu_supports("avx2"))
+			return matchedFilterAVX2;
+		if (__builtin_cpu_supports("sse2"))
+			return matchedFilterSSE2;
+#endif
+		return matchedFilterScalar;
+	}
+	switch (isa) {
+#ifdef POLICY_X86
+		case scanAVX2:
+			return __builtin_cpu_supports("avx2") ? matchedFilterAVX2 : NULL;
+		case scanSSE2:
+			return __builtin_cpu_supports("sse2") ? matchedFilterSSE2 : NULL;
+#endif
+		case scanScalar:
+			return matchedFilterScalar;
+		default:
+			return NULL;
+	}
+}
+
+std::vector<double> defaultSpikeTemplate(double samplingFrequency, int *center)
+{
+	int before = (int)lround(0.4e-3 * samplingFrequency);
+	int after = (int)lround(1e-3 * samplingFrequency);
+	std::vector<double> taps;
+	double energy = 0;
+	for (int k = -before; k <= after; k++) {
+		double t = k / samplingFrequency;
+		double v = -exp(-pow(t / 0.15e-3, 2)) + 0.35 * exp(-pow((t - 0.45e-3) / 0.3e-3, 2));
+		taps.push_back(v);
+		energy += v * v;
+	}
+	for (size_t k = 0; k < taps.size(); k++)
+		taps[k] /= sqrt(energy);
+	*center = before;
+	return taps;
+}
+
+int energyResolution(double samplingFrequency)
+{
+	return std::max(1, (int)lround(0.1e-3 * samplingFrequency));
+}
+
+std::vector<double> energySmoothing(int resolution)
+{
+	int half = 2 * resolution;
+	std::vector<double> taps;
+	double sum = 0;
+	for (int k = -half; k <= half; k++) {
+		taps.push_back(half + 1 - abs(k));
+		sum += taps.back();
+	}
+	for (size_t k = 0; k < taps.size(); k++)
+		taps[k] /= sum;
+	return taps;
+}
+
+int detectionPolarity(int method, int threshPolarity)
+{
+	switch (method) {
+		case detectEnergy: return energyPolicy::polarity(threshPolarity);
+		case detectMatchedFilter: return matchedFilterPolicy::polarity(threshPolarity);
+		default: return thresholdPolicy::polarity(threshPolarity);
+	}
+}
@@ -0,0 +1,107 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Detection methods. Each one turns a channel's window into the detection
+* signal that the crossing scan, the noise estimate and the spike tracker
+* work on; the spike maximum, the snippet and its validation still come from
+* the voltage. The method is picked when the parameters are set, and the
+* detector's scan is instantiated for each policy below, so the per-sample
+* work is a direct call into that method's vectorized kernel.
+*/
+
+#ifndef DETECTOR_POLICY_H
+#define DETECTOR_POLICY_H
+
+#include "crossing_scan.h"
+#include <vector>
+
+enum detectionMethod {
+	detectThreshold, // the voltage itself
+	detectEnergy, // smoothed nonlinear (Teager) energy operator, x[n]^2 - x[n-k] x[n+k]
+	detectMatchedFilter, // correlation with a unit-energy spike template
+};
+
+// NEO of resolution k of x[0, length) into out, 0 for the k samples at either end
+typedef void (*energyKernelFn)(const float *x, int length, int k, float *out);
+// out[n] = sum over k of taps[k] * x[n - center + k], in k order, and 0
+// where the taps would reach outside x
+typedef void (*matchedFilterFn)(const float *x, int length, const float *taps, int numTaps, int center, float *out);
+// kernels for the requested instruction set, or NULL if the CPU lacks it;
+// all give identical results
+energyKernelFn getEnergyKernel(crossingScanIsa isa = scanBest);
+matchedFilterFn getMatchedFilter(crossingScanIsa isa = scanBest);
+
+// Biphasic extracellular spike (sharp negative peak, slower positive
+// rebound) from 0.4 ms before to 1 ms after the peak, scaled to unit energy
+// so white noise keeps its level through the filter. *center is the peak.
+std::vector<double> defaultSpikeTemplate(double samplingFrequency, int *center);
+// NEO resolution of about 0.1 ms, and the Bartlett window of 4k + 1 taps
+// (unit sum) the energy is smoothed with
+int energyResolution(double samplingFrequency);
+std::vector<double> energySmoothing(int resolution);
+
+// what a policy needs besides the window
+struct detectionKernels {
+	energyKernelFn energy;
+	matchedFilterFn matchedFilter;
+	const float *taps;
+	int numTaps;
+	int center;
+	int resolution; // of the energy operator
+	const float *smoothing; // of the energy
+	int numSmoothing;
+};
+
+// A policy has polarity(), the band the crossing scan applies to its signal
+// for the configured threshPolarity, and signal(), which returns the
+// detection signal of window[0, length): the window itself or out, filled
+// sample for sample in line with it. out has room for 2 * length samples,
+// the second half is scratch.
+struct thresholdPolicy {
+	static int polarity(int threshPolarity) { return threshPolarity; }
+	static const float *signal(const detectionKernels &, const float *window, int, float *) { return window; }
+};
+
+// always positive-going, whatever the polarity of the spike
+struct energyPolicy {
+	static int polarity(int) { return 2; }
+	static const float *signal(const detectionKernels &k, const float *window, int length, float *out)
+	{
+		k.energy(window, length, k.resolution, out + length);
+		k.matchedFilter(out + length, length, k.smoothing, k.numSmoothing, k.numSmoothing / 2, out);
+		return out;
+	}
+};
+
+// A spike shaped like the template gives a positive peak. The template's
+// peak is negative (SpikeDetector::setTemplate() flips one that is not), so
+// negative spikes come out positive and the bands swap.
+struct matchedFilterPolicy {
+	static int polarity(int threshPolarity) { return threshPolarity == 1 ? 2 : threshPolarity == 2 ? 1 : threshPolarity; }
+	static const float *signal(const detectionKernels &k, const float *window, int length, float *out)
+	{
+		k.matchedFilter(window, length, k.taps, k.numTaps, k.center, out);
+		return out;
+	}
+};
+
+// band of the detection signal for a method and threshPolarity
+int detectionPolarity(int method, int threshPolarity);
+
+#endif
@@ -21,10 +21,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "mea.h"
+#include <algorithm>
 #include <iostream>
+#include <poll.h>
 #include <QtGui>
 #include <qwt_plot_renderer.h>
 #include <qwt_symbol.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 extern "C" Plugin::Object *createRTXIPlugin(void)
 {
@@ -35,6 +39,16 @@ static DefaultGUIModel::variable_t vars[] = {
     { "Vm", "Membrane Voltage (in mV)", DefaultGUIModel::INPUT, },
 	{ "Stimulation input", "Input waveform for stimulation", DefaultGUIModel::INPUT, },
 	{ "Stimulation output", "Output waveform for stimulation", DefaultGUIModel::OUTPUT, },
+	{ "Trigger 1", "Pulse when the 1st trigger channel crosses its threshold", DefaultGUIModel::OUTPUT, },
+	{ "Trigger 2", "Pulse when the 2nd trigger channel crosses its threshold", DefaultGUIModel::OUTPUT, },
+	{ "Trigger 3", "Pulse when the 3rd trigger channel crosses its threshold", DefaultGUIModel::OUTPUT, },
+	{ "Trigger 4", "Pulse when the 4th trigger channel crosses its threshold", DefaultGUIModel::OUTPUT, },
+	{ "Trigger 5", "Pulse when the 5th trigger channel crosses its threshold", DefaultGUIModel::OUTPUT, },
+	{ "Trigger 6", "Pulse when the 6th trigger channel crosses its threshold", DefaultGUIModel::OUTPUT, },
+	{ "Trigger 7", "Pulse when the 7th trigger channel crosses its threshold", DefaultGUIModel::OUTPUT, },
+	{ "Trigger 8", "Pulse when the 8th trigger channel crosses its threshold", DefaultGUIModel::OUTPUT, },
+    { "Channels", "Number of electrodes recorded and searched for spikes",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::INTEGER, },
     { "Max spike width (ms)", "Maximum spike duration",
         DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
     { "Min spike width (ms)", "Minimum interval (refractory period) that must pass before another spike is detected",
@@ -43,9 +57,75 @@ static DefaultGUIModel::variable_t vars[] = {
         DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
     { "Min spike slope (uV/s)", "Minimum slope of a spike in microvolts per second",
         DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Threshold (x noise)", "Detection threshold as a multiple of each channel's noise level",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Detection method", "0 = amplitude threshold, 1 = smoothed energy operator, 2 = matched filter (the threshold applies to its output)",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::INTEGER, },
+    { "Noise time constant (s)", "How quickly the noise estimates follow changes on an electrode",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Snippet before peak (ms)", "Length of the waveform kept before each spike maximum",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Snippet after peak (ms)", "Length of the waveform kept after each spike maximum",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Trigger channels", "Up to 8 channels whose threshold crossings drive Trigger 1-8, e.g. 3,17",
+        DefaultGUIModel::PARAMETER, },
+    { "Trigger pulse (ms)", "Length of each trigger pulse",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Trigger amplitude (V)", "Level of the trigger outputs during a pulse",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Trigger dead time (ms)", "Time after a trigger before the same channel can fire again",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Common reference", "Per-frame reference subtracted ahead of detection: 0 = none, 1 = mean, 2 = median of the channels",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::INTEGER, },
+    { "Reference exclude", "Channels left out of the reference and not referenced, e.g. 0,15,30-31 (dead or reference electrodes)",
+        DefaultGUIModel::PARAMETER, },
+    { "Bandpass low (Hz)", "Highpass cutoff of the filter ahead of detection (0 = none)",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Bandpass high (Hz)", "Lowpass cutoff of the filter ahead of detection (0 = none)",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Sort spikes", "1 = label every spike with a unit of its channel on a sorting thread, 0 = off",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::INTEGER, },
+    { "Max units per channel", "Units the sorter keeps on each channel, up to 8",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::INTEGER, },
+    { "Unit distance (x noise)", "A spike farther than this from every unit of its channel starts a new unit",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Rate window (s)", "Sliding window of the channel and population firing rates",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Burst onset (x baseline)", "A network burst starts when the population rate over 50 ms exceeds this multiple of its usual level",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Burst offset (x baseline)", "and ends when it falls below this multiple",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+    { "Burst min channels", "Channels that must fire in a network burst for it to count",
+        DefaultGUIModel::PARAMETER | DefaultGUIModel::INTEGER, },
 	{ "Refresh rate (s)", "Raster plot refresh rate", DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Detection window (s)", "Amount of buffered data searched for spikes in each detection pass",
+		DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Sample format", "Storage of the buffered voltage traces: 0 = float32, 1 = int16 in steps of Sample LSB",
+		DefaultGUIModel::PARAMETER | DefaultGUIModel::INTEGER, },
+	{ "Sample LSB (uV)", "Voltage step of the int16 sample format, the resolution of the acquisition hardware",
+		DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Spike file", "File that Record Spikes writes every detected spike to", DefaultGUIModel::PARAMETER, },
+	{ "Raw file", "Base name of the chunk files that Record Raw writes the voltage traces to", DefaultGUIModel::PARAMETER, },
+	{ "Raw LSB (uV)", "Voltage step the raw recording is quantized to", DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "Note", "Time-stamped note to include in the output file", DefaultGUIModel::PARAMETER, },
 	{ "Time (s)", "Time (s)", DefaultGUIModel::STATE, },
+	{ "Dropped frames", "Samples lost on every channel because the detector fell behind", DefaultGUIModel::STATE, },
+	{ "Dropped spikes", "Spikes lost because the raster fell behind", DefaultGUIModel::STATE, },
+	{ "Buffer high-water (%)", "Fullest the voltage buffer has been", DefaultGUIModel::STATE, },
+	{ "Clipped samples", "Samples outside the range of the int16 sample format", DefaultGUIModel::STATE, },
+	{ "Spike rate (Hz)", "Spikes per second on all channels since the last refresh", DefaultGUIModel::STATE, },
+	{ "Detection pass p99 (ms)", "99th percentile of the time taken by a detection pass", DefaultGUIModel::STATE, },
+	{ "Spike latency p99 (ms)", "99th percentile of the time from acquisition to a spike being queued for display", DefaultGUIModel::STATE, },
+	{ "Triggers armed", "Trigger channels with a threshold; 0 unless Detection method is 0 and no common reference or bandpass is on",
+		DefaultGUIModel::STATE, },
+	{ "Triggers fired", "Stimulation pulses started by the trigger channels", DefaultGUIModel::STATE, },
+	{ "Sorted units", "Units the sorter currently holds over all channels", DefaultGUIModel::STATE, },
+	{ "Population rate (Hz)", "Spikes per second on all channels over the rate window, updated after every detection pass", DefaultGUIModel::STATE, },
+	{ "Active channels", "Channels with a spike in the rate window", DefaultGUIModel::STATE, },
+	{ "Network burst", "1 while a network burst is in progress", DefaultGUIModel::STATE, },
+	{ "Network bursts", "Network bursts that reached the minimum number of channels", DefaultGUIModel::STATE, },
+	{ "Last burst (s)", "Duration of the last network burst", DefaultGUIModel::STATE, },
+	{ "Median ISI (ms)", "Median inter-spike interval over all channels", DefaultGUIModel::STATE, },
 };
 
 static size_t num_vars = sizeof(vars) / sizeof(DefaultGUIModel::variable_t);
@@ -70,11 +150,18 @@ void MEA::customizeGUI(void)
 
     rplot = new BasicPlot(this);
     rplot->setAxisScaleDraw(QwtPlot::xBottom, new TimeScaleDraw(QTime(0,0,0,0)));
-    rCurve = new QwtPlotCurve("Curve 1");
-    rCurve->setStyle(QwtPlotCurve::NoCurve);
-    rCurve->setSymbol(new QwtSymbol(QwtSymbol::VLine, Qt::NoBrush, QPen(Qt::white), QSize(4,4)));
-    rCurve->attach(rplot);
-    rCurve->setPen(QColor(Qt::white));
+    // one curve per sorted unit, unsorted spikes in white
+    const QColor unitColors[maxSortUnits + 1] = { Qt::white, Qt::red, Qt::green, Qt::cyan, Qt::yellow,
+        Qt::magenta, QColor(255, 128, 0), QColor(128, 128, 255), Qt::gray };
+    for (int u = 0; u <= maxSortUnits; u++) {
+        rCurves[u] = new QwtPlotCurve(QString("Unit %1").arg(u));
+        rCurves[u]->setStyle(QwtPlotCurve::NoCurve);
+        rCurves[u]->setSymbol(new QwtSymbol(QwtSymbol::VLine, Qt::NoBrush, QPen(unitColors[u]), QSize(4,4)));
+        rCurves[u]->attach(rplot);
+        rCurves[u]->setPen(unitColors[u]);
+        rasterData[u] = new RasterSeriesData(&raster, numChannels, u);
+        rCurves[u]->setData(rasterData[u]);
+    }
 
     QVBoxLayout *rightLayout = new QVBoxLayout;
     QGroupBox *plotBox = new QGroupBox("MEA Raster Plot");
@@ -82,12 +169,23 @@ void MEA::customizeGUI(void)
     plotBox->setLayout(plotBoxLayout);
     QPushButton *savePlotButton = new QPushButton("Save Screenshot");
     QPushButton *clearButton = new QPushButton("Clear Plot");
+    QPushButton *saveStatsButton = new QPushButton("Save Stats");
+    QPushButton *recordButton = new QPushButton("Record Spikes");
+    recordButton->setCheckable(true);
+    QPushButton *recordRawButton = new QPushButton("Record Raw");
+    recordRawButton->setCheckable(true);
+    plotBoxLayout->addWidget(recordButton);
+    plotBoxLayout->addWidget(recordRawButton);
     plotBoxLayout->addWidget(savePlotButton);
     plotBoxLayout->addWidget(clearButton);
+    plotBoxLayout->addWidget(saveStatsButton);
     rightLayout->addWidget(rplot);
 
     QObject::connect(clearButton, SIGNAL(clicked()), this, SLOT(clearData()));
     QObject::connect(savePlotButton, SIGNAL(clicked()), this, SLOT(screenshot()));
+    QObject::connect(saveStatsButton, SIGNAL(clicked()), this, SLOT(saveStats()));
+    QObject::connect(recordButton, SIGNAL(toggled(bool)), this, SLOT(recordSpikes(bool)));
+    QObject::connect(recordRawButton, SIGNAL(toggled(bool)), this, SLOT(recordRaw(bool)));
     QObject::connect(DefaultGUIModel::pauseButton, SIGNAL(toggled(bool)),this,SLOT(pause(bool)));
     QObject::connect(DefaultGUIModel::pauseButton, SIGNAL(toggled(bool)),clearButton,SLOT(setEnabled(bool)));
     QObject::connect(DefaultGUIModel::pauseButton, SIGNAL(toggled(bool)),DefaultGUIModel::modifyButton,SLOT(setEnabled(bool)));
@@ -99,9 +197,6 @@ void MEA::customizeGUI(void)
 
     timer0->start(refreshRate * 1000); // max refresh rate = 4 Hz
     QObject::connect(timer0, SIGNAL(timeout(void)), this, SLOT(refreshMEA(void)));
-    
-    timer1->start(500); // spikeDetectWindow * 1000
-    QObject::connect(timer1, SIGNAL(timeout(void)), this, SLOT(detectSpikes(void)));
 
     emit setPlotRange(0, systime, plotymin, plotymax);
     customLayout->addWidget(plotBox, 0, 0, 1, 2);
@@ -109,20 +204,30 @@ void MEA::customizeGUI(void)
     setLayout(customLayout);
 }
 
-MEA::~MEA(void) {}
+MEA::~MEA(void) {
+    stopDetection();
+    spikeFile.close();
+    rawFile.close();
+    close(detectionEvent);
+}
 
 void MEA::execute(void) {
     systime = count * RT::System::getInstance()->getPeriod() * 1e-9; // current time
-
-    // TO-DO: buffer systimes for the current vm buffer to get save accurate spike times
     
-    // buffer voltage traces
+    // buffer voltage traces, one frame per tick (dropped if the detector has fallen behind),
+    // stamped with count so spikes are timed to the sample
 	for (int i = 0; i < numChannels; i++) {
-		vm[i].push(input(0));
+		frameValues[i] = input(0);
+	}
+	// the detection thread polls vm for a full window: no syscall here, which
+	// would move a Xenomai RT thread to secondary mode
+	vm.push(frameValues.data(), count); // converted to the sample format here
+	
+	// closed-loop stimulation: a crossing sets its trigger output in the same tick
+	for (int k = 0; k < maxTriggerChannels; k++) {
+		output(1 + k) = k < trigger.numTriggers() ? trigger.process(k, frameValues[trigger.channel(k)]) : 0;
 	}
-	numVoltageReads++;
 	
-	// TO-DO: need to make this channel specific (add a stim channel input)
 	// stimulation output
 	output(0) = input(1);
     
@@ -134,29 +239,85 @@ void MEA::update(DefaultGUIModel::update_flags_t flag) {
     switch (flag) {
         case INIT:
             setState("Time (s)", systime);
-            setParameter("Max spike width (ms)", QString::number(maxSpikeWidth * 1e3 / samplingFrequency));
-            setParameter("Min spike width (ms)", QString::number(minSpikeWidth * 1e3 / samplingFrequency));
-            setParameter("Max spike amplitude (uV)", QString::number(maxSpikeAmp * 1e6));
-            setParameter("Min spike slope (uV/s)", QString::number(minSpikeSlope * 1e6));
+            setState("Dropped frames", droppedFrames);
+            setState("Dropped spikes", droppedSpikes);
+            setState("Buffer high-water (%)", bufferHighWater);
+            setState("Clipped samples", clippedSamples);
+            setState("Spike rate (Hz)", spikeRate);
+            setState("Detection pass p99 (ms)", passP99);
+            setState("Spike latency p99 (ms)", latencyP99);
+            setState("Triggers armed", triggersArmed);
+            setState("Triggers fired", triggersFired);
+            setState("Sorted units", sortedUnits);
+            setState("Population rate (Hz)", populationRate);
+            setState("Active channels", activeChannels);
+            setState("Network burst", networkBurst);
+            setState("Network bursts", networkBursts);
+            setState("Last burst (s)", lastBurst);
+            setState("Median ISI (ms)", medianIsi);
+            setParameter("Channels", QString::number(numChannels));
+            setParameter("Max spike width (ms)", QString::number(detectorParams.maxSpikeWidth * 1e3 / samplingFrequency));
+            setParameter("Min spike width (ms)", QString::number(detectorParams.minSpikeWidth * 1e3 / samplingFrequency));
+            setParameter("Max spike amplitude (uV)", QString::number(detectorParams.maxSpikeAmp * 1e6));
+            setParameter("Min spike slope (uV/s)", QString::number(detectorParams.minSpikeSlope * 1e6));
+            setParameter("Threshold (x noise)", QString::number(detectorParams.thresholdMultiplier));
+            setParameter("Detection method", QString::number(detectorParams.detectionMethod));
+            setParameter("Noise time constant (s)", QString::number(detectorParams.noiseTimeConstant));
+            setParameter("Snippet before peak (ms)", QString::number(detectorParams.numPre * 1e3 / samplingFrequency));
+            setParameter("Snippet after peak (ms)", QString::number(detectorParams.numPost * 1e3 / samplingFrequency));
+            setParameter("Trigger channels", triggerChannels);
+            setParameter("Trigger pulse (ms)", QString::number(1));
+            setParameter("Trigger amplitude (V)", QString::number(5));
+            setParameter("Trigger dead time (ms)", QString::number(10));
+            setParameter("Common reference", QString::number(referenceSetting));
+            setParameter("Reference exclude", referenceExclude);
+            setParameter("Bandpass low (Hz)", QString::number(filterLow));
+            setParameter("Bandpass high (Hz)", QString::number(filterHigh));
+            setParameter("Sort spikes", QString::number(sortSetting));
+            setParameter("Max units per channel", QString::number(sorterParameters().maxUnits));
+            setParameter("Unit distance (x noise)", QString::number(sorterParameters().unitDistance));
+            setParameter("Rate window (s)", QString::number(networkParameters().rateWindow));
+            setParameter("Burst onset (x baseline)", QString::number(networkParameters().burstOnset));
+            setParameter("Burst offset (x baseline)", QString::number(networkParameters().burstOffset));
+            setParameter("Burst min channels", QString::number(networkParameters().burstMinChannels));
             setParameter("Refresh rate (s)", QString::number(refreshRate));
+            setParameter("Detection window (s)", QString::number(spikeDetectWindow));
+            setParameter("Sample format", QString::number(sampleSetting));
+            setParameter("Sample LSB (uV)", QString::number(sampleLsb * 1e6));
+            setParameter("Spike file", "mea_spikes.spk");
+            setParameter("Raw file", "mea_raw");
+            setParameter("Raw LSB (uV)", QString::number(0.1));
             setParameter("Note", note);
             break;
         case MODIFY:
-            maxSpikeWidth = floor(getParameter("Max spike width (ms)").toDouble() * samplingFrequency / 1e3);
-            minSpikeWidth = floor(getParameter("Min spike width (ms)").toDouble() * samplingFrequency / 1e3);
-            maxSpikeAmp = getParameter("Max spike amplitude (uV)").toDouble() / 1e6;
-            minSpikeSlope = getParameter("Min spike slope (uV/s)").toDouble() / 1e6;
             refreshRate = getParameter("Refresh rate (s)").toDouble(); // To-do: constrain to > 4 Hz?
+            spikeDetectWindow = getParameter("Detection window (s)").toDouble();
+            if (getParameter("Note") != note) {
+                note = getParameter("Note");
+                spikeFile.note(count, note.toStdString());
+            }
+            stopDetection();
+            setNumChannels(getParameter("Channels").toInt());
+            setDetectorParameters();
+            allocateBuffers();
+            startDetection();
             bookkeep();
             break;
         case PAUSE:
             output(0) = 0; // stop command in case pause occurs in the middle of command
+            for (int k = 0; k < maxTriggerChannels; k++)
+                output(1 + k) = 0;
             break;
         case UNPAUSE:
             bookkeep();
             break;
         case PERIOD:
             dt = RT::System::getInstance()->getPeriod() * 1e-9;
+            samplingFrequency = 1 / dt;
+            stopDetection();
+            setDetectorParameters();
+            allocateBuffers();
+            startDetection();
             bookkeep();
             break;
         default:
@@ -169,392 +330,317 @@ void MEA::initParameters() {
     systime = 0;
     count = 0;
     dt = RT::System::getInstance()->getPeriod() * 1e-9;
+    samplingFrequency = 1 / dt;
     refreshRate = 10; // max refresh rate = 4 Hz
     spikeDetectWindow = 500e-3;
     note = "";
-    
-    // spike validation variables
-    threshPolarity = 0; // 0 = bipolar; 1 = negative only; 2 = positive only
-	numPre = 15; // TO-DO: set this based on samplingFrequency (and possibly based on user input in msec)
-	numPost = 15; // TO-DO: set this based on samplingFrequency
-	maxSpikeWidth = floor(10e-3 * samplingFrequency);
-	minSpikeWidth = floor(0.1e-3 * samplingFrequency);
-	minSpikeSlope = 5e-6;
-	maxSpikeAmp = 1000e-6;
-    downsample = 1;
-	deadTime = (int)(1e-3 * samplingFrequency);
+    numChannels = 60;
+    plotymax = numChannels - 1;
+    triggerChannels = "";
+    triggersArmed = 0;
+    triggersFired = 0;
+    referenceSetting = referenceNone;
+    referenceExclude = "";
+    filterLow = 0;
+    filterHigh = 0;
+    sampleSetting = sampleFloat32;
+    sampleLsb = 0.1e-6;
+    sortSetting = 0;
+    sortedUnits = 0;
+    populationRate = 0;
+    activeChannels = 0;
+    networkBurst = 0;
+    networkBursts = 0;
+    lastBurst = 0;
+    medianIsi = 0;
+    droppedFrames = 0;
+    droppedSpikes = 0;
+    bufferHighWater = 0;
+    clippedSamples = 0;
+    spikeRate = 0;
+    passP99 = 0;
+    latencyP99 = 0;
+    lastQueued = 0;
+    lastRefresh = 0;
     
     // spike detector variables
-    spkcount = 0;
-    numVoltageReads = 0;
-    threshold.resize(numChannels);
-    numUpdates.resize(numChannels);
-    initialSamplesToSkip.resize(numChannels);
-    regularDetect.resize(numChannels);
-	spikeDetectionBuffer.reserve(vmBufferSize); // TO-DO: set size based on spike detector rate
-	detectionCarryOverBuffer.resize(numChannels);
-    RMSList.resize(numChannels);
-    for(int j = 0; j < numChannels; j++) {
-        RMSList[j].resize(numUpdatesForTrain);
-    }
-    inASpike.resize(numChannels);
-    waitToComeDown.resize(numChannels);
-    enterSpikeIndex.resize(numChannels);
-    exitSpikeIndex.resize(numChannels);
-    waveform.resize(numPost + numPre + 1);
+    detectorParams = detectorParameters(samplingFrequency);
+    detector.setParameters(detectorParams);
+    raster.resize(numChannels, displayTime);
+    detectionEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pool.setRecorder(&spikeFile);
+    pool.setRawRecorder(&rawFile);
+    pool.setFilter(&bandpass);
+    pool.setReference(&reference);
+    network.configure(numChannels, samplingFrequency, networkParameters(), networkLag());
+    pool.setAnalytics(&network);
+    detectionBlockSize = 0;
+    allocateBuffers();
+    startDetection();
     
     bookkeep();
 }
 
-void MEA::bookkeep() {
-    timer0->start(refreshRate * 1000); // restart timer with new refreshRate
+// A new channel count resizes everything per channel (the buffers follow in
+// allocateBuffers) and starts the raster over. Detection must be stopped.
+void MEA::setNumChannels(int channels) {
+    channels = std::max(1, std::min(maxChannels, channels));
+    if (channels == numChannels)
+        return;
+    numChannels = channels;
+    raster.resize(numChannels, displayTime);
+    for (int u = 0; u <= maxSortUnits; u++)
+        rasterData[u]->setChannels(numChannels);
+    plotymax = numChannels - 1;
+    setParameter("Channels", QString::number(numChannels));
 }
 
-void MEA::refreshMEA() {
-    for (int m = 0; m < spkcount; m++) {
-        if(meaBuffer.pop(currentSpike)) {
-            time.push_back(currentSpike.spktime);
-            channels.push_back(currentSpike.channelNum);
-        }
-    }
-    
-    // delete old spikes
-    if(!time.empty()) {
-        while (time.front() < systime - displayTime) {
-            time.pop_front();
-            channels.pop_front();
-        }
+// convert the GUI spike settings into samples at the current sampling rate
+void MEA::setDetectorParameters() {
+    detectorParams.samplingFrequency = samplingFrequency;
+    detectorParams.maxSpikeWidth = floor(getParameter("Max spike width (ms)").toDouble() * samplingFrequency / 1e3);
+    detectorParams.minSpikeWidth = floor(getParameter("Min spike width (ms)").toDouble() * samplingFrequency / 1e3);
+    detectorParams.maxSpikeAmp = getParameter("Max spike amplitude (uV)").toDouble() / 1e6;
+    detectorParams.minSpikeSlope = getParameter("Min spike slope (uV/s)").toDouble() / 1e6;
+    detectorParams.deadTime = (int)(1e-3 * samplingFrequency);
+    detectorParams.numPre = std::max(1, (int)lround(getParameter("Snippet before peak (ms)").toDouble() * samplingFrequency / 1e3));
+    detectorParams.numPost = std::max(1, (int)lround(getParameter("Snippet after peak (ms)").toDouble() * samplingFrequency / 1e3));
+    detectorParams.thresholdMultiplier = getParameter("Threshold (x noise)").toDouble();
+    detectorParams.noiseTimeConstant = std::max(dt, getParameter("Noise time constant (s)").toDouble());
+    detectorParams.detectionMethod = std::max((int)detectThreshold, std::min((int)detectMatchedFilter, getParameter("Detection method").toInt()));
+    detector.setParameters(detectorParams);
+    referenceSetting = std::max((int)referenceNone, std::min((int)referenceMedian, getParameter("Common reference").toInt()));
+    std::vector<int> excluded;
+    if (parseChannelList(getParameter("Reference exclude").toStdString(), numChannels, excluded))
+        referenceExclude = getParameter("Reference exclude");
+    else if (!parseChannelList(referenceExclude.toStdString(), numChannels, excluded))
+        referenceExclude = ""; // the last valid list no longer fits the channel count
+    setParameter("Reference exclude", referenceExclude);
+    reference.configure(numChannels, (referenceMode)referenceSetting, excluded);
+    // the RT thread is inactive here; thresholds come back with the next detection pass
+    std::vector<int> triggered;
+    if (parseChannelList(getParameter("Trigger channels").toStdString(), numChannels, triggered))
+        triggerChannels = getParameter("Trigger channels");
+    else if (!parseChannelList(triggerChannels.toStdString(), numChannels, triggered))
+        triggerChannels = "";
+    setParameter("Trigger channels", triggerChannels);
+    trigger.configure(triggered, detectorParams.threshPolarity,
+        (int)lround(getParameter("Trigger dead time (ms)").toDouble() * samplingFrequency / 1e3),
+        (int)lround(getParameter("Trigger pulse (ms)").toDouble() * samplingFrequency / 1e3),
+        getParameter("Trigger amplitude (V)").toDouble());
+    // keeps its state unless the band, channels or rate changed
+    filterLow = std::max(0.0, getParameter("Bandpass low (Hz)").toDouble());
+    filterHigh = std::max(0.0, getParameter("Bandpass high (Hz)").toDouble());
+    bandpass.design(numChannels, samplingFrequency, filterLow, filterHigh);
+    // keeps the trained units unless the channels, snippet or settings changed
+    sortSetting = std::max(0, std::min(1, getParameter("Sort spikes").toInt()));
+    if (sortSetting) {
+        sorterParameters sortParams;
+        sortParams.maxUnits = std::max(1, std::min(maxSortUnits, getParameter("Max units per channel").toInt()));
+        sortParams.unitDistance = std::max(1.0, getParameter("Unit distance (x noise)").toDouble());
+        sorter.configure(numChannels, detectorParams.numPre + 1 + detectorParams.numPost, sortParams);
+        setParameter("Max units per channel", QString::number(sortParams.maxUnits));
+        setParameter("Unit distance (x noise)", QString::number(sortParams.unitDistance));
     }
-    
-    rCurve->setSamples(time, channels);
-    
-    if (systime <= displayTime) {
-        emit setPlotRange(0, systime, plotymin, plotymax);
-    } else {
-        emit setPlotRange(systime-displayTime, systime, plotymin, plotymax);
-    }
-    rplot->replot();
+    // keeps the windows and histograms unless the channels, rate or settings changed
+    networkParameters networkParams;
+    networkParams.rateWindow = std::max(networkParams.binWidth, getParameter("Rate window (s)").toDouble());
+    networkParams.burstOnset = std::max(1.0, getParameter("Burst onset (x baseline)").toDouble());
+    networkParams.burstOffset = std::max(0.0, std::min(networkParams.burstOnset, getParameter("Burst offset (x baseline)").toDouble()));
+    networkParams.burstMinChannels = std::max(1, getParameter("Burst min channels").toInt());
+    network.configure(numChannels, samplingFrequency, networkParams, networkLag());
+    // storage of vm, applied by allocateBuffers()
+    sampleSetting = std::max((int)sampleFloat32, std::min((int)sampleInt16, getParameter("Sample format").toInt()));
+    if (getParameter("Sample LSB (uV)").toDouble() > 0)
+        sampleLsb = getParameter("Sample LSB (uV)").toDouble() * 1e-6;
+    setParameter("Sample format", QString::number(sampleSetting));
+    setParameter("Sample LSB (uV)", QString::number(sampleLsb * 1e6));
+}
 
-    spkcount = 0;
+// A pass can take a full vm plus the carry-over, so its spikes reach that far
+// past the analytics' last advance (with the vm size allocateBuffers() gives)
+double MEA::networkLag() {
+    int blockSize = std::max(1, (int)(spikeDetectWindow * samplingFrequency));
+    return (framebuffer::capacityFor(vmBufferWindows * blockSize) + detector.getCarryOverLength()) / samplingFrequency;
 }
 
-void MEA::screenshot() {
-    QwtPlotRenderer renderer;
-    renderer.exportTo(rplot,"screenshot.pdf");
+// size the voltage buffers and the detection cadence from the sampling rate and detection window,
+// called with the RT thread inactive (init, modify and period changes)
+void MEA::allocateBuffers() {
+    int blockSize = std::max(1, (int)(spikeDetectWindow * samplingFrequency));
+    bool sameFormat = vm.format() == sampleSetting && (sampleSetting != sampleInt16 || vm.scales()[0] == sampleLsb);
+    if (blockSize == detectionBlockSize && vm.channels() == numChannels && sameFormat)
+        return; // keep buffered data and trained thresholds
+    detectionBlockSize = blockSize;
+    vm.resize(numChannels, vmBufferWindows * detectionBlockSize, (sampleFormat)sampleSetting, sampleLsb);
+    frameValues.assign(numChannels, 0);
+    detector.reset(numChannels, vm.capacity());
 }
 
-void MEA::clearData() {
-	time.clear();
-	channels.clear();
-	
-	rCurve->setSamples(time, channels);
-	rplot->replot();
+// Detection runs on its own thread, which checks vm for a full detection window
+// a few times per window and fans each pass out over the pool. It must be
+// stopped while the detector or vm are reconfigured.
+void MEA::startDetection() {
+    if (detectionThread.joinable())
+        return;
+    // leave a core for the RT thread and one for the GUI
+    int numThreads = std::max(1, (int)std::thread::hardware_concurrency() - 2);
+    // while sorting, the sorter takes every spike and records it once it has its unit
+    pool.setRecorder(sortSetting ? NULL : &spikeFile);
+    pool.setSorter(sortSetting ? &sorter : NULL);
+    pool.start(&detector, &vm, numThreads, 16384 / numThreads); // ~4.5 MB of spike records in total
+    if (sortSetting)
+        sorter.start(&spikeFile);
+    detectionQuit = false;
+    detectionThread = std::thread(&MEA::detectionLoop, this);
 }
 
-// spike detection/validation
-void MEA::detectSpikes() {
-    int channel;
-    int indiciesToSearchForCross, indiciesToSearchForReturn;
-	int idx, i;
-    bool skipSpikeDetection;
-    double spikeDetectionSum;
-    
-    for(channel = 0; channel < numChannels; channel++) {
-        // define position in current data buffer
-		i = numPre + initialSamplesToSkip[channel];
-		initialSamplesToSkip[channel] = 0;
-		
-		// create the current data buffer
-		if (!regularDetect[channel])
-		{
-			// first fill, cannot get the first samples because the number of "pre" samples will be too low
-			regularDetect[channel] = true; // no longer the first detection
-			spikeDetectionBuffer.clear();
-			for (int j = 0; j < numVoltageReads; j++) {
-				vm[channel].pop(vm_temp);
-				spikeDetectionBuffer.prepend(vm_temp);
-			}
-		}
-		else
-		{
-			spikeDetectionBuffer.clear();
-			// data from this buffer
-			for (int j = 0; j < numVoltageReads; j++) {
-				vm[channel].pop(vm_temp);
-				spikeDetectionBuffer.prepend(vm_temp);
-			}
-			// data from last buffer that we could not detect on because of edge effects
-			for (int j = 0; j < carryOverLength; j++) {
-				spikeDetectionBuffer.prepend(detectionCarryOverBuffer[channel][j]);
-			}
-		}
-        
-        // don't need to run spike detection if buffer is empty (protocol hasn't started) or all 0 (not acquiring data)
-        skipSpikeDetection = false;
-        spikeDetectionSum = 0;
-        if (!spikeDetectionBuffer.empty()) {
-            for (int j = 0; j < spikeDetectionBuffer.count(); j++) {
-                spikeDetectionSum = spikeDetectionSum + spikeDetectionBuffer[j];
-            }
-            if (spikeDetectionSum == 0) {
-                skipSpikeDetection = true;
-            }
-        } else {
-            skipSpikeDetection = true;
-        }
-		
-        if (!skipSpikeDetection) {
-            indiciesToSearchForCross = spikeDetectionBuffer.count() - maxSpikeWidth - numPost;
-            indiciesToSearchForReturn = spikeDetectionBuffer.count() - numPost;
-        
-            updateThreshold(channel); // update threshold for current channel
-            
-            // for fixed and adaptive, the current threshold is not a function of i
-            currentThreshold = threshold[channel];
-            for (; i < indiciesToSearchForReturn; i++)
-            {
-                //peak detection- just requires one sample
-                if (!inASpike[channel] && i < indiciesToSearchForCross)
-                {
-                    if (withinThreshold(spikeDetectionBuffer[i],currentThreshold,threshPolarity))
-                    {
-                        waitToComeDown[channel] = false;
-                        continue; // not above threshold, next point please
-                    }
-                    else if (!waitToComeDown[channel])
-                    {
-                        // entering a spike
-                        inASpike[channel] = true;
-                        enterSpikeIndex[channel] = i; // TO-DO: maybe use this index (either i or enterSpikeIndex) to set spike times?
-                        posCross = findSpikePolarityBySlopeOfCrossing(channel);
-                    }
-                }
-                // exiting a spike, maxspikewidth (to find peak), -numPre and +numPost (to find waveform)
-                else if (inASpike[channel] &&
-                        ((posCross && spikeDetectionBuffer[i] < currentThreshold) ||
-                        (!posCross && spikeDetectionBuffer[i] > -currentThreshold)))
-                {
-                    inASpike[channel] = false;
-                    exitSpikeIndex[channel] = i;
-                    // calculate spike width
-                    spikeWidth = exitSpikeIndex[channel] - enterSpikeIndex[channel];
-                    // find the index and value of the spike maximum
-                    spikeMaxIndex = findMaxDeflection(enterSpikeIndex[channel], spikeWidth);
-                    spikeMax = spikeDetectionBuffer[spikeMaxIndex];
-                    // define spike waveform
-                    createWaveform(spikeMaxIndex);
-                    // check if the spike is any good
-                    goodSpike = checkSpike();
-                    if (!goodSpike) {
-                        continue; // if the spike is no good
-                    }
-                    // record the waveform
-                    spike.spktime = systime; // TO-DO: this is probably no longer accurate by the time this code is reached
-                    spike.channelNum = channel;
-                    spike.currentThresh = currentThreshold;
-                    spike.wave = waveform;
-                    meaBuffer.push(spike);
-                    spkcount++;
-            
-                    // Carry-over dead time if a spike was detected at the end of the buffer
-                    initialSamplesToSkip[channel] = deadTime + numPre + (exitSpikeIndex[channel] - indiciesToSearchForCross);
-                    if (initialSamplesToSkip[channel] < 0)
-                        initialSamplesToSkip[channel] = 0;
-            
-                    //else
-                    i = exitSpikeIndex[channel] + deadTime;
-                }
-                else if (inASpike[channel] && i == indiciesToSearchForReturn - 1)
-                {
-                    // spike is taking too long to come back through the threshold
-                    waitToComeDown[channel] = true;
-                    inASpike[channel] = false;
-                    break;
-                }
-                else if (!inASpike[channel] && i >= indiciesToSearchForCross)
-                {
-                    break;
-                }
-            }
-            // create carry-over buffer from last samples of this buffer
-            idx = 0;
-            for (i = spikeDetectionBuffer.count() - carryOverLength; i < spikeDetectionBuffer.count(); i++)
-            {
-                detectionCarryOverBuffer[channel][idx] = spikeDetectionBuffer[i];
-                idx++;
-            }
-        }
-    }
-    numVoltageReads = 0;
+void MEA::stopDetection() {
+    if (!detectionThread.joinable())
+        return;
+    detectionQuit = true;
+    uint64_t one = 1;
+    if (write(detectionEvent, &one, sizeof(one)) < 0) { /* already signalled */ }
+    detectionThread.join();
+    sorter.stop(); // takes the spikes of the last pass first
+    pool.stop();
 }
 
-void MEA::updateThreshold(int channel)
-{
-    //std::cout << "updateThreshold -- input(0): " << input(0) << std::endl;
-    // start updating threshold once data acquisition starts
-    if (!spikeDetectionBuffer.empty())
-    {
-        if (numUpdates[channel] > numUpdatesForTrain) { /* do nothing */ }
-        else if (numUpdates[channel] == numUpdatesForTrain)
-        {
-            // average threshold estimates gathered during training period
-            for(int j = 0; j < RMSList[channel].size(); j++) {
-                threshold[channel] += RMSList[channel][j];
+void MEA::detectionLoop() {
+    // a quarter window between checks; the eventfd only cuts the wait short to quit
+    int timeout = std::max(1, (int)(250.0 * detectionBlockSize / samplingFrequency)); // ms
+    struct pollfd event = { detectionEvent, POLLIN, 0 };
+    while (!detectionQuit) {
+        if (vm.available() < (size_t)detectionBlockSize) {
+            if (poll(&event, 1, timeout) > 0) {
+                uint64_t pending;
+                if (read(detectionEvent, &pending, sizeof(pending)) < 0) { /* spurious wakeup */ }
             }
-            threshold[channel] /= RMSList[channel].size();
-            numUpdates[channel]++; // prevent further updates
-        }
-        else
-        {
-            calcThreshForOneBlock(channel);
-            numUpdates[channel]++;
+            continue;
         }
+        pool.detect();
+        if (sorter.isRunning())
+            sorter.wake();
+        trigger.updateThresholds(detector, reference.isEnabled() || bandpass.isEnabled());
     }
 }
 
-void MEA::calcThreshForOneBlock(int channel)
-{
-    double dd;
-    double tempData = 0;
-    double thresholdTemp;
-    for (int j = 0; j < spikeDetectionBuffer.size() / downsample; j++)
-    {
-        dd = spikeDetectionBuffer[j * downsample] * spikeDetectionBuffer[j * downsample];
-        if (dd > 0) // don't include blanked samples
-        {
-            tempData += dd;
-        }
-    }
-    tempData /= (spikeDetectionBuffer.size() / downsample);
-    //std::cout << "calcThreshForOneBlock -- tempData: " << tempData << std::endl;
-    thresholdTemp = sqrt(tempData); // TO-DO: * _thresholdMultiplier; What is this for?
-    //std::cout << "calcThreshForOneBlock -- thresholdTemp: " << thresholdTemp << std::endl;
-    RMSList[channel][numUpdates[channel]] = thresholdTemp;
-    //std::cout << "calcThreshForOneBlock -- threshold on channel " << channel << ": " << threshold[channel] << std::endl;
-    threshold[channel] = ((threshold[channel] * (numUpdates[channel])) / (numUpdates[channel] + 1)) + (thresholdTemp / (numUpdates[channel] + 1));
-    //std::cout << "calcThreshForOneBlock -- numUpdates on channel " << channel << ": " << numUpdates[channel] << std::endl;
-    //std::cout << "calcThreshForOneBlock -- threshold on channel " << channel << ": " << threshold[channel] << std::endl;
+void MEA::bookkeep() {
+    timer0->start(refreshRate * 1000); // restart timer with new refreshRate
 }
 
-
-bool MEA::withinThreshold(double channelVoltage, double thisThreshold, int threshPolarity)
-{
-	switch(threshPolarity)
-	{
-		case 0:
-			return channelVoltage < thisThreshold && channelVoltage > -thisThreshold;
-		case 1:
-			return channelVoltage > -thisThreshold;
-		case 2:
-			return channelVoltage < thisThreshold;
-		default:
-			return channelVoltage < thisThreshold && channelVoltage > -thisThreshold;
-	}
+void MEA::refreshMEA() {
+    // drain the spikes queued since the last refresh, by the sorter when it runs
+    bool sorting = sorter.isRunning();
+    while (sorting ? sorter.popSpike(spike) : pool.popSpike(spike)) {
+        raster.add(spike.sampleIndex * dt, spike.spike.channel, spike.spike.unit); // old spikes leave a bucket at a time
+    }
+    
+    double viewStart = systime <= displayTime ? 0 : systime - displayTime;
+    emit setPlotRange(viewStart, systime, plotymin, plotymax);
+    // only the visible marks are handed to qwt, aggregated down to the canvas width
+    int columns = rplot->canvas()->width();
+    for (int u = 0; u <= maxSortUnits; u++)
+        rasterData[u]->setColumns(columns);
+    raster.setView(viewStart, systime, columns);
+    rplot->replot();
+    updateStats();
 }
 
-bool MEA::findSpikePolarityBySlopeOfCrossing(int channel)
-{
-	// Is the crossing through the bottom or top threshold?
-	return spikeDetectionBuffer[enterSpikeIndex[channel]] > 0;
+// Read the lock-free pipeline counters into the states. vm counts are reset
+// whenever it is reallocated, the pool's are kept.
+void MEA::updateStats() {
+    droppedFrames = vm.droppedFrames();
+    droppedSpikes = pool.spikesDropped() + sorter.spikesDropped();
+    bufferHighWater = 100.0 * vm.highWater() / vm.capacity();
+    clippedSamples = vm.clippedSamples();
+    unsigned long long queued = pool.spikesQueued();
+    if (systime > lastRefresh)
+        spikeRate = (queued - lastQueued) / (systime - lastRefresh);
+    lastQueued = queued;
+    lastRefresh = systime;
+    passP99 = pool.passDurations().percentile(0.99) * 1e-6;
+    latencyP99 = pool.spikeLatencies().percentile(0.99) * 1e-6;
+    triggersArmed = trigger.armedTriggers();
+    triggersFired = trigger.triggersFired();
+    sortedUnits = sorter.unitsFound();
+    populationRate = network.populationRate();
+    activeChannels = network.activeChannels();
+    networkBurst = network.inBurst();
+    networkBursts = network.burstCount();
+    lastBurst = network.lastBurstDuration();
+    medianIsi = network.medianIsi() * 1e3;
 }
 
-int MEA::findMaxDeflection(int startInd, int widthToSearch)
-{
-	int maxIndex = startInd;
-	// Find absolute maximum
-	for (int i = startInd+1; i < startInd + widthToSearch; i++) {
-        if (abs(spikeDetectionBuffer[i]) > abs(spikeDetectionBuffer[maxIndex])) {
-			maxIndex = i;
-		}
-	}
-	return maxIndex;
+void MEA::screenshot() {
+    QwtPlotRenderer renderer;
+    renderer.exportTo(rplot,"screenshot.pdf");
 }
 
-void MEA::createWaveform(int maxIdx)
-{
-	for (int j = maxIdx - numPre; j < maxIdx + numPost + 1; j++) {
-		waveform[j - maxIdx + numPre] = spikeDetectionBuffer[j];
+// The writer is opened and closed between detection passes, the pool only
+// checks whether it is open at the start of a pass.
+void MEA::recordSpikes(bool on) {
+    stopDetection();
+    if (on) {
+        if (!spikeFile.open(getParameter("Spike file").toStdString(), numChannels, samplingFrequency))
+            std::cerr << "MEA: could not open " << getParameter("Spike file").toStdString() << std::endl;
+        else if (!note.isEmpty())
+            spikeFile.note(count, note.toStdString());
+    } else {
+        spikeFile.close();
     }
+    startDetection();
 }
 
-// Check spike based on spike detection settings
-bool MEA::checkSpike()
-{
-	// Check spike width
-	bool spikeWidthGood = maxSpikeWidth >= spikeWidth && minSpikeWidth <= spikeWidth;
-	if (!spikeWidthGood) {
-        //std::cout << "Here0" << std::endl;
-		return spikeWidthGood;
-    }
-	
-	// Check spike amplitude
-    // TO-DO: absWave is all 0 -- abs function is not working as expected
-	QVector<double> absWave;
-	absWave.resize(waveform.size());
-	for (int i = 0; i < waveform.size(); ++i) {
-		absWave[i] = qAbs(waveform[i]);
-    }
-
-	bool spikeMaxGood = spikeMax < maxSpikeAmp; // this has already been calculated
-	if (!spikeMaxGood) {
-        //std::cout << "Here1" << std::endl;
-		return spikeMaxGood;
-    }
-
-	// Check to make sure this is not the tail end of another spike
-	bool notTailend = absWave[0] < absWave[numPre];
-    //std::cout << "absWave[0]: " << absWave[0] << std::endl << "absWave[numPre]: " << absWave[numPre] << std::endl;
-	if (!notTailend) {
-        //std::cout << "Here2" << std::endl;
-		return notTailend;
+// Batches of one buffer length, so the writer gets a whole detection pass at
+// a time and has the next pass to write it.
+void MEA::recordRaw(bool on) {
+    stopDetection();
+    if (on) {
+        std::string base = getParameter("Raw file").toStdString();
+        if (!rawFile.open(base, numChannels, samplingFrequency, getParameter("Raw LSB (uV)").toDouble() * 1e-6, vm.capacity()))
+            std::cerr << "MEA: could not open " << base << std::endl;
+    } else {
+        rawFile.close();
     }
+    startDetection();
+}
 
-	// Check spike slope
-    // TO-DO: currently debugging here -- slope is always 0
-	bool spikeSlopeGood = getSpikeSlope(absWave) > minSpikeSlope;
-	if (!spikeSlopeGood) {
-        //std::cout << "Spike slope: " << getSpikeSlope(absWave) << std::endl;
-        //std::cout << "Here3" << std::endl;
-		return spikeSlopeGood;
+void MEA::saveStats() {
+    FILE *out = fopen("mea_stats.txt", "a");
+    if (!out)
+        return;
+    fprintf(out, "time %.3f s, %d channels at %.0f Hz\n", systime, numChannels, samplingFrequency);
+    fprintf(out, "frames dropped %llu, buffer high-water %zu of %zu frames\n", vm.droppedFrames(), vm.highWater(), vm.capacity());
+    if (vm.format() == sampleInt16)
+        fprintf(out, "int16 samples of %.3g uV, clipped %llu\n", vm.scales()[0] * 1e6, vm.clippedSamples());
+    fprintf(out, "spikes queued %llu, dropped %llu\n", pool.spikesQueued(), pool.spikesDropped());
+    fprintf(out, "spike file records written %llu, dropped %llu\n", spikeFile.recordsWritten(), spikeFile.recordsDropped());
+    if (spikeFile.writeFailed())
+        fprintf(out, "spike file write failed, recording stopped\n");
+    if (rawFile.framesWritten() > 0)
+        fprintf(out, "raw frames written %llu, dropped %llu, clipped samples %llu, %.2f bytes/sample\n", rawFile.framesWritten(),
+            rawFile.framesDropped(), rawFile.samplesClipped(), (double)rawFile.bytesWritten() / (rawFile.framesWritten() * numChannels));
+    if (rawFile.writeFailed())
+        fprintf(out, "raw file write failed, recording stopped\n");
+    pool.passDurations().print(out, "detection pass", 1e-6, "ms");
+    pool.spikeLatencies().print(out, "spike latency", 1e-6, "ms");
+    if (sorter.spikesSorted() > 0) {
+        fprintf(out, "spikes sorted %llu, dropped %llu, %d units\n", sorter.spikesSorted(), sorter.spikesDropped(), sorter.unitsFound());
+        sorter.batchDurations().print(out, "sorting batch", 1e-6, "ms");
     }
-
-	//Ensure that part of the spike is not blanked
-	double numBlanked = 0;
-	for (int i = 0; i < absWave.size(); i++)
-	{
-		if (absWave[i] < VOLTAGE_EPSILON)
-		{
-			numBlanked++;
-		}
-		else
-		{
-			numBlanked = 0;
-		}
-
-		if (numBlanked > 5) {
-			return false;
-        }
-	}
-
-	// spike is validated
-	return true;
+    network.print(out);
+    fprintf(out, "\n");
+    fclose(out);
+    // the population rate time series and the recent bursts, replaced every time
+    out = fopen("mea_network.txt", "w");
+    if (!out)
+        return;
+    network.writeSeries(out);
+    fclose(out);
 }
 
-double MEA::getSpikeSlope(QVector<double> absWave)
-{
-	double spikeSlopeEstimate = 0;
-	int diffWidth;
-
-	if (spikeWidth + 2 <= numPre)
-		diffWidth = spikeWidth + 2;
-	else
-		diffWidth = numPre;
-
-	for (int i = numPre + 1 - diffWidth; i < numPre + diffWidth; i++)
-	{
-		spikeSlopeEstimate += qAbs(absWave[i + 1] - absWave[i]);
-	}
-
-	return spikeSlopeEstimate / (double)(2 * diffWidth);
+void MEA::clearData() {
+	raster.clear();
+	rplot->replot();
 }
-
@@ -21,9 +21,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <atomic>
+#include <thread>
+#include <vector>
 #include <basicplot.h>
 #include <default_gui_model.h>
 #include <qwt_plot_curve.h>
+#include <qwt_series_data.h>
+#include "detection_pool.h"
+#include "spike_raster.h"
+#include "spike_sorter.h"
+#include "stim_trigger.h"
 
 class TimeScaleDraw : public QwtScaleDraw
 {
@@ -41,37 +48,41 @@ class TimeScaleDraw : public QwtScaleDraw
 		QTime baseTime;
 };
 
-template<typename T, size_t Size>
-class ringbuffer {
+// Curve data that exposes only the raster marks of one unit in the visible
+// range, at most one per pixel column and channel once zoomed out
+class RasterSeriesData : public QwtSeriesData<QPointF>
+{
 	public:
-		ringbuffer() : head_(0), tail_(0) {}
-
-		bool push(const T & value)
+		RasterSeriesData(spikeRaster *r, int channels, int u):
+			raster(r), numChannels(channels), columns(1000), unit(u)
 		{
-			size_t head = head_.load(std::memory_order_relaxed);
-			size_t next_head = next(head);
-			if (next_head == tail_.load(std::memory_order_acquire))
-				return false;
-			ring_[head] = value;
-			head_.store(next_head, std::memory_order_release);
-				return true;
 		}
-		bool pop(T & value)
+		virtual size_t size() const
 		{
-			size_t tail = tail_.load(std::memory_order_relaxed);
-			if (tail == head_.load(std::memory_order_acquire))
-				return false;
-			value = ring_[tail];
-			tail_.store(next(tail), std::memory_order_release);
-				return true;
+			size_t first, count;
+			raster->unitMarks(unit, first, count);
+			return count;
 		}
-	private:
-		size_t next(size_t current)
+		virtual QPointF sample(size_t i) const
 		{
-			return (current + 1) % Size;
+			size_t first, count;
+			raster->unitMarks(unit, first, count);
+			const rasterMark &mark = raster->mark(first + i);
+			return QPointF(mark.time, mark.channel);
 		}
-		T ring_[Size];
-		std::atomic<size_t> head_, tail_;
+		virtual QRectF boundingRect() const
+		{
+			return QRectF(raster->oldestTime(), 0, raster->newestTime() - raster->oldestTime(), numChannels - 1);
+		}
+		// called by qwt with the visible area before every replot
+		virtual void setRectOfInterest(const QRectF &rect) { raster->setView(rect.left(), rect.right(), columns); }
+		void setColumns(int n) { columns = n > 0 ? n : 1; }
+		void setChannels(int n) { numChannels = n; }
+	private:
+		spikeRaster *raster;
+		int numChannels;
+		int columns;
+		int unit;
 };
 
 class MEA : public DefaultGUIModel {
@@ -94,7 +105,6 @@ class MEA : public DefaultGUIModel {
 	private:
 		// inputs, states, related constants
 		QTimer *timer0 = new QTimer(this);
-        QTimer *timer1 = new QTimer(this);
 		double systime;
 		long long count; // keep track of plug-in time
         double dt;
@@ -103,84 +113,88 @@ class MEA : public DefaultGUIModel {
 		double spikeDetectWindow;
 		
 		// data handling
-		double samplingFrequency = 20000; // TO-DO: better to get this from control panel
-		static const int numChannels = 60;
-        static const int vmBufferSize = 2000; // TO-DO: need this to change based on refreshRate
-		int numVoltageReads;
-		std::array<ringbuffer<double, vmBufferSize>, numChannels> vm;
-		int spkcount;
-		struct spikeData { // TO-DO: main output, save anything else?
-			double spktime;
-			double channelNum;
-			double currentThresh;
-			QwtArray<double> wave;
-		};
-		ringbuffer<spikeData, 10000> meaBuffer; // TO-DO: need this to change based on refreshRate
-		spikeData spike;
-		spikeData currentSpike;
+		double samplingFrequency; // 1 / RT period
+		int numChannels; // set from the "Channels" parameter, only changed with detection stopped
+		static const int maxChannels = 1024;
+		static const int vmBufferWindows = 4; // detection windows vm can hold before samples are dropped
+		int detectionBlockSize; // samples per detection window
+		framebuffer vm; // one frame of numChannels samples per RT tick
+		int sampleSetting; // sampleFormat of vm, the "Sample format" parameter
+		double sampleLsb; // (V) step of the int16 format
+		std::vector<double> frameValues; // RT thread: the frame execute() hands to vm
+		int detectionEvent; // eventfd written by stopDetection() to wake the detection thread
+		std::thread detectionThread;
+		std::atomic<bool> detectionQuit;
+		pooledSpike spike; // TO-DO: main output, save anything else?
+		
+		// pipeline health, published as states at every refresh
+		double droppedFrames; // each one is a sample lost on every channel
+		double droppedSpikes;
+		double bufferHighWater; // (%) of vm
+		double clippedSamples; // saturated by the int16 format
+		double spikeRate; // (Hz) all channels
+		double passP99; // (ms) detection pass duration
+		double latencyP99; // (ms) acquisition to spike queue
+		double triggersArmed;
+		double triggersFired;
+		double sortedUnits;
+		// network state, read from the analytics at every refresh
+		double populationRate; // (Hz)
+		double activeChannels;
+		double networkBurst; // 1 during a burst
+		double networkBursts;
+		double lastBurst; // (s) duration
+		double medianIsi; // (ms)
+		unsigned long long lastQueued;
+		double lastRefresh;
         
         // spike detector variables
-        QVector<int> initialSamplesToSkip;
-		QVector<bool> regularDetect;
-		QVector<double> spikeDetectionBuffer;
-		ulong bufferOffset;
-		QVector<double*> detectionCarryOverBuffer; // TO-DO: maybe change this to a vector of vectors
-		int carryOverLength;
-		int numPre;
-		int numPost;
-		double maxSpikeWidth;
-		double minSpikeWidth;
-        double maxSpikeAmp;
-        double minSpikeSlope;
-        int downsample;
-        QVector<QVector<double>> RMSList;
-        QVector<double> channelThresh;
-		int deadTime;
-        double currentThreshold;
-        QVector<double> threshold;
-        int numUpdatesForTrain = 200; // TO-DO: this needs to be 10/spikeDetectWindow
-        QVector<int> numUpdates;
-        double vm_temp;
-		QVector<bool> inASpike; // true when the waveform is over or under the current detection threshold for a given channel
-		QVector<bool> waitToComeDown;
-		int threshPolarity;
-		QVector<int> enterSpikeIndex;
-		QVector<int> exitSpikeIndex;
-		bool posCross; // polarity of inital threshold crossing
-		int spikeWidth;
-		int spikeMaxIndex;
-		double spikeMax;
-		QwtArray<double> waveform;
-		bool goodSpike;
-        double VOLTAGE_EPSILON = 0.1e-6; // 0.1 uV
+        SpikeDetector detector;
+        detectorParameters detectorParams;
+        int referenceSetting; // referenceMode, the "Common reference" parameter
+        QString referenceExclude; // last valid channel list
+        commonReference reference; // removed by the pool from every new frame
+        double filterLow; // (Hz) bandpass ahead of detection, 0 leaves that side out
+        double filterHigh; // (Hz)
+        biquadFilter bandpass; // run by the pool workers on the new frames
+        QString triggerChannels; // last valid channel list
+        stimTrigger trigger; // RT fast path on a few channels, armed from the detector's thresholds
+        detectionPool pool; // channel groups searched in parallel, spikes queued per group for the display
+        spikeFileWriter spikeFile; // fed by the pool after every pass while recording
+        rawRecorder rawFile; // voltage traces, also fed by the pool
+        int sortSetting; // the "Sort spikes" parameter
+        networkAnalytics network; // rates, bursts and ISIs, fed by the pool after every pass
+        spikeSorter sorter; // labels the pool's spikes with units on its own thread, then displays and records them
         
 		// raster plot variables
 		int displayTime = 600; // (s) change this to set the raster display window
-		QwtArray<double> channels;
-		QwtArray<double> time;
+		spikeRaster raster; // one bucket per second of spikes
+		RasterSeriesData *rasterData[maxSortUnits + 1]; // per unit, owned by rCurves
 		double plotymin = 0;
-		double plotymax = numChannels-1;
+		double plotymax;
 		
 		// QT components
 		BasicPlot *rplot;
-		QwtPlotCurve *rCurve;
+		QwtPlotCurve *rCurves[maxSortUnits + 1]; // unsorted spikes, then one per unit
 		
 		// MEA functions
 		void initParameters(void);
 		void bookkeep(void);
+		void setNumChannels(int channels);
+		void setDetectorParameters(void);
+		double networkLag(void); // (s)
+		void allocateBuffers(void);
+		void startDetection(void);
+		void stopDetection(void);
+		void detectionLoop(void);
+		void updateStats(void);
 	
 	private slots:
 		// all custom slots
 		void refreshMEA(void);
 		void clearData(void);
 		void screenshot(void);
-        void detectSpikes(void);
-        void updateThreshold(int);
-        void calcThreshForOneBlock(int);
-		bool withinThreshold(double, double, int);
-		bool findSpikePolarityBySlopeOfCrossing(int);
-		int findMaxDeflection(int, int);
-		void createWaveform(int);
-		bool checkSpike(void);
-		double getSpikeSlope(QVector<double>);
+		void saveStats(void);
+		void recordSpikes(bool);
+		void recordRaw(bool);
 };
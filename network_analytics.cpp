@@ -0,0 +1,339 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+* Streaming network analytics: rate windows, network bursts and ISI histograms
+*/
+
+#include "network_analytics.h"
+#include <algorithm>
+#include <cmath>
+
+networkParameters::networkParameters(void) : rateWindow(1), binWidth(0.01), burstWindow(0.05), burstOnset(4), burstOffset(2),
+	burstMinChannels(5), baselineTime(60), seriesInterval(0.1)
+{
+}
+
+bool networkParameters::operator==(const networkParameters &p) const
+{
+	return rateWindow == p.rateWindow && binWidth == p.binWidth && burstWindow == p.burstWindow && burstOnset == p.burstOnset &&
+		burstOffset == p.burstOffset && burstMinChannels == p.burstMinChannels && baselineTime == p.baselineTime &&
+		seriesInterval == p.seriesInterval;
+}
+
+networkAnalytics::networkAnalytics(void) : numChannels(0), samplingFrequency(0), binSamples(1), windowBins(1), burstBins(1), seriesBins(1),
+	isiScale(0), isiOffset(0), binMask(0), closedBin(-1), newestBin(-1), active(0), popWindow(0), burstSum(0), binsSeen(0), baseline(0),
+	burstOpen(false), burstStart(0), burstPeak(0), lastActive(0), burstSpikes(0), burstChannels(0), publishedWindow(0), nextBurst(0), nextSample(0),
+	numSamples(0), popRate(0), numActive(0), bursting(false), totalBursts(0), lastDuration(0), isiMedian(0), late(0)
+{
+}
+
+void networkAnalytics::configure(int channels, double fs, const networkParameters &p, double maxLag)
+{
+	long long lagBins = std::max(1LL, (long long)ceil(maxLag * fs / std::max(1LL, llround(p.binWidth * fs)))) + 1;
+	if (channels == numChannels && fs == samplingFrequency && p == params && lagBins <= binMask + 1 - windowBins)
+		return; // keep the windows and histograms
+	params = p;
+	params.burstMinChannels = std::max(1, params.burstMinChannels);
+	numChannels = std::max(0, channels);
+	samplingFrequency = fs;
+	binSamples = std::max(1LL, llround(params.binWidth * fs));
+	windowBins = std::max(1, (int)llround(params.rateWindow * fs / binSamples));
+	burstBins = std::max(1, std::min(windowBins, (int)llround(params.burstWindow * fs / binSamples)));
+	seriesBins = std::max(1, (int)llround(params.seriesInterval * fs / binSamples));
+	isiScale = isiBinsPerDecade / log(10.0);
+	isiOffset = log(isiMinimum * fs);
+
+	size_t ringBins = 1;
+	while ((long long)ringBins < windowBins + lagBins)
+		ringBins <<= 1;
+	bins.assign(ringBins, std::vector<uint16_t>());
+	binMask = ringBins - 1;
+	closedBin = -1;
+	windowCount.assign(numChannels, 0);
+	active = 0;
+	popWindow = 0;
+	burstSum = 0;
+	binsSeen = 0;
+	baseline = 0;
+	lastSpike.assign(numChannels, ~0ULL);
+	isiCounts.reset(new std::atomic<uint32_t>[(numChannels + 1) * numIsiBins]);
+	for (int k = 0; k < (numChannels + 1) * numIsiBins; k++)
+		isiCounts[k].store(0, std::memory_order_relaxed);
+	burstOpen = false;
+	channelBurst.assign(numChannels, -1);
+
+	std::lock_guard<std::mutex> guard(lock);
+	publishedCounts.assign(numChannels, 0);
+	publishedWindow = windowBins * binSamples / fs;
+	bursts.clear();
+	nextBurst = 0;
+	series.assign(maxSamples, networkSample());
+	nextSample = 0;
+	numSamples = 0;
+	popRate = 0;
+	numActive = 0;
+	bursting = false;
+	totalBursts = 0;
+	lastDuration = 0;
+	isiMedian = 0;
+	late = 0;
+}
+
+void networkAnalytics::add(int channel, unsigned long long sampleIndex)
+{
+	if (channel < 0 || channel >= numChannels)
+		return;
+	unsigned long long previous = lastSpike[channel];
+	if (previous == ~0ULL || sampleIndex > previous) {
+		if (previous != ~0ULL) {
+			// only this thread writes the counts, readers see whole values
+			int bin = 1 + (int)floor(isiScale * (log((double)(sampleIndex - previous)) - isiOffset));
+			bin = std::max(0, std::min(numIsiBins - 1, bin));
+			std::atomic<uint32_t> &own = isiCounts[channel * numIsiBins + bin];
+			std::atomic<uint32_t> &all = isiCounts[numChannels * numIsiBins + bin];
+			own.store(own.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			all.store(all.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		}
+		lastSpike[channel] = sampleIndex;
+	}
+
+	long long b = sampleIndex / binSamples;
+	if (closedBin < 0)
+		closedBin = newestBin = b;
+	// until the first bin closes, the windows start at the earliest spike
+	if (binsSeen == 0 && b < closedBin && newestBin - b <= binMask - windowBins)
+		closedBin = b;
+	newestBin = std::max(newestBin, b);
+	// open bins may not reach the slots of the rate window
+	if (b < closedBin || b - closedBin > binMask - windowBins) {
+		late.store(late.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return;
+	}
+	bins[b & binMask].push_back((uint16_t)channel);
+}
+
+void networkAnalytics::advance(unsigned long long sampleIndex)
+{
+	if (bins.empty())
+		return;
+	long long target = sampleIndex / binSamples; // bins before it end by sampleIndex
+	if (closedBin < 0)
+		closedBin = newestBin = target;
+	std::lock_guard<std::mutex> guard(lock);
+	while (closedBin < target)
+		closeBin(closedBin++);
+
+	publishedCounts = windowCount;
+	publishedWindow = std::min(binsSeen, (long long)windowBins) * binSamples / samplingFrequency;
+	popRate.store(publishedWindow > 0 ? popWindow / publishedWindow : 0, std::memory_order_relaxed);
+	numActive.store(active, std::memory_order_relaxed);
+	bursting.store(burstOpen, std::memory_order_relaxed);
+
+	// the middle of the bin holding the median of all intervals
+	const std::atomic<uint32_t> *all = &isiCounts[numChannels * numIsiBins];
+	unsigned long long total = 0, below = 0;
+	for (int k = 0; k < numIsiBins; k++)
+		total += all[k].load(std::memory_order_relaxed);
+	for (int k = 0; k < numIsiBins && total > 0; k++) {
+		below += all[k].load(std::memory_order_relaxed);
+		if (2 * below >= total) {
+			double median = k == 0 ? isiBinStart(1) : k == numIsiBins - 1 ? isiBinStart(k) : sqrt(isiBinStart(k) * isiBinStart(k + 1));
+			isiMedian.store(median, std::memory_order_relaxed);
+			break;
+		}
+	}
+}
+
+// Every spike enters the rate window once, when its bin closes, and leaves it
+// once, so the windows cost O(1) per spike and per bin.
+void networkAnalytics::closeBin(long long b)
+{
+	std::vector<uint16_t> &closing = bins[b & binMask];
+	burstSum += closing.size();
+	if (binsSeen >= burstBins)
+		burstSum -= bins[(b - burstBins) & binMask].size();
+	if (binsSeen >= windowBins) {
+		std::vector<uint16_t> &leaving = bins[(b - windowBins) & binMask];
+		for (size_t k = 0; k < leaving.size(); k++) {
+			if (--windowCount[leaving[k]] == 0)
+				active--;
+		}
+		popWindow -= leaving.size();
+		leaving.clear(); // the slot of a future bin
+	}
+	for (size_t k = 0; k < closing.size(); k++) {
+		if (windowCount[closing[k]]++ == 0)
+			active++;
+	}
+	popWindow += closing.size();
+	binsSeen++;
+
+	// hysteresis on the population rate, relative to its level outside bursts
+	if (!burstOpen) {
+		double onset = std::max(params.burstOnset * baseline * burstBins, (double)params.burstMinChannels);
+		if (binsSeen >= windowBins && burstSum >= onset) {
+			openBurst(b);
+		} else {
+			double a = std::max(1.0 / binsSeen, binSamples / (params.baselineTime * samplingFrequency));
+			baseline += a * (closing.size() - baseline);
+		}
+	} else {
+		countBurstSpikes(b);
+		burstPeak = std::max(burstPeak, burstSum);
+		if (burstSum <= params.burstOffset * baseline * burstBins)
+			closeBurst();
+	}
+
+	if ((b + 1) % seriesBins == 0) {
+		networkSample &s = series[nextSample];
+		s.time = binTime(b + 1);
+		s.rate = popWindow * samplingFrequency / (std::min(binsSeen, (long long)windowBins) * binSamples);
+		s.activeChannels = (uint16_t)std::min(active, 65535);
+		s.inBurst = burstOpen;
+		nextSample = (nextSample + 1) % maxSamples;
+		numSamples = std::min(numSamples + 1, maxSamples);
+	}
+}
+
+// the burst reaches back over the bins of the burst window that are
+// already at the onset level
+void networkAnalytics::openBurst(long long b)
+{
+	long long first = b;
+	while (first > b - burstBins + 1 && bins[(first - 1) & binMask].size() >= params.burstOnset * baseline)
+		first--;
+	burstOpen = true;
+	burstStart = first;
+	burstPeak = burstSum;
+	lastActive = b;
+	burstSpikes = 0;
+	burstChannels = 0;
+	for (long long k = first; k <= b; k++)
+		countBurstSpikes(k);
+}
+
+void networkAnalytics::countBurstSpikes(long long b)
+{
+	const std::vector<uint16_t> &spikes = bins[b & binMask];
+	for (size_t k = 0; k < spikes.size(); k++) {
+		if (channelBurst[spikes[k]] != burstStart) {
+			channelBurst[spikes[k]] = burstStart;
+			burstChannels++;
+		}
+	}
+	burstSpikes += spikes.size();
+	// the burst ends with its last bin at the onset level
+	if (spikes.size() >= params.burstOnset * baseline)
+		lastActive = b;
+}
+
+// called with the lock held; bursts reaching too few channels are dropped
+void networkAnalytics::closeBurst(void)
+{
+	burstOpen = false;
+	if (burstChannels < params.burstMinChannels)
+		return;
+	networkBurst burst;
+	burst.start = binTime(burstStart);
+	burst.duration = binTime(lastActive + 1) - burst.start;
+	burst.spikes = burstSpikes;
+	burst.channels = burstChannels;
+	burst.peakRate = burstPeak * samplingFrequency / (burstBins * binSamples);
+	if (bursts.size() < maxBursts)
+		bursts.push_back(burst);
+	else
+		bursts[nextBurst] = burst;
+	nextBurst = (nextBurst + 1) % maxBursts;
+	totalBursts.store(totalBursts.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	lastDuration.store(burst.duration, std::memory_order_relaxed);
+}
+
+void networkAnalytics::channelRates(std::vector<double> &rates) const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	rates.resize(publishedCounts.size());
+	for (size_t c = 0; c < rates.size(); c++)
+		rates[c] = publishedWindow > 0 ? publishedCounts[c] / publishedWindow : 0;
+}
+
+void networkAnalytics::isiHistogram(int channel, std::vector<unsigned long long> &counts) const
+{
+	counts.assign(numIsiBins, 0);
+	if (!isiCounts || channel >= numChannels)
+		return;
+	int row = channel < 0 ? numChannels : channel;
+	for (int k = 0; k < numIsiBins; k++)
+		counts[k] = isiCounts[row * numIsiBins + k].load(std::memory_order_relaxed);
+}
+
+void networkAnalytics::recentBursts(std::vector<networkBurst> &out) const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	out.clear();
+	size_t first = bursts.size() < maxBursts ? 0 : nextBurst;
+	for (size_t k = 0; k < bursts.size(); k++)
+		out.push_back(bursts[(first + k) % bursts.size()]);
+}
+
+void networkAnalytics::timeSeries(std::vector<networkSample> &out) const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	out.clear();
+	for (size_t k = 0; k < numSamples; k++)
+		out.push_back(series[(nextSample + maxSamples - numSamples + k) % maxSamples]);
+}
+
+double networkAnalytics::isiBinStart(int bin)
+{
+	if (bin <= 0)
+		return 0;
+	return isiMinimum * pow(10.0, (double)(bin - 1) / isiBinsPerDecade);
+}
+
+void networkAnalytics::print(FILE *out) const
+{
+	std::vector<double> rates;
+	channelRates(rates);
+	std::vector<double> sorted(rates);
+	std::sort(sorted.begin(), sorted.end());
+	fprintf(out, "population rate %.1f Hz, %d active channels, channel rates (Hz) min %.2f median %.2f max %.2f\n",
+		populationRate(), activeChannels(), sorted.empty() ? 0 : sorted.front(), sorted.empty() ? 0 : sorted[sorted.size() / 2],
+		sorted.empty() ? 0 : sorted.back());
+	fprintf(out, "network bursts %llu, last %.3f s, median ISI %.1f ms, %llu spikes too late for the windows\n", burstCount(),
+		lastBurstDuration(), medianIsi() * 1e3, spikesLate());
+	std::vector<unsigned long long> counts;
+	isiHistogram(-1, counts);
+	fprintf(out, "ISI histogram, %d bins per decade from %g ms (below, bins, above):", isiBinsPerDecade, isiMinimum * 1e3);
+	for (int k = 0; k < numIsiBins; k++)
+		fprintf(out, " %llu", counts[k]);
+	fprintf(out, "\n");
+}
+
+void networkAnalytics::writeSeries(FILE *out) const
+{
+	std::vector<networkSample> samples;
+	timeSeries(samples);
+	fprintf(out, "# time (s), population rate (Hz), active channels, in burst\n");
+	for (size_t k = 0; k < samples.size(); k++)
+		fprintf(out, "%.3f %.1f %d %d\n", samples[k].time, samples[k].rate, samples[k].activeChannels, samples[k].inBurst);
+	std::vector<networkBurst> list;
+	recentBursts(list);
+	fprintf(out, "# bursts: start (s), duration (s), spikes, channels, peak rate (Hz)\n");
+	for (size_t k = 0; k < list.size(); k++)
+		fprintf(out, "# %.3f %.3f %u %d %.1f\n", list[k].start, list[k].duration, list[k].spikes, list[k].channels, list[k].peakRate);
+}
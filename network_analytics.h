@@ -0,0 +1,176 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+* Streaming network analytics over the detected spikes: sliding-window
+* firing rates per channel and over the array, network burst detection on
+* the population rate and log-binned inter-spike interval histograms. The
+* detection thread feeds it every spike once per pass and each spike costs
+* O(1); other threads read the results.
+*/
+
+#ifndef NETWORK_ANALYTICS_H
+#define NETWORK_ANALYTICS_H
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <vector>
+
+// ISI histogram bins: one below isiMinimum, isiBinsPerDecade per decade up
+// to isiMinimum x 10^isiDecades, and one above
+static const double isiMinimum = 1e-3; // (s)
+static const int isiBinsPerDecade = 10;
+static const int isiDecades = 4;
+static const int numIsiBins = isiBinsPerDecade * isiDecades + 2;
+
+struct networkParameters {
+	double rateWindow; // (s) sliding window of the channel and population rates
+	double binWidth; // (s) time resolution of the windows
+	double burstWindow; // (s) population rate window the burst thresholds apply to
+	double burstOnset; // a burst starts when that rate exceeds this x baseline
+	double burstOffset; // and ends when it falls below this x baseline
+	int burstMinChannels; // channels a burst must reach to count, and spikes in a burst window to start one
+	double baselineTime; // (s) time constant of the baseline population rate, tracked outside bursts
+	double seriesInterval; // (s) between points of the time series
+
+	networkParameters(void);
+	bool operator==(const networkParameters &p) const;
+};
+
+struct networkBurst {
+	double start; // (s)
+	double duration; // (s)
+	unsigned spikes;
+	int channels; // that fired during the burst
+	double peakRate; // (Hz) population rate over the burst window
+};
+
+// one point of the time series, at the end of each series interval
+struct networkSample {
+	double time; // (s)
+	float rate; // (Hz) population rate over the rate window
+	uint16_t activeChannels; // with a spike in the rate window
+	uint16_t inBurst;
+};
+
+class networkAnalytics {
+	public:
+		networkAnalytics(void);
+
+		// Not thread safe: stopped. Starts over unless the channel count,
+		// sampling rate and parameters are unchanged. Spikes may arrive up to
+		// maxLag seconds ahead of the last advance().
+		void configure(int numChannels, double samplingFrequency, const networkParameters &p, double maxLag = 1);
+		const networkParameters &getParameters(void) const { return params; }
+
+		// Detection thread. Spikes of a pass may come in any channel order,
+		// but in time order within each channel. A spike before the last
+		// advance() only counts towards its ISI.
+		void add(int channel, unsigned long long sampleIndex);
+		// Detection thread: no spike before sampleIndex is added anymore. Closes
+		// the bins up to it, which moves the windows, the burst detection and
+		// the time series forward.
+		void advance(unsigned long long sampleIndex);
+
+		// Any thread, as of the last advance().
+		double populationRate(void) const { return popRate.load(std::memory_order_relaxed); } // (Hz)
+		int activeChannels(void) const { return numActive.load(std::memory_order_relaxed); }
+		bool inBurst(void) const { return bursting.load(std::memory_order_relaxed); }
+		unsigned long long burstCount(void) const { return totalBursts.load(std::memory_order_relaxed); }
+		double lastBurstDuration(void) const { return lastDuration.load(std::memory_order_relaxed); } // (s)
+		double medianIsi(void) const { return isiMedian.load(std::memory_order_relaxed); } // (s) over all channels
+		unsigned long long spikesLate(void) const { return late.load(std::memory_order_relaxed); } // missed the windows
+
+		// Any thread, copies taken under a lock.
+		void channelRates(std::vector<double> &rates) const; // (Hz)
+		void isiHistogram(int channel, std::vector<unsigned long long> &counts) const; // channel -1 for all
+		void recentBursts(std::vector<networkBurst> &out) const; // oldest first
+		void timeSeries(std::vector<networkSample> &out) const; // oldest first
+		static double isiBinStart(int bin); // (s) lower edge, 0 for the first bin
+		// summary lines for the stats file
+		void print(FILE *out) const;
+		// the time series and the bursts as text columns
+		void writeSeries(FILE *out) const;
+
+	private:
+		networkParameters params;
+		int numChannels;
+		double samplingFrequency;
+		long long binSamples;
+		int windowBins;
+		int burstBins;
+		int seriesBins;
+		double isiScale; // bins per unit of log(samples)
+		double isiOffset;
+
+		// ring of bins, each listing the channel of every spike in it; bins
+		// before closedBin are closed and the last windowBins of them form the
+		// rate window
+		std::vector<std::vector<uint16_t> > bins;
+		long long binMask;
+		long long closedBin; // -1 before the first spike or advance
+		long long newestBin; // holding a spike
+		std::vector<int> windowCount; // per channel, spikes in the rate window
+		int active; // channels with a non-zero windowCount
+		long long popWindow; // spikes in the rate window
+		long long burstSum; // spikes in the burst window
+		long long binsSeen;
+		double baseline; // mean spikes per bin outside bursts
+
+		std::vector<unsigned long long> lastSpike; // per channel, ~0 before the first
+		std::unique_ptr<std::atomic<uint32_t>[]> isiCounts; // numChannels + 1 rows, the last for all channels
+
+		// the burst in progress
+		bool burstOpen;
+		long long burstStart; // first bin
+		long long burstPeak; // largest burstSum
+		long long lastActive; // last bin at the onset level
+		unsigned burstSpikes;
+		int burstChannels;
+		std::vector<long long> channelBurst; // per channel, start bin of the last burst it fired in
+
+		// published under the lock at every advance()
+		mutable std::mutex lock;
+		std::vector<int> publishedCounts;
+		double publishedWindow; // (s) covered by the counts
+		std::vector<networkBurst> bursts; // ring of the last maxBursts
+		size_t nextBurst;
+		std::vector<networkSample> series; // ring
+		size_t nextSample;
+		size_t numSamples;
+		std::atomic<double> popRate;
+		std::atomic<int> numActive;
+		std::atomic<bool> bursting;
+		std::atomic<unsigned long long> totalBursts;
+		std::atomic<double> lastDuration;
+		std::atomic<double> isiMedian;
+		std::atomic<unsigned long long> late;
+
+		static const size_t maxBursts = 1000;
+		static const size_t maxSamples = 6000;
+
+		void closeBin(long long b);
+		void openBurst(long long b);
+		void closeBurst(void);
+		void countBurstSpikes(long long b);
+		double binTime(long long b) const { return b * binSamples / samplingFrequency; }
+};
+
+#endif
@@ -0,0 +1,91 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Pipeline health histograms
+*/
+
+#include "pipeline_stats.h"
+
+latencyHistogram::latencyHistogram(void)
+{
+	clear();
+}
+
+void latencyHistogram::clear(void)
+{
+	for (int k = 0; k < numBuckets; k++)
+		counts[k].store(0, std::memory_order_relaxed);
+	total.store(0, std::memory_order_relaxed);
+	maximum.store(0, std::memory_order_relaxed);
+}
+
+// values below 2^subBits map to themselves, above that the top subBits + 1
+// significant bits select the bucket
+int latencyHistogram::bucketOf(uint64_t value)
+{
+	if (value < (1u << subBits))
+		return value;
+	int exponent = 63 - __builtin_clzll(value);
+	int sub = (value >> (exponent - subBits)) & ((1u << subBits) - 1);
+	return ((exponent - subBits + 1) << subBits) + sub;
+}
+
+uint64_t latencyHistogram::bucketTop(int bucket)
+{
+	if (bucket < (1 << subBits))
+		return bucket;
+	int exponent = (bucket >> subBits) + subBits - 1;
+	int shift = exponent - subBits;
+	uint64_t low = (uint64_t)((1 << subBits) + (bucket & ((1 << subBits) - 1))) << shift;
+	return low + ((1ULL << shift) - 1);
+}
+
+void latencyHistogram::record(uint64_t value)
+{
+	counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+	total.fetch_add(1, std::memory_order_relaxed);
+	uint64_t seen = maximum.load(std::memory_order_relaxed);
+	while (value > seen && !maximum.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+}
+
+uint64_t latencyHistogram::percentile(double q) const
+{
+	uint64_t n = count();
+	if (n == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(q * n);
+	if (rank >= n)
+		rank = n - 1;
+	uint64_t seen = 0;
+	for (int k = 0; k < numBuckets; k++) {
+		seen += counts[k].load(std::memory_order_relaxed);
+		if (seen > rank) {
+			uint64_t top = bucketTop(k);
+			return top < max() ? top : max();
+		}
+	}
+	return max();
+}
+
+void latencyHistogram::print(FILE *out, const char *name, double scale, const char *unit) const
+{
+	fprintf(out, "%s (%s) n %llu  p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n", name, unit,
+		(unsigned long long)count(), percentile(0.5) * scale, percentile(0.9) * scale,
+		percentile(0.99) * scale, percentile(0.999) * scale, max() * scale);
+}
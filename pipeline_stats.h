@@ -0,0 +1,62 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Health counters for the acquisition -> detection -> display pipeline.
+* Everything here is lock-free, so any thread may record and the GUI can
+* read at any time.
+*/
+
+#ifndef PIPELINE_STATS_H
+#define PIPELINE_STATS_H
+
+#include <atomic>
+#include <cstdio>
+#include <stdint.h>
+
+// Log-linear histogram in the spirit of HdrHistogram: values below 16 have a
+// bucket each, and every power of two above is split into 16 buckets, so
+// any value from 1 to 2^64 is reported within 1/16 of itself using a fixed
+// table. Recording is one relaxed increment (plus a compare-exchange when a
+// new maximum is set).
+class latencyHistogram {
+	public:
+		latencyHistogram(void);
+
+		void record(uint64_t value);
+		// not synchronized with record(), counts recorded meanwhile may survive
+		void clear(void);
+		uint64_t count(void) const { return total.load(std::memory_order_relaxed); }
+		uint64_t max(void) const { return maximum.load(std::memory_order_relaxed); }
+		// smallest bucket upper edge that covers fraction q of the values, 0 when empty
+		uint64_t percentile(double q) const;
+		// one line: count, p50, p90, p99, p99.9 and max, each multiplied by scale
+		void print(FILE *out, const char *name, double scale, const char *unit) const;
+
+	private:
+		static const int subBits = 4;
+		static const int numBuckets = (64 - subBits + 1) << subBits;
+		std::atomic<uint64_t> counts[numBuckets];
+		std::atomic<uint64_t> total;
+		std::atomic<uint64_t> maximum;
+
+		static int bucketOf(uint64_t value);
+		static uint64_t bucketTop(int bucket);
+};
+
+#endif
@@ -0,0 +1,503 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Compressed raw voltage recorder and reader
+*/
+
+#include "raw_recorder.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static_assert(sizeof(rawFileHeader) == 64, "chunk headers are 64 bytes");
+static_assert(sizeof(rawBlockHeader) == 16 && sizeof(rawIndexEntry) == 24, "on-disk layouts must not change");
+
+// a delta of two int16 samples zigzags into at most 17 bits
+static const int maxDeltaBits = 17;
+
+size_t rawEncodedBound(size_t n)
+{
+	size_t groups = (n + rawGroupLength - 1) / rawGroupLength;
+	return sizeof(int16_t) + groups * (1 + (rawGroupLength * maxDeltaBits + 7) / 8);
+}
+
+static inline uint32_t zigzag(int32_t d)
+{
+	return ((uint32_t)d << 1) ^ (uint32_t)(d >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t z)
+{
+	return (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+}
+
+size_t encodeChannel(const int16_t *samples, size_t n, uint8_t *out)
+{
+	if (n == 0)
+		return 0;
+	uint8_t *p = out;
+	memcpy(p, &samples[0], sizeof(int16_t));
+	p += sizeof(int16_t);
+
+	uint32_t deltas[rawGroupLength];
+	for (size_t g = 1; g < n; g += rawGroupLength) {
+		int count = std::min<size_t>(rawGroupLength, n - g);
+		uint32_t all = 0;
+		for (int k = 0; k < count; k++) {
+			deltas[k] = zigzag((int32_t)samples[g + k] - samples[g + k - 1]);
+			all |= deltas[k];
+		}
+		int width = all ? 32 - __builtin_clz(all) : 0;
+		*p++ = width;
+		// little-endian bit stream, whole bytes out as soon as they are complete
+		uint64_t pendingBits = 0;
+		int numBits = 0;
+		for (int k = 0; k < count; k++) {
+			pendingBits |= (uint64_t)deltas[k] << numBits;
+			numBits += width;
+			while (numBits >= 8) {
+				*p++ = pendingBits;
+				pendingBits >>= 8;
+				numBits -= 8;
+			}
+		}
+		if (numBits > 0)
+			*p++ = pendingBits;
+	}
+	return p - out;
+}
+
+bool decodeChannel(const uint8_t *in, size_t length, int16_t *samples, size_t n)
+{
+	if (n == 0)
+		return true;
+	const uint8_t *end = in + length;
+	if (length < sizeof(int16_t))
+		return false;
+	memcpy(&samples[0], in, sizeof(int16_t));
+	in += sizeof(int16_t);
+
+	for (size_t g = 1; g < n; g += rawGroupLength) {
+		int count = std::min<size_t>(rawGroupLength, n - g);
+		if (in >= end)
+			return false;
+		int width = *in++;
+		if (width > maxDeltaBits || end - in < (count * width + 7) / 8)
+			return false;
+		uint32_t mask = (1u << width) - 1;
+		uint64_t pendingBits = 0;
+		int numBits = 0;
+		int32_t previous = samples[g - 1];
+		for (int k = 0; k < count; k++) {
+			while (numBits < width) {
+				pendingBits |= (uint64_t)*in++ << numBits;
+				numBits += 8;
+			}
+			previous += unzigzag(pendingBits & mask);
+			samples[g + k] = previous;
+			pendingBits >>= width;
+			numBits -= width;
+		}
+	}
+	return true;
+}
+
+static bool writeAll(int fd, const void *data, size_t length)
+{
+	const char *p = static_cast<const char *>(data);
+	while (length > 0) {
+		ssize_t n = write(fd, p, length);
+		if (n < 0)
+			return false;
+		p += n;
+		length -= n;
+	}
+	return true;
+}
+
+// drops whatever a failed write left past length, so the next write starts there
+static bool truncateTo(int fd, uint64_t length)
+{
+	return ftruncate(fd, length) == 0 && lseek(fd, length, SEEK_SET) == (off_t)length;
+}
+
+static std::string chunkName(const std::string &base, int fileNumber)
+{
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%04d.raw", fileNumber);
+	return base + suffix;
+}
+
+rawRecorder::rawRecorder(void) : numChannels(0), samplingFrequency(0), lsb(0), chunkFrames(0), wakeup(-1),
+	recording(false), quit(false), filling(0), pending(-1), fd(-1), indexFd(-1), fileNumber(0), fileOffset(0),
+	fileFirstStamp(0), indexOffset(0), written(0), dropped(0), clipped(0), bytes(0), failed(false)
+{
+}
+
+rawRecorder::~rawRecorder(void)
+{
+	close();
+}
+
+bool rawRecorder::open(const std::string &name, int channels, double fs, double step, size_t batchFrames, double chunkSeconds)
+{
+	close();
+	base = name;
+	numChannels = channels;
+	samplingFrequency = fs;
+	lsb = step;
+	chunkFrames = std::max(1.0, chunkSeconds * fs);
+	indexFd = ::open((base + ".raw.idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (indexFd < 0 || wakeup < 0 || numChannels < 1 || !(lsb > 0)) {
+		close();
+		return false;
+	}
+	for (int b = 0; b < 2; b++) {
+		batches[b].samples.assign(std::max<size_t>(batchFrames, 1) * numChannels, 0);
+		batches[b].blocks.clear();
+		batches[b].used = 0;
+	}
+	filling = 0;
+	pending = -1;
+	fd = -1;
+	fileNumber = -1;
+	indexBuffer.clear();
+	indexOffset = 0;
+	written = dropped = clipped = bytes = 0;
+	failed = false;
+	quit = false;
+	writer = std::thread(&rawRecorder::writerLoop, this);
+	recording.store(true, std::memory_order_release);
+	return true;
+}
+
+void rawRecorder::close(void)
+{
+	recording.store(false, std::memory_order_release);
+	if (writer.joinable()) {
+		quit.store(true, std::memory_order_release);
+		uint64_t one = 1;
+		if (write(wakeup, &one, sizeof(one)) < 0) { /* already signalled */ }
+		writer.join();
+		int b = pending.load(std::memory_order_acquire);
+		if (b >= 0)
+			writeBatch(batches[b]);
+		writeBatch(batches[filling]);
+		pending = -1;
+	}
+	if (fd >= 0) {
+		fdatasync(fd);
+		::close(fd);
+	}
+	if (indexFd >= 0)
+		::close(indexFd);
+	if (wakeup >= 0)
+		::close(wakeup);
+	fd = indexFd = wakeup = -1;
+}
+
+// Quantization happens here, on the producer, so a batch holds int16 and
+// the copy is half the size of the float windows it comes from.
+void rawRecorder::append(const float *const *channelData, size_t offset, size_t n, unsigned long long firstStamp)
+{
+	if (!recording.load(std::memory_order_relaxed))
+		return;
+	const double scale = 1 / lsb;
+	while (n > 0) {
+		batch *b = &batches[filling];
+		size_t capacity = b->samples.size() / numChannels;
+		if (b->used / numChannels == capacity) {
+			flush();
+			b = &batches[filling];
+			if (b->used > 0) {
+				dropped.fetch_add(n, std::memory_order_relaxed); // the writer is not keeping up
+				return;
+			}
+		}
+		size_t frames = std::min(n, capacity - b->used / numChannels);
+		blockInfo block = { firstStamp, frames, b->used };
+		unsigned long long numClipped = 0;
+		for (int c = 0; c < numChannels; c++) {
+			const float *in = channelData[c] + offset;
+			int16_t *out = &b->samples[block.offset + c * frames];
+			// branch free, so the loop vectorizes
+			for (size_t j = 0; j < frames; j++) {
+				double v = in[j] * scale;
+				numClipped += (v > 32767.0) | (v < -32768.0);
+				v = std::min(std::max(v, -32768.0), 32767.0);
+				out[j] = (int16_t)(int)(v + std::copysign(0.5, v)); // round half away from zero
+			}
+		}
+		if (numClipped)
+			clipped.fetch_add(numClipped, std::memory_order_relaxed);
+		b->blocks.push_back(block);
+		b->used += frames * numChannels;
+		offset += frames;
+		firstStamp += frames;
+		n -= frames;
+	}
+}
+
+void rawRecorder::flush(void)
+{
+	if (batches[filling].used == 0 || pending.load(std::memory_order_acquire) >= 0)
+		return;
+	int b = filling;
+	filling ^= 1;
+	batches[filling].used = 0;
+	batches[filling].blocks.clear();
+	pending.store(b, std::memory_order_release);
+	uint64_t one = 1;
+	if (write(wakeup, &one, sizeof(one)) < 0) { /* counter saturated, writer is already pending */ }
+}
+
+void rawRecorder::writerLoop(void)
+{
+	struct pollfd event = { wakeup, POLLIN, 0 };
+	for (;;) {
+		if (poll(&event, 1, -1) < 0)
+			continue; // interrupted
+		uint64_t signalled;
+		if (read(wakeup, &signalled, sizeof(signalled)) < 0) { /* spurious wakeup */ }
+		int b = pending.load(std::memory_order_acquire);
+		if (b >= 0) {
+			writeBatch(batches[b]);
+			pending.store(-1, std::memory_order_release);
+		}
+		if (quit.load(std::memory_order_acquire))
+			return;
+	}
+}
+
+bool rawRecorder::startFile(unsigned long long firstStamp)
+{
+	if (fd >= 0)
+		::close(fd); // no sync, the page cache writes it back
+	fileNumber++;
+	fd = ::open(chunkName(base, fileNumber).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+	rawFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, rawFileMagic, sizeof(header.magic));
+	header.version = 1;
+	header.numChannels = numChannels;
+	header.samplingFrequency = samplingFrequency;
+	header.lsb = lsb;
+	header.groupLength = rawGroupLength;
+	header.fileNumber = fileNumber;
+	if (!writeAll(fd, &header, sizeof(header))) {
+		::close(fd); // no blocks go after a torn header, the next block starts another file
+		fd = -1;
+		return false;
+	}
+	fileOffset = sizeof(header);
+	fileFirstStamp = firstStamp;
+	return true;
+}
+
+// encode every block of a batch, one writev() per block
+void rawRecorder::writeBatch(batch &b)
+{
+	for (size_t k = 0; k < b.blocks.size(); k++) {
+		const blockInfo &block = b.blocks[k];
+		if (failed.load(std::memory_order_relaxed)) {
+			dropped.fetch_add(block.frames, std::memory_order_relaxed);
+			continue;
+		}
+		if ((fd < 0 || block.firstStamp - fileFirstStamp >= chunkFrames) && !startFile(block.firstStamp)) {
+			dropped.fetch_add(block.frames, std::memory_order_relaxed);
+			continue;
+		}
+		size_t tableBytes = numChannels * sizeof(uint32_t);
+		payload.resize(tableBytes + numChannels * rawEncodedBound(block.frames));
+		uint32_t *sizes = reinterpret_cast<uint32_t *>(payload.data());
+		size_t used = tableBytes;
+		for (int c = 0; c < numChannels; c++) {
+			sizes[c] = encodeChannel(&b.samples[block.offset + c * block.frames], block.frames, &payload[used]);
+			used += sizes[c];
+		}
+
+		rawBlockHeader header = { block.firstStamp, (uint32_t)block.frames, (uint32_t)used };
+		struct iovec parts[2] = { { &header, sizeof(header) }, { payload.data(), used } };
+		size_t total = sizeof(header) + used;
+		if (writev(fd, parts, 2) != (ssize_t)total) {
+			dropped.fetch_add(block.frames, std::memory_order_relaxed);
+			// a torn block must not stay in front of the next one
+			if (!truncateTo(fd, fileOffset))
+				fail();
+			continue;
+		}
+		rawIndexEntry entry = { block.firstStamp, (uint32_t)block.frames, (uint32_t)fileNumber, fileOffset };
+		indexBuffer.push_back(entry);
+		fileOffset += total;
+		written.fetch_add(block.frames, std::memory_order_relaxed);
+		bytes.fetch_add(total, std::memory_order_relaxed);
+	}
+	b.blocks.clear();
+	b.used = 0;
+	// blocks are indexed only once they are whole on disk; a torn entry is cut
+	// off, and the blocks it was for stay in their chunk files unindexed
+	if (!indexBuffer.empty() && indexFd >= 0) {
+		size_t length = indexBuffer.size() * sizeof(rawIndexEntry);
+		if (writeAll(indexFd, indexBuffer.data(), length))
+			indexOffset += length;
+		else if (!truncateTo(indexFd, indexOffset))
+			fail();
+	}
+	indexBuffer.clear();
+}
+
+// Writer thread (or close() once it is gone): a failed write could not be
+// cut back, so nothing more is written. Everything up to the last whole block
+// and index entry stays readable.
+void rawRecorder::fail(void)
+{
+	failed.store(true, std::memory_order_relaxed);
+	recording.store(false, std::memory_order_release);
+}
+
+rawFileReader::rawFileReader(void) : numChannels(0), samplingFrequency(0), lsb(0)
+{
+}
+
+rawFileReader::~rawFileReader(void)
+{
+	close();
+}
+
+bool rawFileReader::open(const std::string &name)
+{
+	close();
+	base = name;
+	int indexFd = ::open((base + ".raw.idx").c_str(), O_RDONLY | O_CLOEXEC);
+	if (indexFd < 0)
+		return false;
+	rawIndexEntry entry;
+	while (read(indexFd, &entry, sizeof(entry)) == sizeof(entry))
+		index.push_back(entry);
+	::close(indexFd);
+
+	// map every chunk the index refers to, in order
+	for (size_t k = 0; k < index.size(); k++) {
+		while (files.size() <= index[k].fileNumber) {
+			mapping m = { NULL, 0 };
+			int fd = ::open(chunkName(base, files.size()).c_str(), O_RDONLY | O_CLOEXEC);
+			struct stat st;
+			if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(rawFileHeader)) {
+				m.length = st.st_size;
+				m.data = mmap(NULL, m.length, PROT_READ, MAP_SHARED, fd, 0);
+				if (m.data == MAP_FAILED)
+					m.data = NULL;
+			}
+			if (fd >= 0)
+				::close(fd);
+			const rawFileHeader *header = static_cast<const rawFileHeader *>(m.data);
+			if (header && (memcmp(header->magic, rawFileMagic, sizeof(header->magic)) != 0 ||
+					header->groupLength != (uint32_t)rawGroupLength)) {
+				munmap(m.data, m.length);
+				m.data = NULL;
+			}
+			if (header && m.data && numChannels == 0) {
+				numChannels = header->numChannels;
+				samplingFrequency = header->samplingFrequency;
+				lsb = header->lsb;
+			}
+			files.push_back(m);
+		}
+	}
+	// keep the blocks that are complete on disk (a recording may still be running)
+	size_t valid = 0;
+	while (valid < index.size()) {
+		const mapping &m = files[index[valid].fileNumber];
+		if (!m.data || index[valid].offset + sizeof(rawBlockHeader) > m.length)
+			break;
+		const rawBlockHeader *header = reinterpret_cast<const rawBlockHeader *>(static_cast<const char *>(m.data) + index[valid].offset);
+		if (header->firstStamp != index[valid].firstStamp || index[valid].offset + sizeof(rawBlockHeader) + header->bytes > m.length)
+			break;
+		valid++;
+	}
+	index.resize(valid);
+	return numChannels > 0;
+}
+
+void rawFileReader::close(void)
+{
+	for (size_t k = 0; k < files.size(); k++) {
+		if (files[k].data)
+			munmap(files[k].data, files[k].length);
+	}
+	files.clear();
+	index.clear();
+	numChannels = 0;
+}
+
+size_t rawFileReader::findBlock(unsigned long long stamp) const
+{
+	// last block starting at or before stamp, if it reaches stamp
+	size_t i = std::upper_bound(index.begin(), index.end(), stamp,
+		[](unsigned long long s, const rawIndexEntry &e) { return s < e.firstStamp; }) - index.begin();
+	if (i > 0 && stamp < index[i - 1].firstStamp + index[i - 1].frames)
+		return i - 1;
+	return i;
+}
+
+const uint8_t *rawFileReader::blockPayload(size_t i) const
+{
+	const mapping &m = files[index[i].fileNumber];
+	return static_cast<const uint8_t *>(m.data) + index[i].offset + sizeof(rawBlockHeader);
+}
+
+bool rawFileReader::readChannel(size_t i, int channel, int16_t *samples) const
+{
+	if (i >= index.size() || channel < 0 || channel >= numChannels)
+		return false;
+	const uint8_t *payload = blockPayload(i);
+	const uint32_t *sizes = reinterpret_cast<const uint32_t *>(payload);
+	const uint8_t *data = payload + numChannels * sizeof(uint32_t);
+	for (int c = 0; c < channel; c++)
+		data += sizes[c];
+	return decodeChannel(data, sizes[channel], samples, index[i].frames);
+}
+
+bool rawFileReader::readBlock(size_t i, std::vector<int16_t> &samples) const
+{
+	if (i >= index.size())
+		return false;
+	size_t frames = index[i].frames;
+	samples.resize(frames * numChannels);
+	const uint8_t *payload = blockPayload(i);
+	const uint32_t *sizes = reinterpret_cast<const uint32_t *>(payload);
+	const uint8_t *data = payload + numChannels * sizeof(uint32_t);
+	for (int c = 0; c < numChannels; c++) {
+		if (!decodeChannel(data, sizes[c], &samples[c * frames], frames))
+			return false;
+		data += sizes[c];
+	}
+	return true;
+}
@@ -0,0 +1,186 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Compressed recording of the raw voltage stream. Samples are quantized to
+* the ADC step (int16), each channel of a block is delta encoded and the
+* zigzagged deltas are bit-packed in groups of rawGroupLength with one bit
+* width per group. Blocks go to a series of chunk files
+* "<base>.NNNN.raw"; "<base>.raw.idx" has one entry per block so any
+* sample can be found without reading the chunks before it.
+*/
+
+#ifndef RAW_RECORDER_H
+#define RAW_RECORDER_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char rawFileMagic[8] = { 'M', 'E', 'A', 'R', 'A', 'W', 0, 1 };
+static const int rawGroupLength = 128;
+
+// start of every chunk file
+struct rawFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t numChannels;
+	double samplingFrequency; // (Hz)
+	double lsb; // (V) per count
+	uint32_t groupLength; // deltas per bit width
+	uint32_t fileNumber;
+	uint8_t reserved[24];
+};
+
+// Frames with consecutive stamps. The payload is numChannels uint32 byte
+// counts followed by each channel's encoded samples, in channel order.
+struct rawBlockHeader {
+	uint64_t firstStamp;
+	uint32_t frames;
+	uint32_t bytes; // payload
+};
+
+struct rawIndexEntry {
+	uint64_t firstStamp;
+	uint32_t frames;
+	uint32_t fileNumber;
+	uint64_t offset; // of the rawBlockHeader in its chunk file
+};
+
+// Channel codec: the first sample as is, then per group of up to
+// rawGroupLength deltas one byte of bit width and the packed zigzag deltas.
+size_t rawEncodedBound(size_t n);
+size_t encodeChannel(const int16_t *samples, size_t n, uint8_t *out);
+// false if in is too short or corrupt
+bool decodeChannel(const uint8_t *in, size_t length, int16_t *samples, size_t n);
+
+// Records blocks of channel-major samples, as the detection pool has them
+// after a pass. The producer thread quantizes into one of two batches; a
+// background thread encodes and writes the other. append() never waits for
+// the writer, frames that do not fit are dropped and counted.
+class rawRecorder {
+	public:
+		rawRecorder(void);
+		~rawRecorder(void);
+
+		// Not thread safe with append(). A new chunk file is started every
+		// chunkSeconds; batches hold batchFrames frames each.
+		bool open(const std::string &base, int numChannels, double samplingFrequency, double lsb,
+				size_t batchFrames, double chunkSeconds = 60);
+		void close(void);
+		bool isOpen(void) const { return recording.load(std::memory_order_acquire); }
+
+		// producer thread: frames [offset, offset + n) of channelData[c], stamped from firstStamp on
+		void append(const float *const *channelData, size_t offset, size_t n, unsigned long long firstStamp);
+		void flush(void);
+
+		unsigned long long framesWritten(void) const { return written.load(std::memory_order_relaxed); }
+		unsigned long long framesDropped(void) const { return dropped.load(std::memory_order_relaxed); }
+		unsigned long long samplesClipped(void) const { return clipped.load(std::memory_order_relaxed); }
+		unsigned long long bytesWritten(void) const { return bytes.load(std::memory_order_relaxed); }
+		// a write failed and could not be cut back to the last whole block or
+		// index entry; recording stopped there
+		bool writeFailed(void) const { return failed.load(std::memory_order_relaxed); }
+
+	private:
+		struct blockInfo {
+			unsigned long long firstStamp;
+			size_t frames;
+			size_t offset; // into samples, channel c starts at offset + c * frames
+		};
+		struct batch {
+			std::vector<int16_t> samples;
+			std::vector<blockInfo> blocks;
+			size_t used; // samples
+		};
+
+		std::string base;
+		int numChannels;
+		double samplingFrequency;
+		double lsb;
+		unsigned long long chunkFrames;
+
+		int wakeup; // eventfd, written by flush() and close()
+		std::atomic<bool> recording;
+		std::atomic<bool> quit;
+		std::thread writer;
+		batch batches[2];
+		int filling;
+		std::atomic<int> pending; // batch owned by the writer, -1 when none
+
+		// writer thread only
+		int fd;
+		int indexFd;
+		int fileNumber;
+		uint64_t fileOffset;
+		unsigned long long fileFirstStamp;
+		uint64_t indexOffset; // end of the last whole index entry
+		std::vector<uint8_t> payload;
+		std::vector<rawIndexEntry> indexBuffer;
+
+		std::atomic<unsigned long long> written;
+		std::atomic<unsigned long long> dropped;
+		std::atomic<unsigned long long> clipped;
+		std::atomic<unsigned long long> bytes;
+		std::atomic<bool> failed;
+
+		void writerLoop(void);
+		void writeBatch(batch &b);
+		bool startFile(unsigned long long firstStamp);
+		void fail(void);
+};
+
+// Random access to a recording through its index. All chunk files are
+// mapped by open(), so blocks can be decoded from several threads at once.
+class rawFileReader {
+	public:
+		rawFileReader(void);
+		~rawFileReader(void);
+
+		bool open(const std::string &base);
+		void close(void);
+
+		int getNumChannels(void) const { return numChannels; }
+		double getSamplingFrequency(void) const { return samplingFrequency; }
+		double getLsb(void) const { return lsb; }
+		size_t numBlocks(void) const { return index.size(); }
+		const rawIndexEntry &block(size_t i) const { return index[i]; }
+		// index of the block holding stamp, or of the first block after it
+		size_t findBlock(unsigned long long stamp) const;
+		// decodes block i into samples[c * frames + j] as counts, or of a single channel
+		bool readBlock(size_t i, std::vector<int16_t> &samples) const;
+		bool readChannel(size_t i, int channel, int16_t *samples) const;
+
+	private:
+		std::string base;
+		int numChannels;
+		double samplingFrequency;
+		double lsb;
+		std::vector<rawIndexEntry> index;
+		struct mapping {
+			void *data;
+			size_t length;
+		};
+		std::vector<mapping> files;
+
+		const uint8_t *blockPayload(size_t i) const;
+};
+
+#endif
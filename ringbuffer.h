@@ -0,0 +1,405 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Single-producer/single-consumer buffers shared by the RT thread and the
+* detector.
+*/
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+// Lock-free queue between one producer and one consumer thread. Indices
+// are free-running counters masked into a power-of-two ring, and each side
+// keeps a cached copy of the other side's index so the shared atomic is
+// only re-read when the ring looks full (producer) or empty (consumer).
+template<typename T>
+class ringbuffer {
+	public:
+		ringbuffer(size_t size = 0) { resize(size); }
+
+		// not thread safe: only call while neither side is using the buffer.
+		// The capacity is rounded up to a power of two.
+		void resize(size_t size)
+		{
+			size_t capacity = 1;
+			while (capacity < size)
+				capacity <<= 1;
+			ring_.assign(capacity, T());
+			mask_ = capacity - 1;
+			head_ = 0;
+			tail_ = 0;
+			cachedHead_ = 0;
+			cachedTail_ = 0;
+		}
+		size_t capacity(void) const { return mask_ + 1; }
+		// number of queued elements; exact on either side, a snapshot otherwise
+		size_t size(void) const
+		{
+			return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+		}
+
+		// producer
+		bool push(const T & value)
+		{
+			T *slot = prepare();
+			if (!slot)
+				return false;
+			*slot = value;
+			commit();
+			return true;
+		}
+		bool push(T && value)
+		{
+			T *slot = prepare();
+			if (!slot)
+				return false;
+			*slot = std::move(value);
+			commit();
+			return true;
+		}
+		template<typename... Args>
+		bool emplace(Args&&... args)
+		{
+			T *slot = prepare();
+			if (!slot)
+				return false;
+			*slot = T(std::forward<Args>(args)...);
+			commit();
+			return true;
+		}
+		// in-place write: fill the slot returned by prepare() (NULL when full), then commit()
+		T *prepare(void)
+		{
+			size_t head = head_.load(std::memory_order_relaxed);
+			if (head - cachedTail_ > mask_) {
+				cachedTail_ = tail_.load(std::memory_order_acquire);
+				if (head - cachedTail_ > mask_)
+					return NULL;
+			}
+			return &ring_[head & mask_];
+		}
+		void commit(void)
+		{
+			head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+		// pushes as many of values[0..n) as fit, returns the number pushed
+		size_t push_n(const T *values, size_t n)
+		{
+			size_t head = head_.load(std::memory_order_relaxed);
+			if (capacity() - (head - cachedTail_) < n)
+				cachedTail_ = tail_.load(std::memory_order_acquire);
+			size_t space = capacity() - (head - cachedTail_);
+			if (n > space)
+				n = space;
+			for (size_t k = 0; k < n; k++)
+				ring_[(head + k) & mask_] = values[k];
+			head_.store(head + n, std::memory_order_release);
+			return n;
+		}
+
+		// consumer
+		bool pop(T & value)
+		{
+			T *slot = front();
+			if (!slot)
+				return false;
+			value = std::move(*slot);
+			release();
+			return true;
+		}
+		// in-place read: use the slot returned by front() (NULL when empty), then release()
+		T *front(void)
+		{
+			size_t tail = tail_.load(std::memory_order_relaxed);
+			if (tail == cachedHead_) {
+				cachedHead_ = head_.load(std::memory_order_acquire);
+				if (tail == cachedHead_)
+					return NULL;
+			}
+			return &ring_[tail & mask_];
+		}
+		void release(void)
+		{
+			tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+		// pops up to n elements into values, returns the number popped
+		size_t pop_n(T *values, size_t n)
+		{
+			size_t tail = tail_.load(std::memory_order_relaxed);
+			if (cachedHead_ - tail < n)
+				cachedHead_ = head_.load(std::memory_order_acquire);
+			size_t avail = cachedHead_ - tail;
+			if (n > avail)
+				n = avail;
+			for (size_t k = 0; k < n; k++)
+				values[k] = std::move(ring_[(tail + k) & mask_]);
+			tail_.store(tail + n, std::memory_order_release);
+			return n;
+		}
+
+	private:
+		// full cache lines of padding keep the producer and consumer indices
+		// apart without needing an over-aligned operator new
+		static const size_t cacheLine = 64;
+
+		char pad0_[cacheLine];
+		std::atomic<size_t> head_; // written by the producer
+		size_t cachedTail_; // producer's copy of tail_
+		char pad1_[cacheLine];
+		std::atomic<size_t> tail_; // written by the consumer
+		size_t cachedHead_; // consumer's copy of head_
+		char pad2_[cacheLine];
+		size_t mask_; // read-only after resize()
+		std::vector<T> ring_;
+};
+
+// Storage type of the framebuffer samples. float32 keeps the values as
+// they come; int16 keeps them in counts of a per-channel step (the ADC's
+// LSB), a quarter of the size of a double and all the resolution the
+// hardware has.
+enum sampleFormat {
+	sampleFloat32,
+	sampleInt16,
+};
+
+// Blanked samples (inputs of exactly 0, as the amplifier gives while it is
+// held during stimulation) are 0 as float32. As int16, 0 counts is an
+// ordinary sample, so blanking has a code of its own that no stored value
+// takes; it decodes to 0.
+static const int16_t blankedCount = INT16_MIN;
+static inline bool isBlanked(float v) { return v == 0; }
+static inline bool isBlanked(int16_t v) { return v == blankedCount; }
+static inline void storeBlanked(float &out) { out = 0; }
+static inline void storeBlanked(int16_t &out) { out = blankedCount; }
+
+// v in storage units: floats are rounded to nearest, counts are rounded to
+// nearest even and saturate at +-32767. The SIMD kernels that write samples
+// back match these bit for bit.
+static inline void storeSample(float &out, double v) { out = (float)v; }
+static inline void storeSample(int16_t &out, double v)
+{
+	out = (int16_t)lrint(v < -32767.0 ? -32767.0 : (v > 32767.0 ? 32767.0 : v));
+}
+
+// Frame-interleaved multi-channel ring: the producer writes one frame of
+// numChannels samples per tick and publishes it with a single release
+// store; the consumer reads whole blocks back as contiguous per-channel
+// float arrays. Frame counters are never wrapped. Every frame also carries
+// a stamp from the producer (its sample counter), which stays correct when
+// frames are dropped because the buffer was full.
+class framebuffer {
+	public:
+		framebuffer(void) : numChannels(0), format_(sampleFloat32), mask(0), head_(0), tail_(0), dropped_(0), clipped_(0), highWater_(0) {}
+
+		// Not thread safe: only call while neither side is using the buffer.
+		// The capacity is rounded up to a power of two (capacityFor()). For
+		// int16 every channel starts with a step of scale per count.
+		void resize(int channels, size_t frames, sampleFormat format = sampleFloat32, double scale = 1)
+		{
+			size_t size = capacityFor(frames);
+			numChannels = channels;
+			format_ = format;
+			mask = size - 1;
+			frames32_.assign(format == sampleFloat32 ? size * numChannels : 0, 0);
+			frames16_.assign(format == sampleInt16 ? size * numChannels : 0, 0);
+			stamps_.assign(size, 0);
+			scales_.assign(numChannels, format == sampleInt16 ? scale : 1);
+			inverseScales_.assign(numChannels, format == sampleInt16 ? 1 / scale : 1);
+			head_ = 0;
+			tail_ = 0;
+			dropped_ = 0;
+			clipped_ = 0;
+			highWater_ = 0;
+		}
+		// not thread safe, as resize(); ignored for float32
+		void setScale(int channel, double scale)
+		{
+			if (format_ != sampleInt16)
+				return;
+			scales_[channel] = scale;
+			inverseScales_[channel] = 1 / scale;
+		}
+		int channels(void) const { return numChannels; }
+		size_t capacity(void) const { return mask + 1; }
+		static size_t capacityFor(size_t frames)
+		{
+			size_t size = 1;
+			while (size < frames)
+				size <<= 1;
+			return size;
+		}
+		sampleFormat format(void) const { return format_; }
+		// value of one count of each channel, 1 for float32
+		const double *scales(void) const { return scales_.data(); }
+		const double *inverseScales(void) const { return inverseScales_.data(); }
+
+		// producer: store values[0..numChannels) as the next frame and publish
+		// it, or drop it and return false when the buffer is full; values of
+		// exactly 0 are stored as blanked
+		bool push(const double *values, unsigned long long stamp)
+		{
+			unsigned long long head = head_.load(std::memory_order_relaxed);
+			size_t fill = head - tail_.load(std::memory_order_acquire);
+			if (fill > mask) {
+				dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				return false;
+			}
+			if (fill >= highWater_.load(std::memory_order_relaxed))
+				highWater_.store(fill + 1, std::memory_order_relaxed);
+			size_t offset = (head & mask) * numChannels;
+			if (format_ == sampleInt16) {
+				int16_t *frame = &frames16_[offset];
+				unsigned long long clipped = 0;
+				for (int c = 0; c < numChannels; c++) {
+					if (values[c] == 0) {
+						storeBlanked(frame[c]);
+						continue;
+					}
+					double v = values[c] * inverseScales_[c];
+					clipped += v < -32767.0 || v > 32767.0;
+					storeSample(frame[c], v);
+				}
+				if (clipped)
+					clipped_.store(clipped_.load(std::memory_order_relaxed) + clipped, std::memory_order_relaxed);
+			} else {
+				float *frame = &frames32_[offset];
+				for (int c = 0; c < numChannels; c++)
+					frame[c] = (float)values[c];
+			}
+			stamps_[head & mask] = stamp;
+			head_.store(head + 1, std::memory_order_release);
+			return true;
+		}
+
+		// consumer: number of published frames not yet read
+		size_t available(void) const
+		{
+			return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_relaxed);
+		}
+		// consumer: index of the next frame readBlock() will return
+		unsigned long long readIndex(void) const { return tail_.load(std::memory_order_relaxed); }
+		// consumer: stamp published with a frame that has not been released yet
+		unsigned long long stamp(unsigned long long frame) const { return stamps_[frame & mask]; }
+
+		// consumer: frames that are published but not released may be changed in
+		// place (filtered) before they are read. Returns the data of frame and,
+		// in *run, how many frames follow it contiguously before the storage
+		// wraps. T must be the storage type of format().
+		template<class T>
+		T *frameData(unsigned long long frame, size_t *run)
+		{
+			size_t offset = frame & mask;
+			*run = capacity() - offset;
+			return storage((T*)NULL) + offset * numChannels;
+		}
+
+		// consumer: transpose up to n frames into channelData[c][0..n) and release them
+		size_t readBlock(float *const *channelData, size_t n)
+		{
+			n = readChannels(channelData, 0, numChannels, readIndex(), n);
+			release(n);
+			return n;
+		}
+
+		// consumer side, split so several threads can transpose disjoint channel
+		// ranges of the same frames: copy frames [start, start + n) of channels
+		// [first, last) into channelData[c][0..n), counts scaled back to
+		// values, without releasing them
+		size_t readChannels(float *const *channelData, int first, int last, unsigned long long start, size_t n) const
+		{
+			size_t avail = head_.load(std::memory_order_acquire) - start;
+			if (n > avail)
+				n = avail;
+			if (format_ == sampleInt16)
+				transpose(frames16_.data(), channelData, first, last, start, n);
+			else
+				transpose(frames32_.data(), channelData, first, last, start, n);
+			return n;
+		}
+		// Health counters kept by the producer and readable from any thread:
+		// frames refused by push() because the buffer was full (every channel
+		// loses that sample), int16 samples saturated by push() and the most
+		// frames ever held at once
+		unsigned long long droppedFrames(void) const { return dropped_.load(std::memory_order_relaxed); }
+		unsigned long long clippedSamples(void) const { return clipped_.load(std::memory_order_relaxed); }
+		size_t highWater(void) const { return highWater_.load(std::memory_order_relaxed); }
+
+		// consumer: hand the oldest n frames back to the producer
+		void release(size_t n)
+		{
+			tail_.store(tail_.load(std::memory_order_relaxed) + n, std::memory_order_release);
+		}
+
+	private:
+		int numChannels;
+		sampleFormat format_;
+		size_t mask;
+		std::vector<float> frames32_; // only the one of format_ is allocated
+		std::vector<int16_t> frames16_;
+		std::vector<unsigned long long> stamps_;
+		std::vector<double> scales_;
+		std::vector<double> inverseScales_;
+		std::atomic<unsigned long long> head_, tail_;
+		std::atomic<unsigned long long> dropped_; // written by the producer only
+		std::atomic<unsigned long long> clipped_; // written by the producer only
+		std::atomic<size_t> highWater_; // written by the producer only
+
+		float *storage(float *) { return frames32_.data(); }
+		int16_t *storage(int16_t *) { return frames16_.data(); }
+		float decode(float v, int) const { return v; }
+		float decode(int16_t v, int c) const { return isBlanked(v) ? 0.0f : (float)(v * scales_[c]); }
+
+		template<class T>
+		void transpose(const T *frames, float *const *channelData, int first, int last, unsigned long long start, size_t n) const
+		{
+			size_t done = 0;
+			while (done < n) {
+				// contiguous run of frames up to the end of the storage
+				size_t offset = (start + done) & mask;
+				size_t run = n - done;
+				if (run > capacity() - offset)
+					run = capacity() - offset;
+				const T *frame = frames + offset * numChannels;
+				size_t j = 0;
+				// tiles of 16 frames so each channel gets a full cache line per pass
+				for (; j + 16 <= run; j += 16) {
+					const T *tile = frame + j * numChannels;
+					for (int c = first; c < last; c++) {
+						float *out = channelData[c] + done + j;
+						for (int k = 0; k < 16; k++)
+							out[k] = decode(tile[k * numChannels + c], c);
+					}
+				}
+				for (; j < run; j++) {
+					for (int c = first; c < last; c++)
+						channelData[c][done + j] = decode(frame[j * numChannels + c], c);
+				}
+				done += run;
+			}
+		}
+};
+
+#endif
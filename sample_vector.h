@@ -0,0 +1,154 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Loads and stores of framebuffer samples as double vectors, for the
+* kernels that filter or re-reference the frames in place. Every store
+* rounds exactly as storeSample() does, so the vector kernels give the same
+* samples as the scalar ones. The blanked masks and masked stores follow
+* isBlanked() and storeBlanked().
+*/
+
+#ifndef SAMPLE_VECTOR_H
+#define SAMPLE_VECTOR_H
+
+#include <cstring>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SAMPLE_VECTOR_X86
+#include <immintrin.h>
+
+// two samples
+__attribute__((target("sse2")))
+static inline __m128d loadSSE2(const float *p)
+{
+	return _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i*)p)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128d loadSSE2(const int16_t *p)
+{
+	int32_t bits;
+	memcpy(&bits, p, sizeof(bits));
+	__m128i v = _mm_cvtsi32_si128(bits);
+	return _mm_cvtepi32_pd(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16)); // sign extend
+}
+
+__attribute__((target("sse2")))
+static inline void storeSSE2(float *p, __m128d v)
+{
+	_mm_storel_epi64((__m128i*)p, _mm_castps_si128(_mm_cvtpd_ps(v)));
+}
+
+// saturated, then rounded to nearest even like lrint()
+__attribute__((target("sse2")))
+static inline void storeSSE2(int16_t *p, __m128d v)
+{
+	v = _mm_min_pd(_mm_max_pd(v, _mm_set1_pd(-32767.0)), _mm_set1_pd(32767.0));
+	__m128i counts = _mm_cvtpd_epi32(v);
+	int32_t bits = _mm_cvtsi128_si32(_mm_packs_epi32(counts, counts));
+	memcpy(p, &bits, sizeof(bits));
+}
+
+// all bits set in the lanes of x, loaded from p, that hold blanked samples
+__attribute__((target("sse2")))
+static inline __m128d blankedSSE2(const float *, __m128d x)
+{
+	return _mm_cmpeq_pd(x, _mm_setzero_pd());
+}
+
+__attribute__((target("sse2")))
+static inline __m128d blankedSSE2(const int16_t *, __m128d x)
+{
+	return _mm_cmpeq_pd(x, _mm_set1_pd(-32768.0));
+}
+
+// v, with the lanes set in blanked stored as blanked samples
+__attribute__((target("sse2")))
+static inline void storeSSE2(float *p, __m128d v, __m128d blanked)
+{
+	storeSSE2(p, _mm_andnot_pd(blanked, v));
+}
+
+__attribute__((target("sse2")))
+static inline void storeSSE2(int16_t *p, __m128d v, __m128d blanked)
+{
+	v = _mm_min_pd(_mm_max_pd(v, _mm_set1_pd(-32767.0)), _mm_set1_pd(32767.0));
+	v = _mm_or_pd(_mm_andnot_pd(blanked, v), _mm_and_pd(blanked, _mm_set1_pd(-32768.0)));
+	__m128i counts = _mm_cvtpd_epi32(v);
+	int32_t bits = _mm_cvtsi128_si32(_mm_packs_epi32(counts, counts));
+	memcpy(p, &bits, sizeof(bits));
+}
+
+// four samples
+__attribute__((target("avx2")))
+static inline __m256d loadAVX2(const float *p)
+{
+	return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d loadAVX2(const int16_t *p)
+{
+	return _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i*)p)));
+}
+
+__attribute__((target("avx2")))
+static inline void storeAVX2(float *p, __m256d v)
+{
+	_mm_storeu_ps(p, _mm256_cvtpd_ps(v));
+}
+
+__attribute__((target("avx2")))
+static inline void storeAVX2(int16_t *p, __m256d v)
+{
+	v = _mm256_min_pd(_mm256_max_pd(v, _mm256_set1_pd(-32767.0)), _mm256_set1_pd(32767.0));
+	__m128i counts = _mm256_cvtpd_epi32(v);
+	_mm_storel_epi64((__m128i*)p, _mm_packs_epi32(counts, counts));
+}
+
+__attribute__((target("avx2")))
+static inline __m256d blankedAVX2(const float *, __m256d x)
+{
+	return _mm256_cmp_pd(x, _mm256_setzero_pd(), _CMP_EQ_OQ);
+}
+
+__attribute__((target("avx2")))
+static inline __m256d blankedAVX2(const int16_t *, __m256d x)
+{
+	return _mm256_cmp_pd(x, _mm256_set1_pd(-32768.0), _CMP_EQ_OQ);
+}
+
+__attribute__((target("avx2")))
+static inline void storeAVX2(float *p, __m256d v, __m256d blanked)
+{
+	storeAVX2(p, _mm256_andnot_pd(blanked, v));
+}
+
+__attribute__((target("avx2")))
+static inline void storeAVX2(int16_t *p, __m256d v, __m256d blanked)
+{
+	v = _mm256_min_pd(_mm256_max_pd(v, _mm256_set1_pd(-32767.0)), _mm256_set1_pd(32767.0));
+	v = _mm256_or_pd(_mm256_andnot_pd(blanked, v), _mm256_and_pd(blanked, _mm256_set1_pd(-32768.0)));
+	__m128i counts = _mm256_cvtpd_epi32(v);
+	_mm_storel_epi64((__m128i*)p, _mm_packs_epi32(counts, counts));
+}
+#endif
+
+#endif
@@ -0,0 +1,465 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Spike detection/validation
+*/
+
+#include "spike_detector.h"
+#include <algorithm>
+#include <cmath>
+
+detectorParameters::detectorParameters(double fs)
+{
+	samplingFrequency = fs;
+	numPre = (int)lround(0.75e-3 * samplingFrequency); // 15 samples at 20 kHz
+	numPost = numPre;
+	maxSpikeWidth = floor(10e-3 * samplingFrequency);
+	minSpikeWidth = floor(0.1e-3 * samplingFrequency);
+	maxSpikeAmp = 1000e-6;
+	minSpikeSlope = 5e-6;
+	deadTime = (int)(1e-3 * samplingFrequency);
+	threshPolarity = 0;
+	noiseEstimator = 0;
+	noiseTimeConstant = 10;
+	thresholdMultiplier = 5;
+	detectionMethod = detectThreshold;
+}
+
+// snippets must fit in a detectedSpike, trim the post-peak part first; the
+// validator needs a sample either side of the maximum for the tail-end and
+// slope tests
+static void limitWaveLength(detectorParameters &p)
+{
+	p.numPre = std::max(1, p.numPre);
+	p.numPost = std::max(1, p.numPost);
+	if (p.numPre + 1 + p.numPost > maxWaveLength)
+		p.numPost = std::max(1, maxWaveLength - 1 - p.numPre);
+	if (p.numPre + 1 + p.numPost > maxWaveLength)
+		p.numPre = maxWaveLength - 2;
+}
+
+SpikeDetector::SpikeDetector(int channels, const detectorParameters &params) : p(params), maxBlockLength(0),
+	templateCenter(0), customTemplate(false)
+{
+	limitWaveLength(p);
+	crossingScan = getCrossingScan();
+	kernels.energy = getEnergyKernel();
+	kernels.matchedFilter = getMatchedFilter();
+	validator = getSpikeValidator(p.numPre, p.numPost);
+	reset(channels);
+	selectMethod(p.detectionMethod, p.samplingFrequency);
+}
+
+void SpikeDetector::setParameters(const detectorParameters &params)
+{
+	int previousMethod = p.detectionMethod;
+	double previousFrequency = p.samplingFrequency;
+	p = params;
+	limitWaveLength(p);
+	validator = getSpikeValidator(p.numPre, p.numPost);
+	selectMethod(previousMethod, previousFrequency);
+	// samples from the end of a block that could not be searched because of edge effects
+	carryOverLength = p.numPre + (int)p.maxSpikeWidth + p.numPost;
+	// the noise estimates carry over, only the threshold derived from them changes
+	for (int c = 0; c < numChannels; c++) {
+		if (channels[c].numNoiseBlocks > 0)
+			channels[c].threshold = p.thresholdMultiplier * noiseLevel(channels[c]);
+	}
+}
+
+void SpikeDetector::setTemplate(const std::vector<double> &taps, int center)
+{
+	spikeTemplate.assign(taps.begin(), taps.end());
+	templateCenter = std::max(0, std::min((int)taps.size() - 1, center));
+	// negative peak, as the default template (see matchedFilterPolicy)
+	if (!spikeTemplate.empty() && spikeTemplate[templateCenter] > 0) {
+		for (size_t k = 0; k < spikeTemplate.size(); k++)
+			spikeTemplate[k] = -spikeTemplate[k];
+	}
+	customTemplate = true;
+	if (p.detectionMethod == detectMatchedFilter)
+		clearNoise();
+}
+
+// Picks the scan for the method. Estimates of another detection signal
+// (a new method, or a new default template at another rate) are of no use.
+void SpikeDetector::selectMethod(int previousMethod, double previousFrequency)
+{
+	switch (p.detectionMethod) {
+		case detectEnergy:
+			scanMethod = &SpikeDetector::scanWindowWith<energyPolicy>;
+			break;
+		case detectMatchedFilter:
+			scanMethod = &SpikeDetector::scanWindowWith<matchedFilterPolicy>;
+			break;
+		default:
+			p.detectionMethod = detectThreshold;
+			scanMethod = &SpikeDetector::scanWindowWith<thresholdPolicy>;
+			break;
+	}
+	bool newRate = smoothing.empty() || p.samplingFrequency != previousFrequency;
+	if (newRate) {
+		kernels.resolution = energyResolution(p.samplingFrequency);
+		std::vector<double> taps = energySmoothing(kernels.resolution);
+		smoothing.assign(taps.begin(), taps.end());
+	}
+	bool newTemplate = !customTemplate && newRate;
+	if (newTemplate) {
+		std::vector<double> taps = defaultSpikeTemplate(p.samplingFrequency, &templateCenter);
+		spikeTemplate.assign(taps.begin(), taps.end());
+	}
+	if (p.detectionMethod != previousMethod || (newRate && p.detectionMethod == detectEnergy) ||
+			(newTemplate && p.detectionMethod == detectMatchedFilter))
+		clearNoise();
+}
+
+void SpikeDetector::clearNoise(void)
+{
+	for (int c = 0; c < numChannels; c++) {
+		channels[c].meanSquare = 0;
+		channels[c].medianAbs = 0;
+		channels[c].numNoiseBlocks = 0;
+		channels[c].threshold = 0;
+	}
+}
+
+void SpikeDetector::reset(int numCh, int maxBlock)
+{
+	numChannels = numCh;
+	carryOverLength = p.numPre + (int)p.maxSpikeWidth + p.numPost;
+	if (maxBlock > 0)
+		maxBlockLength = maxBlock;
+
+	channels.resize(numChannels);
+	for (int c = 0; c < numChannels; c++) {
+		channelState &s = channels[c];
+		s.samples.resize(carryOverLength + maxBlockLength);
+		s.begin = 0;
+		s.end = 0;
+		s.regularDetect = false;
+		s.meanSquare = 0;
+		s.medianAbs = 0;
+		s.numNoiseBlocks = 0;
+		s.threshold = 0;
+		s.tracker = spikeTracker();
+	}
+}
+
+float *SpikeDetector::appendBuffer(int channel, int length)
+{
+	channelState &s = channels[channel];
+
+	// data from last buffer that we could not detect on because of edge effects
+	int carried = 0;
+	if (s.regularDetect)
+		carried = s.end - s.begin < carryOverLength ? s.end - s.begin : carryOverLength;
+	s.begin = s.end - carried;
+
+	// slide the carry-over back to the front once the new block no longer fits behind it
+	if (s.end + length > (int)s.samples.size()) {
+		std::copy(s.samples.begin() + s.begin, s.samples.begin() + s.end, s.samples.begin());
+		s.begin = 0;
+		s.end = carried;
+		if (s.end + length > (int)s.samples.size())
+			s.samples.resize(s.end + length); // block longer than the window was sized for
+	}
+	return s.samples.data() + s.end;
+}
+
+int SpikeDetector::processWindow(int channel, int length, std::vector<detectedSpike> &spikes)
+{
+	return processWindow(channel, length, spikes, defaultWorkspace);
+}
+
+int SpikeDetector::processWindow(int channel, int length, std::vector<detectedSpike> &spikes, detectionWorkspace &ws)
+{
+	spikeTracker &t = channels[channel].tracker;
+	if (!scanWindow(channel, length, ws)) {
+		t.initialSamplesToSkip = 0;
+		return 0;
+	}
+	return trackSpikes(p, validator, t, ws, channel, length, spikes);
+}
+
+template<class Policy>
+bool SpikeDetector::scanWindowWith(int channel, int length, detectionWorkspace &ws)
+{
+	scanStats stats;
+	channelState &s = channels[channel];
+
+	// the current data buffer is the carry-over followed by the new samples
+	// (first fill: no carry-over, so the first numPre samples are never searched)
+	s.end += length;
+	s.regularDetect = true;
+	ws.spikeDetectionBuffer = s.samples.data() + s.begin;
+	ws.bufferLength = s.end - s.begin;
+
+	// One vectorized pass finds every sample outside the detection band and
+	// gathers the noise statistics of the buffer. Don't need to run spike
+	// detection if buffer is empty (protocol hasn't started) or all 0 (not acquiring data).
+	if (ws.bufferLength == 0)
+		return false;
+	if ((int)ws.candidates.size() < ws.bufferLength)
+		ws.candidates.resize(ws.bufferLength);
+	if ((int)ws.signal.size() < 2 * ws.bufferLength)
+		ws.signal.resize(2 * ws.bufferLength);
+	detectionKernels k = kernels;
+	k.taps = spikeTemplate.data();
+	k.numTaps = spikeTemplate.size();
+	k.center = templateCenter;
+	k.smoothing = smoothing.data();
+	k.numSmoothing = smoothing.size();
+	ws.detectionSignal = Policy::signal(k, ws.spikeDetectionBuffer, ws.bufferLength, ws.signal.data());
+	const int polarity = Policy::polarity(p.threshPolarity);
+	// the threshold and the probe are converted to float once per window, not per sample
+	ws.currentThreshold = (float)s.threshold;
+	ws.numCandidates = crossingScan(ws.detectionSignal, ws.bufferLength, ws.currentThreshold, polarity,
+			(float)s.medianAbs, ws.candidates.data(), &stats);
+	if (stats.numNonZero == 0)
+		return false;
+
+	// this buffer's statistics set the threshold for the next one, except for
+	// the very first buffer, which is rescanned once an estimate exists
+	bool firstEstimate = s.numNoiseBlocks == 0;
+	updateThreshold(s, stats);
+	if (firstEstimate) {
+		ws.currentThreshold = (float)s.threshold;
+		ws.numCandidates = crossingScan(ws.detectionSignal, ws.bufferLength, ws.currentThreshold, polarity,
+				(float)s.medianAbs, ws.candidates.data(), &stats);
+	}
+	return true;
+}
+
+int SpikeDetector::trackSpikes(const detectorParameters &p, spikeValidatorFn validator, spikeTracker &t,
+		detectionWorkspace &ws, int channel, int length, std::vector<detectedSpike> &spikes)
+{
+	int indiciesToSearchForCross, indiciesToSearchForReturn;
+	int i, k;
+	const int numCandidates = ws.numCandidates;
+	int numSpikes = 0;
+
+	// define position in current data buffer
+	i = p.numPre + t.initialSamplesToSkip;
+	t.initialSamplesToSkip = 0;
+
+	indiciesToSearchForCross = ws.bufferLength - p.maxSpikeWidth - p.numPost;
+	indiciesToSearchForReturn = ws.bufferLength - p.numPost;
+
+	// for fixed and adaptive, the current threshold is not a function of i
+	k = 0;
+	while (i < indiciesToSearchForCross)
+	{
+		// jump to the next sample outside the threshold, everything before it is within threshold
+		while (k < numCandidates && ws.candidates[k] < i)
+			k++;
+		if (k == numCandidates || ws.candidates[k] >= indiciesToSearchForCross)
+		{
+			t.waitToComeDown = false;
+			break; // no more crossings in the searchable part of this buffer
+		}
+		if (ws.candidates[k] > i)
+		{
+			t.waitToComeDown = false;
+			i = ws.candidates[k];
+		}
+		if (t.waitToComeDown)
+		{
+			i++;
+			continue; // still coming down from a spike that was too long
+		}
+
+		// entering a spike
+		t.inASpike = true;
+		t.enterSpikeIndex = i;
+		ws.posCross = findSpikePolarityBySlopeOfCrossing(t, ws);
+
+		// exiting a spike, maxspikewidth (to find peak), -numPre and +numPost (to find waveform)
+		for (i++; i < indiciesToSearchForReturn; i++)
+		{
+			if ((ws.posCross && ws.detectionSignal[i] < ws.currentThreshold) ||
+					(!ws.posCross && ws.detectionSignal[i] > -ws.currentThreshold))
+				break;
+		}
+		t.inASpike = false;
+		if (i == indiciesToSearchForReturn)
+		{
+			// spike is taking too long to come back through the threshold
+			t.waitToComeDown = true;
+			break;
+		}
+
+		t.exitSpikeIndex = i;
+		// calculate spike width
+		ws.spikeWidth = t.exitSpikeIndex - t.enterSpikeIndex;
+		// find the index and value of the spike maximum, in the voltage whatever the method
+		ws.spikeMaxIndex = findMaxDeflection(ws, t.enterSpikeIndex, ws.spikeWidth);
+		ws.spikeMax = ws.spikeDetectionBuffer[ws.spikeMaxIndex];
+		// check if the spike is any good, straight from the buffer
+		const float *wave = ws.spikeDetectionBuffer + ws.spikeMaxIndex - p.numPre;
+		if (!validator(p, wave, ws.spikeWidth, ws.spikeMax)) {
+			i = t.exitSpikeIndex + 1;
+			continue; // if the spike is no good
+		}
+		// record the waveform
+		detectedSpike spike;
+		spike.channel = channel;
+		spike.maxIndex = ws.spikeMaxIndex - (ws.bufferLength - length);
+		spike.threshold = ws.currentThreshold;
+		spike.waveLength = p.numPre + 1 + p.numPost;
+		spike.unit = 0;
+		std::copy(wave, wave + spike.waveLength, spike.wave);
+		spikes.push_back(spike); // no allocation once spikes has grown to its working size
+		numSpikes++;
+
+		// Carry-over dead time if a spike was detected at the end of the buffer
+		t.initialSamplesToSkip = p.deadTime + p.numPre + (t.exitSpikeIndex - indiciesToSearchForCross);
+		if (t.initialSamplesToSkip < 0)
+			t.initialSamplesToSkip = 0;
+
+		i = t.exitSpikeIndex + p.deadTime + 1;
+	}
+
+	// the last carryOverLength samples stay in the window for the next block
+	return numSpikes;
+}
+
+// Folds one buffer's statistics into the running noise estimates of a channel.
+// The mean square is exponentially weighted with time constant
+// noiseTimeConstant. The median of |v| is tracked by stochastic approximation:
+// the fraction of samples above the current estimate (counted during the
+// scan) nudges it up or down, and the estimate settles where half the samples
+// are above it. The first buffers are weighted evenly so the estimates
+// converge quickly after a reset.
+void SpikeDetector::updateThreshold(channelState &s, const scanStats &stats)
+{
+	double meanSquare = stats.sumSquares / stats.numNonZero; // don't include blanked samples
+	double weight = 1 - exp(-stats.numNonZero / (p.noiseTimeConstant * p.samplingFrequency));
+	s.numNoiseBlocks++;
+	if (weight < 1.0 / s.numNoiseBlocks)
+		weight = 1.0 / s.numNoiseBlocks;
+
+	s.meanSquare += weight * (meanSquare - s.meanSquare);
+	if (s.numNoiseBlocks == 1) {
+		s.medianAbs = 0.6745 * sqrt(meanSquare); // gaussian guess to start from
+	} else {
+		// 1 / 0.429 is the Newton step for gaussian noise (slope of the fraction above vs. log level)
+		double fractionAbove = (double)stats.numAbove / stats.numNonZero;
+		s.medianAbs *= exp(weight * (fractionAbove - 0.5) / 0.429);
+	}
+	s.threshold = p.thresholdMultiplier * noiseLevel(s);
+}
+
+// noise standard deviation from the selected estimator
+double SpikeDetector::noiseLevel(const channelState &s) const
+{
+	if (p.noiseEstimator == 1)
+		return sqrt(s.meanSquare);
+	return s.medianAbs / 0.6745;
+}
+
+bool SpikeDetector::findSpikePolarityBySlopeOfCrossing(const spikeTracker &t, const detectionWorkspace &ws)
+{
+	// Is the crossing through the bottom or top threshold?
+	return ws.detectionSignal[t.enterSpikeIndex] > 0;
+}
+
+int SpikeDetector::findMaxDeflection(const detectionWorkspace &ws, int startInd, int widthToSearch)
+{
+	int maxIndex = startInd;
+	// Find absolute maximum
+	for (int i = startInd+1; i < startInd + widthToSearch; i++) {
+		if (fabs(ws.spikeDetectionBuffer[i]) > fabs(ws.spikeDetectionBuffer[maxIndex])) {
+			maxIndex = i;
+		}
+	}
+	return maxIndex;
+}
+
+static const double VOLTAGE_EPSILON = 0.1e-6; // 0.1 uV
+
+// Check spike based on spike detection settings. The amplitude and tail-end
+// tests are O(1); the slope estimate and the blanked-run search share one pass
+// over |wave|. Results match the original step-by-step checks exactly (same
+// comparisons, slope terms summed in the same order). Pre and Post are the
+// snippet lengths when they are known at compile time, which turns the pass
+// into straight-line code, or 0 to take them from the parameters.
+template<int Pre, int Post>
+static bool validateSpikeImpl(const detectorParameters &p, const float *wave, int spikeWidth, double spikeMax)
+{
+	const int numPre = Pre > 0 ? Pre : p.numPre;
+	const int numPost = Post > 0 ? Post : p.numPost;
+
+	// Check spike width
+	if (!(p.maxSpikeWidth >= spikeWidth && p.minSpikeWidth <= spikeWidth))
+		return false;
+
+	// Check spike amplitude
+	// TO-DO: signed, so negative-going deflections of any size pass
+	if (!(spikeMax < p.maxSpikeAmp)) // this has already been calculated
+		return false;
+
+	// Check to make sure this is not the tail end of another spike
+	if (!(fabs(wave[0]) < fabs(wave[numPre])))
+		return false;
+
+	// The slope estimate averages |d|wave|| over diffWidth samples either side
+	// of the maximum (slope in V/sample, compared against minSpikeSlope as is).
+	// Capped at numPost so a trimmed snippet is never read past its end.
+	int diffWidth = spikeWidth + 2 <= numPre ? spikeWidth + 2 : numPre;
+	if (diffWidth > numPost)
+		diffWidth = numPost;
+	int slopeBegin = numPre + 1 - diffWidth;
+	int slopeEnd = numPre + diffWidth; // last difference is |wave[slopeEnd]| - |wave[slopeEnd - 1]|
+
+	// Ensure that part of the spike is not blanked (more than 5 samples in a row under 0.1 uV)
+	const int length = numPre + 1 + numPost;
+	int numBlanked = 0;
+	double spikeSlopeEstimate = 0;
+	double previous = fabs(wave[0]);
+	if (previous < VOLTAGE_EPSILON)
+		numBlanked = 1;
+#pragma GCC unroll 64
+	for (int i = 1; i < length; i++) {
+		double a = fabs(wave[i]);
+		if (i > slopeBegin && i <= slopeEnd)
+			spikeSlopeEstimate += fabs(a - previous);
+		numBlanked = a < VOLTAGE_EPSILON ? numBlanked + 1 : 0;
+		if (numBlanked > 5)
+			return false;
+		previous = a;
+	}
+	return spikeSlopeEstimate / (double)(2 * diffWidth) > p.minSpikeSlope;
+}
+
+bool validateSpike(const detectorParameters &p, const float *wave, int spikeWidth, double spikeMax)
+{
+	return validateSpikeImpl<0, 0>(p, wave, spikeWidth, spikeMax);
+}
+
+// the default 0.75 ms snippets at 10, 20 and 40 kHz
+spikeValidatorFn getSpikeValidator(int numPre, int numPost)
+{
+	if (numPre == 8 && numPost == 8)
+		return validateSpikeImpl<8, 8>;
+	if (numPre == 15 && numPost == 15)
+		return validateSpikeImpl<15, 15>;
+	if (numPre == 30 && numPost == 30)
+		return validateSpikeImpl<30, 30>;
+	return validateSpike;
+}
@@ -0,0 +1,200 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Spike detector used by the MEA plug-in. This has no Qt or RTXI
+* dependencies so it can also be driven by the replay tools.
+*/
+
+#ifndef SPIKE_DETECTOR_H
+#define SPIKE_DETECTOR_H
+
+#include "crossing_scan.h"
+#include "detector_policy.h"
+#include <algorithm>
+#include <vector>
+
+// longest snippet a spike record holds inline (numPre + 1 + numPost samples)
+static const int maxWaveLength = 64;
+
+struct detectorParameters {
+	double samplingFrequency;
+	int numPre; // samples kept before the spike maximum (0.75 ms by default)
+	int numPost; // samples kept after the spike maximum (numPre + 1 + numPost is capped at maxWaveLength)
+	double maxSpikeWidth; // (samples)
+	double minSpikeWidth; // (samples)
+	double maxSpikeAmp; // (V)
+	double minSpikeSlope; // (V/s)
+	int deadTime; // (samples)
+	int threshPolarity; // 0 = bipolar; 1 = negative only; 2 = positive only
+	int noiseEstimator; // 0 = median absolute deviation; 1 = RMS
+	double noiseTimeConstant; // (s) memory of the running noise estimates
+	double thresholdMultiplier; // detection threshold in units of the noise estimate
+	int detectionMethod; // detectThreshold, detectEnergy or detectMatchedFilter (detector_policy.h)
+
+	detectorParameters(double fs = 20000);
+};
+
+// Plain fixed-size record so spikes can be copied through queues and files
+// without touching the heap. wave[0..waveLength) is the snippet around the
+// maximum (sample numPre), stored as float to keep records compact.
+struct detectedSpike {
+	int channel;
+	int maxIndex; // index of the spike maximum relative to the start of the new block (negative inside the carry-over)
+	double threshold; // of the detection signal (V, or V^2 for the energy operator)
+	int waveLength;
+	int unit; // set by the spike sorter, 0 when unsorted
+	float wave[maxWaveLength];
+};
+
+// Scratch space for searching one channel's window. Different channels can
+// be processed concurrently as long as each thread has its own workspace.
+struct detectionWorkspace {
+	std::vector<int> candidates; // samples outside the threshold band
+	int numCandidates;
+	const float *spikeDetectionBuffer; // view of the active window
+	const float *detectionSignal; // what the threshold applies to, in line with the window
+	std::vector<float> signal; // holds it unless it is the window itself, plus scratch
+	int bufferLength;
+	float currentThreshold; // the channel's threshold rounded to the sample type once per window
+	bool posCross; // polarity of inital threshold crossing
+	int spikeWidth;
+	int spikeMaxIndex;
+	double spikeMax;
+};
+
+// Where the spike-tracking state machine of one channel stands between
+// windows, for one set of parameters
+struct spikeTracker {
+	int initialSamplesToSkip;
+	bool inASpike; // true when the waveform is over or under the current detection threshold
+	bool waitToComeDown;
+	int enterSpikeIndex;
+	int exitSpikeIndex;
+
+	spikeTracker(void) : initialSamplesToSkip(0), inASpike(false), waitToComeDown(false), enterSpikeIndex(0), exitSpikeIndex(0) {}
+};
+
+// Validates a candidate from its snippet wave[0, numPre + 1 + numPost), with
+// the maximum at wave[numPre]: width, amplitude, tail-end, slope and blanking
+// checks, the per-sample ones fused into a single pass without allocating.
+// The samples are float, the arithmetic on them is still double.
+bool validateSpike(const detectorParameters &p, const float *wave, int spikeWidth, double spikeMax);
+// Same check with the snippet lengths baked in for the common settings, or
+// validateSpike itself for anything else
+typedef bool (*spikeValidatorFn)(const detectorParameters &p, const float *wave, int spikeWidth, double spikeMax);
+spikeValidatorFn getSpikeValidator(int numPre, int numPost);
+
+class SpikeDetector {
+	public:
+		SpikeDetector(int channels = 0, const detectorParameters &params = detectorParameters());
+
+		// resets all per-channel detection and noise state and preallocates
+		// each channel's window for blocks of up to maxBlockLength samples
+		void reset(int channels, int maxBlockLength = 0);
+		void setParameters(const detectorParameters &params);
+		const detectorParameters &getParameters(void) const { return p; }
+		int getNumChannels(void) const { return numChannels; }
+		// samples of each window kept for the next one
+		int getCarryOverLength(void) const { return carryOverLength; }
+		// both of the detection signal, so in volts for the threshold and
+		// matched filter methods and in V^2 for the energy operator
+		double getThreshold(int channel) const { return channels[channel].threshold; }
+		double getNoiseLevel(int channel) const { return noiseLevel(channels[channel]); }
+		bool isTrained(int channel) const { return channels[channel].numNoiseBlocks > 0; } // has a noise estimate
+		// Template of the matched filter method, taps[center] lined up with the
+		// spike maximum; it should have unit energy. A template whose
+		// maximum is positive is negated, so the bands of threshPolarity keep
+		// their meaning for the filter output. Until one is set,
+		// defaultSpikeTemplate() at the sampling rate is used. Changing the
+		// template or the method starts the noise estimates over.
+		void setTemplate(const std::vector<double> &taps, int center);
+
+		// Zero-copy path: appendBuffer() returns room for the next length samples
+		// of a channel directly behind its carry-over, the caller fills it and
+		// processWindow() runs detection over carry-over + new samples. Blocks
+		// must be passed in arrival order; validated spikes are appended to
+		// spikes and their number is returned. A channel only touches its own
+		// state, so channels may be processed on different threads as long as
+		// each thread passes its own workspace.
+		float *appendBuffer(int channel, int length);
+		int processWindow(int channel, int length, std::vector<detectedSpike> &spikes, detectionWorkspace &ws);
+		int processWindow(int channel, int length, std::vector<detectedSpike> &spikes);
+		// The two halves of processWindow(). scanWindow() fills ws with the
+		// window, its detection signal and candidates and updates the noise
+		// estimate; it returns false when there is nothing to search (then the
+		// tracker's initialSamplesToSkip must be cleared). trackSpikes() runs
+		// the state machine of one tracker over them with the threshold in
+		// ws.currentThreshold, so several parameter sets can share one scan.
+		bool scanWindow(int channel, int length, detectionWorkspace &ws) { return (this->*scanMethod)(channel, length, ws); }
+		static int trackSpikes(const detectorParameters &p, spikeValidatorFn validator, spikeTracker &t,
+				detectionWorkspace &ws, int channel, int length, std::vector<detectedSpike> &spikes);
+		// same as above for data that is already in memory, of any type that
+		// converts to float
+		template<class T>
+		int processBlock(int channel, const T *data, int length, std::vector<detectedSpike> &spikes)
+		{
+			std::copy(data, data + length, appendBuffer(channel, length));
+			return processWindow(channel, length, spikes);
+		}
+
+	private:
+		detectorParameters p;
+		int numChannels;
+		int carryOverLength;
+		int maxBlockLength;
+		crossingScanFn crossingScan;
+		detectionKernels kernels; // taps are filled in per window
+		std::vector<float> spikeTemplate;
+		int templateCenter;
+		bool customTemplate;
+		std::vector<float> smoothing; // of the energy operator
+		// scanWindowWith() instantiated for the policy of p.detectionMethod
+		typedef bool (SpikeDetector::*scanWindowFn)(int channel, int length, detectionWorkspace &ws);
+		scanWindowFn scanMethod;
+		spikeValidatorFn validator; // picked for the snippet lengths in setParameters()
+		detectionWorkspace defaultWorkspace; // used by the single-threaded overloads
+
+		// Everything detection keeps between blocks for one channel. The sliding
+		// window is allocated once: the active window is samples[begin, end),
+		// the carry-over from the previous block stays in place and new samples
+		// are appended behind it.
+		struct channelState {
+			std::vector<float> samples;
+			int begin;
+			int end;
+			bool regularDetect;
+			// running noise estimates, O(1) per channel
+			double meanSquare; // exponentially weighted mean of v^2
+			double medianAbs; // streaming estimate of the median of |v|
+			int numNoiseBlocks;
+			double threshold;
+			spikeTracker tracker;
+		};
+		std::vector<channelState> channels;
+
+		template<class Policy> bool scanWindowWith(int channel, int length, detectionWorkspace &ws);
+		void selectMethod(int previousMethod, double previousFrequency);
+		void clearNoise(void);
+		void updateThreshold(channelState &, const scanStats &);
+		double noiseLevel(const channelState &) const;
+		static bool findSpikePolarityBySlopeOfCrossing(const spikeTracker &, const detectionWorkspace &);
+		static int findMaxDeflection(const detectionWorkspace &, int, int);
+};
+
+#endif
@@ -0,0 +1,349 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Spike-event file writer and reader
+*/
+
+#include "spike_file.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(spikeFileHeader) == 64, "records must start 64 bytes into the file");
+static_assert(sizeof(spikeFileRecord) % 8 == 0, "records must stay 8-byte aligned when mapped");
+
+// write() until everything is out or the disk refuses
+static bool writeAll(int fd, const void *data, size_t length)
+{
+	const char *p = static_cast<const char *>(data);
+	while (length > 0) {
+		ssize_t n = write(fd, p, length);
+		if (n < 0)
+			return false;
+		p += n;
+		length -= n;
+	}
+	return true;
+}
+
+spikeFileWriter::spikeFileWriter(void) : fd(-1), indexFd(-1), wakeup(-1), recording(false), quit(false),
+	filling(0), pending(-1), blocking(false), numRecords(0), written(0), dropped(0), failed(false)
+{
+	counts[0] = counts[1] = 0;
+}
+
+spikeFileWriter::~spikeFileWriter(void)
+{
+	close();
+}
+
+bool spikeFileWriter::open(const std::string &path, int numChannels, double samplingFrequency, size_t batchRecords)
+{
+	close();
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	indexFd = ::open((path + ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	spikeFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, spikeFileMagic, sizeof(header.magic));
+	header.version = 2; // 1 had no unit and a 32-bit type, the same bytes on little-endian hosts
+	header.recordSize = sizeof(spikeFileRecord);
+	header.numChannels = numChannels;
+	header.waveCapacity = maxWaveLength;
+	header.samplingFrequency = samplingFrequency;
+	header.indexStride = indexStride;
+	if (fd < 0 || indexFd < 0 || wakeup < 0 || !writeAll(fd, &header, sizeof(header))) {
+		close();
+		return false;
+	}
+
+	// zeroed once, so unused snippet samples are written as zeros
+	for (int b = 0; b < 2; b++) {
+		spikeFileRecord blank;
+		memset(&blank, 0, sizeof(blank));
+		batches[b].assign(batchRecords > 0 ? batchRecords : 1, blank);
+		counts[b] = 0;
+	}
+	filling = 0;
+	pending = -1;
+	notes.clear();
+	numRecords = 0;
+	indexBuffer.clear();
+	written = 0;
+	dropped = 0;
+	failed = false;
+	quit = false;
+	writer = std::thread(&spikeFileWriter::writerLoop, this);
+	recording.store(true, std::memory_order_release);
+	return true;
+}
+
+void spikeFileWriter::close(void)
+{
+	recording.store(false, std::memory_order_release);
+	if (writer.joinable()) {
+		quit.store(true, std::memory_order_release);
+		uint64_t one = 1;
+		if (write(wakeup, &one, sizeof(one)) < 0) { /* already signalled */ }
+		writer.join();
+
+		// the writer is gone, write what it left behind in order
+		int b = pending.load(std::memory_order_acquire);
+		if (b >= 0)
+			writeRecords(batches[b].data(), counts[b]);
+		writeRecords(batches[filling].data(), counts[filling]);
+		counts[0] = counts[1] = 0;
+		pending = -1;
+		std::lock_guard<std::mutex> lock(noteMutex);
+		writeRecords(notes.data(), notes.size());
+		notes.clear();
+	}
+	if (fd >= 0) {
+		fdatasync(fd); // the only sync, everything else stays in the page cache
+		::close(fd);
+	}
+	if (indexFd >= 0)
+		::close(indexFd);
+	if (wakeup >= 0)
+		::close(wakeup);
+	fd = indexFd = wakeup = -1;
+}
+
+bool spikeFileWriter::append(unsigned long long sampleIndex, const detectedSpike &spike)
+{
+	if (!recording.load(std::memory_order_relaxed))
+		return false;
+	if (counts[filling] == batches[filling].size()) {
+		flush();
+		while (blocking && counts[filling] == batches[filling].size()) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			flush();
+		}
+		if (counts[filling] == batches[filling].size()) {
+			dropped.fetch_add(1, std::memory_order_relaxed); // the disk is not keeping up
+			return false;
+		}
+	}
+	spikeFileRecord &r = batches[filling][counts[filling]++];
+	r.sampleIndex = sampleIndex;
+	r.type = SPIKE_RECORD;
+	r.unit = spike.unit;
+	r.channel = spike.channel;
+	r.threshold = spike.threshold;
+	int previous = r.length;
+	r.length = spike.waveLength;
+	std::copy(spike.wave, spike.wave + spike.waveLength, r.wave);
+	if (previous > r.length)
+		std::fill(r.wave + r.length, r.wave + previous, 0.f); // left over from an earlier lap
+	return true;
+}
+
+void spikeFileWriter::flush(void)
+{
+	if (counts[filling] == 0 || pending.load(std::memory_order_acquire) >= 0)
+		return;
+	int b = filling;
+	filling ^= 1;
+	counts[filling] = 0;
+	pending.store(b, std::memory_order_release);
+	uint64_t one = 1;
+	if (write(wakeup, &one, sizeof(one)) < 0) { /* counter saturated, writer is already pending */ }
+}
+
+void spikeFileWriter::note(unsigned long long sampleIndex, const std::string &text)
+{
+	if (!recording.load(std::memory_order_acquire))
+		return;
+	spikeFileRecord r;
+	memset(&r, 0, sizeof(r));
+	r.sampleIndex = sampleIndex;
+	r.type = NOTE_RECORD;
+	r.channel = -1;
+	r.length = std::min(text.size(), sizeof(r.wave));
+	memcpy(r.wave, text.data(), r.length);
+	{
+		std::lock_guard<std::mutex> lock(noteMutex);
+		notes.push_back(r);
+	}
+	uint64_t one = 1;
+	if (write(wakeup, &one, sizeof(one)) < 0) { /* already signalled */ }
+}
+
+void spikeFileWriter::writerLoop(void)
+{
+	struct pollfd event = { wakeup, POLLIN, 0 };
+	std::vector<spikeFileRecord> taken;
+	for (;;) {
+		if (poll(&event, 1, -1) < 0)
+			continue; // interrupted
+		uint64_t signalled;
+		if (read(wakeup, &signalled, sizeof(signalled)) < 0) { /* spurious wakeup */ }
+
+		int b = pending.load(std::memory_order_acquire);
+		if (b >= 0) {
+			writeRecords(batches[b].data(), counts[b]);
+			pending.store(-1, std::memory_order_release);
+		}
+		{
+			std::lock_guard<std::mutex> lock(noteMutex);
+			taken.swap(notes);
+		}
+		writeRecords(taken.data(), taken.size());
+		taken.clear();
+		if (quit.load(std::memory_order_acquire))
+			return;
+	}
+}
+
+// one write() per batch for the records, index entries for every completed chunk
+void spikeFileWriter::writeRecords(const spikeFileRecord *records, size_t n)
+{
+	if (n == 0 || fd < 0)
+		return;
+	if (!writeAll(fd, records, n * sizeof(spikeFileRecord))) {
+		dropped.fetch_add(n, std::memory_order_relaxed);
+		// cut a partial record off so the rest of the file stays aligned; if
+		// that fails too, nothing more can be appended safely
+		off_t end = sizeof(spikeFileHeader) + numRecords * sizeof(spikeFileRecord);
+		if (ftruncate(fd, end) < 0 || lseek(fd, end, SEEK_SET) != end) {
+			failed.store(true, std::memory_order_relaxed);
+			recording.store(false, std::memory_order_release);
+			::close(fd);
+			fd = -1;
+		}
+		return;
+	}
+	for (size_t k = 0; k < n; k++) {
+		uint64_t sample = records[k].sampleIndex;
+		if (numRecords % indexStride == 0) {
+			chunk.firstRecord = numRecords;
+			chunk.minSample = chunk.maxSample = sample;
+		}
+		chunk.minSample = std::min<uint64_t>(chunk.minSample, sample);
+		chunk.maxSample = std::max<uint64_t>(chunk.maxSample, sample);
+		if (++numRecords % indexStride == 0)
+			indexBuffer.push_back(chunk);
+	}
+	if (!indexBuffer.empty()) {
+		writeAll(indexFd, indexBuffer.data(), indexBuffer.size() * sizeof(spikeIndexEntry));
+		indexBuffer.clear();
+	}
+	written.fetch_add(n, std::memory_order_relaxed);
+}
+
+spikeFileReader::spikeFileReader(void) : map(NULL), mapLength(0), head(NULL), records(NULL), numRecords(0)
+{
+}
+
+spikeFileReader::~spikeFileReader(void)
+{
+	close();
+}
+
+bool spikeFileReader::open(const std::string &path)
+{
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(spikeFileHeader)) {
+		::close(fd);
+		return false;
+	}
+	mapLength = st.st_size;
+	map = mmap(NULL, mapLength, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		return false;
+	}
+	head = static_cast<const spikeFileHeader *>(map);
+	if (memcmp(head->magic, spikeFileMagic, sizeof(head->magic)) != 0 || head->recordSize != sizeof(spikeFileRecord) ||
+			head->waveCapacity != (uint32_t)maxWaveLength || head->indexStride == 0) {
+		close();
+		return false;
+	}
+	records = reinterpret_cast<const spikeFileRecord *>(static_cast<const char *>(map) + sizeof(spikeFileHeader));
+	numRecords = (mapLength - sizeof(spikeFileHeader)) / sizeof(spikeFileRecord);
+
+	// complete chunks from the sidecar, as long as it agrees with the records
+	size_t stride = head->indexStride;
+	int indexFd = ::open((path + ".idx").c_str(), O_RDONLY | O_CLOEXEC);
+	if (indexFd >= 0) {
+		spikeIndexEntry entry;
+		while (read(indexFd, &entry, sizeof(entry)) == sizeof(entry) && entry.firstRecord == index.size() * stride &&
+				entry.firstRecord + stride <= numRecords)
+			index.push_back(entry);
+		::close(indexFd);
+	}
+	// anything else (the last, partial chunk at least) comes from the records
+	for (size_t first = index.size() * stride; first < numRecords; first += stride) {
+		spikeIndexEntry entry = { first, records[first].sampleIndex, records[first].sampleIndex };
+		for (size_t i = first; i < std::min(first + stride, numRecords); i++) {
+			entry.minSample = std::min<uint64_t>(entry.minSample, records[i].sampleIndex);
+			entry.maxSample = std::max<uint64_t>(entry.maxSample, records[i].sampleIndex);
+		}
+		index.push_back(entry);
+	}
+
+	runningMax.resize(index.size());
+	remainingMin.resize(index.size());
+	for (size_t k = 0; k < index.size(); k++)
+		runningMax[k] = k == 0 ? index[k].maxSample : std::max(runningMax[k - 1], index[k].maxSample);
+	for (size_t k = index.size(); k-- > 0; )
+		remainingMin[k] = k + 1 == index.size() ? index[k].minSample : std::min(remainingMin[k + 1], index[k].minSample);
+	return true;
+}
+
+void spikeFileReader::close(void)
+{
+	if (map)
+		munmap(map, mapLength);
+	map = NULL;
+	mapLength = 0;
+	head = NULL;
+	records = NULL;
+	numRecords = 0;
+	index.clear();
+	runningMax.clear();
+	remainingMin.clear();
+}
+
+// runningMax and remainingMin are both non-decreasing, so the chunks that
+// can hold [t0, t1) are found with two binary searches
+void spikeFileReader::findRange(uint64_t t0, uint64_t t1, size_t &first, size_t &last) const
+{
+	first = last = 0;
+	if (index.empty() || t0 >= t1)
+		return;
+	size_t firstChunk = std::lower_bound(runningMax.begin(), runningMax.end(), t0) - runningMax.begin();
+	size_t endChunk = std::lower_bound(remainingMin.begin(), remainingMin.end(), t1) - remainingMin.begin();
+	size_t stride = head->indexStride;
+	first = std::min(firstChunk * stride, numRecords);
+	last = std::min(endChunk * stride, numRecords);
+	if (first > last)
+		first = last;
+}
@@ -0,0 +1,168 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Append-only binary spike-event files. The file is a 64-byte header
+* followed by fixed-size records, so it can be memory-mapped and used as
+* an array. Spikes and time-stamped notes share the record layout. A
+* sidecar "<file>.idx" holds the sample range of every indexStride records
+* for time queries; it can be rebuilt from the records if it is missing.
+*/
+
+#ifndef SPIKE_FILE_H
+#define SPIKE_FILE_H
+
+#include "spike_detector.h"
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char spikeFileMagic[8] = { 'M', 'E', 'A', 'S', 'P', 'K', 0, 1 };
+
+struct spikeFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize; // sizeof(spikeFileRecord)
+	uint32_t numChannels;
+	uint32_t waveCapacity; // floats per record, maxWaveLength when written
+	double samplingFrequency; // (Hz) sampleIndex / samplingFrequency is the time in seconds
+	uint32_t indexStride; // records per index entry
+	uint8_t reserved[28];
+};
+
+enum spikeRecordType { SPIKE_RECORD = 0, NOTE_RECORD = 1 };
+
+struct spikeFileRecord {
+	uint64_t sampleIndex; // spike maximum, or when the note was taken
+	int16_t type; // spikeRecordType
+	int16_t unit; // sorted unit, 0 when unsorted (and in version 1 files)
+	int32_t channel; // -1 for notes
+	float threshold; // (V)
+	int32_t length; // samples in wave, or bytes of note text
+	float wave[maxWaveLength]; // snippet, maximum at wave[numPre]; holds the text of a note
+};
+
+// sample range of records [firstRecord, firstRecord + indexStride)
+struct spikeIndexEntry {
+	uint64_t firstRecord;
+	uint64_t minSample;
+	uint64_t maxSample;
+};
+
+// Streams records to disk from a background thread. One producer thread
+// fills a batch while the writer thread writes the other one; append()
+// never waits for the disk, it drops the record and counts it when both
+// batches are full. Notes may come from another thread (the GUI) and go
+// through a small locked list the producer never touches. Nothing is
+// fsynced while recording, only once on close.
+class spikeFileWriter {
+	public:
+		spikeFileWriter(void);
+		~spikeFileWriter(void);
+
+		// not thread safe with append(): the producer must be idle
+		bool open(const std::string &path, int numChannels, double samplingFrequency, size_t batchRecords = 4096);
+		void close(void);
+		bool isOpen(void) const { return recording.load(std::memory_order_acquire); }
+
+		// producer thread
+		bool append(unsigned long long sampleIndex, const detectedSpike &spike);
+		// hands the batch being filled to the writer, unless it is still busy with the other one
+		void flush(void);
+		// Offline producers that would rather wait for the disk than drop: a full
+		// append() then waits for the writer. Never for the detection thread.
+		void setBlocking(bool wait) { blocking = wait; }
+
+		// any thread, text beyond the record payload is cut off
+		void note(unsigned long long sampleIndex, const std::string &text);
+
+		unsigned long long recordsWritten(void) const { return written.load(std::memory_order_relaxed); }
+		unsigned long long recordsDropped(void) const { return dropped.load(std::memory_order_relaxed); }
+		// a write failed and the file could not be cut back to its last whole
+		// record; recording stopped there and the file up to it is intact
+		bool writeFailed(void) const { return failed.load(std::memory_order_relaxed); }
+
+		static const uint32_t indexStride = 256;
+
+	private:
+		int fd;
+		int indexFd;
+		int wakeup; // eventfd, written by flush() and close()
+		std::atomic<bool> recording;
+		std::atomic<bool> quit;
+		std::thread writer;
+
+		// batches[filling] belongs to the producer; batches[pending] belongs to
+		// the writer until it sets pending back to -1
+		std::vector<spikeFileRecord> batches[2];
+		size_t counts[2];
+		int filling;
+		std::atomic<int> pending;
+		bool blocking;
+
+		std::mutex noteMutex;
+		std::vector<spikeFileRecord> notes;
+
+		// writer thread only
+		uint64_t numRecords;
+		spikeIndexEntry chunk;
+		std::vector<spikeIndexEntry> indexBuffer;
+
+		std::atomic<unsigned long long> written;
+		std::atomic<unsigned long long> dropped;
+		std::atomic<bool> failed;
+
+		void writerLoop(void);
+		void writeRecords(const spikeFileRecord *records, size_t n);
+};
+
+// Read-only view of a spike file through mmap. Records past the last
+// complete one (a file still being written) are ignored.
+class spikeFileReader {
+	public:
+		spikeFileReader(void);
+		~spikeFileReader(void);
+
+		bool open(const std::string &path);
+		void close(void);
+
+		const spikeFileHeader &header(void) const { return *head; }
+		size_t size(void) const { return numRecords; }
+		const spikeFileRecord &record(size_t i) const { return records[i]; }
+
+		// Records [first, last) include every record with t0 <= sampleIndex < t1;
+		// records in between outside the range still have to be skipped by the caller.
+		// Spikes are written roughly in time order (a detection pass at a time),
+		// so the range is small.
+		void findRange(uint64_t t0, uint64_t t1, size_t &first, size_t &last) const;
+
+	private:
+		void *map;
+		size_t mapLength;
+		const spikeFileHeader *head;
+		const spikeFileRecord *records;
+		size_t numRecords;
+		std::vector<spikeIndexEntry> index; // loaded from the sidecar or rebuilt
+		std::vector<uint64_t> runningMax; // max sample of chunks [0, k]
+		std::vector<uint64_t> remainingMin; // min sample of chunks [k, end)
+};
+
+#endif
@@ -0,0 +1,256 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Time-bucketed spike history for the raster plot
+*/
+
+#include "spike_raster.h"
+#include <algorithm>
+#include <cmath>
+
+spikeRaster::spikeRaster(void) : numChannels(0), words(0), bucketTime(1), newest(-1), changed(true), viewStart(0), viewEnd(0), viewColumns(0)
+{
+	unitStart.assign(2, 0);
+}
+
+void spikeRaster::resize(int channels, double displayTime, double bucketSeconds)
+{
+	numChannels = channels;
+	words = (channels + 63) / 64;
+	bucketTime = bucketSeconds;
+	// one extra bucket for the partially filled newest one
+	size_t numBuckets = (size_t)ceil(displayTime / bucketTime) + 1;
+	buckets.assign(numBuckets, bucket());
+	for (size_t k = 0; k < buckets.size(); k++) {
+		buckets[k].index = -1;
+		buckets[k].active.assign(slicesPerBucket * words, 0);
+		buckets[k].units.assign(slicesPerBucket * numChannels, 0);
+	}
+	newest = -1;
+	marks.clear();
+	unitStart.assign(2, 0);
+	changed = true;
+}
+
+void spikeRaster::clear(void)
+{
+	for (size_t k = 0; k < buckets.size(); k++) {
+		buckets[k].index = -1;
+		buckets[k].spikes.clear();
+		std::fill(buckets[k].active.begin(), buckets[k].active.end(), 0);
+	}
+	newest = -1;
+	marks.clear();
+	unitStart.assign(2, 0);
+	changed = true;
+}
+
+bool spikeRaster::isLive(const bucket &b) const
+{
+	return b.index >= 0 && b.index > newest - (long long)buckets.size();
+}
+
+void spikeRaster::add(double time, int channel, int unit)
+{
+	if (buckets.empty() || time < 0 || channel < 0 || channel >= numChannels)
+		return;
+	long long index = (long long)floor(time / bucketTime);
+	if (index <= newest - (long long)buckets.size())
+		return; // older than anything still displayed
+
+	bucket &b = buckets[index % buckets.size()];
+	if (b.index != index) {
+		// recycling the slot evicts the bucket that held it, whatever its size
+		b.index = index;
+		b.spikes.clear();
+		std::fill(b.active.begin(), b.active.end(), 0);
+	}
+	if (index > newest)
+		newest = index;
+	rasterMark spike = { time, channel, std::max(0, std::min(255, unit)) };
+	b.spikes.push_back(spike);
+	changed = true;
+	int slice = std::min(slicesPerBucket - 1, (int)((time / bucketTime - index) * slicesPerBucket));
+	b.active[slice * words + (channel >> 6)] |= 1ULL << (channel & 63);
+	b.units[slice * numChannels + channel] = spike.unit;
+}
+
+size_t spikeRaster::size(void) const
+{
+	size_t n = 0;
+	for (size_t k = 0; k < buckets.size(); k++) {
+		if (isLive(buckets[k]))
+			n += buckets[k].spikes.size();
+	}
+	return n;
+}
+
+double spikeRaster::oldestTime(void) const
+{
+	if (newest < 0)
+		return 0;
+	return std::max(0LL, newest - (long long)buckets.size() + 1) * bucketTime;
+}
+
+double spikeRaster::newestTime(void) const
+{
+	return newest < 0 ? 0 : (newest + 1) * bucketTime;
+}
+
+void spikeRaster::setView(double t0, double t1, int columns)
+{
+	// every curve asks for the same view before a replot
+	if (!changed && t0 == viewStart && t1 == viewEnd && columns == viewColumns)
+		return;
+	changed = false;
+	viewStart = t0;
+	viewEnd = t1;
+	viewColumns = columns;
+	marks.clear();
+	unitStart.assign(2, 0);
+	if (newest < 0 || columns <= 0 || !(t1 > t0))
+		return;
+	if ((t1 - t0) / columns >= bucketTime / slicesPerBucket)
+		markSlices(t0, t1, columns);
+	else
+		markColumns(t0, t1, columns);
+	groupUnits();
+}
+
+void spikeRaster::unitMarks(int unit, size_t &first, size_t &count) const
+{
+	if (unit < 0 || unit + 1 >= (int)unitStart.size()) {
+		first = count = 0;
+		return;
+	}
+	first = unitStart[unit];
+	count = unitStart[unit + 1] - first;
+}
+
+// counting sort by unit, keeping the time order within each
+void spikeRaster::groupUnits(void)
+{
+	int top = 0;
+	for (size_t i = 0; i < marks.size(); i++)
+		top = std::max(top, marks[i].unit);
+	unitStart.assign(top + 2, 0);
+	if (top == 0) {
+		unitStart[1] = marks.size();
+		return;
+	}
+	for (size_t i = 0; i < marks.size(); i++)
+		unitStart[marks[i].unit + 1]++;
+	for (int u = 0; u <= top; u++)
+		unitStart[u + 1] += unitStart[u];
+	sorted.resize(marks.size());
+	std::vector<size_t> next(unitStart.begin(), unitStart.end() - 1);
+	for (size_t i = 0; i < marks.size(); i++)
+		sorted[next[marks[i].unit]++] = marks[i];
+	marks.swap(sorted);
+}
+
+// zoomed in: individual spikes, or per-column occupancy once they outnumber the pixels
+void spikeRaster::markColumns(double t0, double t1, int columns)
+{
+	long long first = std::max((long long)floor(t0 / bucketTime), newest - (long long)buckets.size() + 1);
+	long long last = std::min((long long)floor(t1 / bucketTime), newest);
+	size_t inView = 0;
+	for (long long index = first; index <= last; index++) {
+		const bucket &b = buckets[index % buckets.size()];
+		if (b.index == index)
+			inView += b.spikes.size();
+	}
+
+	double columnWidth = (t1 - t0) / columns;
+	bool aggregate = inView > (size_t)columns * numChannels;
+	if (aggregate) {
+		grid.assign((size_t)columns * words, 0);
+		gridUnits.resize((size_t)columns * numChannels);
+	}
+	for (long long index = first; index <= last; index++) {
+		const bucket &b = buckets[index % buckets.size()];
+		if (b.index != index)
+			continue;
+		for (size_t k = 0; k < b.spikes.size(); k++) {
+			const rasterMark &spike = b.spikes[k];
+			if (spike.time < t0 || spike.time >= t1)
+				continue;
+			if (!aggregate) {
+				marks.push_back(spike);
+				continue;
+			}
+			int column = std::min(columns - 1, (int)((spike.time - t0) / columnWidth));
+			grid[(size_t)column * words + (spike.channel >> 6)] |= 1ULL << (spike.channel & 63);
+			gridUnits[(size_t)column * numChannels + spike.channel] = spike.unit;
+		}
+	}
+	if (aggregate)
+		emitGrid(t0, columnWidth, columns);
+}
+
+// zoomed out: every column spans at least one slice, so the slices' channel
+// masks are enough and individual spikes are never touched
+void spikeRaster::markSlices(double t0, double t1, int columns)
+{
+	double sliceTime = bucketTime / slicesPerBucket;
+	long long first = std::max((long long)floor(t0 / bucketTime), newest - (long long)buckets.size() + 1);
+	long long last = std::min((long long)floor(t1 / bucketTime), newest);
+	double columnWidth = (t1 - t0) / columns;
+	grid.assign((size_t)columns * words, 0);
+	gridUnits.resize((size_t)columns * numChannels);
+	for (long long index = first; index <= last; index++) {
+		const bucket &b = buckets[index % buckets.size()];
+		if (b.index != index)
+			continue;
+		for (int slice = 0; slice < slicesPerBucket; slice++) {
+			double start = index * bucketTime + slice * sliceTime;
+			if (start + sliceTime <= t0 || start >= t1)
+				continue;
+			int column = std::max(0, std::min(columns - 1, (int)((start - t0) / columnWidth)));
+			const uint64_t *mask = &b.active[slice * words];
+			const uint8_t *units = &b.units[slice * numChannels];
+			uint8_t *columnUnits = &gridUnits[(size_t)column * numChannels];
+			for (int w = 0; w < words; w++) {
+				grid[(size_t)column * words + w] |= mask[w];
+				// later slices overwrite, the mark takes the unit of the last spike
+				for (uint64_t bits = mask[w]; bits; bits &= bits - 1) {
+					int channel = w * 64 + __builtin_ctzll(bits);
+					columnUnits[channel] = units[channel];
+				}
+			}
+		}
+	}
+	emitGrid(t0, columnWidth, columns);
+}
+
+void spikeRaster::emitGrid(double t0, double columnWidth, int columns)
+{
+	for (int column = 0; column < columns; column++) {
+		double time = t0 + (column + 0.5) * columnWidth;
+		for (int w = 0; w < words; w++) {
+			uint64_t bits = grid[(size_t)column * words + w];
+			while (bits) {
+				int channel = w * 64 + __builtin_ctzll(bits);
+				rasterMark mark = { time, channel, gridUnits[(size_t)column * numChannels + channel] };
+				marks.push_back(mark);
+				bits &= bits - 1;
+			}
+		}
+	}
+}
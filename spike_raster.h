@@ -0,0 +1,101 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Spike history behind the raster plot. Spikes are kept in a ring of
+* fixed-length time buckets, so old spikes leave a whole bucket at a time.
+* Each bucket also keeps one channel mask per short time slice, with the
+* unit of each channel's last spike in the slice, so the marks for a
+* zoomed-out view are built from the masks and cost depends on the plot
+* width rather than on the number of spikes. Marks are grouped by sorted
+* unit so each unit can be drawn in its own colour.
+*/
+
+#ifndef SPIKE_RASTER_H
+#define SPIKE_RASTER_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <vector>
+
+struct rasterMark {
+	double time; // (s)
+	int channel;
+	int unit; // 0 when unsorted; for a mark that stands for several spikes, that of the last one added
+};
+
+class spikeRaster {
+	public:
+		spikeRaster(void);
+
+		// keeps the last displayTime seconds in buckets of bucketTime seconds
+		void resize(int channels, double displayTime, double bucketTime = 1);
+		void clear(void);
+		// spikes may arrive slightly out of order; anything older than the
+		// oldest bucket still held is dropped
+		void add(double time, int channel, int unit = 0);
+		size_t size(void) const; // spikes held
+		double oldestTime(void) const;
+		double newestTime(void) const;
+
+		// Rebuilds the marks for [t0, t1) drawn across the given number of pixel
+		// columns. Once a column covers at least one slice, the slice masks give
+		// at most one mark per column and channel. Zoomed in further, every
+		// spike in view is a mark, unless there are more than pixels, in which
+		// case they are binned per column as well. Does nothing when neither
+		// the view nor the spikes changed since the last call.
+		void setView(double t0, double t1, int columns);
+		size_t numMarks(void) const { return marks.size(); }
+		const rasterMark &mark(size_t i) const { return marks[i]; }
+		// marks [first, first + count) are those of unit; units above
+		// maxUnit() have none
+		void unitMarks(int unit, size_t &first, size_t &count) const;
+		int maxUnit(void) const { return (int)unitStart.size() - 2; }
+
+	private:
+		struct bucket {
+			long long index; // floor(time / bucketTime), -1 when unused
+			std::vector<rasterMark> spikes; // keeps its capacity when recycled
+			std::vector<uint64_t> active; // per slice, one bit per channel with spikes in it
+			std::vector<uint8_t> units; // per slice and channel, valid where its bit is set
+		};
+		static const int slicesPerBucket = 64;
+		std::vector<bucket> buckets;
+		int numChannels;
+		int words; // 64-bit words per channel mask
+		double bucketTime;
+		long long newest; // newest bucket index seen, -1 before the first spike
+
+		std::vector<rasterMark> marks; // in unit order
+		std::vector<size_t> unitStart; // first mark of each unit, and the end
+		std::vector<rasterMark> sorted; // scratch for the grouping
+		std::vector<uint64_t> grid; // column x channel occupancy scratch
+		std::vector<uint8_t> gridUnits; // column x channel, valid where grid has a bit
+		bool changed; // spikes added or cleared since the marks were built
+		double viewStart;
+		double viewEnd;
+		int viewColumns;
+
+		bool isLive(const bucket &b) const;
+		void markColumns(double t0, double t1, int columns);
+		void markSlices(double t0, double t1, int columns);
+		void emitGrid(double t0, double columnWidth, int columns);
+		void groupUnits(void);
+};
+
+#endif
@@ -0,0 +1,529 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Online spike sorting: incremental PCA and streaming clustering per channel
+*/
+
+#include "spike_sorter.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SORTER_X86
+#include <immintrin.h>
+#endif
+
+sorterParameters::sorterParameters(void) : numComponents(3), maxUnits(4), unitDistance(5), mergeDistance(4), maxShift(2),
+	memory(1000), warmup(100), basisInterval(100)
+{
+}
+
+bool sorterParameters::operator==(const sorterParameters &p) const
+{
+	return numComponents == p.numComponents && maxUnits == p.maxUnits && unitDistance == p.unitDistance &&
+		mergeDistance == p.mergeDistance &&
+		maxShift == p.maxShift && memory == p.memory && warmup == p.warmup && basisInterval == p.basisInterval;
+}
+
+// Four running sums per component, lane k & 3 taking sample k, added up as
+// (0 + 1) + (2 + 3). The SIMD kernels keep the same lanes.
+static void projectScalar(const float *wave, int length, const double *basis, int stride, int numComponents, double *out)
+{
+	for (int j = 0; j < numComponents; j++) {
+		const double *b = basis + j * stride;
+		double lane[4] = { 0, 0, 0, 0 };
+		for (int k = 0; k < length; k++)
+			lane[k & 3] = lane[k & 3] + b[k] * (double)wave[k];
+		out[j] = (lane[0] + lane[1]) + (lane[2] + lane[3]);
+	}
+}
+
+#ifdef SORTER_X86
+// the last partial group of 4 samples, zero padded so the kernels never
+// read past the snippet
+static inline const float *waveGroup(const float *wave, int length, int k, float *tail)
+{
+	if (k + 4 <= length)
+		return wave + k;
+	for (int l = 0; l < 4; l++)
+		tail[l] = k + l < length ? wave[k + l] : 0.f;
+	return tail;
+}
+
+__attribute__((target("sse2")))
+static void projectSSE2(const float *wave, int length, const double *basis, int stride, int numComponents, double *out)
+{
+	__m128d lo[maxSortComponents], hi[maxSortComponents];
+	for (int j = 0; j < numComponents; j++)
+		lo[j] = hi[j] = _mm_setzero_pd();
+	float tail[4];
+	for (int k = 0; k < length; k += 4) {
+		__m128 w = _mm_loadu_ps(waveGroup(wave, length, k, tail));
+		__m128d w01 = _mm_cvtps_pd(w);
+		__m128d w23 = _mm_cvtps_pd(_mm_movehl_ps(w, w));
+		for (int j = 0; j < numComponents; j++) {
+			const double *b = basis + j * stride + k;
+			lo[j] = _mm_add_pd(lo[j], _mm_mul_pd(_mm_loadu_pd(b), w01));
+			hi[j] = _mm_add_pd(hi[j], _mm_mul_pd(_mm_loadu_pd(b + 2), w23));
+		}
+	}
+	for (int j = 0; j < numComponents; j++) {
+		__m128d s01 = _mm_add_sd(lo[j], _mm_unpackhi_pd(lo[j], lo[j]));
+		__m128d s23 = _mm_add_sd(hi[j], _mm_unpackhi_pd(hi[j], hi[j]));
+		out[j] = _mm_cvtsd_f64(_mm_add_sd(s01, s23));
+	}
+}
+
+__attribute__((target("avx2")))
+static void projectAVX2(const float *wave, int length, const double *basis, int stride, int numComponents, double *out)
+{
+	__m256d acc[maxSortComponents];
+	for (int j = 0; j < numComponents; j++)
+		acc[j] = _mm256_setzero_pd();
+	float tail[4];
+	for (int k = 0; k < length; k += 4) {
+		__m256d w = _mm256_cvtps_pd(_mm_loadu_ps(waveGroup(wave, length, k, tail)));
+		for (int j = 0; j < numComponents; j++)
+			acc[j] = _mm256_add_pd(acc[j], _mm256_mul_pd(_mm256_loadu_pd(basis + j * stride + k), w));
+	}
+	for (int j = 0; j < numComponents; j++) {
+		__m128d lo = _mm256_castpd256_pd128(acc[j]);
+		__m128d hi = _mm256_extractf128_pd(acc[j], 1);
+		__m128d s01 = _mm_add_sd(lo, _mm_unpackhi_pd(lo, lo));
+		__m128d s23 = _mm_add_sd(hi, _mm_unpackhi_pd(hi, hi));
+		out[j] = _mm_cvtsd_f64(_mm_add_sd(s01, s23));
+	}
+}
+#endif
+
+snippetProjectionFn getSnippetProjection(crossingScanIsa isa)
+{
+	if (isa == scanBest) {
+#ifdef SORTER_X86
+		if (__builtin_cpu_supports("avx2"))
+			return projectAVX2;
+		if (__builtin_cpu_supports("sse2"))
+			return projectSSE2;
+#endif
+		return projectScalar;
+	}
+	switch (isa) {
+#ifdef SORTER_X86
+		case scanAVX2:
+			return __builtin_cpu_supports("avx2") ? projectAVX2 : NULL;
+		case scanSSE2:
+			return __builtin_cpu_supports("sse2") ? projectSSE2 : NULL;
+#endif
+		case scanScalar:
+			return projectScalar;
+		default:
+			return NULL;
+	}
+}
+
+spikeSorter::spikeSorter(void) : waveLength(0), stride(0), project(getSnippetProjection()), recorder(NULL),
+	quit(false), totalUnits(0), sorted(0), dropped(0)
+{
+	wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+spikeSorter::~spikeSorter(void)
+{
+	stop();
+	if (wakeup >= 0)
+		close(wakeup);
+}
+
+void spikeSorter::configure(int numChannels, int length, const sorterParameters &p)
+{
+	sorterParameters q = p;
+	q.numComponents = std::max(1, std::min(maxSortComponents, q.numComponents));
+	q.maxUnits = std::max(1, std::min(maxSortUnits, q.maxUnits));
+	q.memory = std::max(1, q.memory);
+	q.warmup = std::max(q.numComponents + 1, q.warmup);
+	q.basisInterval = std::max(1, q.basisInterval);
+	q.maxShift = std::max(0, std::min(maxSortShift, q.maxShift));
+	length = std::max(1, std::min(maxWaveLength, length));
+	if (numChannels == (int)channels.size() && length == waveLength && q == params)
+		return; // keep the trained units
+	params = q;
+	waveLength = length;
+	stride = (waveLength + 3) & ~3;
+	channels.assign(numChannels, channelModel());
+	for (size_t c = 0; c < channels.size(); c++) {
+		channelModel &m = channels[c];
+		m.seen = 0;
+		m.sinceBasis = 0;
+		m.hasBasis = false;
+		m.noiseVariance = 0;
+		m.mean.assign(stride, 0);
+		m.covariance.assign(waveLength * stride, 0);
+		m.basis.assign(params.numComponents * stride, 0);
+		for (int u = 0; u < maxSortUnits; u++) {
+			m.units[u].active = false;
+			m.units[u].center.assign(stride, 0);
+		}
+		m.numUnits = 0;
+	}
+	scratch.assign((maxSortComponents + 1) * stride, 0);
+	totalUnits = 0;
+}
+
+// exponentially weighted mean and covariance, the newest spike weighing 1 / memory
+void spikeSorter::updateModel(channelModel &m, const float *wave)
+{
+	m.seen++;
+	double a = 1.0 / std::min(m.seen, (long long)params.memory);
+	double *delta = scratch.data();
+	for (int k = 0; k < waveLength; k++) {
+		delta[k] = wave[k] - m.mean[k];
+		m.mean[k] += a * delta[k];
+	}
+	double keep = 1 - a;
+	for (int i = 0; i < waveLength; i++) {
+		double *row = &m.covariance[i * stride];
+		double s = a * delta[i];
+		for (int k = i; k < waveLength; k++)
+			row[k] = keep * (row[k] + s * delta[k]);
+	}
+}
+
+// Subspace iteration on the covariance, started from the previous basis
+// (or cosines the first time), then the unit centres are projected again.
+void spikeSorter::updateBasis(channelModel &m, int iterations)
+{
+	int q = params.numComponents;
+	double *v = m.basis.data();
+	double *w = scratch.data() + stride;
+	if (!m.hasBasis) {
+		for (int j = 0; j < q; j++) {
+			for (int k = 0; k < waveLength; k++)
+				v[j * stride + k] = cos(M_PI * (j + 1) * (k + 0.5) / waveLength);
+		}
+	}
+	const double *c = m.covariance.data();
+	for (int it = 0; it <= iterations; it++) {
+		// the first pass only orthonormalizes the starting rows
+		for (int j = 0; j < q; j++) {
+			double *out = w + j * stride;
+			const double *in = v + j * stride;
+			if (it == 0) {
+				std::copy(in, in + stride, out);
+				continue;
+			}
+			for (int i = 0; i < waveLength; i++) {
+				double acc = 0;
+				for (int k = 0; k < i; k++)
+					acc += c[k * stride + i] * in[k];
+				for (int k = i; k < waveLength; k++)
+					acc += c[i * stride + k] * in[k];
+				out[i] = acc;
+			}
+		}
+		// Gram-Schmidt; a row that vanishes keeps its previous direction
+		for (int j = 0; j < q; j++) {
+			double *out = w + j * stride;
+			for (int i = 0; i < j; i++) {
+				const double *prev = v + i * stride;
+				double dot = 0;
+				for (int k = 0; k < waveLength; k++)
+					dot += out[k] * prev[k];
+				for (int k = 0; k < waveLength; k++)
+					out[k] -= dot * prev[k];
+			}
+			double norm = 0;
+			for (int k = 0; k < waveLength; k++)
+				norm += out[k] * out[k];
+			if (norm > 1e-300) {
+				norm = 1 / sqrt(norm);
+				for (int k = 0; k < waveLength; k++)
+					v[j * stride + k] = out[k] * norm;
+			}
+		}
+	}
+
+	// the variance the basis leaves out, spread over the other dimensions,
+	// is the noise each component carries as well
+	double trace = 0, captured = 0;
+	for (int i = 0; i < waveLength; i++)
+		trace += c[i * stride + i];
+	for (int j = 0; j < q; j++) {
+		const double *row = v + j * stride;
+		for (int i = 0; i < waveLength; i++) {
+			double acc = 0;
+			for (int k = 0; k < i; k++)
+				acc += c[k * stride + i] * row[k];
+			for (int k = i; k < waveLength; k++)
+				acc += c[i * stride + k] * row[k];
+			captured += acc * row[i];
+		}
+	}
+	m.noiseVariance = std::max(1e-30, waveLength > q ? (trace - captured) / (waveLength - q) : trace / waveLength);
+	m.hasBasis = true;
+	m.sinceBasis = 0;
+
+	for (int u = 0; u < maxSortUnits; u++) {
+		if (m.units[u].active)
+			projectCenter(m, m.units[u].center.data(), 0, m.units[u].projection);
+	}
+	tidyUnits(m);
+}
+
+// center moved by shift samples, the edge samples repeated, as the snippets are
+void spikeSorter::projectCenter(const channelModel &m, const double *center, int shift, double *out) const
+{
+	for (int j = 0; j < params.numComponents; j++) {
+		const double *row = &m.basis[j * stride];
+		double acc = 0;
+		for (int k = 0; k < waveLength; k++)
+			acc += row[k] * center[std::max(0, std::min(waveLength - 1, k + shift))];
+		out[j] = acc;
+	}
+}
+
+// Drops units without a spike over the last memory spikes of the channel
+// and merges units that have drifted together, into the lower ID. Units
+// whose spikes were each moved by up to maxShift samples towards them may
+// be apart by twice that, so their centres are compared over that range of
+// shifts, as whole snippets: a shifted centre is mostly outside the basis.
+void spikeSorter::tidyUnits(channelModel &m)
+{
+	double merge = params.mergeDistance * params.mergeDistance * m.noiseVariance;
+	for (int u = 0; u < maxSortUnits; u++) {
+		unit &a = m.units[u];
+		if (a.active && a.lastSpike < m.seen - params.memory) {
+			a.active = false;
+			m.numUnits--;
+			totalUnits.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+	for (int u = 0; u < maxSortUnits; u++) {
+		unit &a = m.units[u];
+		for (int v = u + 1; a.active && v < maxSortUnits; v++) {
+			unit &b = m.units[v];
+			if (!b.active)
+				continue;
+			int shift = 0;
+			double nearest = merge;
+			for (int s = -2 * params.maxShift; s <= 2 * params.maxShift; s++) {
+				double d2 = 0;
+				for (int k = 0; k < waveLength; k++) {
+					double e = a.center[k] - b.center[std::max(0, std::min(waveLength - 1, k + s))];
+					d2 += e * e;
+				}
+				if (d2 < nearest) {
+					nearest = d2;
+					shift = s;
+				}
+			}
+			if (nearest >= merge)
+				continue;
+			double wa = a.weight / (a.weight + b.weight);
+			double *aligned = scratch.data();
+			for (int k = 0; k < waveLength; k++)
+				aligned[k] = b.center[std::max(0, std::min(waveLength - 1, k + shift))];
+			for (int k = 0; k < waveLength; k++)
+				a.center[k] = wa * a.center[k] + (1 - wa) * aligned[k];
+			projectCenter(m, a.center.data(), 0, a.projection);
+			a.weight = std::min((double)params.memory, a.weight + b.weight);
+			a.lastSpike = std::max(a.lastSpike, b.lastSpike);
+			b.active = false;
+			m.numUnits--;
+			totalUnits.fetch_sub(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+int spikeSorter::sort(detectedSpike &spike)
+{
+	spike.unit = 0;
+	if (spike.channel < 0 || spike.channel >= (int)channels.size() || spike.waveLength != waveLength)
+		return 0;
+	channelModel &m = channels[spike.channel];
+	updateModel(m, spike.wave);
+	if (!m.hasBasis) {
+		if (m.seen < params.warmup)
+			return 0;
+		updateBasis(m, 30);
+	} else if (++m.sinceBasis >= params.basisInterval) {
+		updateBasis(m, 4);
+	}
+
+	// Nearest unit within the new-unit distance. Noise moves the maximum a
+	// snippet is aligned on, so it may also be moved by up to maxShift
+	// samples to line up with a unit.
+	int q = params.numComponents;
+	float shifted[2 * maxSortShift + 1][maxWaveLength];
+	double y[2 * maxSortShift + 1][maxSortComponents];
+	int numShifts = 2 * params.maxShift + 1;
+	for (int v = 0; v < numShifts; v++) {
+		// shift 0 first, so it wins ties
+		int shift = (v + 1) / 2 * (v % 2 ? 1 : -1);
+		for (int k = 0; k < waveLength; k++)
+			shifted[v][k] = spike.wave[std::max(0, std::min(waveLength - 1, k + shift))];
+		project(shifted[v], waveLength, m.basis.data(), stride, q, y[v]);
+	}
+	int best = -1, bestShift = 0;
+	double bestDistance = params.unitDistance * params.unitDistance * m.noiseVariance;
+	for (int u = 0; u < maxSortUnits; u++) {
+		const unit &s = m.units[u];
+		if (!s.active)
+			continue;
+		for (int v = 0; v < numShifts; v++) {
+			double d2 = 0;
+			for (int j = 0; j < q; j++)
+				d2 += (y[v][j] - s.projection[j]) * (y[v][j] - s.projection[j]);
+			if (d2 < bestDistance) {
+				bestDistance = d2;
+				best = u;
+				bestShift = v;
+			}
+		}
+	}
+	if (best < 0) {
+		// the first free ID starts a unit, an outlier once they are all taken
+		for (int u = 0; u < params.maxUnits && best < 0; u++) {
+			if (!m.units[u].active)
+				best = u;
+		}
+		if (best < 0)
+			return 0;
+		unit &s = m.units[best];
+		s.active = true;
+		s.weight = 0;
+		m.numUnits++;
+		totalUnits.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// streaming k-means step towards the aligned spike
+	unit &s = m.units[best];
+	s.weight = std::min((double)params.memory, s.weight + 1);
+	s.lastSpike = m.seen;
+	double eta = 1 / s.weight;
+	for (int k = 0; k < waveLength; k++)
+		s.center[k] += eta * (shifted[bestShift][k] - s.center[k]);
+	for (int j = 0; j < q; j++)
+		s.projection[j] += eta * (y[bestShift][j] - s.projection[j]);
+	spike.unit = best + 1;
+	return spike.unit;
+}
+
+void spikeSorter::start(spikeFileWriter *r, size_t queueLength)
+{
+	stop();
+	incoming.clear();
+	recorder = r;
+	queue.resize(queueLength);
+	quit = false;
+	worker = std::thread(&spikeSorter::sortLoop, this);
+}
+
+void spikeSorter::stop(void)
+{
+	if (!worker.joinable())
+		return;
+	quit.store(true, std::memory_order_release);
+	uint64_t one = 1;
+	if (write(wakeup, &one, sizeof(one)) < 0) { /* already signalled */ }
+	worker.join();
+}
+
+void spikeSorter::append(const std::vector<pooledSpike> &spikes)
+{
+	if (spikes.empty())
+		return;
+	std::lock_guard<std::mutex> lock(incomingMutex);
+	incoming.insert(incoming.end(), spikes.begin(), spikes.end());
+}
+
+void spikeSorter::wake(void)
+{
+	uint64_t one = 1;
+	if (write(wakeup, &one, sizeof(one)) < 0) { /* counter saturated, sorter is already pending */ }
+}
+
+bool spikeSorter::popSpike(pooledSpike &spike)
+{
+	pooledSpike *slot = queue.front();
+	if (!slot)
+		return false;
+	spike = *slot;
+	queue.release();
+	return true;
+}
+
+void spikeSorter::clearStats(void)
+{
+	sorted.store(0, std::memory_order_relaxed);
+	dropped.store(0, std::memory_order_relaxed);
+	batchTime.clear();
+}
+
+void spikeSorter::sortLoop(void)
+{
+	struct pollfd event = { wakeup, POLLIN, 0 };
+	for (;;) {
+		if (poll(&event, 1, -1) < 0)
+			continue; // interrupted
+		uint64_t signalled;
+		if (read(wakeup, &signalled, sizeof(signalled)) < 0) { /* spurious wakeup */ }
+		// whatever the last pass queued is still sorted and recorded
+		bool last = quit.load(std::memory_order_acquire);
+		drain();
+		if (last)
+			return;
+	}
+}
+
+void spikeSorter::drain(void)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	{
+		// both keep their capacity, so a steady spike rate allocates nothing
+		std::lock_guard<std::mutex> lock(incomingMutex);
+		batch.swap(incoming);
+	}
+	bool recording = recorder && recorder->isOpen();
+	unsigned long long n = batch.size(), full = 0;
+	for (size_t k = 0; k < batch.size(); k++) {
+		sort(batch[k].spike);
+		if (recording)
+			recorder->append(batch[k].sampleIndex, batch[k].spike);
+		pooledSpike *slot = queue.prepare();
+		if (!slot) {
+			full++; // the display is not keeping up; the spike is still sorted and recorded
+			continue;
+		}
+		*slot = batch[k];
+		queue.commit();
+	}
+	batch.clear();
+	if (n == 0)
+		return;
+	if (recording)
+		recorder->flush();
+	sorted.fetch_add(n, std::memory_order_relaxed);
+	if (full)
+		dropped.fetch_add(full, std::memory_order_relaxed);
+	batchTime.record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+}
@@ -0,0 +1,155 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Online spike sorting. Every channel keeps an incremental PCA of its
+* spike snippets and a few units clustered in the space of the first
+* principal components. A background thread takes every spike the
+* detection pool finds, labels each one with a unit of its channel and
+* passes it on to the display and the spike file.
+*/
+
+#ifndef SPIKE_SORTER_H
+#define SPIKE_SORTER_H
+
+#include "crossing_scan.h"
+#include "detection_pool.h"
+#include "pipeline_stats.h"
+#include "ringbuffer.h"
+#include "spike_file.h"
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const int maxSortComponents = 3;
+static const int maxSortUnits = 8;
+static const int maxSortShift = 3;
+
+struct sorterParameters {
+	int numComponents; // principal components the units are clustered in, 1 to maxSortComponents
+	int maxUnits; // per channel, 1 to maxSortUnits
+	double unitDistance; // a spike farther than this (x noise) from every unit starts a new one
+	double mergeDistance; // units that come closer than this (x noise) are merged
+	int maxShift; // samples a snippet may be moved to line up with a unit, up to maxSortShift
+	int memory; // spikes the covariance and the unit centres average over
+	int warmup; // spikes of a channel before its first basis, left unsorted
+	int basisInterval; // spikes of a channel between basis updates
+
+	sorterParameters(void);
+	bool operator==(const sorterParameters &p) const;
+};
+
+// out[j] = sum of basis[j * stride + k] * wave[k] over k < length, for j <
+// numComponents. stride is a multiple of 4 and at least length. Every
+// kernel sums in the same order, so all give the same bits.
+typedef void (*snippetProjectionFn)(const float *wave, int length, const double *basis, int stride,
+		int numComponents, double *out);
+
+// kernel for the requested instruction set, or NULL if the CPU lacks it
+snippetProjectionFn getSnippetProjection(crossingScanIsa isa = scanBest);
+
+class spikeSorter {
+	public:
+		spikeSorter(void);
+		~spikeSorter(void);
+
+		// Not thread safe: stopped. Every channel starts over unsorted unless
+		// the channel count, snippet length and parameters are unchanged.
+		void configure(int numChannels, int waveLength, const sorterParameters &p);
+		void setIsa(crossingScanIsa isa) { project = getSnippetProjection(isa); }
+		const sorterParameters &getParameters(void) const { return params; }
+
+		// Sets spike.unit and returns it: 1 to maxUnits, or 0 while the
+		// channel is still warming up, for outliers once all of its units are
+		// taken and for snippets of another length. Offline use, or from the
+		// sorting thread.
+		int sort(detectedSpike &spike);
+
+		// Starts the sorting thread. After every wake() it takes the spikes
+		// appended so far, sorts them, appends them to the recorder while it is
+		// open and queues them for the display. Hand it to the pool with
+		// setSorter(), which must not record itself. Not thread safe.
+		void start(spikeFileWriter *recorder, size_t queueLength = 16384);
+		// sorts what was appended once more, then joins the sorting thread
+		void stop(void);
+		bool isRunning(void) const { return worker.joinable(); }
+		// detection thread: a pass's spikes, kept until the sorting thread
+		// takes them, however far behind it is
+		void append(const std::vector<pooledSpike> &spikes);
+		// detection thread, after each pass
+		void wake(void);
+		// display thread: next sorted spike, false when there is none
+		bool popSpike(pooledSpike &spike);
+
+		// Any thread. Statistics are kept across restarts.
+		int unitsFound(void) const { return totalUnits.load(std::memory_order_relaxed); } // over all channels
+		unsigned long long spikesSorted(void) const { return sorted.load(std::memory_order_relaxed); }
+		unsigned long long spikesDropped(void) const { return dropped.load(std::memory_order_relaxed); } // display queue was full
+		const latencyHistogram &batchDurations(void) const { return batchTime; } // (ns) per wake()
+		void clearStats(void);
+
+	private:
+		struct unit {
+			bool active;
+			double weight; // spikes so far, capped at the memory
+			long long lastSpike; // channel spike count when it last got one
+			double projection[maxSortComponents]; // of the centre
+			std::vector<double> center; // mean snippet
+		};
+		struct channelModel {
+			long long seen;
+			long long sinceBasis;
+			bool hasBasis;
+			double noiseVariance; // per component, the variance left outside the basis
+			std::vector<double> mean;
+			std::vector<double> covariance; // length x length, upper triangle
+			std::vector<double> basis; // numComponents rows of stride, zero past length
+			unit units[maxSortUnits];
+			int numUnits;
+		};
+		sorterParameters params;
+		int waveLength;
+		int stride; // waveLength rounded up to a multiple of 4
+		snippetProjectionFn project;
+		std::vector<channelModel> channels;
+		std::vector<double> scratch; // basis updates
+
+		std::mutex incomingMutex;
+		std::vector<pooledSpike> incoming; // appended, not taken yet
+		std::vector<pooledSpike> batch; // sorting thread: taken from incoming
+		spikeFileWriter *recorder;
+		ringbuffer<pooledSpike> queue; // sorting thread -> display
+		std::thread worker;
+		int wakeup; // eventfd
+		std::atomic<bool> quit;
+
+		std::atomic<int> totalUnits;
+		std::atomic<unsigned long long> sorted;
+		std::atomic<unsigned long long> dropped;
+		latencyHistogram batchTime;
+
+		void sortLoop(void);
+		void drain(void);
+		void updateModel(channelModel &m, const float *wave);
+		void updateBasis(channelModel &m, int iterations);
+		void tidyUnits(channelModel &m);
+		void projectCenter(const channelModel &m, const double *center, int shift, double *out) const;
+};
+
+#endif
@@ -0,0 +1,80 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Spike-triggered stimulation on the RT thread
+*/
+
+#include "stim_trigger.h"
+#include <algorithm>
+
+stimTrigger::stimTrigger(void) : count(0), polarity(0), deadSamples(1), pulseSamples(0), amplitude(0)
+{
+	configure(std::vector<int>(), 0, 1, 0, 0);
+}
+
+void stimTrigger::configure(const std::vector<int> &channels, int threshPolarity, int dead, int pulse, double amp)
+{
+	count = std::min((int)channels.size(), maxTriggerChannels);
+	polarity = threshPolarity;
+	pulseSamples = std::max(0, pulse);
+	deadSamples = std::max(std::max(1, dead), pulseSamples);
+	amplitude = amp;
+	for (int k = 0; k < maxTriggerChannels; k++) {
+		trigger &t = triggers[k];
+		t.channel = k < count ? channels[k] : -1;
+		t.threshold.store(0, std::memory_order_relaxed);
+		t.fired.store(0, std::memory_order_relaxed);
+		t.wasOutside = false;
+		t.deadLeft = 0;
+		t.pulseLeft = 0;
+	}
+}
+
+void stimTrigger::updateThresholds(const SpikeDetector &detector, bool conditioned)
+{
+	// other methods, the reference and the filter give a signal the RT
+	// thread does not compute; LFP and artifacts in the input would cross
+	// the threshold trained on it
+	if (conditioned || detector.getParameters().detectionMethod != detectThreshold) {
+		for (int k = 0; k < count; k++)
+			setThreshold(k, 0);
+		return;
+	}
+	for (int k = 0; k < count; k++) {
+		int c = triggers[k].channel;
+		if (c < detector.getNumChannels() && detector.isTrained(c))
+			setThreshold(k, detector.getThreshold(c));
+	}
+}
+
+int stimTrigger::armedTriggers(void) const
+{
+	int armed = 0;
+	for (int k = 0; k < count; k++)
+		armed += triggers[k].threshold.load(std::memory_order_relaxed) > 0;
+	return armed;
+}
+
+unsigned long long stimTrigger::triggersFired(void) const
+{
+	unsigned long long total = 0;
+	for (int k = 0; k < count; k++)
+		total += triggersFired(k);
+	return total;
+}
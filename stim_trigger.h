@@ -0,0 +1,106 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Closed-loop stimulation on the RT thread. A few selected channels are
+* checked every tick against the threshold the detector has trained for
+* them: the first sample outside the band starts a pulse on that channel's
+* output in the same tick, then the channel is held off for a dead time.
+* The cost per tick is a fixed handful of compares per trigger, with no
+* locks, allocation or system calls.
+*/
+
+#ifndef STIM_TRIGGER_H
+#define STIM_TRIGGER_H
+
+#include "spike_detector.h"
+#include <atomic>
+#include <vector>
+
+static const int maxTriggerChannels = 8;
+
+class stimTrigger {
+	public:
+		stimTrigger(void);
+
+		// Triggers on the first maxTriggerChannels of channels, with the
+		// detector's polarity convention (0 = bipolar; 1 = negative only;
+		// 2 = positive only). A pulse lasts pulseSamples ticks at amplitude;
+		// a channel cannot fire again for deadSamples ticks (at least the
+		// pulse) after it fired. Disarms every trigger. Not thread safe with
+		// process(): call with the RT thread inactive.
+		void configure(const std::vector<int> &channels, int threshPolarity, int deadSamples, int pulseSamples, double amplitude);
+		int numTriggers(void) const { return count; }
+		int channel(int k) const { return triggers[k].channel; }
+
+		// any thread: threshold of trigger k, 0 disarms it
+		void setThreshold(int k, double threshold) { triggers[k].threshold.store(threshold, std::memory_order_relaxed); }
+		// detection thread, after a pass: arms each trigger at its channel's
+		// current threshold once the channel is trained, or disarms them all
+		// unless the detector thresholds the voltage as the RT thread sees it.
+		// conditioned is whether the detector searches re-referenced or
+		// filtered traces, whose thresholds do not apply to the input.
+		void updateThresholds(const SpikeDetector &detector, bool conditioned);
+		// any thread: triggers with a threshold
+		int armedTriggers(void) const;
+
+		// RT thread: sample v of trigger k's channel for this tick, returns
+		// the value of its output for the same tick (0 when k is unused)
+		double process(int k, double v);
+
+		unsigned long long triggersFired(int k) const { return triggers[k].fired.load(std::memory_order_relaxed); }
+		unsigned long long triggersFired(void) const;
+
+	private:
+		struct trigger {
+			int channel;
+			std::atomic<double> threshold;
+			std::atomic<unsigned long long> fired; // written by the RT thread only
+			bool wasOutside;
+			int deadLeft; // ticks
+			int pulseLeft; // ticks
+		};
+		trigger triggers[maxTriggerChannels];
+		int count;
+		int polarity;
+		int deadSamples;
+		int pulseSamples;
+		double amplitude;
+};
+
+inline double stimTrigger::process(int k, double v)
+{
+	trigger &t = triggers[k];
+	double threshold = t.threshold.load(std::memory_order_relaxed);
+	// the band of the crossing scan
+	bool outside = threshold > 0 && ((polarity != 2 && v <= -threshold) || (polarity != 1 && v >= threshold));
+	if (t.deadLeft > 0) {
+		t.deadLeft--;
+	} else if (outside && !t.wasOutside) {
+		t.pulseLeft = pulseSamples;
+		t.deadLeft = deadSamples - 1; // this tick counts
+		t.fired.store(t.fired.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+	t.wasOutside = outside;
+	if (t.pulseLeft == 0)
+		return 0;
+	t.pulseLeft--;
+	return amplitude;
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Parameter sweeps sharing one crossing scan
+*/
+
+#include "detector_sweep.h"
+#include <algorithm>
+
+static bool sameScan(const detectorParameters &a, const detectorParameters &b)
+{
+	return a.numPre == b.numPre && a.numPost == b.numPost && a.maxSpikeWidth == b.maxSpikeWidth &&
+		a.threshPolarity == b.threshPolarity && a.noiseEstimator == b.noiseEstimator && a.detectionMethod == b.detectionMethod &&
+		a.noiseTimeConstant == b.noiseTimeConstant && a.samplingFrequency == b.samplingFrequency;
+}
+
+detectorSweep::detectorSweep(const std::vector<detectorParameters> &params) : numChannels(0)
+{
+	for (size_t k = 0; k < params.size(); k++) {
+		// the detector trims snippets that do not fit a record, trackers must see the same
+		SpikeDetector trimmed(0, params[k]);
+		configs.push_back(trimmed.getParameters());
+		validators.push_back(getSpikeValidator(configs[k].numPre, configs[k].numPost));
+		size_t g = 0;
+		while (g < groups.size() && !sameScan(configs[groups[g].configs[0]], configs[k]))
+			g++;
+		if (g == groups.size())
+			groups.push_back(group());
+		groups[g].configs.push_back(k);
+	}
+	for (size_t g = 0; g < groups.size(); g++) {
+		detectorParameters lowest = configs[groups[g].configs[0]];
+		for (size_t i = 1; i < groups[g].configs.size(); i++)
+			lowest.thresholdMultiplier = std::min(lowest.thresholdMultiplier, configs[groups[g].configs[i]].thresholdMultiplier);
+		groups[g].detector.reset(new SpikeDetector(0, lowest));
+	}
+}
+
+void detectorSweep::reset(int channels, int maxBlockLength)
+{
+	numChannels = channels;
+	for (size_t g = 0; g < groups.size(); g++)
+		groups[g].detector->reset(numChannels, maxBlockLength);
+	newSamples.assign(numChannels, NULL);
+	trackers.assign(configs.size() * numChannels, spikeTracker());
+	counts.assign(configs.size() * numChannels, 0);
+}
+
+float *detectorSweep::appendBuffer(int channel, int length)
+{
+	newSamples[channel] = groups[0].detector->appendBuffer(channel, length);
+	return newSamples[channel];
+}
+
+void detectorSweep::processWindow(int channel, int length, sweepWorkspace &ws)
+{
+	for (size_t g = 0; g < groups.size(); g++) {
+		SpikeDetector &detector = *groups[g].detector;
+		if (g > 0)
+			std::copy(newSamples[channel], newSamples[channel] + length, detector.appendBuffer(channel, length));
+
+		// a trained detector searches with the threshold of the previous window,
+		// an untrained one with the estimate from this one
+		bool trained = detector.isTrained(channel);
+		double noiseLevel = detector.getNoiseLevel(channel);
+		bool searchable = detector.scanWindow(channel, length, ws.scan);
+		if (!trained)
+			noiseLevel = detector.getNoiseLevel(channel);
+
+		ws.track.spikeDetectionBuffer = ws.scan.spikeDetectionBuffer;
+		ws.track.detectionSignal = ws.scan.detectionSignal;
+		ws.track.bufferLength = ws.scan.bufferLength;
+		if (ws.track.candidates.size() < ws.scan.candidates.size())
+			ws.track.candidates.resize(ws.scan.candidates.size());
+		for (size_t i = 0; i < groups[g].configs.size(); i++) {
+			int k = groups[g].configs[i];
+			spikeTracker &t = trackers[k * numChannels + channel];
+			if (!searchable) {
+				t.initialSamplesToSkip = 0;
+				continue;
+			}
+			const detectorParameters &p = configs[k];
+			ws.track.currentThreshold = p.thresholdMultiplier * noiseLevel;
+			ws.track.numCandidates = narrowCandidates(ws.scan.detectionSignal, ws.scan.candidates.data(), ws.scan.numCandidates,
+					ws.track.currentThreshold, detectionPolarity(p.detectionMethod, p.threshPolarity), ws.track.candidates.data());
+			ws.spikes.clear();
+			counts[k * numChannels + channel] += SpikeDetector::trackSpikes(p, validators[k], t, ws.track, channel, length, ws.spikes);
+		}
+	}
+}
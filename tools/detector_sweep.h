@@ -0,0 +1,77 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Parameter sweeps in one pass over the data. Every block is searched with
+* N detector settings while it is still in cache. The settings share the
+* detection window, the crossing scan and the noise estimate, and fan out
+* only into a spike-tracking state machine and a validator each. Settings
+* that need a different window (snippet lengths, maximum width) or noise
+* estimate (polarity, estimator, time constant) get a scan of their own.
+* Per setting, the spikes counted are exactly those SpikeDetector finds
+* with that setting alone.
+*/
+
+#ifndef DETECTOR_SWEEP_H
+#define DETECTOR_SWEEP_H
+
+#include "spike_detector.h"
+#include <memory>
+#include <vector>
+
+// one per thread
+struct sweepWorkspace {
+	detectionWorkspace scan;
+	detectionWorkspace track;
+	std::vector<detectedSpike> spikes;
+};
+
+class detectorSweep {
+	public:
+		detectorSweep(const std::vector<detectorParameters> &configs);
+
+		// clears all state and counts
+		void reset(int numChannels, int maxBlockLength);
+		int numConfigs(void) const { return configs.size(); }
+		int numScans(void) const { return groups.size(); }
+		const detectorParameters &getParameters(int config) const { return configs[config]; }
+
+		// as SpikeDetector::appendBuffer() and processWindow(); channels may be
+		// processed on different threads, each with its own workspace
+		float *appendBuffer(int channel, int length);
+		void processWindow(int channel, int length, sweepWorkspace &ws);
+
+		unsigned long long spikeCount(int config, int channel) const { return counts[config * numChannels + channel]; }
+
+	private:
+		// settings sharing a scan; the detector runs at the lowest threshold
+		// multiplier of the group, whose candidates include everyone else's
+		struct group {
+			std::unique_ptr<SpikeDetector> detector;
+			std::vector<int> configs;
+		};
+		std::vector<detectorParameters> configs;
+		std::vector<spikeValidatorFn> validators;
+		std::vector<group> groups;
+		int numChannels;
+		std::vector<float*> newSamples; // per channel, from appendBuffer()
+		std::vector<spikeTracker> trackers; // [config * numChannels + channel]
+		std::vector<unsigned long long> counts; // same
+};
+
+#endif
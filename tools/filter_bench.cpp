@@ -0,0 +1,206 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Throughput of the bandpass filter ahead of detection, per instruction set,
+* on frame-interleaved blocks of either sample format as the pool filters
+* them. Every kernel is checked bit for bit against the scalar one, and the response of the
+* designed filter is measured with sine inputs. int16 samples of 0 counts
+* must be filtered like any other and only blanked ones left alone. Exits
+* non-zero on a mismatch.
+*/
+
+#include "biquad_filter.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double seconds(benchClock::time_point start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+// gain of the filter for a sine at f, from the last second of 2 s of input
+static double gainAt(double f, double fs, double low, double high, int order)
+{
+	biquadFilter filter;
+	filter.design(1, fs, low, high, order);
+	size_t n = 2 * fs;
+	std::vector<float> x(n);
+	for (size_t j = 0; j < n; j++)
+		x[j] = sin(2 * M_PI * f * j / fs);
+	filter.process(x.data(), n, 0, 1);
+	double peak = 0;
+	for (size_t j = n / 2; j < n; j++)
+		peak = std::max(peak, (double)fabs(x[j]));
+	return peak;
+}
+
+struct benchSetup {
+	int numChannels;
+	double fs, low, high;
+	int order;
+	size_t blockFrames;
+	int rounds;
+};
+
+// every kernel on frames of type T, int16 frames holding the input in
+// counts of lsb; false on a mismatch
+template<class T>
+static bool benchFormat(const char *name, const benchSetup &b, const std::vector<double> &input, double lsb)
+{
+	const crossingScanIsa isas[] = { scanScalar, scanSSE2, scanAVX2 };
+	std::vector<T> converted(input.size()), reference, frames(input.size());
+	for (size_t i = 0; i < input.size(); i++) {
+		if (input[i] == 0)
+			storeBlanked(converted[i]);
+		else
+			storeSample(converted[i], input[i] / lsb);
+	}
+	bool ok = true;
+	for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+		double elapsed = 0;
+		for (int r = 0; r < b.rounds; r++) {
+			biquadFilter filter;
+			if (!filter.setIsa(isas[k]))
+				break;
+			filter.design(b.numChannels, b.fs, b.low, b.high, b.order);
+			std::copy(converted.begin(), converted.end(), frames.begin());
+			benchClock::time_point start = benchClock::now();
+			filter.process(frames.data(), b.blockFrames, 0, b.numChannels);
+			elapsed += seconds(start);
+		}
+		if (elapsed == 0) {
+			printf("  %-7s %-7s n/a\n", name, crossingScanName(isas[k]));
+			continue;
+		}
+		if (reference.empty())
+			reference = frames;
+		bool same = memcmp(reference.data(), frames.data(), frames.size() * sizeof(T)) == 0;
+		ok &= same;
+		double samples = (double)b.blockFrames * b.numChannels * b.rounds;
+		printf("  %-7s %-7s %7.0f Msamples/s  %5.1f%% of a core for %d channels at %.0f Hz  %s\n", name, crossingScanName(isas[k]),
+			samples / elapsed * 1e-6, b.numChannels * b.fs / (samples / elapsed) * 100, b.numChannels, b.fs, same ? "ok" : "MISMATCH");
+	}
+	return ok;
+}
+
+// A step down to a long run of 0 counts, with blanked stretches, through
+// every int16 kernel. The highpass rings through the 0 counts, so they must
+// come out as the float filter gives for the same values (to within the
+// rounding to counts) while blanked samples stay blanked. float cannot hold
+// a 0 that is not blanked, so it gets a value far below one count instead.
+static bool checkZeroCounts(int numChannels, double fs, double low, double high, int order)
+{
+	const crossingScanIsa isas[] = { scanScalar, scanSSE2, scanAVX2 };
+	size_t n = fs / 10;
+	std::vector<int16_t> counts(n * numChannels);
+	std::vector<float> values(counts.size());
+	for (size_t i = 0; i < counts.size(); i++) {
+		size_t j = i / numChannels;
+		int c = i % numChannels;
+		if (j % 1000 >= 900 && c % 3 == 0) {
+			counts[i] = blankedCount;
+			values[i] = 0;
+		} else {
+			counts[i] = j % 1000 < 200 ? 1000 + 10 * c : 0;
+			values[i] = counts[i] != 0 ? counts[i] : 1e-20f;
+		}
+	}
+	biquadFilter reference;
+	reference.design(numChannels, fs, low, high, order);
+	reference.process(values.data(), n, 0, numChannels);
+
+	bool ok = true;
+	for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+		biquadFilter filter;
+		if (!filter.setIsa(isas[k]))
+			continue;
+		filter.design(numChannels, fs, low, high, order);
+		std::vector<int16_t> frames = counts;
+		filter.process(frames.data(), n, 0, numChannels);
+		size_t wrong = 0, ringing = 0;
+		for (size_t i = 0; i < frames.size(); i++) {
+			if (isBlanked(counts[i]))
+				wrong += !isBlanked(frames[i]);
+			else
+				wrong += isBlanked(frames[i]) || fabs(frames[i] - values[i]) > 1;
+			ringing += counts[i] == 0 && frames[i] != 0;
+		}
+		bool good = wrong == 0 && ringing > 0;
+		ok &= good;
+		printf("  zero counts %-7s %zu of %zu zero-count samples filtered to nonzero, %zu wrong  %s\n", crossingScanName(isas[k]),
+			ringing, (size_t)std::count(counts.begin(), counts.end(), 0), wrong, good ? "ok" : "MISMATCH");
+	}
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int numChannels = 256;
+	double fs = 40000;
+	double low = 300, high = 3000;
+	int order = 4;
+	size_t blockFrames = 20000;
+	int rounds = 10;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:f:l:u:o:b:n:h")) != -1) {
+		switch (opt) {
+			case 'c': numChannels = atoi(optarg); break;
+			case 'f': fs = atof(optarg); break;
+			case 'l': low = atof(optarg); break;
+			case 'u': high = atof(optarg); break;
+			case 'o': order = atoi(optarg); break;
+			case 'b': blockFrames = atoi(optarg); break;
+			case 'n': rounds = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-c channels] [-f fs] [-l low_Hz] [-u high_Hz] [-o order] [-b block_frames] [-n rounds]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	biquadFilter design;
+	design.design(numChannels, fs, low, high, order);
+	printf("bandpass %.0f-%.0f Hz, order %d per side (%d sections), %d channels at %.0f Hz\n", low, high, order,
+		design.numSections(), numChannels, fs);
+	const double probes[] = { 10, 60, low, sqrt(low * high), high, 10000 };
+	printf("  gain  ");
+	for (size_t k = 0; k < sizeof(probes) / sizeof(probes[0]); k++) {
+		if (probes[k] < fs / 2)
+			printf("  %.0f Hz %.3f", probes[k], gainAt(probes[k], fs, low, high, order));
+	}
+	printf("\n");
+
+	// noise with a little blanking, as from stimulation artifacts
+	srand(1);
+	std::vector<double> input(blockFrames * numChannels);
+	for (size_t i = 0; i < input.size(); i++)
+		input[i] = (i / numChannels) % 4000 < 40 ? 0 : (rand() / (double)RAND_MAX - 0.5) * 20e-6;
+
+	benchSetup setup = { numChannels, fs, low, high, order, blockFrames, rounds };
+	bool ok = benchFormat<float>("float32", setup, input, 1);
+	ok &= benchFormat<int16_t>("int16", setup, input, 0.1e-6);
+	ok &= checkZeroCounts(numChannels, fs, low, high, order);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,345 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Microbenchmarks for the detection kernels. Every variant of a kernel is
+* checked against the scalar one (or, for spike validation, the original
+* step-by-step checks) before it is timed; the program exits non-zero on a
+* mismatch. The matched filter is also checked to find negative spikes with
+* threshPolarity 1 (negative only).
+*/
+
+#include "crossing_scan.h"
+#include "spike_detector.h"
+#include "synthetic_source.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double seconds(benchClock::time_point start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+// one channel of synthetic data, sized like a detection window, as the
+// detector gets it from the frame buffer
+static std::vector<float> makeBlock(int length, double rate, unsigned seed)
+{
+	syntheticSource source(1, 20000, rate, 10e-6, 90e-6, seed);
+	std::vector<double> block(length);
+	source.read(block.data(), length);
+	return std::vector<float>(block.begin(), block.end());
+}
+
+static bool benchCrossingScan(int length, int rounds)
+{
+	const crossingScanIsa isas[] = { scanScalar, scanSSE2, scanAVX2 };
+	const char *polarities[] = { "bipolar", "negative", "positive" };
+	std::vector<float> block = makeBlock(length, 50, 1);
+	std::vector<int> reference(length), candidates(length);
+	float threshold = 5 * 10e-6;
+	float probe = 0.6745 * 10e-6;
+	bool ok = true;
+
+	printf("crossing scan, %d samples, threshold 5 sigma (Msamples/s)\n", length);
+	for (int polarity = 0; polarity < 3; polarity++) {
+		scanStats expectedStats, stats;
+		int expected = getCrossingScan(scanScalar)(block.data(), length, threshold, polarity, probe, reference.data(), &expectedStats);
+		printf("  %-9s", polarities[polarity]);
+		for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+			crossingScanFn scan = getCrossingScan(isas[k]);
+			if (!scan) {
+				printf("  %s n/a", crossingScanName(isas[k]));
+				continue;
+			}
+			int n = scan(block.data(), length, threshold, polarity, probe, candidates.data(), &stats);
+			if (n != expected || !std::equal(candidates.begin(), candidates.begin() + n, reference.begin())) {
+				printf("\n%s scan disagrees with scalar (%d vs %d candidates)\n", crossingScanName(isas[k]), n, expected);
+				ok = false;
+				continue;
+			}
+			// the vector kernels sum in a different order, the counts must match exactly
+			if (stats.numNonZero != expectedStats.numNonZero || stats.numAbove != expectedStats.numAbove ||
+					fabs(stats.sumSquares - expectedStats.sumSquares) > 1e-12 * expectedStats.sumSquares) {
+				printf("\n%s scan statistics disagree with scalar\n", crossingScanName(isas[k]));
+				ok = false;
+				continue;
+			}
+			benchClock::time_point start = benchClock::now();
+			for (int r = 0; r < rounds; r++)
+				n += scan(block.data(), length, threshold, polarity, probe, candidates.data(), &stats);
+			double t = seconds(start);
+			printf("  %s %8.0f", crossingScanName(isas[k]), (double)length * rounds / t * 1e-6);
+		}
+		printf("  (%d candidates)\n", expected);
+	}
+	return ok;
+}
+
+// the energy operator and matched filter of the detection methods, which
+// must match the scalar kernels bit for bit
+static bool benchDetectionSignal(int length, int rounds)
+{
+	const crossingScanIsa isas[] = { scanScalar, scanSSE2, scanAVX2 };
+	std::vector<float> block = makeBlock(length, 50, 2);
+	std::vector<float> reference(length), out(length);
+	int resolution = energyResolution(20000), center;
+	std::vector<double> smoothingTaps = energySmoothing(resolution);
+	std::vector<double> templateTaps = defaultSpikeTemplate(20000, &center);
+	std::vector<float> smoothing(smoothingTaps.begin(), smoothingTaps.end());
+	std::vector<float> taps(templateTaps.begin(), templateTaps.end());
+	bool ok = true;
+
+	printf("detection signal, %d samples (Msamples/s)\n", length);
+	for (int method = 0; method < 3; method++) {
+		const char *names[] = { "energy", "smoothing", "template" };
+		printf("  %-9s", names[method]);
+		for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+			energyKernelFn energy = getEnergyKernel(isas[k]);
+			matchedFilterFn filter = getMatchedFilter(isas[k]);
+			if (!energy || !filter) {
+				printf("  %s n/a", crossingScanName(isas[k]));
+				continue;
+			}
+			benchClock::time_point start;
+			for (int r = -1; r < rounds; r++) {
+				if (r == 0)
+					start = benchClock::now();
+				if (method == 0)
+					energy(block.data(), length, resolution, out.data());
+				else if (method == 1)
+					filter(block.data(), length, smoothing.data(), smoothing.size(), smoothing.size() / 2, out.data());
+				else
+					filter(block.data(), length, taps.data(), taps.size(), center, out.data());
+			}
+			double t = seconds(start);
+			if (k == 0)
+				reference = out;
+			bool same = std::equal(out.begin(), out.end(), reference.begin());
+			ok &= same;
+			printf("  %s %8.0f%s", crossingScanName(isas[k]), (double)length * rounds / t * 1e-6, same ? "" : " MISMATCH");
+		}
+		printf("  (%zu taps)\n", method == 0 ? (size_t)3 : method == 1 ? smoothing.size() : taps.size());
+	}
+	return ok;
+}
+
+// Negative spikes through the matched filter: negative only finds them all,
+// positive only (the side lobes) fewer, with the default template and with
+// it negated by the caller (setTemplate() flips it back).
+static bool checkMatchedPolarity(void)
+{
+	const double fs = 20000;
+	const int blockLength = 10000, numBlocks = 20;
+	int center;
+	std::vector<double> negated = defaultSpikeTemplate(fs, &center);
+	for (size_t k = 0; k < negated.size(); k++)
+		negated[k] = -negated[k];
+	bool ok = true;
+	printf("matched filter on negative spikes (found of injected)\n");
+	for (int custom = 0; custom < 2; custom++) {
+		const char *names[] = { "bipolar", "negative", "positive" };
+		long long found[3], injected = 0;
+		for (int polarity = 0; polarity < 3; polarity++) {
+			detectorParameters p(fs);
+			p.detectionMethod = detectMatchedFilter;
+			p.threshPolarity = polarity;
+			SpikeDetector detector(1, p);
+			detector.reset(1, blockLength);
+			if (custom)
+				detector.setTemplate(negated, center);
+			syntheticSource source(1, fs, 20, 10e-6, 90e-6, 3);
+			std::vector<double> block(blockLength);
+			std::vector<detectedSpike> spikes;
+			found[polarity] = 0;
+			for (int b = 0; b < numBlocks; b++) {
+				source.read(block.data(), blockLength);
+				spikes.clear();
+				found[polarity] += detector.processBlock(0, block.data(), blockLength, spikes);
+			}
+			injected = source.getInjected();
+		}
+		printf("  %-9s", custom ? "negated" : "default");
+		for (int polarity = 0; polarity < 3; polarity++)
+			printf("  %s %lld/%lld", names[polarity], found[polarity], injected);
+		// the side lobes of the filtered spike reach into the other band
+		bool good = found[1] >= 0.95 * injected && found[2] < 0.8 * found[1];
+		printf("%s\n", good ? "" : "  WRONG BAND");
+		ok &= good;
+	}
+	return ok;
+}
+
+// checkSpike()/getSpikeSlope() as they were before validateSpike(), kept as the golden reference
+static double referenceSlope(const detectorParameters &p, int spikeWidth, std::vector<double> absWave)
+{
+	double spikeSlopeEstimate = 0;
+	int diffWidth;
+
+	if (spikeWidth + 2 <= p.numPre)
+		diffWidth = spikeWidth + 2;
+	else
+		diffWidth = p.numPre;
+
+	for (int i = p.numPre + 1 - diffWidth; i < p.numPre + diffWidth; i++)
+	{
+		spikeSlopeEstimate += fabs(absWave[i + 1] - absWave[i]);
+	}
+
+	return spikeSlopeEstimate / (double)(2 * diffWidth);
+}
+
+static bool referenceCheckSpike(const detectorParameters &p, const std::vector<double> &waveform, int spikeWidth, double spikeMax)
+{
+	bool spikeWidthGood = p.maxSpikeWidth >= spikeWidth && p.minSpikeWidth <= spikeWidth;
+	if (!spikeWidthGood)
+		return spikeWidthGood;
+
+	std::vector<double> absWave;
+	absWave.resize(waveform.size());
+	for (size_t i = 0; i < waveform.size(); ++i)
+		absWave[i] = fabs(waveform[i]);
+
+	bool spikeMaxGood = spikeMax < p.maxSpikeAmp;
+	if (!spikeMaxGood)
+		return spikeMaxGood;
+
+	bool notTailend = absWave[0] < absWave[p.numPre];
+	if (!notTailend)
+		return notTailend;
+
+	bool spikeSlopeGood = referenceSlope(p, spikeWidth, absWave) > p.minSpikeSlope;
+	if (!spikeSlopeGood)
+		return spikeSlopeGood;
+
+	double numBlanked = 0;
+	for (size_t i = 0; i < absWave.size(); i++)
+	{
+		if (absWave[i] < 0.1e-6)
+			numBlanked++;
+		else
+			numBlanked = 0;
+		if (numBlanked > 5)
+			return false;
+	}
+	return true;
+}
+
+struct spikeCandidate {
+	int maxIndex;
+	int spikeWidth;
+};
+
+static bool benchValidateSpike(int length, int rounds)
+{
+	detectorParameters p(20000);
+	std::vector<float> block = makeBlock(length, 50, 2);
+	// blanked stretches of a few to a few dozen samples
+	for (int start = 1000; start + 40 < length; start += 1777)
+		std::fill(block.begin() + start, block.begin() + start + 3 + start % 37, 0.0f);
+	// every sample with a full snippet around it (for the longest snippets
+	// below) is a candidate, with widths across the whole range
+	const int margin = 30;
+	std::vector<spikeCandidate> candidates;
+	for (int i = margin; i + margin < length; i++) {
+		spikeCandidate c = { i, 1 + (i * 7919) % (int)(p.maxSpikeWidth + 2) };
+		candidates.push_back(c);
+	}
+
+	// golden check over several settings, both outcomes of every test must
+	// occur; the specialized snippet lengths and one generic one
+	const int snippets[][2] = { { 15, 15 }, { 8, 8 }, { 30, 30 }, { 10, 20 } };
+	const double slopes[] = { 0, 1e-6, 5e-6, 20e-6 };
+	const double amps[] = { 1000e-6, 20e-6 };
+	long long accepted = 0, mismatches = 0;
+	for (size_t w = 0; w < sizeof(snippets) / sizeof(snippets[0]); w++) {
+		p.numPre = snippets[w][0];
+		p.numPost = snippets[w][1];
+		spikeValidatorFn validator = getSpikeValidator(p.numPre, p.numPost);
+		std::vector<double> waveform(p.numPre + 1 + p.numPost);
+		for (size_t s = 0; s < sizeof(slopes) / sizeof(slopes[0]); s++) {
+			for (size_t a = 0; a < sizeof(amps) / sizeof(amps[0]); a++) {
+				p.minSpikeSlope = slopes[s];
+				p.maxSpikeAmp = amps[a];
+				for (size_t k = 0; k < candidates.size(); k++) {
+					const float *wave = &block[candidates[k].maxIndex - p.numPre];
+					std::copy(wave, wave + waveform.size(), waveform.begin());
+					double spikeMax = block[candidates[k].maxIndex];
+					bool expected = referenceCheckSpike(p, waveform, candidates[k].spikeWidth, spikeMax);
+					mismatches += expected != validateSpike(p, wave, candidates[k].spikeWidth, spikeMax);
+					mismatches += expected != validator(p, wave, candidates[k].spikeWidth, spikeMax);
+					accepted += expected;
+				}
+			}
+		}
+	}
+	printf("spike validation, %zu candidates x 4 snippets x 8 settings: %lld accepted, %lld mismatches\n",
+		candidates.size(), accepted, mismatches);
+
+	// timing at the plug-in defaults
+	p = detectorParameters(20000);
+	std::vector<double> waveform(p.numPre + 1 + p.numPost);
+	spikeValidatorFn validator = getSpikeValidator(p.numPre, p.numPost);
+	int n = candidates.size() < (size_t)rounds * 10 ? candidates.size() : rounds * 10;
+	long long sink = 0;
+	benchClock::time_point start = benchClock::now();
+	for (int k = 0; k < n; k++) {
+		const float *wave = &block[candidates[k].maxIndex - p.numPre];
+		std::copy(wave, wave + waveform.size(), waveform.begin());
+		sink += referenceCheckSpike(p, waveform, candidates[k].spikeWidth, block[candidates[k].maxIndex]);
+	}
+	double reference = seconds(start);
+	start = benchClock::now();
+	for (int k = 0; k < n; k++)
+		sink += validateSpike(p, &block[candidates[k].maxIndex - p.numPre], candidates[k].spikeWidth, block[candidates[k].maxIndex]);
+	double fused = seconds(start);
+	start = benchClock::now();
+	for (int k = 0; k < n; k++)
+		sink += validator(p, &block[candidates[k].maxIndex - p.numPre], candidates[k].spikeWidth, block[candidates[k].maxIndex]);
+	double fixed = seconds(start);
+	printf("  ns/candidate     reference %6.1f  fused %6.1f  fixed %d+1+%d %6.1f  (%lld)\n", reference / n * 1e9,
+		fused / n * 1e9, p.numPre, p.numPost, fixed / n * 1e9, sink);
+	return mismatches == 0;
+}
+
+int main(int argc, char **argv)
+{
+	int length = 10000;
+	int rounds = 2000;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:n:h")) != -1) {
+		switch (opt) {
+			case 'l': length = atoi(optarg); break;
+			case 'n': rounds = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-l block_length] [-n rounds]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	bool ok = benchCrossingScan(length, rounds);
+	ok &= benchDetectionSignal(length, rounds / 10);
+	ok &= benchValidateSpike(length * 10, rounds);
+	ok &= checkMatchedPolarity();
+	return ok ? 0 : 1;
+}
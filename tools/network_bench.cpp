@@ -0,0 +1,223 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+/*
+* Accuracy and cost of the streaming network analytics. Poisson spike
+* trains with injected network bursts are fed in detection passes, in
+* channel order within a pass, as the detection pool does. After every pass
+* the population rate and active channel count must equal a brute-force
+* count over the spikes of the rate window, and the ISI histogram must hold
+* every interval, and no spike may miss the windows; exits non-zero
+* otherwise. The windows are checked again with passes of 4 s, as when
+* detection falls behind. The detected bursts are matched to the injected
+* ones.
+*/
+
+#include "network_analytics.h"
+#include "pipeline_stats.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+struct injectedBurst {
+	long long start;
+	long long end;
+};
+
+struct passCheck {
+	long long checks;
+	long long wrongRate;
+	long long wrongActive;
+};
+
+// Each pass adds the spikes up to its end less a carry-over, then advances
+// past them, as the pool does after a detection pass. After every pass the
+// windows are checked against a brute-force count.
+static passCheck feedPasses(networkAnalytics &network, const std::vector<std::vector<long long> > &trains, const std::vector<long long> &all,
+		long long total, long long passFrames, long long carry, double fs, latencyHistogram &passCost, uint64_t &busy)
+{
+	const networkParameters &params = network.getParameters();
+	int numChannels = trains.size();
+	long long binSamples = std::max(1LL, llround(params.binWidth * fs));
+	long long windowSamples = std::max(1LL, llround(params.rateWindow * fs / binSamples)) * binSamples;
+	std::vector<size_t> next(numChannels, 0);
+	passCheck result = { 0, 0, 0 };
+	for (long long end = passFrames; end < total + passFrames; end += passFrames) {
+		long long added = end - carry;
+		benchClock::time_point start = benchClock::now();
+		for (int c = 0; c < numChannels; c++) {
+			for (; next[c] < trains[c].size() && trains[c][next[c]] < added; next[c]++)
+				network.add(c, trains[c][next[c]]);
+		}
+		network.advance(added);
+		uint64_t cost = std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock::now() - start).count();
+		passCost.record(cost);
+		busy += cost;
+
+		// the windows end at the last bin boundary before the advance
+		long long windowEnd = added / binSamples * binSamples;
+		if (windowEnd < windowSamples)
+			continue;
+		long long windowStart = windowEnd - windowSamples;
+		long long inWindow = std::lower_bound(all.begin(), all.end(), windowEnd) - std::lower_bound(all.begin(), all.end(), windowStart);
+		int active = 0;
+		for (int c = 0; c < numChannels; c++)
+			active += std::lower_bound(trains[c].begin(), trains[c].end(), windowEnd) != std::lower_bound(trains[c].begin(), trains[c].end(), windowStart);
+		result.checks++;
+		result.wrongRate += fabs(network.populationRate() - inWindow * fs / windowSamples) > 1e-6;
+		result.wrongActive += network.activeChannels() != active;
+	}
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	int numChannels = 60;
+	double fs = 20000;
+	double seconds = 300;
+	double baseRate = 1; // (Hz) per channel
+	double burstInterval = 5; // (s) mean time between bursts
+	double burstLength = 0.2; // (s)
+	double burstFraction = 0.5; // of the channels
+	double burstRate = 40; // (Hz) per channel in a burst
+	double passTime = 0.5;
+	unsigned seed = 1;
+	networkParameters params;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:f:t:r:b:d:p:R:w:o:O:m:s:h")) != -1) {
+		switch (opt) {
+			case 'c': numChannels = atoi(optarg); break;
+			case 'f': fs = atof(optarg); break;
+			case 't': seconds = atof(optarg); break;
+			case 'r': baseRate = atof(optarg); break;
+			case 'b': burstInterval = atof(optarg); break;
+			case 'd': burstLength = atof(optarg); break;
+			case 'p': burstFraction = atof(optarg); break;
+			case 'R': burstRate = atof(optarg); break;
+			case 'w': passTime = atof(optarg); break;
+			case 'o': params.burstOnset = atof(optarg); break;
+			case 'O': params.burstOffset = atof(optarg); break;
+			case 'm': params.burstMinChannels = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-c channels] [-f fs] [-t seconds] [-r rate_hz] [-b burst_interval_s] [-d burst_s] "
+					"[-p burst_fraction] [-R burst_rate_hz] [-w pass_s] [-o onset] [-O offset] [-m min_channels] [-s seed]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	// spike trains: background everywhere, and a random subset of the
+	// channels firing faster during each burst
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<double> uniform(0, 1);
+	long long total = (long long)(seconds * fs);
+	std::vector<injectedBurst> injected;
+	for (double t = 1 + burstInterval * -log(1 - uniform(rng)); t + burstLength < seconds;
+			t += burstLength + 1 + burstInterval * -log(1 - uniform(rng))) {
+		injectedBurst b = { (long long)(t * fs), (long long)((t + burstLength) * fs) };
+		injected.push_back(b);
+	}
+	std::vector<std::vector<long long> > trains(numChannels);
+	for (int c = 0; c < numChannels; c++) {
+		for (double t = -log(1 - uniform(rng)) / baseRate; t < seconds; t += -log(1 - uniform(rng)) / baseRate)
+			trains[c].push_back((long long)(t * fs));
+	}
+	for (size_t k = 0; k < injected.size(); k++) {
+		for (int c = 0; c < numChannels; c++) {
+			if (uniform(rng) >= burstFraction)
+				continue;
+			for (double t = injected[k].start - log(1 - uniform(rng)) * fs / burstRate; t < injected[k].end;
+					t -= log(1 - uniform(rng)) * fs / burstRate)
+				trains[c].push_back((long long)t);
+		}
+	}
+	long long numSpikes = 0, intervals = 0;
+	std::vector<long long> all;
+	for (int c = 0; c < numChannels; c++) {
+		std::sort(trains[c].begin(), trains[c].end());
+		trains[c].erase(std::unique(trains[c].begin(), trains[c].end()), trains[c].end());
+		numSpikes += trains[c].size();
+		intervals += std::max(0, (int)trains[c].size() - 1);
+		all.insert(all.end(), trains[c].begin(), trains[c].end());
+	}
+	std::sort(all.begin(), all.end());
+
+	// spikes reach up to a pass and the carry-over past the last advance
+	networkAnalytics network;
+	long long passFrames = std::max(1LL, (long long)(passTime * fs));
+	long long carry = (long long)(2e-3 * fs);
+	network.configure(numChannels, fs, params, (double)(passFrames + carry) / fs);
+	latencyHistogram passCost;
+	uint64_t busy = 0;
+	passCheck check = feedPasses(network, trains, all, total, passFrames, carry, fs, passCost, busy);
+	// and again with passes of several seconds, as when detection falls
+	// behind and a pass takes the whole buffer
+	networkAnalytics longNetwork;
+	long long longFrames = std::max(passFrames, (long long)(4 * fs));
+	longNetwork.configure(numChannels, fs, params, (double)(longFrames + carry) / fs);
+	latencyHistogram longCost;
+	uint64_t longBusy = 0;
+	passCheck longCheck = feedPasses(longNetwork, trains, all, total, longFrames, carry, fs, longCost, longBusy);
+	std::vector<unsigned long long> histogram;
+	network.isiHistogram(-1, histogram);
+	long long histogrammed = 0;
+	for (size_t k = 0; k < histogram.size(); k++)
+		histogrammed += histogram[k];
+
+	// a detected burst overlapping an injected one is a hit
+	std::vector<networkBurst> found;
+	network.recentBursts(found);
+	long long hits = 0, falseBursts = 0;
+	double onsetError = 0, lengthError = 0;
+	std::vector<bool> matched(injected.size(), false);
+	for (size_t k = 0; k < found.size(); k++) {
+		long long s = (long long)(found[k].start * fs), e = (long long)((found[k].start + found[k].duration) * fs);
+		bool hit = false;
+		for (size_t i = 0; i < injected.size() && !hit; i++) {
+			if (!matched[i] && s < injected[i].end && e > injected[i].start) {
+				matched[i] = hit = true;
+				hits++;
+				onsetError += fabs(s - injected[i].start) / fs;
+				lengthError += fabs((e - s) - (injected[i].end - injected[i].start)) / fs;
+			}
+		}
+		falseBursts += !hit;
+	}
+
+	printf("%d channels at %.0f Hz, %.0f s, %.1f Hz background, %zu bursts of %.2f s on %.0f%% of the channels at %.0f Hz\n",
+		numChannels, fs, seconds, baseRate, injected.size(), burstLength, burstFraction * 100, burstRate);
+	printf("windows            %lld passes checked, %lld wrong population rates, %lld wrong active channel counts, %llu spikes late\n",
+		check.checks, check.wrongRate, check.wrongActive, network.spikesLate());
+	printf("%4.1f s passes      %lld passes checked, %lld wrong population rates, %lld wrong active channel counts, %llu spikes late\n",
+		longFrames / fs, longCheck.checks, longCheck.wrongRate, longCheck.wrongActive, longNetwork.spikesLate());
+	printf("ISI histogram      %lld intervals of %lld\n", histogrammed, intervals);
+	printf("bursts             %zu found, %lld of %zu injected (%.1f%%), %lld false, onset off by %.1f ms and length by %.1f ms on average\n",
+		found.size(), hits, injected.size(), injected.empty() ? 0 : 100.0 * hits / injected.size(), falseBursts,
+		hits ? onsetError / hits * 1e3 : 0, hits ? lengthError / hits * 1e3 : 0);
+	network.print(stdout);
+	passCost.print(stdout, "pass cost", 1e-3, "us");
+	printf("cost               %.1f ns per spike, %.4f%% of a core\n", (double)busy / numSpikes, busy * 1e-7 / seconds);
+	bool ok = check.wrongRate == 0 && check.wrongActive == 0 && network.spikesLate() == 0;
+	ok &= longCheck.wrongRate == 0 && longCheck.wrongActive == 0 && longNetwork.spikesLate() == 0;
+	return ok && histogrammed == intervals ? 0 : 1;
+}
@@ -0,0 +1,360 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Re-runs spike detection over a raw recording with new settings, on every
+* core and faster than real time. Optionally writes the spikes to a spike
+* file, checks them against a single-threaded run of the same detector, and
+* compares them with the spike file recorded live. Settings given as comma
+* separated lists are swept: every combination is evaluated in a single pass
+* over the data and the spike counts and rates of each are listed.
+*/
+
+#include "offline_replay.h"
+#include "spike_file.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <thread>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double seconds(benchClock::time_point start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-j threads] [-w window_s] [-S segment_s] [-u warmup_s] [-m threshold_multiplier]\n"
+		"          [-M max_width_ms] [-N min_width_ms] [-A max_amplitude_uV] [-s min_slope_uV_per_s]\n"
+		"          [-d dead_time_ms] [-p polarity] [-D method] [-T noise_time_constant_s] [-W pre_ms,post_ms]\n"
+		"          [-B low_Hz,high_Hz] [-C mean|median] [-X channels] [-o spike_file] [-c live_spike_file] [-r] raw_base\n"
+		"  -D is threshold, energy or matched (filter)\n"
+		"  -T and -W are \"Noise time constant (s)\" and \"Snippet before/after peak (ms)\" live\n"
+		"  -B bandpass-filters the traces as \"Bandpass low/high (Hz)\" do live, 0 turns an edge off\n"
+		"  -C removes the per-frame mean or median of the channels not excluded by -X (e.g. 0,15-16),\n"
+		"     as \"Common reference\" and \"Reference exclude\" do live\n"
+		"  -m, -M, -N, -A, -s, -d and -D take comma separated lists to sweep every combination\n"
+		"  -w must match \"Detection window (s)\" of the recording to find what the plug-in found\n"
+		"  -u trains every segment on this much data before it instead of carrying the\n"
+		"     detector state over (parallel in time, not exact near segment edges)\n"
+		"  -r checks the result against a single-threaded run over the whole recording,\n"
+		"     or the counts of a sweep against a separate run per setting\n"
+		"  -c reports how many spikes match those of a spike file recorded live\n", name);
+}
+
+// the whole recording through one detector, block by block, channel by
+// channel; the replay has prepared the reference
+static std::vector<pooledSpike> sequentialDetect(const offlineReplay &replay, const detectorParameters &params, const offlineOptions &options)
+{
+	const rawFileReader &reader = replay.getReader();
+	int numChannels = reader.getNumChannels();
+	size_t blockFrames = options.blockFrames;
+	SpikeDetector detector(numChannels, params);
+	detector.reset(numChannels, blockFrames);
+	std::vector<rawChannelCursor> cursors(numChannels);
+	std::vector<biquadFilter> filters;
+	offlineFilters(options, reader.getSamplingFrequency(), numChannels, filters);
+	std::vector<detectedSpike> spikes;
+	std::vector<pooledSpike> result;
+	for (unsigned long long position = 0; position < replay.numFrames(); position += blockFrames) {
+		size_t length = std::min<unsigned long long>(blockFrames, replay.numFrames() - position);
+		for (int c = 0; c < numChannels; c++) {
+			float *samples = detector.appendBuffer(c, length);
+			cursors[c].read(reader, replay.getBlockStarts(), c, position, length, samples);
+			replay.applyReference(c, position, length, samples);
+			filters[c].process(samples, length, 0, 1);
+			spikes.clear();
+			detector.processWindow(c, length, spikes);
+			for (size_t k = 0; k < spikes.size(); k++) {
+				pooledSpike spike = { replay.stampAt(position + spikes[k].maxIndex), spikes[k] };
+				result.push_back(spike);
+			}
+		}
+	}
+	std::sort(result.begin(), result.end(), spikeOrder);
+	return result;
+}
+
+// "a,b,c" times scale
+static std::vector<double> parseList(const char *text, double scale)
+{
+	std::vector<double> values;
+	for (const char *p = text; *p;) {
+		char *end;
+		values.push_back(strtod(p, &end) * scale);
+		p = *end == ',' ? end + 1 : end + strlen(end);
+	}
+	return values;
+}
+
+// "threshold,energy,matched" as detectionMethod values
+static std::vector<double> parseMethods(const char *text)
+{
+	std::vector<double> values;
+	for (const char *p = text; *p;) {
+		values.push_back(*p == 'e' ? detectEnergy : *p == 'm' ? detectMatchedFilter : detectThreshold);
+		const char *end = strchr(p, ',');
+		p = end ? end + 1 : p + strlen(p);
+	}
+	return values;
+}
+
+// every combination of the listed values, later options varying fastest
+static void expand(std::vector<detectorParameters> &configs, const std::vector<double> &values,
+		void (*set)(detectorParameters &, double))
+{
+	if (values.empty())
+		return;
+	std::vector<detectorParameters> expanded;
+	for (size_t i = 0; i < configs.size(); i++) {
+		for (size_t k = 0; k < values.size(); k++) {
+			expanded.push_back(configs[i]);
+			set(expanded.back(), values[k]);
+		}
+	}
+	configs.swap(expanded);
+}
+
+static int sweep(offlineReplay &replay, const std::vector<detectorParameters> &configs, const offlineOptions &options, bool check)
+{
+	const rawFileReader &reader = replay.getReader();
+	int numChannels = reader.getNumChannels();
+	double fs = reader.getSamplingFrequency();
+	double dataSeconds = replay.numFrames() / fs;
+	detectorSweep sweep(configs);
+	sweep.reset(numChannels, options.blockFrames);
+	benchClock::time_point start = benchClock::now();
+	replay.run(sweep, options);
+	double elapsed = seconds(start);
+
+	printf("recording          %d channels at %.0f Hz, %.1f s in %zu blocks\n", numChannels, fs, dataSeconds, reader.numBlocks());
+	printf("sweep              %d settings sharing %d scan%s, %d thread%s, %.3g s windows\n", sweep.numConfigs(),
+		sweep.numScans(), sweep.numScans() == 1 ? "" : "s", options.numThreads, options.numThreads == 1 ? "" : "s",
+		options.blockFrames / fs);
+	printf("throughput         %.3g setting-samples/s (%.0fx real time for all settings)\n",
+		replay.numFrames() * (double)numChannels * sweep.numConfigs() / elapsed, dataSeconds / elapsed);
+	const char *methodNames[] = { "thresh", "energy", "match" };
+	printf("\n   # method thresh  max w  min w  max amp    slope   dead    spikes  rate/ch  active\n");
+	printf("              (x)   (ms)   (ms)     (uV)   (uV/s)   (ms)              (Hz)  (>0.1 Hz)\n");
+	bool ok = true;
+	std::vector<pooledSpike> none;
+	for (int k = 0; k < sweep.numConfigs(); k++) {
+		const detectorParameters &p = sweep.getParameters(k);
+		unsigned long long total = 0;
+		int active = 0;
+		for (int c = 0; c < numChannels; c++) {
+			total += sweep.spikeCount(k, c);
+			active += sweep.spikeCount(k, c) > 0.1 * dataSeconds;
+		}
+		printf("%4d %-6s %6.2f %6.2f %6.2f %8.0f %8.2f %6.2f %9llu %8.2f %7d", k, methodNames[p.detectionMethod], p.thresholdMultiplier, p.maxSpikeWidth * 1e3 / fs,
+			p.minSpikeWidth * 1e3 / fs, p.maxSpikeAmp * 1e6, p.minSpikeSlope * 1e6, p.deadTime * 1e3 / fs, total,
+			total / dataSeconds / numChannels, active);
+		if (check) {
+			// the same setting on its own, channel by channel
+			std::vector<unsigned long long> alone(numChannels, 0);
+			replay.run(p, options, [&](std::vector<pooledSpike> &segment) {
+				for (size_t i = 0; i < segment.size(); i++)
+					alone[segment[i].spike.channel]++;
+			});
+			int differ = 0;
+			for (int c = 0; c < numChannels; c++)
+				differ += alone[c] != sweep.spikeCount(k, c);
+			printf("  %s", differ ? "MISMATCH" : "ok");
+			ok &= differ == 0;
+		}
+		printf("\n");
+	}
+	return ok ? 0 : 1;
+}
+
+static bool sameSpike(const pooledSpike &a, const pooledSpike &b)
+{
+	return a.sampleIndex == b.sampleIndex && a.spike.channel == b.spike.channel && a.spike.threshold == b.spike.threshold &&
+		a.spike.waveLength == b.spike.waveLength && std::equal(a.spike.wave, a.spike.wave + a.spike.waveLength, b.spike.wave);
+}
+
+int main(int argc, char **argv)
+{
+	int numThreads = std::max(1u, std::thread::hardware_concurrency());
+	double spikeDetectWindow = 500e-3;
+	double segmentSeconds = 60;
+	double warmupSeconds = 0;
+	std::vector<double> multipliers, maxWidths, minWidths, maxAmps, minSlopes, deadTimes, methods;
+	int polarity = -1;
+	double noiseTimeConstant = -1;
+	double snippetPre = -1, snippetPost = -1;
+	double filterLow = 0, filterHigh = 0;
+	referenceMode referenceSetting = referenceNone;
+	const char *exclude = "";
+	const char *outputFile = NULL;
+	const char *liveFile = NULL;
+	bool check = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "j:w:S:u:m:M:N:A:s:d:p:D:T:W:B:C:X:o:c:rh")) != -1) {
+		switch (opt) {
+			case 'j': numThreads = atoi(optarg); break;
+			case 'w': spikeDetectWindow = atof(optarg); break;
+			case 'S': segmentSeconds = atof(optarg); break;
+			case 'u': warmupSeconds = atof(optarg); break;
+			case 'm': multipliers = parseList(optarg, 1); break;
+			case 'M': maxWidths = parseList(optarg, 1e-3); break;
+			case 'N': minWidths = parseList(optarg, 1e-3); break;
+			case 'A': maxAmps = parseList(optarg, 1e-6); break;
+			case 's': minSlopes = parseList(optarg, 1e-6); break;
+			case 'd': deadTimes = parseList(optarg, 1e-3); break;
+			case 'p': polarity = atoi(optarg); break;
+			case 'D': methods = parseMethods(optarg); break;
+			case 'T': noiseTimeConstant = atof(optarg); break;
+			case 'W': sscanf(optarg, "%lf,%lf", &snippetPre, &snippetPost); break;
+			case 'B': sscanf(optarg, "%lf,%lf", &filterLow, &filterHigh); break;
+			case 'C': referenceSetting = strcmp(optarg, "median") == 0 ? referenceMedian : referenceMean; break;
+			case 'X': exclude = optarg; break;
+			case 'o': outputFile = optarg; break;
+			case 'c': liveFile = optarg; break;
+			case 'r': check = true; break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind + 1 != argc) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rawFileReader reader;
+	if (!reader.open(argv[optind])) {
+		fprintf(stderr, "%s: not a raw recording\n", argv[optind]);
+		return 1;
+	}
+	double fs = reader.getSamplingFrequency();
+	std::vector<detectorParameters> configs(1, detectorParameters(fs));
+	if (polarity >= 0)
+		configs[0].threshPolarity = polarity;
+	// converted as the plug-in converts its parameters
+	if (noiseTimeConstant >= 0)
+		configs[0].noiseTimeConstant = std::max(1 / fs, noiseTimeConstant);
+	if (snippetPre >= 0)
+		configs[0].numPre = std::max(1, (int)lround(snippetPre * fs / 1e3));
+	if (snippetPost >= 0)
+		configs[0].numPost = std::max(1, (int)lround(snippetPost * fs / 1e3));
+	expand(configs, multipliers, [](detectorParameters &p, double v) { p.thresholdMultiplier = v; });
+	expand(configs, maxWidths, [](detectorParameters &p, double v) { p.maxSpikeWidth = floor(v * p.samplingFrequency); });
+	expand(configs, minWidths, [](detectorParameters &p, double v) { p.minSpikeWidth = floor(v * p.samplingFrequency); });
+	expand(configs, maxAmps, [](detectorParameters &p, double v) { p.maxSpikeAmp = v; });
+	expand(configs, minSlopes, [](detectorParameters &p, double v) { p.minSpikeSlope = v; });
+	expand(configs, deadTimes, [](detectorParameters &p, double v) { p.deadTime = (int)(v * p.samplingFrequency); });
+	expand(configs, methods, [](detectorParameters &p, double v) { p.detectionMethod = (int)v; });
+	const detectorParameters &params = configs[0];
+
+	offlineOptions options;
+	options.numThreads = numThreads;
+	options.blockFrames = std::max(1L, lround(spikeDetectWindow * fs));
+	options.segmentBlocks = std::max(1L, lround(segmentSeconds * fs / options.blockFrames));
+	options.warmupBlocks = (size_t)ceil(warmupSeconds * fs / options.blockFrames);
+	options.lowCut = filterLow;
+	options.highCut = filterHigh;
+	options.reference = referenceSetting;
+	if (!parseChannelList(exclude, reader.getNumChannels(), options.referenceExclude)) {
+		fprintf(stderr, "bad channel list %s\n", exclude);
+		return 1;
+	}
+
+	offlineReplay replay(reader);
+	if (configs.size() > 1)
+		return sweep(replay, configs, options, check);
+	spikeFileWriter writer;
+	if (outputFile) {
+		if (!writer.open(outputFile, reader.getNumChannels(), fs)) {
+			perror(outputFile);
+			return 1;
+		}
+		writer.setBlocking(true);
+	}
+	std::vector<pooledSpike> all;
+	benchClock::time_point start = benchClock::now();
+	unsigned long long numSpikes = replay.run(params, options, [&](std::vector<pooledSpike> &segment) {
+		for (size_t k = 0; k < segment.size(); k++)
+			writer.append(segment[k].sampleIndex, segment[k].spike);
+		writer.flush();
+		if (check || liveFile)
+			all.insert(all.end(), segment.begin(), segment.end());
+	});
+	writer.close();
+	double elapsed = seconds(start);
+	double dataSeconds = replay.numFrames() / fs;
+
+	printf("recording          %d channels at %.0f Hz, %.1f s in %zu blocks\n", reader.getNumChannels(), fs, dataSeconds, reader.numBlocks());
+	printf("sharding           %d thread%s, %.3g s windows, %.3g s segments, %s\n", numThreads, numThreads == 1 ? "" : "s",
+		options.blockFrames / fs, options.blockFrames * options.segmentBlocks / fs,
+		options.warmupBlocks ? "independent after warm-up" : "state carried over");
+	printf("spikes detected    %llu (%.1f spikes/s of data)\n", numSpikes, numSpikes / dataSeconds);
+	printf("throughput         %.3g samples/s (%.0fx real time)\n", replay.numFrames() * (double)reader.getNumChannels() / elapsed,
+		dataSeconds / elapsed);
+	if (outputFile)
+		printf("spike file         %llu records, %llu dropped\n", writer.recordsWritten(), writer.recordsDropped());
+
+	bool ok = true;
+	if (check) {
+		std::sort(all.begin(), all.end(), spikeOrder);
+		start = benchClock::now();
+		std::vector<pooledSpike> reference = sequentialDetect(replay, params, options);
+		double sequential = seconds(start);
+		// merge on (stamp, channel); with the state carried over every field must agree
+		size_t matched = 0, identical = 0;
+		for (size_t i = 0, k = 0; i < all.size() && k < reference.size();) {
+			if (spikeOrder(all[i], reference[k]))
+				i++;
+			else if (spikeOrder(reference[k], all[i]))
+				k++;
+			else {
+				matched++;
+				identical += sameSpike(all[i++], reference[k++]);
+			}
+		}
+		ok = options.warmupBlocks > 0 || (identical == all.size() && identical == reference.size());
+		printf("single-threaded    %zu spikes in %.2f s, %zu at the same time and channel, %zu identical%s\n", reference.size(),
+			sequential, matched, identical, ok ? "" : ", MISMATCH");
+	}
+	if (liveFile) {
+		spikeFileReader live;
+		if (!live.open(liveFile)) {
+			fprintf(stderr, "%s: not a spike file\n", liveFile);
+			return 1;
+		}
+		std::set<std::pair<unsigned long long, int> > offline;
+		for (size_t k = 0; k < all.size(); k++)
+			offline.insert(std::make_pair(all[k].sampleIndex, all[k].spike.channel));
+		size_t numLive = 0, matched = 0;
+		for (size_t i = 0; i < live.size(); i++) {
+			const spikeFileRecord &r = live.record(i);
+			if (r.type != SPIKE_RECORD)
+				continue;
+			numLive++;
+			matched += offline.count(std::make_pair((unsigned long long)r.sampleIndex, (int)r.channel));
+		}
+		printf("live spikes        %zu, %zu found offline, %zu only offline\n", numLive, matched, offline.size() - matched);
+	}
+	return ok ? 0 : 1;
+}
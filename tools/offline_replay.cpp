@@ -0,0 +1,302 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Offline detection over a raw recording, sharded by channel and time segment
+*/
+
+#include "offline_replay.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+bool spikeOrder(const pooledSpike &a, const pooledSpike &b)
+{
+	if (a.sampleIndex != b.sampleIndex)
+		return a.sampleIndex < b.sampleIndex;
+	return a.spike.channel < b.spike.channel;
+}
+
+void offlineFilters(const offlineOptions &options, double samplingFrequency, size_t n, std::vector<biquadFilter> &filters)
+{
+	filters.assign(n, biquadFilter());
+	for (size_t k = 0; k < n; k++)
+		filters[k].design(1, samplingFrequency, options.lowCut, options.highCut);
+}
+
+void rawChannelCursor::read(const rawFileReader &reader, const std::vector<unsigned long long> &blockStarts, int ch,
+		unsigned long long position, size_t n, float *out)
+{
+	const double lsb = reader.getLsb();
+	while (n > 0) {
+		if (ch != channel || block + 1 >= blockStarts.size() || position < blockStarts[block] || position >= blockStarts[block + 1]) {
+			block = std::upper_bound(blockStarts.begin(), blockStarts.end() - 1, position) - blockStarts.begin() - 1;
+			channel = ch;
+			counts.resize(reader.block(block).frames);
+			if (!reader.readChannel(block, channel, counts.data()))
+				std::fill(counts.begin(), counts.end(), 0); // a corrupt block reads as blanked
+		}
+		size_t offset = position - blockStarts[block];
+		size_t k = std::min(n, counts.size() - offset);
+		for (size_t j = 0; j < k; j++)
+			out[j] = (float)(counts[offset + j] * lsb);
+		out += k;
+		position += k;
+		n -= k;
+	}
+}
+
+offlineReplay::offlineReplay(const rawFileReader &r) : reader(r), referenceSetting(referenceNone)
+{
+	blockStarts.push_back(0);
+	for (size_t i = 0; i < reader.numBlocks(); i++)
+		blockStarts.push_back(blockStarts.back() + reader.block(i).frames);
+}
+
+void offlineReplay::prepareReference(const offlineOptions &options)
+{
+	if (options.reference == referenceSetting && options.referenceExclude == referenceExclude)
+		return;
+	referenceSetting = options.reference;
+	referenceExclude = options.referenceExclude;
+	const int numChannels = reader.getNumChannels();
+	commonReference setup;
+	setup.configure(numChannels, referenceSetting, referenceExclude);
+	std::vector<float>().swap(referenceSeries);
+	referenced.assign(numChannels, false);
+	if (!setup.isEnabled())
+		return;
+	for (int c = 0; c < numChannels; c++)
+		referenced[c] = setup.isIncluded(c);
+
+	// blocks decode to the floats rawChannelCursor gives, frame-interleaved
+	referenceSeries.resize(numFrames());
+	std::atomic<size_t> nextBlock(0);
+	auto work = [&]() {
+		commonReference reference;
+		reference.configure(numChannels, referenceSetting, referenceExclude);
+		std::vector<int16_t> counts;
+		std::vector<float> frames;
+		std::vector<double> values;
+		const double lsb = reader.getLsb();
+		for (size_t b = nextBlock.fetch_add(1, std::memory_order_relaxed); b < reader.numBlocks();
+				b = nextBlock.fetch_add(1, std::memory_order_relaxed)) {
+			size_t n = reader.block(b).frames;
+			counts.resize(n);
+			frames.resize(n * numChannels);
+			values.resize(n);
+			for (int c = 0; c < numChannels; c++) {
+				if (!reader.readChannel(b, c, counts.data()))
+					std::fill(counts.begin(), counts.end(), 0);
+				for (size_t j = 0; j < n; j++)
+					frames[j * numChannels + c] = (float)(counts[j] * lsb);
+			}
+			reference.frameReference(frames.data(), n, values.data());
+			std::copy(values.begin(), values.end(), referenceSeries.begin() + blockStarts[b]);
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int k = 0; k < std::max(options.numThreads, 1); k++)
+		threads.push_back(std::thread(work));
+	for (size_t k = 0; k < threads.size(); k++)
+		threads[k].join();
+}
+
+// as commonReference::process() on float frames, in float
+void offlineReplay::applyReference(int channel, unsigned long long position, size_t n, float *samples) const
+{
+	if (referenceSeries.empty() || !referenced[channel])
+		return;
+	const float *ref = &referenceSeries[position];
+	for (size_t j = 0; j < n; j++) {
+		if (!isBlanked(samples[j]) && !std::isnan(ref[j]))
+			samples[j] = (float)(samples[j] - (double)ref[j]);
+	}
+}
+
+unsigned long long offlineReplay::stampAt(long long position) const
+{
+	if (reader.numBlocks() == 0)
+		return position;
+	if (position < 0)
+		return reader.block(0).firstStamp + position;
+	size_t i = std::upper_bound(blockStarts.begin(), blockStarts.end() - 1, (unsigned long long)position) - blockStarts.begin() - 1;
+	return reader.block(i).firstStamp + (position - blockStarts[i]);
+}
+
+void offlineReplay::forEachUnit(const offlineOptions &options, const unitFn &unit, const std::function<void(size_t)> &segmentDone)
+{
+	const int numChannels = reader.getNumChannels();
+	const unsigned long long frames = numFrames();
+	const size_t blockFrames = std::max<size_t>(options.blockFrames, 1);
+	const unsigned long long segmentFrames = blockFrames * std::max<size_t>(options.segmentBlocks, 1);
+	const size_t numSegments = (frames + segmentFrames - 1) / segmentFrames;
+	const size_t numUnits = numSegments * numChannels;
+	const bool chained = options.warmupBlocks == 0;
+
+	// progress[c] is the next segment of channel c that may start
+	std::unique_ptr<std::atomic<size_t>[]> progress(new std::atomic<size_t>[numChannels]);
+	for (int c = 0; c < numChannels; c++)
+		progress[c].store(0, std::memory_order_relaxed);
+	std::vector<int> remaining(numSegments, numChannels);
+	std::mutex doneMutex;
+	std::condition_variable segmentReady;
+	std::atomic<size_t> nextUnit(0);
+
+	// Units are taken in time order, so a chained unit rarely finds the one
+	// before it still running (only with fewer channels than threads).
+	auto work = [&](int worker) {
+		for (;;) {
+			size_t u = nextUnit.fetch_add(1, std::memory_order_relaxed);
+			if (u >= numUnits)
+				return;
+			size_t s = u / numChannels;
+			int c = u % numChannels;
+			unsigned long long first = s * segmentFrames;
+			unsigned long long end = std::min(frames, first + segmentFrames);
+			if (chained) {
+				while (progress[c].load(std::memory_order_acquire) != s)
+					std::this_thread::yield();
+				unit(worker, c, first, first, end);
+				progress[c].store(s + 1, std::memory_order_release);
+			} else {
+				unit(worker, c, first - std::min<unsigned long long>(first, options.warmupBlocks * blockFrames), first, end);
+			}
+			std::lock_guard<std::mutex> lock(doneMutex);
+			if (--remaining[s] == 0)
+				segmentReady.notify_one();
+		}
+	};
+	std::vector<std::thread> threads;
+	for (int k = 0; k < std::max(options.numThreads, 1); k++)
+		threads.push_back(std::thread(work, k));
+
+	for (size_t s = 0; s < numSegments; s++) {
+		{
+			std::unique_lock<std::mutex> lock(doneMutex);
+			segmentReady.wait(lock, [&] { return remaining[s] == 0; });
+		}
+		segmentDone(s);
+	}
+	for (size_t k = 0; k < threads.size(); k++)
+		threads[k].join();
+}
+
+unsigned long long offlineReplay::run(const detectorParameters &params, const offlineOptions &options, const segmentSink &sink)
+{
+	const int numChannels = reader.getNumChannels();
+	const int numThreads = std::max(options.numThreads, 1);
+	const size_t blockFrames = std::max<size_t>(options.blockFrames, 1);
+	const unsigned long long segmentFrames = blockFrames * std::max<size_t>(options.segmentBlocks, 1);
+	const size_t numSegments = (numFrames() + segmentFrames - 1) / segmentFrames;
+
+	// chained: every channel keeps its detector from segment to segment;
+	// otherwise every worker resets its own for each unit
+	std::vector<std::unique_ptr<SpikeDetector> > detectors;
+	int numDetectors = options.warmupBlocks == 0 ? numChannels : numThreads;
+	for (int k = 0; k < numDetectors; k++) {
+		detectors.push_back(std::unique_ptr<SpikeDetector>(new SpikeDetector(1, params)));
+		detectors.back()->reset(1, blockFrames);
+	}
+	struct scratch {
+		rawChannelCursor cursor;
+		detectionWorkspace ws;
+		std::vector<detectedSpike> spikes;
+	};
+	std::vector<scratch> workers(numThreads);
+	std::vector<biquadFilter> filters; // with the detectors
+	offlineFilters(options, reader.getSamplingFrequency(), numDetectors, filters);
+	prepareReference(options);
+	std::vector<std::vector<pooledSpike> > found(numSegments * numChannels); // [segment * numChannels + channel]
+
+	auto unit = [&](int w, int c, unsigned long long position, unsigned long long first, unsigned long long end) {
+		scratch &my = workers[w];
+		SpikeDetector *detector;
+		biquadFilter *filter;
+		if (options.warmupBlocks == 0) {
+			detector = detectors[c].get();
+			filter = &filters[c];
+		} else {
+			detector = detectors[w].get();
+			detector->reset(1, blockFrames);
+			filter = &filters[w];
+			filter->reset();
+		}
+		std::vector<pooledSpike> &out = found[first / segmentFrames * numChannels + c];
+		while (position < end) {
+			size_t length = std::min<unsigned long long>(blockFrames, end - position);
+			float *samples = detector->appendBuffer(0, length);
+			my.cursor.read(reader, blockStarts, c, position, length, samples);
+			applyReference(c, position, length, samples);
+			filter->process(samples, length, 0, 1);
+			my.spikes.clear();
+			detector->processWindow(0, length, my.spikes, my.ws);
+			if (position >= first) { // not training
+				for (size_t k = 0; k < my.spikes.size(); k++) {
+					pooledSpike spike = { stampAt(position + my.spikes[k].maxIndex), my.spikes[k] };
+					spike.spike.channel = c;
+					out.push_back(spike);
+				}
+			}
+			position += length;
+		}
+	};
+
+	// hand over the segments in order as they complete
+	unsigned long long total = 0;
+	std::vector<pooledSpike> segment;
+	forEachUnit(options, unit, [&](size_t s) {
+		segment.clear();
+		for (int c = 0; c < numChannels; c++) {
+			std::vector<pooledSpike> &spikes = found[s * numChannels + c];
+			segment.insert(segment.end(), spikes.begin(), spikes.end());
+			std::vector<pooledSpike>().swap(spikes);
+		}
+		std::sort(segment.begin(), segment.end(), spikeOrder);
+		total += segment.size();
+		sink(segment);
+	});
+	return total;
+}
+
+void offlineReplay::run(detectorSweep &sweep, const offlineOptions &options)
+{
+	offlineOptions chained = options;
+	chained.warmupBlocks = 0;
+	const size_t blockFrames = std::max<size_t>(options.blockFrames, 1);
+	std::vector<rawChannelCursor> cursors(std::max(options.numThreads, 1));
+	std::vector<sweepWorkspace> workspaces(cursors.size());
+	std::vector<biquadFilter> filters;
+	offlineFilters(options, reader.getSamplingFrequency(), reader.getNumChannels(), filters);
+	prepareReference(options);
+	forEachUnit(chained, [&](int w, int c, unsigned long long position, unsigned long long, unsigned long long end) {
+		while (position < end) {
+			size_t length = std::min<unsigned long long>(blockFrames, end - position);
+			float *samples = sweep.appendBuffer(c, length);
+			cursors[w].read(reader, blockStarts, c, position, length, samples);
+			applyReference(c, position, length, samples);
+			filters[c].process(samples, length, 0, 1);
+			sweep.processWindow(c, length, workspaces[w]);
+			position += length;
+		}
+	}, [](size_t) {});
+}
@@ -0,0 +1,130 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Offline detection over a raw recording (see raw_recorder.h), faster than
+* real time. The recording is memory-mapped and split into units of one
+* channel by one time segment, which any number of threads take in time
+* order. Frames are searched in blocks of a fixed length laid on a grid from
+* the first frame, with gaps in the stamps skipped, as the plug-in searches
+* them; a unit only starts a block grid of its own at a segment edge.
+*/
+
+#ifndef OFFLINE_REPLAY_H
+#define OFFLINE_REPLAY_H
+
+#include "detection_pool.h"
+#include "detector_sweep.h"
+#include "raw_recorder.h"
+#include <functional>
+#include <vector>
+
+struct offlineOptions {
+	int numThreads;
+	size_t blockFrames; // detection window, as "Detection window (s)" in the plug-in
+	size_t segmentBlocks; // blocks per time segment
+	// 0: a channel's segments run in order, each from the detector state the
+	// previous one left (carry-over, dead time, noise estimates), so results do
+	// not depend on the sharding. Otherwise segments are independent and each
+	// starts this many blocks early from a reset detector to train the noise
+	// estimates; spikes found in those blocks are dropped. Faster when there
+	// are fewer channels than threads, but not exact near segment edges.
+	size_t warmupBlocks;
+	// bandpass edges (Hz) as "Bandpass low/high (Hz)" in the plug-in, 0 for
+	// none; raw recordings hold the unfiltered traces
+	double lowCut, highCut;
+	// as "Common reference" and "Reference exclude"; raw recordings hold the
+	// traces from before the reference as well
+	referenceMode reference;
+	std::vector<int> referenceExclude;
+
+	offlineOptions(void) : numThreads(1), blockFrames(10000), segmentBlocks(120), warmupBlocks(0), lowCut(0), highCut(0),
+		reference(referenceNone) {}
+};
+
+// One channel of the recording in volts, decoding one raw block at a time
+// to the same floats an int16 framebuffer of that step reads back. Each
+// thread needs its own.
+class rawChannelCursor {
+	public:
+		rawChannelCursor(void) : block((size_t)-1), channel(-1) {}
+		// frames [position, position + n) in file order, gaps skipped
+		void read(const rawFileReader &reader, const std::vector<unsigned long long> &blockStarts, int channel,
+				unsigned long long position, size_t n, float *out);
+
+	private:
+		size_t block;
+		int channel;
+		std::vector<int16_t> counts;
+};
+
+class offlineReplay {
+	public:
+		// reader must stay open while the replay is in use
+		offlineReplay(const rawFileReader &reader);
+
+		unsigned long long numFrames(void) const { return blockStarts.back(); }
+		// stamp of the frame at position; positions before the first frame map before its stamp
+		unsigned long long stampAt(long long position) const;
+		const rawFileReader &getReader(void) const { return reader; }
+		const std::vector<unsigned long long> &getBlockStarts(void) const { return blockStarts; }
+
+		// Detects spikes on every channel. Each segment's spikes, in spikeOrder,
+		// are handed to sink on the calling thread in segment
+		// order, while later segments are still being searched. Returns the
+		// number of spikes.
+		typedef std::function<void(std::vector<pooledSpike> &)> segmentSink;
+		unsigned long long run(const detectorParameters &params, const offlineOptions &options, const segmentSink &sink);
+		// Feeds every channel through sweep, which must be reset for the
+		// recording's channels and blocks; options.warmupBlocks is ignored.
+		void run(detectorSweep &sweep, const offlineOptions &options);
+
+		// The scheduler behind both: calls unit(worker, channel, from, first, end)
+		// for every channel and time segment [first, end) on options.numThreads
+		// threads, where from is where the unit has to start to train its
+		// detector (first when state is carried over). A chained unit starts only
+		// once the channel's previous segment is done. segmentDone(segment) is
+		// called on the calling thread, in order, once all its units are done.
+		typedef std::function<void(int, int, unsigned long long, unsigned long long, unsigned long long)> unitFn;
+		void forEachUnit(const offlineOptions &options, const unitFn &unit, const std::function<void(size_t)> &segmentDone);
+
+		// The common reference of options, computed per frame across all
+		// channels of each raw block as the plug-in does before it splits the
+		// channels, on options.numThreads threads; run() calls it. Keeps a float
+		// per frame, and does nothing if the reference has not changed.
+		void prepareReference(const offlineOptions &options);
+		// takes it off frames [position, position + n) of one channel
+		void applyReference(int channel, unsigned long long position, size_t n, float *samples) const;
+
+	private:
+		const rawFileReader &reader;
+		std::vector<unsigned long long> blockStarts; // position of each raw block's first frame, then the total
+		referenceMode referenceSetting; // of referenceSeries
+		std::vector<int> referenceExclude;
+		std::vector<float> referenceSeries; // (V) per frame, NaN where there is none; empty without a reference
+		std::vector<bool> referenced; // per channel
+};
+
+// n single-channel bandpass filters for the options, which keep their
+// state from one block of a channel to the next
+void offlineFilters(const offlineOptions &options, double samplingFrequency, size_t n, std::vector<biquadFilter> &filters);
+
+// by stamp, then channel
+bool spikeOrder(const pooledSpike &a, const pooledSpike &b);
+
+#endif
@@ -0,0 +1,101 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Cost of rebuilding the raster's visible marks as the spike history grows,
+* for a full-history view and two zoomed-in views of the same plot width.
+*/
+
+#include "spike_raster.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double seconds(benchClock::time_point start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+	int numChannels = 60;
+	int columns = 1000;
+	double displayTime = 600;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:p:h")) != -1) {
+		switch (opt) {
+			case 'c': numChannels = atoi(optarg); break;
+			case 'p': columns = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-c channels] [-p plot_columns]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	const double rates[] = { 1, 10, 50, 200 }; // spikes/s per channel
+	const double views[] = { 600, 10, 1 }; // (s) visible range ending at the newest spike
+	printf("%d channels, %.0f s history, %d columns\n", numChannels, displayTime, columns);
+	printf("%10s %10s", "spikes", "add (ns)");
+	for (size_t v = 0; v < sizeof(views) / sizeof(views[0]); v++)
+		printf("   %4.0f s view: marks   us", views[v]);
+	printf("\n");
+
+	bool ok = true;
+	for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+		spikeRaster raster;
+		raster.resize(numChannels, displayTime);
+		std::mt19937 rng(1);
+		std::exponential_distribution<double> interval(rates[r] * numChannels);
+		std::uniform_int_distribution<int> channel(0, numChannels - 1);
+		// a bit more than the history so eviction is exercised too
+		// each channel's spikes sorted into one unit, so every mark has a known unit
+		long long added = 0;
+		benchClock::time_point start = benchClock::now();
+		for (double t = interval(rng); t < displayTime * 1.2; t += interval(rng)) {
+			int c = channel(rng);
+			raster.add(t, c, 1 + c % 3);
+			added++;
+		}
+		double addTime = seconds(start);
+		printf("%10zu %10.1f", raster.size(), addTime / added * 1e9);
+
+		double end = displayTime * 1.2;
+		for (size_t v = 0; v < sizeof(views) / sizeof(views[0]); v++) {
+			int repeats = 20;
+			start = benchClock::now();
+			// nudged every time, an unchanged view is not rebuilt
+			for (int k = 0; k < repeats; k++)
+				raster.setView(end - views[v] - k * 1e-9, end, columns);
+			for (size_t i = 0; i < raster.numMarks(); i++) {
+				const rasterMark &m = raster.mark(i);
+				if (m.unit != 1 + m.channel % 3) {
+					fprintf(stderr, "%.0f s view: mark on channel %d has unit %d\n", views[v], m.channel, m.unit);
+					ok = false;
+					break;
+				}
+			}
+			printf("   %17zu %6.0f", raster.numMarks(), seconds(start) / repeats * 1e6);
+		}
+		printf("\n");
+	}
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,210 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Round trip and throughput of the raw recording codec. Synthetic channels
+* are quantized, encoded and decoded at a few noise levels and compared
+* sample by sample; a recording with gaps and several chunk files is then
+* written through rawRecorder and read back through rawFileReader. The
+* program exits non-zero on any mismatch.
+*/
+
+#include "raw_recorder.h"
+#include "synthetic_source.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double seconds(benchClock::time_point start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+static int16_t quantize(double v, double lsb)
+{
+	double q = std::floor(v / lsb + 0.5);
+	return q > 32767 ? 32767 : q < -32768 ? -32768 : (int16_t)q;
+}
+
+static bool benchCodec(int length, int rounds, double lsb)
+{
+	// noise levels in uV; the last one clips on purpose
+	const double noises[] = { 2, 10, 50, 5000 };
+	bool ok = true;
+	printf("codec, %d samples per channel block, lsb %.2f uV\n", length, lsb * 1e6);
+	for (size_t k = 0; k < sizeof(noises) / sizeof(noises[0]); k++) {
+		syntheticSource source(1, 20000, 5, noises[k] * 1e-6, 9 * noises[k] * 1e-6, k + 1);
+		std::vector<double> block(length);
+		source.read(block.data(), length);
+		std::vector<int16_t> samples(length), decoded(length);
+		for (int j = 0; j < length; j++)
+			samples[j] = quantize(block[j], lsb);
+		std::vector<uint8_t> encoded(rawEncodedBound(length));
+
+		size_t bytes = 0;
+		benchClock::time_point start = benchClock::now();
+		for (int r = 0; r < rounds; r++)
+			bytes = encodeChannel(samples.data(), length, encoded.data());
+		double encodeTime = seconds(start);
+		start = benchClock::now();
+		bool decodedOk = true;
+		for (int r = 0; r < rounds; r++)
+			decodedOk &= decodeChannel(encoded.data(), bytes, decoded.data(), length);
+		double decodeTime = seconds(start);
+
+		bool same = decodedOk && decoded == samples;
+		ok &= same;
+		double megabytes = (double)length * sizeof(int16_t) * rounds * 1e-6;
+		printf("  noise %6.0f uV  %5.2f bits/sample  %4.1fx vs float64  encode %6.0f MB/s  decode %6.0f MB/s  %s\n",
+			noises[k], bytes * 8.0 / length, length * sizeof(double) / (double)bytes,
+			megabytes / encodeTime, megabytes / decodeTime, same ? "ok" : "MISMATCH");
+	}
+	// edge cases: full-scale steps, short blocks
+	std::vector<int16_t> steps(300);
+	for (size_t j = 0; j < steps.size(); j++)
+		steps[j] = j % 2 ? 32767 : -32768;
+	for (size_t n = 0; n <= steps.size(); n += 37) {
+		std::vector<uint8_t> encoded(rawEncodedBound(n));
+		std::vector<int16_t> decoded(n);
+		size_t bytes = encodeChannel(steps.data(), n, encoded.data());
+		if (!decodeChannel(encoded.data(), bytes, decoded.data(), n) || !std::equal(decoded.begin(), decoded.end(), steps.begin())) {
+			printf("  full-scale steps of %zu samples do not round trip\n", n);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// one producer appending passes with gaps in the stamps, as the pool does
+static bool checkRecording(const char *base, int numChannels, double lsb)
+{
+	const double fs = 20000;
+	const size_t passFrames = 10000;
+	const int numPasses = 40;
+	const size_t gap = 123;
+	syntheticSource source(numChannels, fs, 5, 10e-6, 90e-6, 7);
+	rawRecorder recorder;
+	// 5 s chunks, so the 20 s of data span several files
+	if (!recorder.open(base, numChannels, fs, lsb, passFrames, 5)) {
+		perror(base);
+		return false;
+	}
+	std::vector<double> frames(passFrames * numChannels);
+	std::vector<float> channels(passFrames * numChannels); // the detector windows the pool appends from
+	std::vector<const float *> channelData(numChannels);
+	std::vector<int16_t> expected;
+	std::vector<unsigned long long> expectedStamps;
+	unsigned long long stamp = 0;
+	for (int pass = 0; pass < numPasses; pass++) {
+		source.read(frames.data(), passFrames);
+		for (int c = 0; c < numChannels; c++) {
+			for (size_t j = 0; j < passFrames; j++)
+				channels[c * passFrames + j] = frames[j * numChannels + c];
+			channelData[c] = &channels[c * passFrames];
+		}
+		// two runs per pass with a gap between them
+		size_t split = passFrames / 3;
+		recorder.append(channelData.data(), 0, split, stamp);
+		recorder.append(channelData.data(), split, passFrames - split, stamp + split + gap);
+		recorder.flush();
+		for (size_t j = 0; j < passFrames; j++) {
+			expectedStamps.push_back(stamp + j + (j >= split ? gap : 0));
+			for (int c = 0; c < numChannels; c++)
+				expected.push_back(quantize(channels[c * passFrames + j], lsb));
+		}
+		stamp += passFrames + gap;
+		usleep(2000); // the writer keeps up at real time, not at replay speed
+	}
+	recorder.close();
+	unsigned long long written = recorder.framesWritten();
+	printf("recording, %d channels: %llu frames written, %llu dropped, %.2f bytes/sample\n", numChannels,
+		written, recorder.framesDropped(), (double)recorder.bytesWritten() / (written * numChannels));
+
+	rawFileReader reader;
+	if (!reader.open(base)) {
+		printf("  cannot read %s back\n", base);
+		return false;
+	}
+	// every written frame must decode to the quantized input at its stamp
+	size_t next = 0, checked = 0, mismatches = 0;
+	std::vector<int16_t> block;
+	for (size_t i = 0; i < reader.numBlocks(); i++) {
+		const rawIndexEntry &entry = reader.block(i);
+		if (!reader.readBlock(i, block)) {
+			mismatches++;
+			continue;
+		}
+		while (next < expectedStamps.size() && expectedStamps[next] < entry.firstStamp)
+			next++; // dropped
+		for (size_t j = 0; j < entry.frames; j++, next++) {
+			if (next >= expectedStamps.size() || expectedStamps[next] != entry.firstStamp + j) {
+				mismatches++;
+				continue;
+			}
+			for (int c = 0; c < numChannels; c++)
+				mismatches += block[c * entry.frames + j] != expected[next * numChannels + c];
+			checked++;
+		}
+	}
+	// seeking: the block holding a stamp in the middle of a chunk
+	unsigned long long probe = expectedStamps[expectedStamps.size() / 2];
+	size_t i = reader.findBlock(probe);
+	bool found = i < reader.numBlocks() && reader.block(i).firstStamp <= probe && probe < reader.block(i).firstStamp + reader.block(i).frames;
+	if (found) {
+		const rawIndexEntry &entry = reader.block(i);
+		std::vector<int16_t> channel(entry.frames);
+		size_t first = std::lower_bound(expectedStamps.begin(), expectedStamps.end(), entry.firstStamp) - expectedStamps.begin();
+		found = reader.readChannel(i, numChannels - 1, channel.data());
+		for (size_t j = 0; found && j < entry.frames; j++)
+			found = channel[j] == expected[(first + j) * numChannels + numChannels - 1];
+	}
+	printf("  read back %zu blocks in %d chunk files, %zu frames checked, %zu mismatches, seek %s\n", reader.numBlocks(),
+		(int)(reader.block(reader.numBlocks() - 1).fileNumber + 1), checked, mismatches, found ? "ok" : "FAILED");
+	return mismatches == 0 && checked == written && found;
+}
+
+int main(int argc, char **argv)
+{
+	int length = 10000;
+	int rounds = 2000;
+	int numChannels = 60;
+	double lsb = 0.1e-6;
+	const char *base = "/tmp/raw_bench";
+	int opt;
+	while ((opt = getopt(argc, argv, "l:n:c:b:o:h")) != -1) {
+		switch (opt) {
+			case 'l': length = atoi(optarg); break;
+			case 'n': rounds = atoi(optarg); break;
+			case 'c': numChannels = atoi(optarg); break;
+			case 'b': lsb = atof(optarg) * 1e-6; break;
+			case 'o': base = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-l block_length] [-n rounds] [-c channels] [-b lsb_uV] [-o file_base]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	bool ok = benchCodec(length, rounds, lsb);
+	ok &= checkRecording(base, numChannels, lsb);
+	return ok ? 0 : 1;
+}
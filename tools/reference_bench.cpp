@@ -0,0 +1,188 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Throughput of the common reference stage, per instruction set for the mean
+* and for the median, on frame-interleaved blocks of either sample format as
+* the pool references them; the int16 channels have different steps. Every
+* mean kernel is checked bit for bit against the scalar one, and
+* how much of a shared mains and artifact signal is left afterwards is
+* measured. Exits non-zero on a mismatch.
+*/
+
+#include "common_reference.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double seconds(benchClock::time_point start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+// rms of (frames - own) over the included channels: what is left of the shared signal
+static double residual(const std::vector<double> &frames, const std::vector<double> &own, int numChannels, const std::vector<int> &excluded)
+{
+	std::vector<bool> skip(numChannels, false);
+	for (size_t k = 0; k < excluded.size(); k++)
+		skip[excluded[k]] = true;
+	double sum = 0;
+	size_t count = 0;
+	for (size_t i = 0; i < frames.size(); i++) {
+		if (skip[i % numChannels] || own[i] == 0)
+			continue;
+		double d = frames[i] - own[i];
+		sum += d * d;
+		count++;
+	}
+	return count ? sqrt(sum / count) : 0;
+}
+
+// every case on frames of type T holding input in counts of scales[c]; false
+// on a mismatch or a changed excluded channel
+template<class T>
+static bool benchFormat(const char *format, const std::vector<double> &input, const std::vector<double> &own,
+		const std::vector<double> &scales, int numChannels, const std::vector<int> &excluded, double fs, size_t blockFrames, int rounds)
+{
+	struct benchCase {
+		referenceMode mode;
+		crossingScanIsa isa;
+	};
+	const benchCase cases[] = {
+		{ referenceMean, scanScalar }, { referenceMean, scanSSE2 }, { referenceMean, scanAVX2 }, { referenceMedian, scanScalar },
+	};
+	std::vector<T> converted(input.size()), meanResult, frames(input.size());
+	for (size_t i = 0; i < input.size(); i++) {
+		if (input[i] == 0)
+			storeBlanked(converted[i]);
+		else
+			storeSample(converted[i], input[i] / scales[i % numChannels]);
+	}
+	std::vector<double> volts(input.size());
+	bool ok = true;
+	for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+		const char *name = cases[k].mode == referenceMean ? crossingScanName(cases[k].isa) : "median";
+		commonReference reference;
+		if (!reference.setIsa(cases[k].isa)) {
+			printf("  %-7s %-7s n/a\n", format, name);
+			continue;
+		}
+		reference.configure(numChannels, cases[k].mode, excluded);
+		reference.setScales(scales.data());
+		double elapsed = 0;
+		for (int r = 0; r < rounds; r++) {
+			std::copy(converted.begin(), converted.end(), frames.begin());
+			benchClock::time_point start = benchClock::now();
+			reference.process(frames.data(), blockFrames);
+			elapsed += seconds(start);
+		}
+		const char *check = "";
+		if (cases[k].mode == referenceMean) {
+			if (meanResult.empty())
+				meanResult = frames;
+			bool same = memcmp(meanResult.data(), frames.data(), frames.size() * sizeof(T)) == 0;
+			ok &= same;
+			check = same ? "ok" : "MISMATCH";
+		}
+		// blanked samples stay blanked, the excluded channels come through untouched
+		for (size_t i = 0; i < frames.size(); i++) {
+			if (isBlanked(converted[i]) && !isBlanked(frames[i])) {
+				check = "BLANKING LOST";
+				ok = false;
+			}
+		}
+		for (size_t e = 0; e < excluded.size(); e++) {
+			for (size_t j = 0; j < blockFrames; j++) {
+				if (frames[j * numChannels + excluded[e]] != converted[j * numChannels + excluded[e]]) {
+					check = "EXCLUDED CHANGED";
+					ok = false;
+				}
+			}
+		}
+		for (size_t i = 0; i < frames.size(); i++)
+			volts[i] = frames[i] * scales[i % numChannels];
+		double samples = (double)blockFrames * numChannels * rounds;
+		printf("  %-7s %-7s %7.0f Msamples/s  %5.1f%% of a core  left %5.2f uV rms  %s\n", format, name, samples / elapsed * 1e-6,
+			numChannels * fs / (samples / elapsed) * 100, residual(volts, own, numChannels, excluded) * 1e6, check);
+	}
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int numChannels = 256;
+	double fs = 40000;
+	size_t blockFrames = 20000;
+	int rounds = 10;
+	std::string exclude = "0,15";
+	int opt;
+	while ((opt = getopt(argc, argv, "c:f:b:n:x:h")) != -1) {
+		switch (opt) {
+			case 'c': numChannels = atoi(optarg); break;
+			case 'f': fs = atof(optarg); break;
+			case 'b': blockFrames = atoi(optarg); break;
+			case 'n': rounds = atoi(optarg); break;
+			case 'x': exclude = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-c channels] [-f fs] [-b block_frames] [-n rounds] [-x excluded_channels]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	std::vector<int> excluded;
+	if (!parseChannelList(exclude, numChannels, excluded)) {
+		fprintf(stderr, "bad channel list %s\n", exclude.c_str());
+		return 1;
+	}
+
+	// 10 uV of noise per channel on top of 50 uV of mains and a 200 uV
+	// artifact every 0.1 s shared by all channels, blanked now and then as
+	// from stimulation; the excluded channels carry something else entirely
+	std::mt19937 rng(1);
+	std::normal_distribution<double> noise(0, 10e-6);
+	std::vector<double> own(blockFrames * numChannels), input(own.size());
+	for (size_t j = 0; j < blockFrames; j++) {
+		double t = j / fs;
+		double shared = 50e-6 * sin(2 * M_PI * 60 * t) - 200e-6 * exp(-fmod(t, 0.1) / 0.5e-3);
+		bool blanked = j % 4000 < 40;
+		for (int c = 0; c < numChannels; c++) {
+			size_t i = j * numChannels + c;
+			own[i] = blanked ? 0 : noise(rng);
+			input[i] = blanked ? 0 : own[i] + shared;
+		}
+	}
+	for (size_t k = 0; k < excluded.size(); k++) {
+		for (size_t j = 0; j < blockFrames; j++)
+			own[j * numChannels + excluded[k]] = input[j * numChannels + excluded[k]] = 1e-3;
+	}
+	printf("%d channels at %.0f Hz, %zu excluded, shared signal rms %.1f uV\n", numChannels, fs, excluded.size(),
+		residual(input, own, numChannels, excluded) * 1e6);
+
+	// int16 steps of 0.1 and 0.2 uV on alternate channels, as with mixed amplifier gains
+	std::vector<double> unit(numChannels, 1), steps(numChannels);
+	for (int c = 0; c < numChannels; c++)
+		steps[c] = c % 2 ? 0.2e-6 : 0.1e-6;
+	bool ok = benchFormat<float>("float32", input, own, unit, numChannels, excluded, fs, blockFrames, rounds);
+	ok &= benchFormat<int16_t>("int16", input, own, steps, numChannels, excluded, fs, blockFrames, rounds);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,295 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Replays synthetic or recorded multi-channel data through the spike
+* detector one detection window at a time and reports throughput and
+* per-block latency.
+*/
+
+#include "detection_pool.h"
+#include "synthetic_source.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-c channels] [-f fs] [-t seconds] [-w window_s] [-j threads]\n"
+		"          [-r spike_rate_hz] [-n noise_uV] [-a amplitude_uV] [-d drift_per_hour]\n"
+		"          [-m threshold_multiplier] [-g gap_frames] [-s seed] [-i file] [-o spike_file]\n"
+		"          [-R raw_base] [-l lsb_uV] [-B low_Hz,high_Hz] [-C mean|median] [-X channels]\n"
+		"          [-e artifacts_per_s] [-M mains_uV] [-D threshold|energy|matched] [-N] [-F float32|int16]\n"
+		"          [-T noise_time_constant_s] [-W pre_ms,post_ms]\n"
+		"  -i replays interleaved float64 frames from file instead of synthetic data\n"
+		"  -o records every detected spike to a spike file (see spike_query)\n"
+		"  -R records the voltage traces compressed, quantized to -l uV (default 0.1)\n"
+		"  -C removes the per-frame mean or median of the channels not excluded by -X (e.g. 0,15-16)\n"
+		"  -e and -M add artifacts (3x the spike amplitude) and 60 Hz mains shared by every channel\n"
+		"  -D detection method: amplitude threshold (default), energy operator or matched filter\n"
+		"  -T and -W set \"Noise time constant (s)\" and \"Snippet before/after peak (ms)\"\n"
+		"  -B bandpass filters the traces ahead of detection, as the plug-in does\n"
+		"  -N keeps the network analytics (rates, bursts, ISIs) over the detected spikes\n"
+		"  -F sample format of the frame buffer (default float32); int16 is in steps of -l uV\n"
+		"  -j splits the channels over a pool of detection threads (default 1)\n"
+		"  -g drops this many frames before every block, as if the detector had overrun\n", name);
+}
+
+static double percentile(const std::vector<double> &sorted, double q)
+{
+	if (sorted.empty())
+		return 0;
+	size_t idx = (size_t)(q * (sorted.size() - 1) + 0.5);
+	return sorted[idx];
+}
+
+int main(int argc, char **argv)
+{
+	int numChannels = 60;
+	double samplingFrequency = 20000;
+	double seconds = 60;
+	double spikeDetectWindow = 500e-3;
+	double rate = 5;
+	double noise = 10e-6;
+	double amp = 90e-6;
+	double drift = 0;
+	double multiplier = detectorParameters().thresholdMultiplier;
+	size_t gap = 0;
+	unsigned seed = 1;
+	int numThreads = 1;
+	const char *inputFile = NULL;
+	const char *outputFile = NULL;
+	const char *rawBase = NULL;
+	double lsb = 0.1e-6;
+	double filterLow = 0, filterHigh = 0;
+	referenceMode referenceSetting = referenceNone;
+	const char *exclude = "";
+	double artifactRate = 0, mains = 0;
+	int method = detectThreshold;
+	bool analyze = false;
+	sampleFormat format = sampleFloat32;
+	double noiseTimeConstant = -1;
+	double snippetPre = -1, snippetPost = -1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:f:t:w:r:n:a:d:m:g:s:i:o:R:l:B:C:X:e:M:D:j:NF:T:W:h")) != -1) {
+		switch (opt) {
+			case 'c': numChannels = atoi(optarg); break;
+			case 'f': samplingFrequency = atof(optarg); break;
+			case 't': seconds = atof(optarg); break;
+			case 'w': spikeDetectWindow = atof(optarg); break;
+			case 'r': rate = atof(optarg); break;
+			case 'n': noise = atof(optarg) * 1e-6; break;
+			case 'a': amp = atof(optarg) * 1e-6; break;
+			case 'd': drift = atof(optarg) / 3600; break;
+			case 'm': multiplier = atof(optarg); break;
+			case 'g': gap = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			case 'i': inputFile = optarg; break;
+			case 'o': outputFile = optarg; break;
+			case 'R': rawBase = optarg; break;
+			case 'l': lsb = atof(optarg) * 1e-6; break;
+			case 'B': sscanf(optarg, "%lf,%lf", &filterLow, &filterHigh); break;
+			case 'C': referenceSetting = strcmp(optarg, "median") == 0 ? referenceMedian : referenceMean; break;
+			case 'X': exclude = optarg; break;
+			case 'e': artifactRate = atof(optarg); break;
+			case 'M': mains = atof(optarg) * 1e-6; break;
+			case 'D': method = optarg[0] == 'e' ? detectEnergy : optarg[0] == 'm' ? detectMatchedFilter : detectThreshold; break;
+			case 'j': numThreads = atoi(optarg); break;
+			case 'N': analyze = true; break;
+			case 'F': format = strcmp(optarg, "int16") == 0 ? sampleInt16 : sampleFloat32; break;
+			case 'T': noiseTimeConstant = atof(optarg); break;
+			case 'W': sscanf(optarg, "%lf,%lf", &snippetPre, &snippetPost); break;
+			default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	syntheticSource *synthetic = NULL;
+	frameSource *source;
+	if (inputFile) {
+		fileSource *file = new fileSource(inputFile, numChannels);
+		if (!file->isOpen()) {
+			perror(inputFile);
+			return 1;
+		}
+		source = file;
+	} else {
+		synthetic = new syntheticSource(numChannels, samplingFrequency, rate, noise, amp, seed);
+		synthetic->setNoiseDrift(drift);
+		synthetic->setCommonNoise(mains, artifactRate, 3 * amp);
+		source = synthetic;
+	}
+
+	detectorParameters params(samplingFrequency);
+	params.thresholdMultiplier = multiplier;
+	params.detectionMethod = method;
+	if (noiseTimeConstant >= 0)
+		params.noiseTimeConstant = std::max(1 / samplingFrequency, noiseTimeConstant);
+	if (snippetPre >= 0)
+		params.numPre = std::max(1, (int)lround(snippetPre * samplingFrequency / 1e3));
+	if (snippetPost >= 0)
+		params.numPost = std::max(1, (int)lround(snippetPost * samplingFrequency / 1e3));
+	SpikeDetector detector(numChannels, params);
+	size_t blockFrames = (size_t)(spikeDetectWindow * samplingFrequency);
+	size_t totalFrames = (size_t)(seconds * samplingFrequency);
+	std::vector<double> frames(blockFrames * numChannels);
+	framebuffer vm;
+	vm.resize(numChannels, blockFrames, format, lsb);
+	detector.reset(numChannels, vm.capacity());
+	detectionPool pool;
+	biquadFilter bandpass;
+	bandpass.design(numChannels, samplingFrequency, filterLow, filterHigh);
+	pool.setFilter(&bandpass);
+	std::vector<int> excluded;
+	if (!parseChannelList(exclude, numChannels, excluded)) {
+		fprintf(stderr, "bad channel list %s\n", exclude);
+		return 1;
+	}
+	commonReference reference;
+	reference.configure(numChannels, referenceSetting, excluded);
+	pool.setReference(&reference);
+	networkAnalytics network;
+	if (analyze) {
+		// a pass takes at most the whole buffer and the carry-over
+		network.configure(numChannels, samplingFrequency, networkParameters(), (double)(vm.capacity() + detector.getCarryOverLength()) / samplingFrequency);
+		pool.setAnalytics(&network);
+	}
+	spikeFileWriter recorder;
+	if (outputFile) {
+		if (!recorder.open(outputFile, numChannels, samplingFrequency)) {
+			perror(outputFile);
+			return 1;
+		}
+		pool.setRecorder(&recorder);
+		recorder.note(0, inputFile ? std::string("replay of ") + inputFile : std::string("synthetic replay"));
+	}
+	rawRecorder raw;
+	if (rawBase) {
+		if (!raw.open(rawBase, numChannels, samplingFrequency, lsb, vm.capacity())) {
+			perror(rawBase);
+			return 1;
+		}
+		pool.setRawRecorder(&raw);
+	}
+	pool.start(&detector, &vm, numThreads, 1 << 16);
+	pooledSpike spike;
+	std::vector<std::pair<int, long long> > detected;
+	unsigned long long stamp = 0;
+	std::vector<double> latency;
+	long long numSpikes = 0;
+	size_t processed = 0;
+	double busy = 0;
+
+	while (processed < totalFrames || inputFile) {
+		// frames the producer had to drop: they advance the stamp but never reach the detector
+		if (gap > 0 && processed > 0) {
+			std::vector<double> dropped(gap * numChannels);
+			stamp += source->read(dropped.data(), gap);
+		}
+		size_t n = source->read(frames.data(), std::min(blockFrames, inputFile ? blockFrames : totalFrames - processed));
+		if (n == 0)
+			break;
+
+		// play the producer side of the plug-in, one frame per tick
+		for (size_t j = 0; j < n; j++)
+			vm.push(&frames[j * numChannels], stamp++);
+
+		// the detection pass: drain the frames into the detection windows and search each
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		pool.detect();
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		// the display side, outside the timed pass
+		while (pool.popSpike(spike)) {
+			detected.push_back(std::make_pair(spike.spike.channel, (long long)spike.sampleIndex));
+			numSpikes++;
+		}
+		latency.push_back(elapsed);
+		busy += elapsed;
+		processed += n;
+	}
+
+	recorder.close();
+	raw.close();
+	double dataSeconds = processed / samplingFrequency;
+	std::sort(latency.begin(), latency.end());
+	printf("channels           %d on %d detection thread%s\n", numChannels, pool.numWorkers(), pool.numWorkers() == 1 ? "" : "s");
+	printf("sampling rate      %.0f Hz\n", samplingFrequency);
+	if (format == sampleInt16)
+		printf("frame buffer       int16 in steps of %.3g uV, %llu samples clipped\n", lsb * 1e6, vm.clippedSamples());
+	else
+		printf("frame buffer       float32\n");
+	printf("data               %.1f s in %zu blocks of %zu frames\n", dataSeconds, latency.size(), blockFrames);
+	if (synthetic)
+		printf("spikes injected    %lld\n", synthetic->getInjected());
+	printf("spikes detected    %lld (%.1f spikes/s of data)\n", numSpikes, numSpikes / dataSeconds);
+	if (synthetic) {
+		// match each detected spike to the nearest injected peak on its channel within 1 ms
+		std::vector<std::pair<int, long long> > injected = synthetic->getInjectedPeaks();
+		std::sort(injected.begin(), injected.end());
+		long long window = (long long)(1e-3 * samplingFrequency);
+		long long matched = 0, maxError = 0;
+		double sumError = 0;
+		for (size_t k = 0; k < detected.size(); k++) {
+			std::vector<std::pair<int, long long> >::iterator it =
+				std::lower_bound(injected.begin(), injected.end(), detected[k]);
+			long long best = window + 1;
+			if (it != injected.end() && it->first == detected[k].first)
+				best = it->second - detected[k].second;
+			if (it != injected.begin() && (it - 1)->first == detected[k].first &&
+					llabs(detected[k].second - (it - 1)->second) < llabs(best))
+				best = detected[k].second - (it - 1)->second;
+			if (llabs(best) <= window) {
+				matched++;
+				sumError += llabs(best);
+				maxError = std::max(maxError, llabs(best));
+			}
+		}
+		printf("spike timing       %lld matched, error mean %.3f ms  max %.3f ms\n", matched,
+			matched ? sumError / matched / samplingFrequency * 1e3 : 0, maxError / samplingFrequency * 1e3);
+	}
+	double noiseLevel = 0;
+	for (int c = 0; c < numChannels; c++)
+		noiseLevel += detector.getNoiseLevel(c) / numChannels;
+	if (synthetic)
+		printf("noise estimate     %.2f uV (actual %.2f uV at end)\n", noiseLevel * 1e6, noise * synthetic->getNoiseGain() * 1e6);
+	else
+		printf("noise estimate     %.2f uV\n", noiseLevel * 1e6);
+	printf("throughput         %.3g samples/s (%.1fx real time)\n", processed * (double)numChannels / busy, dataSeconds / busy);
+	printf("block latency (ms) p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n",
+		percentile(latency, 0.5) * 1e3, percentile(latency, 0.9) * 1e3,
+		percentile(latency, 0.99) * 1e3, latency.empty() ? 0 : latency.back() * 1e3);
+	printf("spikes dropped     %llu (display queues full)\n", pool.spikesDropped());
+	if (outputFile)
+		printf("spike file         %llu records, %llu dropped\n", recorder.recordsWritten(), recorder.recordsDropped());
+	if (rawBase)
+		printf("raw file           %llu frames, %llu dropped, %llu clipped, %.2f bytes/sample (%.1fx smaller than float64)\n",
+			raw.framesWritten(), raw.framesDropped(), raw.samplesClipped(),
+			(double)raw.bytesWritten() / (raw.framesWritten() * numChannels),
+			raw.framesWritten() * numChannels * sizeof(double) / (double)raw.bytesWritten());
+	pool.passDurations().print(stdout, "detection pass", 1e-6, "ms");
+	pool.spikeLatencies().print(stdout, "spike latency", 1e-6, "ms");
+	if (analyze)
+		network.print(stdout);
+
+	delete source;
+	return 0;
+}
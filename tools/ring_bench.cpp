@@ -0,0 +1,292 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Compares ringbuffer against the original fixed-size template at the
+* plug-in's producer rates: sample pushes from the RT thread and spike
+* records from the detector.
+*/
+
+#include "ringbuffer.h"
+#include "spike_detector.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <unistd.h>
+
+// the ringbuffer template as it was first shipped with the plug-in
+template<typename T, size_t Size>
+class legacyringbuffer {
+	public:
+		legacyringbuffer() : head_(0), tail_(0) {}
+
+		bool push(const T & value)
+		{
+			size_t head = head_.load(std::memory_order_relaxed);
+			size_t next_head = next(head);
+			if (next_head == tail_.load(std::memory_order_acquire))
+				return false;
+			ring_[head] = value;
+			head_.store(next_head, std::memory_order_release);
+				return true;
+		}
+		bool pop(T & value)
+		{
+			size_t tail = tail_.load(std::memory_order_relaxed);
+			if (tail == head_.load(std::memory_order_acquire))
+				return false;
+			value = ring_[tail];
+			tail_.store(next(tail), std::memory_order_release);
+				return true;
+		}
+	private:
+		size_t next(size_t current)
+		{
+			return (current + 1) % Size;
+		}
+		T ring_[Size];
+		std::atomic<size_t> head_, tail_;
+};
+
+// spike record as it travelled through meaBuffer (heap-backed waveform)
+struct spikeRecord {
+	double spktime;
+	double channelNum;
+	double currentThresh;
+	std::vector<double> wave;
+};
+
+typedef std::chrono::steady_clock benchClock;
+
+static double seconds(benchClock::time_point start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+// fill then drain in bursts of one detection block, single thread
+template<typename Ring>
+static double burst(Ring &ring, size_t blockSize, size_t rounds)
+{
+	double v = 0, sink = 0;
+	benchClock::time_point start = benchClock::now();
+	for (size_t r = 0; r < rounds; r++) {
+		for (size_t k = 0; k < blockSize; k++)
+			ring.push(v++);
+		for (size_t k = 0; k < blockSize; k++) {
+			double out = 0;
+			ring.pop(out);
+			sink += out;
+		}
+	}
+	double t = seconds(start);
+	if (sink < 0)
+		printf("%f\n", sink);
+	return t * 1e9 / (rounds * blockSize);
+}
+
+static double burstBulk(ringbuffer<double> &ring, size_t blockSize, size_t rounds)
+{
+	std::vector<double> in(blockSize), out(blockSize);
+	double sink = 0;
+	for (size_t k = 0; k < blockSize; k++)
+		in[k] = k;
+	benchClock::time_point start = benchClock::now();
+	for (size_t r = 0; r < rounds; r++) {
+		ring.push_n(in.data(), blockSize);
+		ring.pop_n(out.data(), blockSize);
+		sink += out[blockSize - 1];
+	}
+	double t = seconds(start);
+	if (sink < 0)
+		printf("%f\n", sink);
+	return t * 1e9 / (rounds * blockSize);
+}
+
+// producer and consumer on separate threads, consumer drains as fast as it can
+template<typename Ring>
+static double streaming(Ring &ring, size_t total)
+{
+	benchClock::time_point start = benchClock::now();
+	std::thread consumer([&ring, total]() {
+		double out;
+		for (size_t n = 0; n < total; ) {
+			if (ring.pop(out))
+				n++;
+		}
+	});
+	for (size_t n = 0; n < total; ) {
+		if (ring.push((double)n))
+			n++;
+	}
+	consumer.join();
+	return seconds(start) * 1e9 / total;
+}
+
+template<typename Ring>
+static double spikeCopy(Ring &ring, size_t rounds, int waveLength)
+{
+	spikeRecord spike;
+	spike.wave.resize(waveLength);
+	spikeRecord out;
+	benchClock::time_point start = benchClock::now();
+	for (size_t r = 0; r < rounds; r++) {
+		for (int k = 0; k < 100; k++) {
+			spike.spktime = k;
+			ring.push(spike);
+		}
+		for (int k = 0; k < 100; k++)
+			ring.pop(out);
+	}
+	return seconds(start) * 1e9 / (rounds * 100);
+}
+
+static double spikeMove(ringbuffer<spikeRecord> &ring, size_t rounds, int waveLength)
+{
+	spikeRecord out;
+	benchClock::time_point start = benchClock::now();
+	for (size_t r = 0; r < rounds; r++) {
+		for (int k = 0; k < 100; k++) {
+			spikeRecord *slot = ring.prepare();
+			slot->spktime = k;
+			slot->wave.resize(waveLength); // reuses the slot's allocation after the first lap
+			ring.commit();
+		}
+		for (int k = 0; k < 100; k++) {
+			spikeRecord *slot = ring.front();
+			out.spktime = slot->spktime;
+			ring.release();
+		}
+	}
+	return seconds(start) * 1e9 / (rounds * 100);
+}
+
+// fixed-size record as queued by the detection pool today
+static double spikePOD(ringbuffer<detectedSpike> &ring, size_t rounds, int waveLength)
+{
+	detectedSpike spike;
+	spike.waveLength = waveLength;
+	std::fill(spike.wave, spike.wave + waveLength, 0.f);
+	double sink = 0;
+	benchClock::time_point start = benchClock::now();
+	for (size_t r = 0; r < rounds; r++) {
+		for (int k = 0; k < 100; k++) {
+			detectedSpike *slot = ring.prepare();
+			slot->channel = k;
+			slot->waveLength = spike.waveLength;
+			std::copy(spike.wave, spike.wave + spike.waveLength, slot->wave);
+			ring.commit();
+		}
+		for (int k = 0; k < 100; k++) {
+			detectedSpike *slot = ring.front();
+			sink += slot->wave[slot->waveLength / 2];
+			ring.release();
+		}
+	}
+	double t = seconds(start);
+	if (sink < 0)
+		printf("%f\n", sink);
+	return t * 1e9 / (rounds * 100);
+}
+
+// framebuffer producer push and block transpose; only the transpose is
+// timed. Values are whole multiples of 1 uV, so both formats must read back
+// the same floats; *mismatches counts the samples that do not.
+static double transposeBlock(int numChannels, size_t blockSize, size_t rounds, sampleFormat format, size_t *mismatches)
+{
+	framebuffer vm;
+	vm.resize(numChannels, blockSize, format, 1e-6);
+	std::vector<float> storage(numChannels * blockSize);
+	std::vector<float*> channelData(numChannels);
+	for (int c = 0; c < numChannels; c++)
+		channelData[c] = &storage[c * blockSize];
+	std::vector<double> frame(numChannels);
+	double elapsed = 0;
+	for (size_t r = 0; r < rounds; r++) {
+		for (size_t f = 0; f < blockSize; f++) {
+			for (int c = 0; c < numChannels; c++)
+				frame[c] = (double)(c + f) * 1e-6;
+			vm.push(frame.data(), f);
+		}
+		benchClock::time_point start = benchClock::now();
+		vm.readBlock(channelData.data(), blockSize);
+		elapsed += seconds(start);
+	}
+	for (int c = 0; c < numChannels; c++) {
+		for (size_t f = 0; f < blockSize; f++)
+			*mismatches += channelData[c][f] != (float)((double)(c + f) * 1e-6);
+	}
+	return elapsed * 1e9 / ((double)rounds * blockSize * numChannels);
+}
+
+int main(int argc, char **argv)
+{
+	size_t rounds = 2000;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+			case 'n': rounds = atoi(optarg); break;
+			default:
+				fprintf(stderr, "usage: %s [-n rounds]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	const double tick = 50e3; // ns per RT tick at 20 kHz
+	const int numChannels = 60;
+	const size_t blockSize = 1000;
+
+	legacyringbuffer<double, 2000> *legacySamples = new legacyringbuffer<double, 2000>;
+	ringbuffer<double> samples(2000);
+	double legacyNs = burst(*legacySamples, blockSize, rounds);
+	double newNs = burst(samples, blockSize, rounds);
+	double bulkNs = burstBulk(samples, blockSize, rounds);
+	printf("sample push+pop (ns/sample)      legacy %6.2f  new %6.2f  bulk %6.2f\n", legacyNs, newNs, bulkNs);
+	printf("  %d channels per 50 us tick     legacy %5.2f%%  new %5.2f%%\n", numChannels,
+		100 * numChannels * legacyNs / 2 / tick, 100 * numChannels * newNs / 2 / tick);
+
+	legacyringbuffer<double, 10000> *legacyStream = new legacyringbuffer<double, 10000>;
+	ringbuffer<double> stream(10000);
+	size_t total = rounds * blockSize;
+	printf("two-thread stream (ns/sample)    legacy %6.2f  new %6.2f\n",
+		streaming(*legacyStream, total), streaming(stream, total));
+
+	legacyringbuffer<spikeRecord, 10000> *legacySpikes = new legacyringbuffer<spikeRecord, 10000>;
+	ringbuffer<spikeRecord> spikes(10000);
+	ringbuffer<detectedSpike> podSpikes(10000);
+	printf("spike record push+pop (ns/spike) legacy %6.2f  new in-place %6.2f  fixed-size %6.2f\n",
+		spikeCopy(*legacySpikes, rounds, 31), spikeMove(spikes, rounds, 31), spikePOD(podSpikes, rounds, 31));
+
+	const int channelCounts[] = { 60, 120, 256 };
+	const sampleFormat formats[] = { sampleFloat32, sampleInt16 };
+	size_t mismatches = 0;
+	for (int f = 0; f < 2; f++) {
+		printf("frame transpose %-7s (ns/sample)", formats[f] == sampleInt16 ? "int16" : "float32");
+		for (size_t k = 0; k < sizeof(channelCounts) / sizeof(channelCounts[0]); k++)
+			printf("  %d ch %5.2f", channelCounts[k], transposeBlock(channelCounts[k], 1024, rounds / 10 + 1, formats[f], &mismatches));
+		printf("\n");
+	}
+	if (mismatches)
+		printf("frame transpose: %zu samples read back wrong\n", mismatches);
+
+	delete legacySamples;
+	delete legacyStream;
+	delete legacySpikes;
+	return mismatches ? 1 : 0;
+}
@@ -0,0 +1,247 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Accuracy and cost of the online spike sorter. Synthetic data with
+* several units per channel goes through the detection pool and the
+* sorting thread as in the plug-in; the sorted spikes are matched to the
+* injected ones to score the units found over the second half of the
+* data. The same spikes are then sorted again on one thread to time the
+* sorter, and the projection kernels are checked against each other.
+* Exits non-zero when the kernels disagree.
+*/
+
+#include "spike_sorter.h"
+#include "synthetic_source.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double seconds(benchClock::time_point start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+static bool benchProjection(int length, int numComponents, int rounds)
+{
+	const crossingScanIsa isas[] = { scanScalar, scanSSE2, scanAVX2 };
+	int stride = (length + 3) & ~3;
+	std::mt19937 rng(3);
+	std::normal_distribution<double> gauss(0, 1);
+	std::vector<float> waves(256 * maxWaveLength);
+	for (size_t k = 0; k < waves.size(); k++)
+		waves[k] = gauss(rng) * 1e-5;
+	std::vector<double> basis(numComponents * stride, 0);
+	for (int j = 0; j < numComponents; j++)
+		for (int k = 0; k < length; k++)
+			basis[j * stride + k] = gauss(rng) / sqrt(length);
+	std::vector<double> reference(256 * maxSortComponents), out(256 * maxSortComponents);
+	bool ok = true;
+
+	printf("projection, %d samples onto %d components (Msnippets/s)\n ", length, numComponents);
+	for (size_t k = 0; k < sizeof(isas) / sizeof(isas[0]); k++) {
+		snippetProjectionFn project = getSnippetProjection(isas[k]);
+		if (!project) {
+			printf("  %s n/a", crossingScanName(isas[k]));
+			continue;
+		}
+		benchClock::time_point start;
+		for (int r = -1; r < rounds; r++) {
+			if (r == 0)
+				start = benchClock::now();
+			for (int s = 0; s < 256; s++)
+				project(&waves[s * maxWaveLength], length, basis.data(), stride, numComponents, &out[s * maxSortComponents]);
+		}
+		double t = seconds(start);
+		if (k == 0)
+			reference = out;
+		bool same = std::equal(out.begin(), out.end(), reference.begin());
+		ok &= same;
+		printf("  %s %8.2f%s", crossingScanName(isas[k]), 256.0 * rounds / t * 1e-6, same ? "" : " MISMATCH");
+	}
+	printf("\n");
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int numChannels = 60;
+	double fs = 20000;
+	double seconds_ = 120;
+	double rate = 20;
+	double noise = 10e-6, amp = 90e-6;
+	int numUnits = 3;
+	int numThreads = 1;
+	unsigned seed = 1;
+	sorterParameters sorting;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:f:t:r:n:a:u:U:k:d:m:S:j:s:h")) != -1) {
+		switch (opt) {
+			case 'c': numChannels = atoi(optarg); break;
+			case 'f': fs = atof(optarg); break;
+			case 't': seconds_ = atof(optarg); break;
+			case 'r': rate = atof(optarg); break;
+			case 'n': noise = atof(optarg) * 1e-6; break;
+			case 'a': amp = atof(optarg) * 1e-6; break;
+			case 'u': numUnits = std::max(1, atoi(optarg)); break;
+			case 'U': sorting.maxUnits = atoi(optarg); break;
+			case 'k': sorting.numComponents = atoi(optarg); break;
+			case 'd': sorting.unitDistance = atof(optarg); break;
+			case 'm': sorting.mergeDistance = atof(optarg); break;
+			case 'S': sorting.maxShift = atoi(optarg); break;
+			case 'j': numThreads = atoi(optarg); break;
+			case 's': seed = atoi(optarg); break;
+			default:
+				fprintf(stderr,
+					"usage: %s [-c channels] [-f fs] [-t seconds] [-r spike_rate_hz] [-n noise_uV] [-a amplitude_uV]\n"
+					"          [-u units_per_channel] [-U max_units] [-k components] [-d unit_distance] [-m merge_distance]\n"
+					"          [-S max_shift] [-j threads] [-s seed]\n",
+					argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	detectorParameters params(fs);
+	int waveLength = params.numPre + 1 + params.numPost;
+	bool ok = benchProjection(waveLength, sorting.numComponents, 20000);
+
+	// the plug-in's pipeline: detection pool, then the sorting thread
+	syntheticSource source(numChannels, fs, rate, noise, amp, seed);
+	source.setUnits(numUnits);
+	SpikeDetector detector(numChannels, params);
+	size_t blockFrames = (size_t)(0.5 * fs);
+	size_t totalFrames = (size_t)(seconds_ * fs);
+	std::vector<double> frames(blockFrames * numChannels);
+	framebuffer vm;
+	vm.resize(numChannels, blockFrames);
+	detector.reset(numChannels, vm.capacity());
+	detectionPool pool;
+	// display queues far too short for a pass: the sorter must not depend on them
+	pool.start(&detector, &vm, numThreads, 64);
+	spikeSorter sorter;
+	sorter.configure(numChannels, waveLength, sorting);
+	pool.setSorter(&sorter);
+	sorter.start(NULL, 1 << 20);
+	std::vector<pooledSpike> spikes;
+	pooledSpike spike;
+	unsigned long long stamp = 0;
+	for (size_t processed = 0; processed < totalFrames; ) {
+		size_t n = source.read(frames.data(), std::min(blockFrames, totalFrames - processed));
+		for (size_t j = 0; j < n; j++)
+			vm.push(&frames[j * numChannels], stamp++);
+		pool.detect();
+		sorter.wake();
+		while (sorter.popSpike(spike))
+			spikes.push_back(spike);
+		processed += n;
+	}
+	sorter.stop();
+	while (sorter.popSpike(spike))
+		spikes.push_back(spike);
+	pool.stop();
+
+	// score the second half: each found unit stands for the injected unit most of its spikes came from
+	std::vector<std::pair<int, long long> > peaks = source.getInjectedPeaks();
+	const std::vector<int> &units = source.getInjectedUnits();
+	std::vector<std::pair<std::pair<int, long long>, int> > injected;
+	for (size_t k = 0; k < peaks.size(); k++)
+		injected.push_back(std::make_pair(peaks[k], units[k]));
+	std::sort(injected.begin(), injected.end());
+	long long window = (long long)(1e-3 * fs);
+	long long half = (long long)(totalFrames / 2);
+	std::map<std::pair<int, int>, std::map<int, long long> > counts; // (channel, found unit) -> injected unit -> spikes
+	long long matched = 0, unsorted = 0, unmatched = 0;
+	for (size_t k = 0; k < spikes.size(); k++) {
+		if ((long long)spikes[k].sampleIndex < half)
+			continue;
+		std::pair<int, long long> key(spikes[k].spike.channel, spikes[k].sampleIndex);
+		std::vector<std::pair<std::pair<int, long long>, int> >::iterator it =
+			std::lower_bound(injected.begin(), injected.end(), std::make_pair(key, -1));
+		int truth = -1;
+		long long best = window + 1;
+		if (it != injected.end() && it->first.first == key.first && it->first.second - key.second < best) {
+			best = it->first.second - key.second;
+			truth = it->second;
+		}
+		if (it != injected.begin() && (it - 1)->first.first == key.first && key.second - (it - 1)->first.second < best)
+			truth = (it - 1)->second;
+		if (truth < 0) {
+			unmatched++;
+			continue;
+		}
+		matched++;
+		if (spikes[k].spike.unit == 0)
+			unsorted++;
+		else
+			counts[std::make_pair(key.first, spikes[k].spike.unit)][truth]++;
+	}
+	long long agreeing = 0;
+	std::map<std::pair<int, int>, long long> largestShare; // (channel, injected unit) -> spikes in its best found unit
+	std::vector<int> foundPerChannel(numChannels, 0);
+	for (std::map<std::pair<int, int>, std::map<int, long long> >::iterator c = counts.begin(); c != counts.end(); c++) {
+		long long top = 0;
+		for (std::map<int, long long>::iterator u = c->second.begin(); u != c->second.end(); u++) {
+			top = std::max(top, u->second);
+			long long &share = largestShare[std::make_pair(c->first.first, u->first)];
+			share = std::max(share, u->second);
+		}
+		agreeing += top;
+		foundPerChannel[c->first.first]++;
+	}
+	long long complete = 0;
+	for (std::map<std::pair<int, int>, long long>::iterator s = largestShare.begin(); s != largestShare.end(); s++)
+		complete += s->second;
+	long long sortedSpikes = matched - unsorted;
+	double meanFound = 0;
+	for (int c = 0; c < numChannels; c++)
+		meanFound += foundPerChannel[c] / (double)numChannels;
+
+	printf("channels           %d, %d units each, %.0f spikes/s per channel\n", numChannels, numUnits, rate);
+	printf("spikes             %llu injected, %zu sorted, %llu dropped by the pool, %llu by the display queue\n",
+		(unsigned long long)peaks.size(), spikes.size(), pool.spikesDropped(), sorter.spikesDropped());
+	printf("second half        %lld matched to injected spikes (%lld not), %.1f%% left unsorted\n",
+		matched, unmatched, matched ? 100.0 * unsorted / matched : 0);
+	printf("units found        %.2f per channel (%d injected)\n", meanFound, numUnits);
+	printf("purity             %.1f%% of sorted spikes in the main injected unit of their unit\n",
+		sortedSpikes ? 100.0 * agreeing / sortedSpikes : 0);
+	printf("completeness       %.1f%% of sorted spikes in the main found unit of their injected unit\n",
+		sortedSpikes ? 100.0 * complete / sortedSpikes : 0);
+	sorter.batchDurations().print(stdout, "sorting batch", 1e-6, "ms");
+	if (sorter.spikesSorted() != pool.spikesQueued() || spikes.size() + sorter.spikesDropped() != sorter.spikesSorted()) {
+		printf("FAILED: the pool found %llu spikes, %llu were sorted\n", pool.spikesQueued(), sorter.spikesSorted());
+		ok = false;
+	}
+
+	// the same spikes once more on this thread, for the cost per spike
+	spikeSorter timed;
+	timed.configure(numChannels, waveLength, sorting);
+	benchClock::time_point start = benchClock::now();
+	for (size_t k = 0; k < spikes.size(); k++)
+		timed.sort(spikes[k].spike);
+	double t = seconds(start);
+	double perSpike = spikes.empty() ? 0 : t / spikes.size();
+	printf("sorting cost       %.0f ns per spike, %.2g spikes/s on one core (%.1f%% of a core at 1000 spikes/s on each of 60 channels)\n",
+		perSpike * 1e9, perSpike > 0 ? 1 / perSpike : 0, perSpike * 60000 * 100);
+	return ok ? 0 : 1;
+}
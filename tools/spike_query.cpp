@@ -0,0 +1,128 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Prints the spikes and notes of a spike file in a time range, found
+* through the time index, and checks the result against a full scan.
+*/
+
+#include "spike_file.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double seconds(benchClock::time_point start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-s start_s] [-e end_s] [-c channel] [-p] file\n"
+		"  -p prints every matching record instead of a per-channel count\n", name);
+}
+
+int main(int argc, char **argv)
+{
+	double start = 0;
+	double end = 1e300;
+	int channel = -1;
+	bool print = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:e:c:ph")) != -1) {
+		switch (opt) {
+			case 's': start = atof(optarg); break;
+			case 'e': end = atof(optarg); break;
+			case 'c': channel = atoi(optarg); break;
+			case 'p': print = true; break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	spikeFileReader file;
+	if (!file.open(argv[optind])) {
+		fprintf(stderr, "%s: not a spike file\n", argv[optind]);
+		return 1;
+	}
+	const spikeFileHeader &header = file.header();
+	double fs = header.samplingFrequency;
+	uint64_t t0 = (uint64_t)(start * fs);
+	uint64_t t1 = end * fs < 1.8e19 ? (uint64_t)(end * fs) : UINT64_MAX;
+	printf("%zu records, %u channels at %.0f Hz\n", file.size(), header.numChannels, fs);
+
+	benchClock::time_point clock = benchClock::now();
+	size_t first, last;
+	file.findRange(t0, t1, first, last);
+	std::vector<long long> perChannel(header.numChannels);
+	long long numSpikes = 0, numNotes = 0;
+	for (size_t i = first; i < last; i++) {
+		const spikeFileRecord &r = file.record(i);
+		if (r.sampleIndex < t0 || r.sampleIndex >= t1)
+			continue;
+		if (r.type == NOTE_RECORD) {
+			printf("%12.4f s  note: %.*s\n", r.sampleIndex / fs, r.length, (const char *)r.wave);
+			numNotes++;
+			continue;
+		}
+		if (channel >= 0 && r.channel != channel)
+			continue;
+		if (print) {
+			float peak = 0;
+			for (int k = 0; k < r.length; k++)
+				peak = fabsf(r.wave[k]) > fabsf(peak) ? r.wave[k] : peak;
+			printf("%12.4f s  channel %3d  unit %d  threshold %6.1f uV  peak %7.1f uV\n", r.sampleIndex / fs, r.channel,
+				r.unit, r.threshold * 1e6, peak * 1e6);
+		}
+		if (r.channel >= 0 && r.channel < (int)header.numChannels)
+			perChannel[r.channel]++;
+		numSpikes++;
+	}
+	double indexed = seconds(clock);
+
+	// the same query without the index, as a check
+	clock = benchClock::now();
+	long long expected = 0;
+	for (size_t i = 0; i < file.size(); i++) {
+		const spikeFileRecord &r = file.record(i);
+		expected += r.type == SPIKE_RECORD && r.sampleIndex >= t0 && r.sampleIndex < t1 && (channel < 0 || r.channel == channel);
+	}
+	double scanned = seconds(clock);
+
+	if (!print) {
+		for (size_t c = 0; c < perChannel.size(); c++) {
+			if (perChannel[c])
+				printf("channel %3zu  %lld spikes\n", c, perChannel[c]);
+		}
+	}
+	printf("%lld spikes, %lld notes in [%.3f, %.3f) s from records [%zu, %zu)\n", numSpikes, numNotes,
+		t0 / fs, t1 == UINT64_MAX ? 0 : t1 / fs, first, last);
+	printf("query %.3f ms, full scan %.3f ms (%lld spikes)\n", indexed * 1e3, scanned * 1e3, expected);
+	return numSpikes == expected ? 0 : 1;
+}
@@ -0,0 +1,205 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Frame sources for the replay tools: synthetic MEA activity (gaussian
+* noise with biphasic spikes at Poisson times, from one or several units
+* per channel) or a recorded file of interleaved float64 frames.
+*/
+
+#ifndef SYNTHETIC_SOURCE_H
+#define SYNTHETIC_SOURCE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <utility>
+#include <vector>
+
+class frameSource {
+	public:
+		virtual ~frameSource(void) {}
+		// fills up to numFrames interleaved frames, returns the number read
+		virtual size_t read(double *frames, size_t numFrames) = 0;
+};
+
+class syntheticSource : public frameSource {
+	public:
+		syntheticSource(int channels, double fs, double rateHz, double noiseV, double ampV, unsigned seed) :
+			numChannels(channels), samplingFrequency(fs), rng(seed), noise(0, noiseV), spikeAmp(ampV),
+			amplitude(ampV * 0.6, ampV * 1.4), interval(rateHz > 0 ? rateHz / fs : 1), noiseDrift(0),
+			mains(0), artifactAmp(0), artifactRng(seed + 1), nextArtifact(-1), lastArtifact(-1), injected(0)
+		{
+			// biphasic extracellular spike: sharp negative peak followed by a slower positive rebound
+			int len = (int)(2e-3 * fs);
+			peakOffset = len / 4;
+			shapes.resize(1);
+			for (int k = 0; k < len; k++) {
+				double t = (k - len / 4) / fs;
+				shapes[0].push_back(-exp(-pow(t / 0.15e-3, 2)) + 0.35 * exp(-pow((t - 0.45e-3) / 0.3e-3, 2)));
+			}
+			nextSpike.resize(numChannels);
+			for (int c = 0; c < numChannels; c++)
+				nextSpike[c] = rateHz > 0 ? (long long)interval(rng) : -1;
+			activeSpike.assign(numChannels, -1);
+			activeAmp.assign(numChannels, 0);
+			activeUnit.assign(numChannels, 0);
+			frameIndex = 0;
+		}
+
+		// the noise level grows by this fraction of its initial value every second
+		void setNoiseDrift(double perSecond) { noiseDrift = perSecond; }
+		double getNoiseGain(void) const { return 1 + noiseDrift * frameIndex / samplingFrequency; }
+		// signal shared by every channel: 60 Hz mains of mainsV amplitude and
+		// artifacts of artifactV decaying over 0.5 ms, rateHz of them a second
+		void setCommonNoise(double mainsV, double rateHz, double artifactV)
+		{
+			mains = mainsV;
+			artifactAmp = artifactV;
+			artifactInterval = std::exponential_distribution<double>(rateHz > 0 ? rateHz / samplingFrequency : 1);
+			nextArtifact = rateHz > 0 ? frameIndex + (long long)artifactInterval(artifactRng) : -1;
+			lastArtifact = -1;
+		}
+
+		// Every spike comes from one of numUnits units of its channel, picked
+		// at random. Each unit has its own shape (peak width, rebound) and
+		// amplitude, and the amplitude varies by only 10% within a unit.
+		void setUnits(int numUnits)
+		{
+			static const double width[] = { 0.15e-3, 0.3e-3, 0.1e-3, 0.2e-3 };
+			static const double rebound[] = { 0.35, 0.6, 0.15, 0.4 };
+			static const double scale[] = { 1, 0.8, 1.6, 1.25 };
+			int len = shapes[0].size();
+			shapes.assign(std::max(1, numUnits), std::vector<double>());
+			unitScale.assign(shapes.size(), 1);
+			for (size_t u = 0; u < shapes.size(); u++) {
+				int v = u % 4;
+				unitScale[u] = scale[v] * (1 + 0.5 * (u / 4));
+				for (int k = 0; k < len; k++) {
+					double t = (k - len / 4) / samplingFrequency;
+					// the fourth kind has a positive bump ahead of its peak instead of a rebound after it
+					double bump = v == 3 ? exp(-pow((t + 0.35e-3) / 0.15e-3, 2)) : exp(-pow((t - 0.45e-3) / 0.3e-3, 2));
+					shapes[u].push_back(-exp(-pow(t / width[v], 2)) + rebound[v] * bump);
+				}
+			}
+			jitter = std::uniform_real_distribution<double>(0.9, 1.1);
+		}
+
+		size_t read(double *frames, size_t numFrames)
+		{
+			for (size_t n = 0; n < numFrames; n++, frameIndex++) {
+				double *frame = frames + n * numChannels;
+				double gain = getNoiseGain();
+				double shared = 0;
+				if (mains != 0 || nextArtifact >= 0) {
+					if (nextArtifact >= 0 && frameIndex >= nextArtifact) {
+						lastArtifact = frameIndex;
+						nextArtifact = frameIndex + 1 + (long long)artifactInterval(artifactRng);
+					}
+					shared = mains * sin(2 * M_PI * 60 * frameIndex / samplingFrequency);
+					if (lastArtifact >= 0)
+						shared -= artifactAmp * exp(-(frameIndex - lastArtifact) / (0.5e-3 * samplingFrequency));
+				}
+				for (int c = 0; c < numChannels; c++) {
+					double v = gain * noise(rng);
+					if (activeSpike[c] < 0 && nextSpike[c] >= 0 && frameIndex >= nextSpike[c]) {
+						activeSpike[c] = 0;
+						if (shapes.size() > 1) {
+							activeUnit[c] = std::uniform_int_distribution<int>(0, shapes.size() - 1)(rng);
+							activeAmp[c] = spikeAmp * unitScale[activeUnit[c]] * jitter(rng);
+						} else {
+							activeAmp[c] = amplitude(rng);
+						}
+						injectedUnits.push_back(activeUnit[c]);
+						nextSpike[c] = frameIndex + (long long)shapes[0].size() + (long long)interval(rng);
+						injectedPeaks.push_back(std::make_pair(c, frameIndex + peakOffset));
+						injected++;
+					}
+					if (activeSpike[c] >= 0) {
+						v += activeAmp[c] * shapes[activeUnit[c]][activeSpike[c]++];
+						if (activeSpike[c] == (int)shapes[0].size())
+							activeSpike[c] = -1;
+					}
+					frame[c] = v + shared;
+				}
+			}
+			return numFrames;
+		}
+
+		long long getInjected(void) const { return injected; }
+		// (channel, frame of the negative peak) of every injected spike, in injection order
+		const std::vector<std::pair<int, long long> > &getInjectedPeaks(void) const { return injectedPeaks; }
+		// unit of each of them
+		const std::vector<int> &getInjectedUnits(void) const { return injectedUnits; }
+
+	private:
+		int numChannels;
+		double samplingFrequency;
+		std::mt19937 rng;
+		std::normal_distribution<double> noise;
+		double spikeAmp;
+		std::uniform_real_distribution<double> amplitude;
+		std::exponential_distribution<double> interval;
+		double noiseDrift;
+		double mains;
+		double artifactAmp;
+		std::mt19937 artifactRng;
+		std::exponential_distribution<double> artifactInterval;
+		long long nextArtifact;
+		long long lastArtifact;
+		std::vector<std::vector<double> > shapes; // one per unit
+		std::vector<double> unitScale;
+		std::uniform_real_distribution<double> jitter;
+		int peakOffset;
+		std::vector<std::pair<int, long long> > injectedPeaks;
+		std::vector<int> injectedUnits;
+		std::vector<long long> nextSpike;
+		std::vector<int> activeSpike;
+		std::vector<double> activeAmp;
+		std::vector<int> activeUnit;
+		long long frameIndex;
+		long long injected;
+};
+
+class fileSource : public frameSource {
+	public:
+		fileSource(const char *path, int channels) : numChannels(channels)
+		{
+			fp = fopen(path, "rb");
+		}
+		~fileSource(void)
+		{
+			if (fp)
+				fclose(fp);
+		}
+		bool isOpen(void) const { return fp != NULL; }
+
+		size_t read(double *frames, size_t numFrames)
+		{
+			if (!fp)
+				return 0;
+			return fread(frames, sizeof(double) * numChannels, numFrames, fp);
+		}
+
+	private:
+		int numChannels;
+		FILE *fp;
+};
+
+#endif
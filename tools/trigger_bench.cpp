@@ -0,0 +1,181 @@
+/*
+Copyright (C) 2014 Georgia Institute of Technology
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+* Per-tick cost and accuracy of the closed-loop stimulation fast path. The
+* detector is trained on the first seconds of synthetic data, the triggers
+* are armed from its thresholds, and the rest is fed one frame per tick as
+* execute() does. Every pulse must start in the tick of a crossing; the
+* pulses are also matched to the injected spikes. Exits non-zero when a
+* pulse starts anywhere else.
+*/
+
+#include "pipeline_stats.h"
+#include "stim_trigger.h"
+#include "synthetic_source.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock benchClock;
+
+static uint64_t nanoseconds(benchClock::time_point start, benchClock::time_point end)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+int main(int argc, char **argv)
+{
+	int numChannels = 60;
+	double fs = 20000;
+	double seconds = 60;
+	double training = 2;
+	int numTriggers = maxTriggerChannels;
+	double pulse = 1e-3, dead = 10e-3;
+	unsigned seed = 1;
+	int runs = 5;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:f:t:T:k:p:d:s:n:h")) != -1) {
+		switch (opt) {
+			case 'c': numChannels = atoi(optarg); break;
+			case 'f': fs = atof(optarg); break;
+			case 't': seconds = atof(optarg); break;
+			case 'T': training = atof(optarg); break;
+			case 'k': numTriggers = atoi(optarg); break;
+			case 'p': pulse = atof(optarg) * 1e-3; break;
+			case 'd': dead = atof(optarg) * 1e-3; break;
+			case 's': seed = atoi(optarg); break;
+			case 'n': runs = std::max(1, atoi(optarg)); break;
+			default:
+				fprintf(stderr, "usage: %s [-c channels] [-f fs] [-t seconds] [-T training_s] [-k triggers] [-p pulse_ms] [-d dead_ms] [-s seed] [-n runs]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	numTriggers = std::max(1, std::min(std::min(numTriggers, maxTriggerChannels), numChannels));
+
+	// train the thresholds as the detection thread would
+	syntheticSource source(numChannels, fs, 5, 10e-6, 90e-6, seed);
+	detectorParameters params(fs);
+	SpikeDetector detector(numChannels, params);
+	size_t blockFrames = (size_t)(0.5 * fs);
+	std::vector<double> frames(blockFrames * numChannels), channel(blockFrames);
+	std::vector<detectedSpike> spikes;
+	long long trainingFrames = (long long)(training * fs);
+	for (long long done = 0; done < trainingFrames; done += blockFrames) {
+		source.read(frames.data(), blockFrames);
+		for (int c = 0; c < numChannels; c++) {
+			for (size_t j = 0; j < blockFrames; j++)
+				channel[j] = frames[j * numChannels + c];
+			detector.processBlock(c, channel.data(), blockFrames, spikes);
+		}
+	}
+	long long firstTick = (trainingFrames + blockFrames - 1) / blockFrames * blockFrames;
+
+	std::vector<int> triggered;
+	for (int k = 0; k < numTriggers; k++)
+		triggered.push_back(k * numChannels / numTriggers);
+	stimTrigger trigger;
+
+	// the trigger channels' samples, as execute() reads them from its inputs
+	long long ticks = (long long)(seconds * fs);
+	std::vector<double> samples(ticks * maxTriggerChannels, 0);
+	for (long long tick = 0; tick < ticks; tick += blockFrames) {
+		size_t n = source.read(frames.data(), std::min((long long)blockFrames, ticks - tick));
+		for (size_t j = 0; j < n; j++) {
+			for (int k = 0; k < numTriggers; k++)
+				samples[(tick + j) * maxTriggerChannels + k] = frames[j * numChannels + triggered[k]];
+		}
+	}
+
+	// Every trigger slot is processed each tick, as in execute(). The same
+	// ticks are run several times from the same state and each tick keeps
+	// its cheapest run, which leaves out preemption and interrupts of this
+	// (non-RT) process: its maximum is the worst case of the code itself.
+	latencyHistogram firstRun, tickCost, clockCost;
+	std::vector<uint64_t> cheapest;
+	cheapest.assign(ticks, UINT64_MAX);
+	std::vector<std::vector<long long> > onsets(numTriggers);
+	long long misplaced = 0;
+	unsigned long long counted = 0;
+	for (int r = 0; r < runs; r++) {
+		trigger.configure(triggered, params.threshPolarity, (int)lround(dead * fs), (int)lround(pulse * fs), 5);
+		trigger.updateThresholds(detector, false);
+		double last[maxTriggerChannels] = { 0 };
+		for (long long tick = 0; tick < ticks; tick++) {
+			const double *in = &samples[tick * maxTriggerChannels];
+			double out[maxTriggerChannels];
+			benchClock::time_point start = benchClock::now();
+			for (int k = 0; k < maxTriggerChannels; k++)
+				out[k] = trigger.process(k, in[k]);
+			benchClock::time_point end = benchClock::now();
+			uint64_t cost = nanoseconds(start, end);
+			cheapest[tick] = std::min(cheapest[tick], cost);
+			if (r > 0)
+				continue;
+			firstRun.record(cost);
+			clockCost.record(nanoseconds(end, benchClock::now()));
+			for (int k = 0; k < numTriggers; k++) {
+				if (out[k] != 0 && last[k] == 0) {
+					// must be the first sample of this channel outside the band
+					double thr = detector.getThreshold(triggered[k]);
+					double v = in[k], before = tick > 0 ? in[k - maxTriggerChannels] : 0;
+					if (!(v <= -thr || v >= thr) || before <= -thr || before >= thr)
+						misplaced++;
+					onsets[k].push_back(firstTick + tick);
+				}
+				last[k] = out[k];
+			}
+		}
+		if (r == 0)
+			counted = trigger.triggersFired();
+	}
+	for (long long tick = 0; tick < ticks; tick++)
+		tickCost.record(cheapest[tick]);
+
+	// a pulse within 1 ms before an injected peak on its channel counts as a hit
+	const std::vector<std::pair<int, long long> > &peaks = source.getInjectedPeaks();
+	long long window = (long long)(1e-3 * fs);
+	long long injected = 0, hit = 0, fired = 0;
+	double lead = 0;
+	for (int k = 0; k < numTriggers; k++) {
+		fired += onsets[k].size();
+		for (size_t i = 0; i < peaks.size(); i++) {
+			if (peaks[i].first != trigger.channel(k) || peaks[i].second < firstTick + window)
+				continue;
+			injected++;
+			std::vector<long long>::const_iterator it = std::upper_bound(onsets[k].begin(), onsets[k].end(), peaks[i].second);
+			if (it != onsets[k].begin() && peaks[i].second - *(it - 1) <= window) {
+				hit++;
+				lead += peaks[i].second - *(it - 1);
+			}
+		}
+	}
+	printf("%d triggers on %d channels at %.0f Hz, thresholds trained on %.1f s\n", numTriggers, numChannels, fs, training);
+	printf("pulses             %lld, %lld not at a crossing, counted by the trigger %llu\n", fired, misplaced, counted);
+	printf("injected spikes    %lld on trigger channels, %lld triggered (%.1f%%), pulse %.3f ms before the peak on average\n",
+		injected, hit, injected ? 100.0 * hit / injected : 0, hit ? lead / hit / fs * 1e3 : 0);
+	printf("false triggers     %lld\n", fired - hit);
+	firstRun.print(stdout, "tick cost, one run", 1, "ns");
+	tickCost.print(stdout, "tick cost, best of runs", 1, "ns");
+	clockCost.print(stdout, "clock overhead", 1, "ns");
+	printf("worst tick         %llu ns, %.2f%% of the %.1f us sample period\n", (unsigned long long)tickCost.max(),
+		tickCost.max() * fs * 1e-7, 1e6 / fs);
+	return misplaced == 0 && fired == (long long)counted ? 0 : 1;
+}